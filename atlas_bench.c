@@ -0,0 +1,143 @@
+/*
+ * Compares creating and mapping many small plane-sized framebuffers as
+ * individual dumb buffers against sub-allocating them from one atlas:
+ * creation time, ioctls issued and VMAs mapped into the process.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+#include <drm_fourcc.h>
+
+#include "bo.h"
+#include "dev.h"
+
+#define SURFACE_SIZE 64
+#define ATLAS_WIDTH 2048
+
+static const int counts[] = { 10, 100, 1000 };
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int count_vmas(void)
+{
+	FILE *f = fopen("/proc/self/maps", "r");
+	int c, n = 0;
+
+	if (!f)
+		return -1;
+	while ((c = fgetc(f)) != EOF)
+		n += c == '\n';
+	fclose(f);
+	return n;
+}
+
+static void report(const char *name, int n, double secs, uint64_t ioctls,
+		int vmas)
+{
+	printf("%-6s %5d surfaces: %8.3f ms  %6llu ioctls  %5d vmas\n", name,
+		n, secs * 1e3, (unsigned long long)ioctls, vmas);
+}
+
+static int bench_bos(struct sp_dev *dev, int n)
+{
+	struct sp_bo **bos;
+	uint64_t ioctls = dev->stats.ioctls;
+	int i, vmas = count_vmas(), ret = 0;
+	double start;
+
+	bos = calloc(n, sizeof(*bos));
+	if (!bos)
+		return -1;
+
+	start = now();
+	for (i = 0; i < n; i++) {
+		bos[i] = create_sp_bo(dev, SURFACE_SIZE, SURFACE_SIZE, 24, 32,
+				DRM_FORMAT_XRGB8888, 0);
+		if (!bos[i] || !sp_bo_map(bos[i], 0)) {
+			printf("failed to create bo %d\n", i);
+			ret = -1;
+			break;
+		}
+	}
+	if (!ret)
+		report("bo", n, now() - start, dev->stats.ioctls - ioctls,
+			count_vmas() - vmas);
+
+	for (i = 0; i < n; i++)
+		free_sp_bo(bos[i]);
+	free(bos);
+	return ret;
+}
+
+static int bench_atlas(struct sp_dev *dev, int n)
+{
+	struct sp_bo_atlas *atlas;
+	struct sp_bo **bos;
+	uint64_t ioctls = dev->stats.ioctls;
+	int i, vmas = count_vmas(), ret = 0;
+	int per_row = ATLAS_WIDTH / SURFACE_SIZE;
+	double start;
+
+	bos = calloc(n, sizeof(*bos));
+	if (!bos)
+		return -1;
+
+	start = now();
+	atlas = create_sp_bo_atlas(dev, ATLAS_WIDTH,
+			(n + per_row - 1) / per_row * SURFACE_SIZE, 24, 32,
+			DRM_FORMAT_XRGB8888);
+	if (!atlas) {
+		printf("failed to create atlas\n");
+		free(bos);
+		return -1;
+	}
+	for (i = 0; i < n; i++) {
+		bos[i] = sp_bo_atlas_alloc(atlas, SURFACE_SIZE, SURFACE_SIZE);
+		if (!bos[i] || !sp_bo_map(bos[i], 0)) {
+			printf("failed to allocate atlas surface %d\n", i);
+			ret = -1;
+			break;
+		}
+	}
+	if (!ret)
+		report("atlas", n, now() - start, dev->stats.ioctls - ioctls,
+			count_vmas() - vmas);
+
+	destroy_sp_bo_atlas(atlas);
+	free(bos);
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	struct sp_dev *dev;
+	unsigned i;
+	int ret = 0;
+
+	dev = create_sp_dev();
+	if (!dev) {
+		printf("Failed to create sp_dev\n");
+		return -1;
+	}
+
+	printf("%dx%d XRGB8888 surfaces\n", SURFACE_SIZE, SURFACE_SIZE);
+	for (i = 0; !ret && i < sizeof(counts) / sizeof(counts[0]); i++) {
+		ret = bench_bos(dev, counts[i]);
+		if (!ret)
+			ret = bench_atlas(dev, counts[i]);
+	}
+
+	destroy_sp_dev(dev);
+	return ret;
+}
@@ -11,9 +11,11 @@
 #include <errno.h>
 
 #include <xf86drm.h>
+#include <drm_fourcc.h>
 
 #include "dev.h"
 #include "bo.h"
+#include "compositor.h"
 #include "modeset.h"
 
 static int terminate = 0;
@@ -40,14 +42,16 @@ static void incrementor(int *inc, int *val, int increment, int lower, int upper)
 
 int main(int argc, char *argv[])
 {
-	int ret, i, j, num_test_planes;
-	int x_inc = 1, x = 0, y_inc = 1, y = 0;
+	int ret, i, j, num_test_planes = 0, num_hw_planes = 0;
+	int x_inc = 1, x = 0, y_inc = 1, y = 0, reported = 0;
 	uint32_t plane_w = 128, plane_h = 128;
 	struct sp_dev *dev;
 	struct sp_plane **plane = NULL;
+	struct sp_layer **layer = NULL;
+	struct sp_compositor *comp = NULL;
 	struct sp_crtc *test_crtc;
 	fd_set fds;
-	drmModePropertySetPtr pset;
+	struct sp_atomic *req;
 	drmEventContext event_context = {
 		.version = DRM_EVENT_CONTEXT_VERSION,
 		.page_flip_handler = page_flip_handler,
@@ -68,34 +72,66 @@ int main(int argc, char *argv[])
 	}
 	test_crtc = &dev->crtcs[0];
 
-	plane = calloc(dev->num_planes, sizeof(*plane));
-	if (!plane) {
+	/* More planes than the crtc has are composited on the CPU */
+	num_test_planes = argc > 1 ? atoi(argv[1]) : test_crtc->num_planes;
+	if (num_test_planes < 1)
+		num_test_planes = 1;
+
+	plane = calloc(num_test_planes, sizeof(*plane));
+	layer = calloc(num_test_planes, sizeof(*layer));
+	if (!plane || !layer) {
 		printf("Failed to allocate plane array\n");
 		goto out;
 	}
 
 	/* Create our planes */
-	num_test_planes = test_crtc->num_planes;
 	for (i = 0; i < num_test_planes; i++) {
+		struct sp_bo *bo;
+
 		plane[i] = get_sp_plane(dev, test_crtc);
-		if (!plane[i]) {
-			printf("no unused planes available\n");
-			goto out;
+		if (plane[i]) {
+			plane[i]->bo = create_sp_bo(dev, plane_w, plane_h, 16,
+					sp_format_bpp(plane[i]->format),
+					plane[i]->format, 0);
+			if (!plane[i]->bo) {
+				printf("failed to create plane bo\n");
+				goto out;
+			}
+
+			fill_bo(plane[i]->bo, 0xFF, 0x00, 0x00, 0xFF);
+			num_hw_planes++;
+			continue;
 		}
 
-		plane[i]->bo = create_sp_bo(dev, plane_w, plane_h, 16, 32,
-				plane[i]->format, 0);
-		if (!plane[i]->bo) {
-			printf("failed to create plane bo\n");
+		if (!comp) {
+			printf("no unused planes available, compositing %d "
+				"planes (%s)\n", num_test_planes - i,
+				sp_compositor_impl());
+			/* The yellow initialize_screens() fills scanouts with */
+			comp = create_sp_compositor(test_crtc->scanout, NULL,
+					0xFFFFFF00);
+			if (!comp)
+				goto out;
+		}
+
+		bo = create_sp_bo(dev, plane_w, plane_h, 32, 32,
+				DRM_FORMAT_ARGB8888, 0);
+		if (!bo) {
+			printf("failed to create layer bo\n");
 			goto out;
 		}
+		fill_bo(bo, 0xFF, 0x00, 0x00, 0xFF);
 
-		fill_bo(plane[i]->bo, 0xFF, 0x00, 0x00, 0xFF);
+		layer[i] = sp_compositor_add_layer(comp, bo, 0, 0, 0xFF);
+		if (!layer[i]) {
+			free_sp_bo(bo);
+			goto out;
+		}
 	}
 
-	pset = drmModePropertySetAlloc();
-	if (!pset) {
-		printf("Failed to allocate the property set\n");
+	req = sp_atomic_alloc();
+	if (!req) {
+		printf("Failed to allocate the atomic request\n");
 		goto out;
 	}
 
@@ -108,8 +144,15 @@ int main(int argc, char *argv[])
 		incrementor(&y_inc, &y, 5, 0, test_crtc->crtc->mode.vdisplay -
 						plane_h * num_test_planes);
 
+		sp_atomic_reset(req);
 		for (j = 0; j < num_test_planes; j++) {
-			ret = set_sp_plane_pset(dev, plane[j], pset, test_crtc,
+			if (layer[j]) {
+				layer[j]->x = x;
+				layer[j]->y = y + j * plane_h;
+				continue;
+			}
+
+			ret = set_sp_plane_pset(dev, plane[j], req, test_crtc,
 					x, y + j * plane_h);
 			if (ret) {
 				printf("failed to move plane %d\n", ret);
@@ -117,30 +160,57 @@ int main(int argc, char *argv[])
 			}
 		}
 
-		ret = drmModePropertySetCommit(dev->fd,
-				DRM_MODE_PAGE_FLIP_EVENT, NULL, pset);
-		if (ret) {
-			printf("failed to commit properties ret=%d\n", ret);
-			goto out;
+		if (comp) {
+			ret = sp_compositor_compose(comp);
+			if (!ret)
+				ret = sp_bo_flush_damage(test_crtc->scanout);
+			if (ret) {
+				printf("failed to composite planes %d\n", ret);
+				goto out;
+			}
 		}
 
-		do {
-			ret = select(dev->fd + 1, &fds, NULL, NULL, NULL);
-		} while (ret == -1 && errno == EINTR);
+		/* Composited planes land in the scanout without a commit */
+		if (num_hw_planes) {
+			ret = sp_atomic_commit(dev, req,
+					DRM_MODE_PAGE_FLIP_EVENT, NULL);
+			if (ret) {
+				printf("failed to commit properties ret=%d\n",
+					ret);
+				goto out;
+			}
+
+			do {
+				ret = select(dev->fd + 1, &fds, NULL, NULL,
+						NULL);
+			} while (ret == -1 && errno == EINTR);
 
-		if (FD_ISSET(dev->fd, &fds))
-			drmHandleEvent(dev->fd, &event_context);
+			if (FD_ISSET(dev->fd, &fds))
+				dev->ops->handle_event(dev, &event_context);
+		}
+
+		if (!reported++)
+			print_scanout_bandwidth(dev);
 
 		usleep(1e6 / 120); /* 120 Hz */
 	}
 
-	drmModePropertySetFree(pset);
+	sp_atomic_free(req);
 
 	for (i = 0; i < num_test_planes; i++)
-		put_sp_plane(plane[i]);
+		if (plane[i])
+			put_sp_plane(plane[i]);
+
+	print_sp_dev_stats(dev);
 
 out:
+	for (i = 0; layer && i < num_test_planes; i++)
+		if (layer[i])
+			free_sp_bo(layer[i]->bo);
+	if (comp)
+		destroy_sp_compositor(comp);
 	destroy_sp_dev(dev);
 	free(plane);
+	free(layer);
 	return ret;
 }
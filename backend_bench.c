@@ -0,0 +1,184 @@
+/*
+ * Compares the sp_bo allocation backends on the first active CRTC: time to
+ * create a scanout buffer, CPU fill throughput through its mapping, and the
+ * time from page flip to flip event with the buffers on screen.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/select.h>
+#include <time.h>
+
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+#include <drm_fourcc.h>
+
+#include "bo.h"
+#include "dev.h"
+#include "modeset.h"
+
+#define FILLS 20
+#define FLIPS 60
+
+static const char * const caching_names[] = {
+	[SP_BO_CACHING_UNKNOWN] = "unknown",
+	[SP_BO_CACHING_CACHED] = "cached",
+	[SP_BO_CACHING_WC] = "wc",
+	[SP_BO_CACHING_UNCACHED] = "uncached",
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void flip_handler(int fd, unsigned int sequence, unsigned int tv_sec,
+		unsigned int tv_usec, void *user_data)
+{
+	*(int *)user_data = 0;
+}
+
+static int wait_flip(struct sp_dev *dev, int *pending)
+{
+	drmEventContext ctx = {};
+	fd_set fds;
+	struct timeval tv;
+
+	ctx.version = DRM_EVENT_CONTEXT_VERSION;
+	ctx.page_flip_handler = flip_handler;
+
+	while (*pending) {
+		FD_ZERO(&fds);
+		FD_SET(dev->fd, &fds);
+		tv.tv_sec = 1;
+		tv.tv_usec = 0;
+		if (select(dev->fd + 1, &fds, NULL, NULL, &tv) <= 0) {
+			printf("timed out waiting for flip\n");
+			return -1;
+		}
+		dev->ops->handle_event(dev, &ctx);
+	}
+	return 0;
+}
+
+static void bench(struct sp_dev *dev, struct sp_crtc *crtc,
+		enum sp_bo_backend backend)
+{
+	const char *name = sp_bo_backend_name(backend);
+	uint32_t width = crtc->crtc->mode.hdisplay;
+	uint32_t height = crtc->crtc->mode.vdisplay;
+	struct sp_bo *bo[2] = {};
+	double start, create_ms, fill_mbs, flip_ms;
+	int i, ret, pending;
+
+	start = now();
+	for (i = 0; i < 2; i++) {
+		bo[i] = create_sp_bo_with_backend(dev, backend, width, height,
+				24, 32, DRM_FORMAT_XRGB8888, 0, NULL, 0);
+		if (!bo[i]) {
+			printf("%-8s unavailable\n", name);
+			goto out;
+		}
+	}
+	create_ms = (now() - start) * 1e3 / 2;
+
+	if (!sp_bo_map(bo[0], SP_BO_MAP_POPULATE) ||
+	    !sp_bo_map(bo[1], SP_BO_MAP_POPULATE)) {
+		printf("%-8s not mappable\n", name);
+		goto out;
+	}
+
+	start = now();
+	for (i = 0; i < FILLS; i++)
+		fill_bo(bo[i & 1], 0xff, i, 0x80, 0xff - i);
+	sp_bo_flush_writes(bo[0]);
+	sp_bo_flush_writes(bo[1]);
+	fill_mbs = (double)bo[0]->pitch * height * FILLS / (now() - start) /
+		1e6;
+
+	start = now();
+	for (i = 0; i < FLIPS; i++) {
+		pending = 1;
+		ret = dev->ops->page_flip(dev, crtc->crtc->crtc_id,
+				bo[i & 1]->fb_id, DRM_MODE_PAGE_FLIP_EVENT,
+				&pending);
+		if (ret) {
+			printf("%-8s failed to flip ret=%d\n", name, ret);
+			goto out;
+		}
+		if (wait_flip(dev, &pending))
+			goto out;
+	}
+	flip_ms = (now() - start) * 1e3 / FLIPS;
+
+	printf("%-8s %-8s create %7.3f ms  fill %7.0f MB/s  flip %6.2f ms\n",
+		name, caching_names[bo[0]->caching], create_ms, fill_mbs,
+		flip_ms);
+
+out:
+	/* Put the original scanout back before the bos go away */
+	pending = 1;
+	if (!dev->ops->page_flip(dev, crtc->crtc->crtc_id,
+			crtc->scanout->fb_id, DRM_MODE_PAGE_FLIP_EVENT,
+			&pending))
+		wait_flip(dev, &pending);
+	for (i = 0; i < 2; i++)
+		if (bo[i])
+			free_sp_bo(bo[i]);
+}
+
+int main(int argc, char *argv[])
+{
+	struct sp_dev *dev;
+	struct sp_crtc *crtc = NULL;
+	enum sp_bo_backend backend;
+	int i, ret;
+
+	dev = create_sp_dev();
+	if (!dev) {
+		printf("Failed to create sp_dev\n");
+		return -1;
+	}
+
+	ret = initialize_screens(dev);
+	if (ret) {
+		printf("Failed to initialize screens\n");
+		goto out;
+	}
+
+	for (i = 0; i < dev->num_crtcs; i++) {
+		if (dev->crtcs[i].scanout) {
+			crtc = &dev->crtcs[i];
+			break;
+		}
+	}
+	if (!crtc) {
+		printf("No active crtc\n");
+		ret = -1;
+		goto out;
+	}
+
+	printf("%dx%d XRGB8888 on crtc %d, %d fills, %d flips\n",
+		crtc->crtc->mode.hdisplay, crtc->crtc->mode.vdisplay,
+		crtc->crtc->crtc_id, FILLS, FLIPS);
+
+	if (argc > 1) {
+		if (sp_bo_backend_from_name(argv[1], &backend)) {
+			printf("Unknown backend %s\n", argv[1]);
+			ret = -1;
+			goto out;
+		}
+		bench(dev, crtc, backend);
+	} else {
+		for (i = 0; i < SP_BO_NUM_BACKENDS; i++)
+			bench(dev, crtc, i);
+	}
+
+out:
+	destroy_sp_dev(dev);
+	return ret;
+}
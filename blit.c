@@ -0,0 +1,1138 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <drm_fourcc.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+#define HAVE_X86_TARGETS
+#endif
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "bo.h"
+#include "blit.h"
+
+/* Byte offset of each channel within a pixel, as laid out in memory */
+struct blit_format {
+	uint32_t format;
+	uint32_t cpp;
+	uint8_t b, g, r, a;
+	int has_alpha;	/* else a is the X byte */
+};
+
+static const struct blit_format blit_formats[] = {
+	{ DRM_FORMAT_XRGB8888, 4, 0, 1, 2, 3, 0 },
+	{ DRM_FORMAT_ARGB8888, 4, 0, 1, 2, 3, 1 },
+	{ DRM_FORMAT_RGBA8888, 4, 1, 2, 3, 0, 1 },
+	{ DRM_FORMAT_ABGR8888, 4, 2, 1, 0, 3, 1 },
+	{ DRM_FORMAT_RGB565, 2, 0, 0, 0, 0, 0 },
+};
+
+/* RGB565 converts through ARGB8888, whose alpha is always 0xff here */
+#define CANONICAL (&blit_formats[1])
+
+/*
+ * idx[i] is the source byte that goes to byte i of a destination pixel,
+ * 4 for 0xff. For RGB565 conversions it maps to or from ARGB8888.
+ *
+ * dither, if set, is added with saturation to the source bytes of four
+ * consecutive pixels before they are truncated to RGB565, see
+ * build_dither(). Kernels convert multiples of four pixels before their
+ * tail, so the pattern lines up again for to565_c().
+ */
+struct blit_op {
+	uint8_t idx[4];
+	uint32_t cpp;
+	const uint8_t *dither;
+};
+
+/* 4x4 Bayer matrix, thresholds 0-15 */
+static const uint8_t bayer4[4][4] = {
+	{  0,  8,  2, 10 },
+	{ 12,  4, 14,  6 },
+	{  3, 11,  1,  9 },
+	{ 15,  7, 13,  5 },
+};
+
+/*
+ * Dither for the four pixels from (x, y) on, laid out like the source
+ * bytes: thresholds scaled to the 8 and 4 values each 5 and 6 bit channel
+ * step drops.
+ */
+static void build_dither(const struct blit_op *op, uint32_t x, uint32_t y,
+		uint8_t dither[16])
+{
+	int p;
+
+	memset(dither, 0, 16);
+	for (p = 0; p < 4; p++) {
+		uint8_t t = bayer4[y & 3][(x + p) & 3];
+
+		dither[p * 4 + op->idx[0]] = t >> 1;
+		dither[p * 4 + op->idx[1]] = t >> 2;
+		dither[p * 4 + op->idx[2]] = t >> 1;
+	}
+}
+
+typedef void (*blit_row_fn)(uint8_t *dst, const uint8_t *src,
+		uint32_t count, const struct blit_op *op);
+
+static void copy_row(uint8_t *dst, const uint8_t *src, uint32_t count,
+		const struct blit_op *op)
+{
+	memcpy(dst, src, count * op->cpp);
+}
+
+static void conv32_c(uint8_t *dst, const uint8_t *src, uint32_t count,
+		const struct blit_op *op)
+{
+	int i;
+
+	for (; count; count--, dst += 4, src += 4)
+		for (i = 0; i < 4; i++)
+			dst[i] = op->idx[i] < 4 ? src[op->idx[i]] : 0xff;
+}
+
+static void to565_c(uint8_t *dst, const uint8_t *src, uint32_t count,
+		const struct blit_op *op)
+{
+	uint32_t c[3], v, i;
+	int j;
+
+	for (i = 0; count; count--, i++, dst += 2, src += 4) {
+		for (j = 0; j < 3; j++) {
+			c[j] = src[op->idx[j]];
+			if (op->dither)
+				c[j] += op->dither[(i & 3) * 4 + op->idx[j]];
+			if (c[j] > 0xff)
+				c[j] = 0xff;
+		}
+		v = (c[2] >> 3) << 11 | (c[1] >> 2) << 5 | c[0] >> 3;
+		dst[0] = v;
+		dst[1] = v >> 8;
+	}
+}
+
+static void from565_c(uint8_t *dst, const uint8_t *src, uint32_t count,
+		const struct blit_op *op)
+{
+	uint8_t c[4];
+	uint32_t v, r, g, b;
+	int i;
+
+	c[3] = 0xff;
+	for (; count; count--, dst += 4, src += 2) {
+		v = src[0] | src[1] << 8;
+		r = v >> 11;
+		g = (v >> 5) & 0x3f;
+		b = v & 0x1f;
+		c[0] = b << 3 | b >> 2;
+		c[1] = g << 2 | g >> 4;
+		c[2] = r << 3 | r >> 2;
+		for (i = 0; i < 4; i++)
+			dst[i] = op->idx[i] < 4 ? c[op->idx[i]] : 0xff;
+	}
+}
+
+/*
+ * RGB to 10 bit BT.601 limited range YUV 4:2:0, a pair of rows at a time:
+ * luma for every pixel of s0 and s1, chroma from the sum of each 2x2
+ * block. op->idx maps the source to ARGB8888. A last odd column repeats
+ * the edge pixel for chroma; for a last odd row the caller passes s0 twice.
+ */
+typedef void (*yuv_rows_fn)(uint16_t *y0, uint16_t *y1, uint16_t *u,
+		uint16_t *v, const uint8_t *s0, const uint8_t *s1,
+		uint32_t count, const struct blit_op *op);
+
+static inline uint16_t luma10(const uint8_t *p, const struct blit_op *op)
+{
+	return ((66 * p[op->idx[2]] + 129 * p[op->idx[1]] +
+		25 * p[op->idx[0]] + 32) >> 6) + 64;
+}
+
+static void yuv_c(uint16_t *y0, uint16_t *y1, uint16_t *u, uint16_t *v,
+		const uint8_t *s0, const uint8_t *s1, uint32_t count,
+		const struct blit_op *op)
+{
+	const uint8_t *p[4];
+	int32_t r, g, b;
+	uint32_t i, j, next;
+
+	for (i = 0; i < count; i += 2) {
+		next = i + 1 < count ? i + 1 : i;
+		p[0] = s0 + i * 4;
+		p[1] = s0 + next * 4;
+		p[2] = s1 + i * 4;
+		p[3] = s1 + next * 4;
+
+		r = g = b = 0;
+		for (j = 0; j < 4; j++) {
+			r += p[j][op->idx[2]];
+			g += p[j][op->idx[1]];
+			b += p[j][op->idx[0]];
+		}
+
+		y0[i] = luma10(p[0], op);
+		y1[i] = luma10(p[2], op);
+		if (next != i) {
+			y0[next] = luma10(p[1], op);
+			y1[next] = luma10(p[3], op);
+		}
+		u[i / 2] = ((112 * b - 38 * r - 74 * g + 128) >> 8) + 512;
+		v[i / 2] = ((112 * r - 94 * g - 18 * b + 128) >> 8) + 512;
+	}
+}
+
+/* A pair of signed 16-bit multipliers for madd, lo for b/g and hi for r/a */
+#define COEF_PAIR(lo, hi) \
+	((int)((uint32_t)(uint16_t)(hi) << 16 | (uint16_t)(lo)))
+
+#if defined(HAVE_X86_TARGETS)
+/* pshufb mask for four pixels, and the 0xff bytes to OR in after it */
+static void shuffle_masks(const struct blit_op *op, uint8_t shuf[16],
+		uint8_t fill[16])
+{
+	int p, i;
+
+	for (p = 0; p < 4; p++) {
+		for (i = 0; i < 4; i++) {
+			shuf[p * 4 + i] = op->idx[i] < 4 ?
+				p * 4 + op->idx[i] : 0x80;
+			fill[p * 4 + i] = op->idx[i] < 4 ? 0 : 0xff;
+		}
+	}
+}
+
+__attribute__((target("ssse3")))
+static void conv32_ssse3(uint8_t *dst, const uint8_t *src, uint32_t count,
+		const struct blit_op *op)
+{
+	uint8_t shuf[16], fill[16];
+	__m128i m, f;
+
+	shuffle_masks(op, shuf, fill);
+	m = _mm_loadu_si128((const __m128i *)shuf);
+	f = _mm_loadu_si128((const __m128i *)fill);
+
+	for (; count >= 4; count -= 4, dst += 16, src += 16) {
+		__m128i s = _mm_loadu_si128((const __m128i *)src);
+
+		_mm_storeu_si128((__m128i *)dst,
+				_mm_or_si128(_mm_shuffle_epi8(s, m), f));
+	}
+	conv32_c(dst, src, count, op);
+}
+
+/* ARGB8888 in 32-bit lanes to RGB565 in the low 16 bits of each lane */
+__attribute__((target("ssse3")))
+static inline __m128i pack565_epi32(__m128i c)
+{
+	__m128i r = _mm_and_si128(_mm_srli_epi32(c, 8),
+			_mm_set1_epi32(0xf800));
+	__m128i g = _mm_and_si128(_mm_srli_epi32(c, 5),
+			_mm_set1_epi32(0x07e0));
+	__m128i b = _mm_and_si128(_mm_srli_epi32(c, 3),
+			_mm_set1_epi32(0x001f));
+	__m128i v = _mm_or_si128(_mm_or_si128(r, g), b);
+
+	/* Sign extend so packs_epi32 keeps the bit pattern */
+	return _mm_srai_epi32(_mm_slli_epi32(v, 16), 16);
+}
+
+__attribute__((target("ssse3")))
+static void to565_ssse3(uint8_t *dst, const uint8_t *src, uint32_t count,
+		const struct blit_op *op)
+{
+	uint8_t shuf[16], fill[16];
+	__m128i m, d = _mm_setzero_si128();
+
+	shuffle_masks(op, shuf, fill);
+	m = _mm_loadu_si128((const __m128i *)shuf);
+	if (op->dither)
+		d = _mm_loadu_si128((const __m128i *)op->dither);
+
+	for (; count >= 8; count -= 8, dst += 16, src += 32) {
+		__m128i lo = _mm_shuffle_epi8(_mm_adds_epu8(
+				_mm_loadu_si128((const __m128i *)src), d), m);
+		__m128i hi = _mm_shuffle_epi8(_mm_adds_epu8(
+				_mm_loadu_si128((const __m128i *)(src + 16)), d),
+				m);
+
+		_mm_storeu_si128((__m128i *)dst, _mm_packs_epi32(
+				pack565_epi32(lo), pack565_epi32(hi)));
+	}
+	to565_c(dst, src, count, op);
+}
+
+/* RGB565 in 32-bit lanes to opaque ARGB8888 */
+__attribute__((target("ssse3")))
+static inline __m128i unpack565_epi32(__m128i v)
+{
+	const __m128i m5 = _mm_set1_epi32(0x1f), m6 = _mm_set1_epi32(0x3f);
+	__m128i r = _mm_and_si128(_mm_srli_epi32(v, 11), m5);
+	__m128i g = _mm_and_si128(_mm_srli_epi32(v, 5), m6);
+	__m128i b = _mm_and_si128(v, m5);
+
+	r = _mm_or_si128(_mm_slli_epi32(r, 3), _mm_srli_epi32(r, 2));
+	g = _mm_or_si128(_mm_slli_epi32(g, 2), _mm_srli_epi32(g, 4));
+	b = _mm_or_si128(_mm_slli_epi32(b, 3), _mm_srli_epi32(b, 2));
+	return _mm_or_si128(_mm_or_si128(_mm_set1_epi32(0xff000000),
+				_mm_slli_epi32(r, 16)),
+			_mm_or_si128(_mm_slli_epi32(g, 8), b));
+}
+
+__attribute__((target("ssse3")))
+static void from565_ssse3(uint8_t *dst, const uint8_t *src, uint32_t count,
+		const struct blit_op *op)
+{
+	const __m128i zero = _mm_setzero_si128();
+	uint8_t shuf[16], fill[16];
+	__m128i m, f;
+
+	shuffle_masks(op, shuf, fill);
+	m = _mm_loadu_si128((const __m128i *)shuf);
+	f = _mm_loadu_si128((const __m128i *)fill);
+
+	for (; count >= 8; count -= 8, dst += 32, src += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)src);
+		__m128i lo = unpack565_epi32(_mm_unpacklo_epi16(v, zero));
+		__m128i hi = unpack565_epi32(_mm_unpackhi_epi16(v, zero));
+
+		_mm_storeu_si128((__m128i *)dst,
+				_mm_or_si128(_mm_shuffle_epi8(lo, m), f));
+		_mm_storeu_si128((__m128i *)(dst + 16),
+				_mm_or_si128(_mm_shuffle_epi8(hi, m), f));
+	}
+	from565_c(dst, src, count, op);
+}
+
+__attribute__((target("avx2")))
+static void conv32_avx2(uint8_t *dst, const uint8_t *src, uint32_t count,
+		const struct blit_op *op)
+{
+	uint8_t shuf[16], fill[16];
+	__m256i m, f;
+
+	shuffle_masks(op, shuf, fill);
+	m = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)shuf));
+	f = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)fill));
+
+	for (; count >= 8; count -= 8, dst += 32, src += 32) {
+		__m256i s = _mm256_loadu_si256((const __m256i *)src);
+
+		_mm256_storeu_si256((__m256i *)dst,
+				_mm256_or_si256(_mm256_shuffle_epi8(s, m), f));
+	}
+	conv32_c(dst, src, count, op);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i pack565_epi32_avx2(__m256i c)
+{
+	__m256i r = _mm256_and_si256(_mm256_srli_epi32(c, 8),
+			_mm256_set1_epi32(0xf800));
+	__m256i g = _mm256_and_si256(_mm256_srli_epi32(c, 5),
+			_mm256_set1_epi32(0x07e0));
+	__m256i b = _mm256_and_si256(_mm256_srli_epi32(c, 3),
+			_mm256_set1_epi32(0x001f));
+	__m256i v = _mm256_or_si256(_mm256_or_si256(r, g), b);
+
+	return _mm256_srai_epi32(_mm256_slli_epi32(v, 16), 16);
+}
+
+__attribute__((target("avx2")))
+static void to565_avx2(uint8_t *dst, const uint8_t *src, uint32_t count,
+		const struct blit_op *op)
+{
+	uint8_t shuf[16], fill[16];
+	__m256i m, d = _mm256_setzero_si256();
+
+	shuffle_masks(op, shuf, fill);
+	m = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)shuf));
+	if (op->dither)
+		d = _mm256_broadcastsi128_si256(
+				_mm_loadu_si128((const __m128i *)op->dither));
+
+	for (; count >= 16; count -= 16, dst += 32, src += 64) {
+		__m256i lo = _mm256_shuffle_epi8(_mm256_adds_epu8(
+				_mm256_loadu_si256((const __m256i *)src), d), m);
+		__m256i hi = _mm256_shuffle_epi8(_mm256_adds_epu8(
+				_mm256_loadu_si256((const __m256i *)(src + 32)),
+				d), m);
+		__m256i v = _mm256_packs_epi32(pack565_epi32_avx2(lo),
+				pack565_epi32_avx2(hi));
+
+		/* packs works per 128-bit lane, put the quads back in order */
+		_mm256_storeu_si256((__m256i *)dst,
+				_mm256_permute4x64_epi64(v, 0xd8));
+	}
+	to565_c(dst, src, count, op);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i unpack565_epi32_avx2(__m256i v)
+{
+	const __m256i m5 = _mm256_set1_epi32(0x1f);
+	const __m256i m6 = _mm256_set1_epi32(0x3f);
+	__m256i r = _mm256_and_si256(_mm256_srli_epi32(v, 11), m5);
+	__m256i g = _mm256_and_si256(_mm256_srli_epi32(v, 5), m6);
+	__m256i b = _mm256_and_si256(v, m5);
+
+	r = _mm256_or_si256(_mm256_slli_epi32(r, 3), _mm256_srli_epi32(r, 2));
+	g = _mm256_or_si256(_mm256_slli_epi32(g, 2), _mm256_srli_epi32(g, 4));
+	b = _mm256_or_si256(_mm256_slli_epi32(b, 3), _mm256_srli_epi32(b, 2));
+	return _mm256_or_si256(_mm256_or_si256(
+				_mm256_set1_epi32(0xff000000),
+				_mm256_slli_epi32(r, 16)),
+			_mm256_or_si256(_mm256_slli_epi32(g, 8), b));
+}
+
+__attribute__((target("avx2")))
+static void from565_avx2(uint8_t *dst, const uint8_t *src, uint32_t count,
+		const struct blit_op *op)
+{
+	uint8_t shuf[16], fill[16];
+	__m256i m, f;
+
+	shuffle_masks(op, shuf, fill);
+	m = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)shuf));
+	f = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)fill));
+
+	for (; count >= 8; count -= 8, dst += 32, src += 16) {
+		__m256i c = unpack565_epi32_avx2(_mm256_cvtepu16_epi32(
+				_mm_loadu_si128((const __m128i *)src)));
+
+		_mm256_storeu_si256((__m256i *)dst,
+				_mm256_or_si256(_mm256_shuffle_epi8(c, m), f));
+	}
+	from565_c(dst, src, count, op);
+}
+
+/*
+ * br and ga hold ARGB8888 pixels split into b | r << 16 and g | a << 16
+ * lanes, for madd. Chroma takes them summed over 2x2 blocks, in the even
+ * lanes; luma takes single pixels.
+ */
+__attribute__((target("ssse3")))
+static inline __m128i luma10_epi32(__m128i br, __m128i ga)
+{
+	__m128i y = _mm_add_epi32(
+			_mm_madd_epi16(br, _mm_set1_epi32(COEF_PAIR(25, 66))),
+			_mm_madd_epi16(ga, _mm_set1_epi32(COEF_PAIR(129, 0))));
+
+	return _mm_add_epi32(_mm_srli_epi32(
+				_mm_add_epi32(y, _mm_set1_epi32(32)), 6),
+			_mm_set1_epi32(64));
+}
+
+__attribute__((target("ssse3")))
+static inline __m128i chroma10_epi32(__m128i br, __m128i ga, int cbr,
+		int cga)
+{
+	__m128i c = _mm_add_epi32(_mm_madd_epi16(br, _mm_set1_epi32(cbr)),
+			_mm_madd_epi16(ga, _mm_set1_epi32(cga)));
+
+	return _mm_add_epi32(_mm_srai_epi32(
+				_mm_add_epi32(c, _mm_set1_epi32(128)), 8),
+			_mm_set1_epi32(512));
+}
+
+/* The even lanes of a and b, in order */
+__attribute__((target("ssse3")))
+static inline __m128i even_epi32(__m128i a, __m128i b)
+{
+	return _mm_unpacklo_epi64(_mm_shuffle_epi32(a, 0x08),
+			_mm_shuffle_epi32(b, 0x08));
+}
+
+__attribute__((target("ssse3")))
+static void yuv_ssse3(uint16_t *y0, uint16_t *y1, uint16_t *u, uint16_t *v,
+		const uint8_t *s0, const uint8_t *s1, uint32_t count,
+		const struct blit_op *op)
+{
+	const __m128i m8 = _mm_set1_epi32(0x00ff00ff);
+	uint8_t shuf[16], fill[16];
+	__m128i m, br[4], ga[4], sbr[2], sga[2];
+	int i;
+
+	shuffle_masks(op, shuf, fill);
+	m = _mm_loadu_si128((const __m128i *)shuf);
+
+	for (; count >= 8; count -= 8, s0 += 32, s1 += 32, y0 += 8, y1 += 8,
+			u += 4, v += 4) {
+		for (i = 0; i < 4; i++) {
+			const uint8_t *p = (i & 2 ? s1 : s0) + (i & 1) * 16;
+			__m128i c = _mm_shuffle_epi8(
+					_mm_loadu_si128((const __m128i *)p), m);
+
+			br[i] = _mm_and_si128(c, m8);
+			ga[i] = _mm_and_si128(_mm_srli_epi32(c, 8), m8);
+		}
+
+		_mm_storeu_si128((__m128i *)y0, _mm_packs_epi32(
+				luma10_epi32(br[0], ga[0]),
+				luma10_epi32(br[1], ga[1])));
+		_mm_storeu_si128((__m128i *)y1, _mm_packs_epi32(
+				luma10_epi32(br[2], ga[2]),
+				luma10_epi32(br[3], ga[3])));
+
+		/* Add the rows, then each pixel's right neighbour */
+		for (i = 0; i < 2; i++) {
+			sbr[i] = _mm_add_epi16(br[i], br[i + 2]);
+			sga[i] = _mm_add_epi16(ga[i], ga[i + 2]);
+			sbr[i] = _mm_add_epi16(sbr[i],
+					_mm_srli_epi64(sbr[i], 32));
+			sga[i] = _mm_add_epi16(sga[i],
+					_mm_srli_epi64(sga[i], 32));
+		}
+
+		_mm_storel_epi64((__m128i *)u, _mm_packs_epi32(even_epi32(
+				chroma10_epi32(sbr[0], sga[0],
+					COEF_PAIR(112, -38),
+					COEF_PAIR(-74, 0)),
+				chroma10_epi32(sbr[1], sga[1],
+					COEF_PAIR(112, -38),
+					COEF_PAIR(-74, 0))),
+				_mm_setzero_si128()));
+		_mm_storel_epi64((__m128i *)v, _mm_packs_epi32(even_epi32(
+				chroma10_epi32(sbr[0], sga[0],
+					COEF_PAIR(-18, 112),
+					COEF_PAIR(-94, 0)),
+				chroma10_epi32(sbr[1], sga[1],
+					COEF_PAIR(-18, 112),
+					COEF_PAIR(-94, 0))),
+				_mm_setzero_si128()));
+	}
+	yuv_c(y0, y1, u, v, s0, s1, count, op);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i luma10_epi32_avx2(__m256i br, __m256i ga)
+{
+	__m256i y = _mm256_add_epi32(
+			_mm256_madd_epi16(br,
+				_mm256_set1_epi32(COEF_PAIR(25, 66))),
+			_mm256_madd_epi16(ga,
+				_mm256_set1_epi32(COEF_PAIR(129, 0))));
+
+	return _mm256_add_epi32(_mm256_srli_epi32(
+				_mm256_add_epi32(y, _mm256_set1_epi32(32)), 6),
+			_mm256_set1_epi32(64));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i chroma10_epi32_avx2(__m256i br, __m256i ga, int cbr,
+		int cga)
+{
+	__m256i c = _mm256_add_epi32(
+			_mm256_madd_epi16(br, _mm256_set1_epi32(cbr)),
+			_mm256_madd_epi16(ga, _mm256_set1_epi32(cga)));
+
+	return _mm256_add_epi32(_mm256_srai_epi32(
+				_mm256_add_epi32(c, _mm256_set1_epi32(128)), 8),
+			_mm256_set1_epi32(512));
+}
+
+/* Eight 32-bit lanes, in order, to 16 bits */
+__attribute__((target("avx2")))
+static inline __m128i pack_epi32_avx2(__m256i x)
+{
+	return _mm_packs_epi32(_mm256_castsi256_si128(x),
+			_mm256_extracti128_si256(x, 1));
+}
+
+/* The even lanes of a and b, in order */
+__attribute__((target("avx2")))
+static inline __m256i even_epi32_avx2(__m256i a, __m256i b)
+{
+	/* unpack works per 128-bit lane, put the quads back in order */
+	return _mm256_permute4x64_epi64(_mm256_unpacklo_epi64(
+				_mm256_shuffle_epi32(a, 0x08),
+				_mm256_shuffle_epi32(b, 0x08)), 0xd8);
+}
+
+__attribute__((target("avx2")))
+static void yuv_avx2(uint16_t *y0, uint16_t *y1, uint16_t *u, uint16_t *v,
+		const uint8_t *s0, const uint8_t *s1, uint32_t count,
+		const struct blit_op *op)
+{
+	const __m256i m8 = _mm256_set1_epi32(0x00ff00ff);
+	uint8_t shuf[16], fill[16];
+	__m256i m, br[4], ga[4], sbr[2], sga[2];
+	int i;
+
+	shuffle_masks(op, shuf, fill);
+	m = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)shuf));
+
+	for (; count >= 16; count -= 16, s0 += 64, s1 += 64, y0 += 16,
+			y1 += 16, u += 8, v += 8) {
+		for (i = 0; i < 4; i++) {
+			const uint8_t *p = (i & 2 ? s1 : s0) + (i & 1) * 32;
+			__m256i c = _mm256_shuffle_epi8(
+					_mm256_loadu_si256((const __m256i *)p),
+					m);
+
+			br[i] = _mm256_and_si256(c, m8);
+			ga[i] = _mm256_and_si256(_mm256_srli_epi32(c, 8), m8);
+		}
+
+		_mm_storeu_si128((__m128i *)y0, pack_epi32_avx2(
+				luma10_epi32_avx2(br[0], ga[0])));
+		_mm_storeu_si128((__m128i *)(y0 + 8), pack_epi32_avx2(
+				luma10_epi32_avx2(br[1], ga[1])));
+		_mm_storeu_si128((__m128i *)y1, pack_epi32_avx2(
+				luma10_epi32_avx2(br[2], ga[2])));
+		_mm_storeu_si128((__m128i *)(y1 + 8), pack_epi32_avx2(
+				luma10_epi32_avx2(br[3], ga[3])));
+
+		for (i = 0; i < 2; i++) {
+			sbr[i] = _mm256_add_epi16(br[i], br[i + 2]);
+			sga[i] = _mm256_add_epi16(ga[i], ga[i + 2]);
+			sbr[i] = _mm256_add_epi16(sbr[i],
+					_mm256_srli_epi64(sbr[i], 32));
+			sga[i] = _mm256_add_epi16(sga[i],
+					_mm256_srli_epi64(sga[i], 32));
+		}
+
+		_mm_storeu_si128((__m128i *)u, pack_epi32_avx2(
+				even_epi32_avx2(
+					chroma10_epi32_avx2(sbr[0], sga[0],
+						COEF_PAIR(112, -38),
+						COEF_PAIR(-74, 0)),
+					chroma10_epi32_avx2(sbr[1], sga[1],
+						COEF_PAIR(112, -38),
+						COEF_PAIR(-74, 0)))));
+		_mm_storeu_si128((__m128i *)v, pack_epi32_avx2(
+				even_epi32_avx2(
+					chroma10_epi32_avx2(sbr[0], sga[0],
+						COEF_PAIR(-18, 112),
+						COEF_PAIR(-94, 0)),
+					chroma10_epi32_avx2(sbr[1], sga[1],
+						COEF_PAIR(-18, 112),
+						COEF_PAIR(-94, 0)))));
+	}
+	yuv_c(y0, y1, u, v, s0, s1, count, op);
+}
+
+/*
+ * Reads from WC memory are uncached and go one load at a time, unless
+ * they are MOVNTDQA streaming loads, which fetch whole lines into a
+ * streaming buffer. Pulls a block of src through them into bounce.
+ */
+__attribute__((target("sse4.1")))
+static const uint8_t *load_block_stream(uint8_t *bounce, const uint8_t *src,
+		uint32_t bytes)
+{
+	uintptr_t lead = (uintptr_t)src & 15;
+	const __m128i *s = (const __m128i *)(src - lead);
+	__m128i *d = (__m128i *)bounce;
+	uint32_t i, n = (lead + bytes + 15) / 16;
+
+	/* 16 byte blocks never straddle a page, so this stays mapped */
+	for (i = 0; i < n; i++)
+		_mm_store_si128(d + i, _mm_stream_load_si128((__m128i *)(s + i)));
+	return bounce + lead;
+}
+#else
+static const uint8_t *load_block_stream(uint8_t *bounce, const uint8_t *src,
+		uint32_t bytes)
+{
+	memcpy(bounce, src, bytes);
+	return bounce;
+}
+#endif
+
+#if defined(__ARM_NEON)
+static void conv32_neon(uint8_t *dst, const uint8_t *src, uint32_t count,
+		const struct blit_op *op)
+{
+	const uint8x16_t ff = vdupq_n_u8(0xff);
+	int i;
+
+	for (; count >= 16; count -= 16, dst += 64, src += 64) {
+		uint8x16x4_t s = vld4q_u8(src), d;
+
+		for (i = 0; i < 4; i++)
+			d.val[i] = op->idx[i] < 4 ? s.val[op->idx[i]] : ff;
+		vst4q_u8(dst, d);
+	}
+	conv32_c(dst, src, count, op);
+}
+
+static void to565_neon(uint8_t *dst, const uint8_t *src, uint32_t count,
+		const struct blit_op *op)
+{
+	uint8_t dither[4][8] = {};
+	uint8x8_t d[4];
+	int i, p;
+
+	/* Per channel, as vld4 splits them */
+	for (i = 0; op->dither && i < 4; i++)
+		for (p = 0; p < 8; p++)
+			dither[i][p] = op->dither[(p & 3) * 4 + i];
+	for (i = 0; i < 4; i++)
+		d[i] = vld1_u8(dither[i]);
+
+	for (; count >= 8; count -= 8, dst += 16, src += 32) {
+		uint8x8x4_t s = vld4_u8(src);
+		uint16x8_t v;
+
+		for (i = 0; i < 4; i++)
+			s.val[i] = vqadd_u8(s.val[i], d[i]);
+
+		/* Shift-insert keeps the top bits of each channel */
+		v = vshll_n_u8(s.val[op->idx[2]], 8);
+		v = vsriq_n_u16(v, vshll_n_u8(s.val[op->idx[1]], 8), 5);
+		v = vsriq_n_u16(v, vshll_n_u8(s.val[op->idx[0]], 8), 11);
+		vst1q_u8(dst, vreinterpretq_u8_u16(v));
+	}
+	to565_c(dst, src, count, op);
+}
+
+static void from565_neon(uint8_t *dst, const uint8_t *src, uint32_t count,
+		const struct blit_op *op)
+{
+	int i;
+
+	for (; count >= 8; count -= 8, dst += 32, src += 16) {
+		uint16x8_t v = vreinterpretq_u16_u8(vld1q_u8(src));
+		uint8x8_t c[4];
+		uint8x8x4_t d;
+
+		/* Replicate the top bits into the low ones */
+		c[2] = vshrn_n_u16(v, 8);
+		c[1] = vshrn_n_u16(v, 3);
+		c[0] = vmovn_u16(vshlq_n_u16(v, 3));
+		c[2] = vsri_n_u8(c[2], c[2], 5);
+		c[1] = vsri_n_u8(c[1], c[1], 6);
+		c[0] = vsri_n_u8(c[0], c[0], 5);
+		c[3] = vdup_n_u8(0xff);
+
+		for (i = 0; i < 4; i++)
+			d.val[i] = c[op->idx[i] < 4 ? op->idx[i] : 3];
+		vst4_u8(dst, d);
+	}
+	from565_c(dst, src, count, op);
+}
+
+static inline uint16x8_t luma10_neon(uint8x8x4_t s, const struct blit_op *op)
+{
+	uint16x8_t y = vmull_u8(s.val[op->idx[2]], vdup_n_u8(66));
+
+	y = vmlal_u8(y, s.val[op->idx[1]], vdup_n_u8(129));
+	y = vmlal_u8(y, s.val[op->idx[0]], vdup_n_u8(25));
+	return vaddq_u16(vrshrq_n_u16(y, 6), vdupq_n_u16(64));
+}
+
+static inline uint16x4_t chroma10_neon(int16x4_t c0, int16x4_t c1,
+		int16x4_t c2, int16_t k0, int16_t k1, int16_t k2)
+{
+	int32x4_t c = vmull_n_s16(c0, k0);
+
+	c = vmlal_n_s16(c, c1, k1);
+	c = vmlal_n_s16(c, c2, k2);
+	c = vaddq_s32(vrshrq_n_s32(c, 8), vdupq_n_s32(512));
+	return vreinterpret_u16_s16(vmovn_s32(c));
+}
+
+static void yuv_neon(uint16_t *y0, uint16_t *y1, uint16_t *u, uint16_t *v,
+		const uint8_t *s0, const uint8_t *s1, uint32_t count,
+		const struct blit_op *op)
+{
+	for (; count >= 8; count -= 8, s0 += 32, s1 += 32, y0 += 8, y1 += 8,
+			u += 4, v += 4) {
+		uint8x8x4_t a = vld4_u8(s0), b = vld4_u8(s1);
+		int16x4_t c[3];
+		int i;
+
+		vst1q_u16(y0, luma10_neon(a, op));
+		vst1q_u16(y1, luma10_neon(b, op));
+
+		/* Sums of 2x2 blocks, per channel in b, g, r order */
+		for (i = 0; i < 3; i++)
+			c[i] = vreinterpret_s16_u16(vadd_u16(
+					vpaddl_u8(a.val[op->idx[i]]),
+					vpaddl_u8(b.val[op->idx[i]])));
+
+		vst1_u16(u, chroma10_neon(c[0], c[2], c[1], 112, -38, -74));
+		vst1_u16(v, chroma10_neon(c[2], c[1], c[0], 112, -94, -18));
+	}
+	yuv_c(y0, y1, u, v, s0, s1, count, op);
+}
+#endif
+
+static const struct {
+	const char *name;
+	blit_row_fn conv32;
+	blit_row_fn to565;
+	blit_row_fn from565;
+	yuv_rows_fn yuv;
+} blit_impls[] = {
+#if defined(HAVE_X86_TARGETS)
+	{ "avx2", conv32_avx2, to565_avx2, from565_avx2, yuv_avx2 },
+	{ "ssse3", conv32_ssse3, to565_ssse3, from565_ssse3, yuv_ssse3 },
+#endif
+#if defined(__ARM_NEON)
+	{ "neon", conv32_neon, to565_neon, from565_neon, yuv_neon },
+#endif
+	{ "c", conv32_c, to565_c, from565_c, yuv_c },
+};
+
+static int blit_impl = -1;
+
+static int blit_impl_usable(int i)
+{
+#if defined(HAVE_X86_TARGETS)
+	if (blit_impls[i].conv32 == conv32_avx2)
+		return __builtin_cpu_supports("avx2");
+	if (blit_impls[i].conv32 == conv32_ssse3)
+		return __builtin_cpu_supports("ssse3");
+#endif
+	return 1;
+}
+
+static int get_blit_impl(void)
+{
+	const char *force;
+	int i, n = sizeof(blit_impls) / sizeof(blit_impls[0]);
+
+	if (blit_impl >= 0)
+		return blit_impl;
+
+	force = getenv("SP_BLIT_IMPL");
+	for (i = 0; i < n; i++) {
+		if (!blit_impl_usable(i))
+			continue;
+		if (force && strcmp(force, blit_impls[i].name))
+			continue;
+		break;
+	}
+	if (i == n)
+		i = n - 1;
+
+	blit_impl = i;
+	return i;
+}
+
+const char *sp_bo_blit_impl(void)
+{
+	return blit_impls[get_blit_impl()].name;
+}
+
+static const struct blit_format *find_blit_format(uint32_t format)
+{
+	unsigned i;
+
+	for (i = 0; i < sizeof(blit_formats) / sizeof(blit_formats[0]); i++)
+		if (blit_formats[i].format == format)
+			return &blit_formats[i];
+	return NULL;
+}
+
+static void build_idx(const struct blit_format *src,
+		const struct blit_format *dst, uint8_t idx[4])
+{
+	idx[dst->b] = src->b;
+	idx[dst->g] = src->g;
+	idx[dst->r] = src->r;
+	idx[dst->a] = src->has_alpha ? src->a : 4;
+}
+
+static blit_row_fn get_blit_row(const struct blit_format *src,
+		const struct blit_format *dst, struct blit_op *op)
+{
+	int impl = get_blit_impl();
+
+	op->cpp = dst->cpp;
+	op->dither = NULL;
+	if (src->format == dst->format)
+		return copy_row;
+
+	if (dst->cpp == 2) {
+		build_idx(src, CANONICAL, op->idx);
+		return blit_impls[impl].to565;
+	}
+	if (src->cpp == 2) {
+		build_idx(CANONICAL, dst, op->idx);
+		return blit_impls[impl].from565;
+	}
+	build_idx(src, dst, op->idx);
+	return blit_impls[impl].conv32;
+}
+
+/* Source pixels pulled through the bounce buffer at a time, fits in L1 */
+#define BLOCK_BYTES 4096
+
+/* 4:2:0 destinations, their chroma planes after the luma plane */
+static const struct yuv_dst {
+	uint32_t format;
+	uint32_t bits;		/* 10 bit samples sit at the top of 16 */
+	int interleaved;	/* one UV plane, else separate U and V */
+} yuv_dsts[] = {
+	{ DRM_FORMAT_NV12, 8, 1 },
+	{ DRM_FORMAT_YUV420, 8, 0 },
+	{ DRM_FORMAT_P010, 10, 1 },
+};
+
+static const struct yuv_dst *find_yuv_dst(uint32_t format)
+{
+	unsigned i;
+
+	for (i = 0; i < sizeof(yuv_dsts) / sizeof(yuv_dsts[0]); i++)
+		if (yuv_dsts[i].format == format)
+			return &yuv_dsts[i];
+	return NULL;
+}
+
+/* Stores 10 bit samples as 8 bits, rounded, or in the top of 16 */
+static void store_samples(uint8_t *dst, const uint16_t *src, uint32_t count,
+		uint32_t bits)
+{
+	uint32_t i = 0;
+
+#if defined(__SSE2__)
+	const __m128i two = _mm_set1_epi16(2);
+
+	if (bits == 8) {
+		for (; i + 16 <= count; i += 16) {
+			__m128i a = _mm_loadu_si128((const __m128i *)(src + i));
+			__m128i b = _mm_loadu_si128(
+					(const __m128i *)(src + i + 8));
+
+			a = _mm_srli_epi16(_mm_add_epi16(a, two), 2);
+			b = _mm_srli_epi16(_mm_add_epi16(b, two), 2);
+			_mm_storeu_si128((__m128i *)(dst + i),
+					_mm_packus_epi16(a, b));
+		}
+	} else {
+		for (; i + 8 <= count; i += 8)
+			_mm_storeu_si128((__m128i *)(dst + i * 2),
+					_mm_slli_epi16(_mm_loadu_si128(
+						(const __m128i *)(src + i)), 6));
+	}
+#endif
+	for (; i < count; i++) {
+		if (bits == 8) {
+			dst[i] = (src[i] + 2) >> 2;
+		} else {
+			dst[i * 2] = src[i] << 6;
+			dst[i * 2 + 1] = src[i] >> 2;
+		}
+	}
+}
+
+/* Stores U and V samples interleaved, as NV12 and P010 chroma planes */
+static void store_uv(uint8_t *dst, const uint16_t *u, const uint16_t *v,
+		uint32_t count, uint32_t bits)
+{
+	uint32_t i = 0;
+	uint16_t uv[16];
+
+#if defined(__SSE2__)
+	for (; i + 8 <= count; i += 8) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(u + i));
+		__m128i b = _mm_loadu_si128((const __m128i *)(v + i));
+
+		_mm_storeu_si128((__m128i *)uv, _mm_unpacklo_epi16(a, b));
+		_mm_storeu_si128((__m128i *)(uv + 8),
+				_mm_unpackhi_epi16(a, b));
+		store_samples(dst + i * (bits == 8 ? 2 : 4), uv, 16, bits);
+	}
+#endif
+	for (; i < count; i++) {
+		uv[0] = u[i];
+		uv[1] = v[i];
+		store_samples(dst + i * (bits == 8 ? 2 : 4), uv, 2, bits);
+	}
+}
+
+static uint8_t *plane_addr(struct sp_bo *bo, uint32_t plane, uint32_t x,
+		uint32_t y, uint32_t cpp)
+{
+	return (uint8_t *)bo->map_addr + bo->offsets[plane] - bo->offset +
+		y * bo->pitches[plane] + x * cpp;
+}
+
+/*
+ * RGB to a 4:2:0 bo, a pair of rows at a time. The kernels give 10 bit
+ * samples in a cached block, which are then packed into the planes.
+ */
+static void blit_yuv(struct sp_bo *dst, uint32_t dst_x, uint32_t dst_y,
+		struct sp_bo *src, uint32_t src_x, uint32_t src_y,
+		uint32_t width, uint32_t height,
+		const struct blit_format *sf, const struct yuv_dst *yd,
+		int stream)
+{
+	uint8_t bounce[2][BLOCK_BYTES + 32] __attribute__((aligned(64)));
+	uint16_t luma[2][BLOCK_BYTES / 4], chroma[2][BLOCK_BYTES / 8];
+	uint32_t cpp = yd->bits == 8 ? 1 : 2, block = BLOCK_BYTES / 4;
+	uint32_t x, y, n, cx, cy;
+	yuv_rows_fn yuv = blit_impls[get_blit_impl()].yuv;
+	const uint8_t *s0, *s1, *p0, *p1;
+	struct blit_op op;
+
+	build_idx(sf, CANONICAL, op.idx);
+	op.cpp = 4;
+	op.dither = NULL;
+
+	for (y = 0; y < height; y += 2) {
+		s0 = (const uint8_t *)src->map_addr + (src_y + y) * src->pitch +
+			src_x * 4;
+		s1 = y + 1 < height ? s0 + src->pitch : s0;
+		cy = (dst_y + y) / 2;
+
+		for (x = 0; x < width; x += n) {
+			n = width - x < block ? width - x : block;
+			p0 = s0 + x * 4;
+			p1 = s1 + x * 4;
+			if (stream) {
+				p0 = load_block_stream(bounce[0], p0, n * 4);
+				p1 = s1 == s0 ? p0 :
+					load_block_stream(bounce[1], p1, n * 4);
+			}
+
+			yuv(luma[0], luma[1], chroma[0], chroma[1], p0, p1, n,
+					&op);
+
+			store_samples(plane_addr(dst, 0, dst_x + x, dst_y + y,
+					cpp), luma[0], n, yd->bits);
+			if (y + 1 < height)
+				store_samples(plane_addr(dst, 0, dst_x + x,
+						dst_y + y + 1, cpp), luma[1], n,
+						yd->bits);
+
+			cx = (dst_x + x) / 2;
+			if (yd->interleaved) {
+				store_uv(plane_addr(dst, 1, cx, cy, cpp * 2),
+					chroma[0], chroma[1], (n + 1) / 2,
+					yd->bits);
+			} else {
+				store_samples(plane_addr(dst, 1, cx, cy, cpp),
+					chroma[0], (n + 1) / 2, yd->bits);
+				store_samples(plane_addr(dst, 2, cx, cy, cpp),
+					chroma[1], (n + 1) / 2, yd->bits);
+			}
+		}
+	}
+}
+
+static int blit(struct sp_bo *dst, uint32_t dst_x, uint32_t dst_y,
+		struct sp_bo *src, uint32_t src_x, uint32_t src_y,
+		uint32_t width, uint32_t height, int dither)
+{
+	const struct blit_format *sf, *df;
+	const struct yuv_dst *yd;
+	struct blit_op op;
+	blit_row_fn row_fn;
+	uint8_t bounce[BLOCK_BYTES + 32] __attribute__((aligned(64)));
+	uint8_t pattern[16];
+	const uint8_t *s;
+	uint8_t *d;
+	uint32_t y, x, n, block;
+	int stream = 0;
+
+	sf = find_blit_format(src->format);
+	df = find_blit_format(dst->format);
+	yd = find_yuv_dst(dst->format);
+	if (!sf || !(df || (yd && sf->cpp == 4))) {
+		printf("unsupported blit %.4s -> %.4s\n", (char *)&src->format,
+			(char *)&dst->format);
+		return -EINVAL;
+	}
+	if (yd && ((dst_x | dst_y) & 1)) {
+		printf("blit to %.4s at odd %u,%u\n", (char *)&dst->format,
+			dst_x, dst_y);
+		return -EINVAL;
+	}
+
+	if (src_x >= src->width || src_y >= src->height ||
+	    dst_x >= dst->width || dst_y >= dst->height)
+		return 0;
+	if (width > src->width - src_x)
+		width = src->width - src_x;
+	if (width > dst->width - dst_x)
+		width = dst->width - dst_x;
+	if (height > src->height - src_y)
+		height = src->height - src_y;
+	if (height > dst->height - dst_y)
+		height = dst->height - dst_y;
+	if (!width || !height)
+		return 0;
+
+	if (!sp_bo_map(src, 0) ||
+	    !sp_bo_map(dst, width == dst->width && height == dst->height ?
+			SP_BO_MAP_POPULATE : 0))
+		return -ENOMEM;
+
+#if defined(HAVE_X86_TARGETS)
+	stream = sp_bo_write_combined(src) && __builtin_cpu_supports("sse4.1");
+#endif
+
+	if (yd) {
+		blit_yuv(dst, dst_x, dst_y, src, src_x, src_y, width, height,
+				sf, yd, stream);
+		sp_bo_add_damage(dst, dst_x, dst_y, width, height);
+		return 0;
+	}
+
+	row_fn = get_blit_row(sf, df, &op);
+	dither = dither && df->cpp == 2 && sf->cpp == 4;
+	block = BLOCK_BYTES / sf->cpp;
+
+	s = (const uint8_t *)src->map_addr + src_y * src->pitch +
+		src_x * sf->cpp;
+	d = (uint8_t *)dst->map_addr + dst_y * dst->pitch + dst_x * df->cpp;
+	for (y = 0; y < height; y++, s += src->pitch, d += dst->pitch) {
+		/* Blocks are a multiple of 4 pixels and keep the phase */
+		if (dither) {
+			build_dither(&op, dst_x, dst_y + y, pattern);
+			op.dither = pattern;
+		}
+
+		if (!stream) {
+			row_fn(d, s, width, &op);
+			continue;
+		}
+
+		for (x = 0; x < width; x += n) {
+			n = width - x < block ? width - x : block;
+			row_fn(d + x * df->cpp,
+				load_block_stream(bounce, s + x * sf->cpp,
+					n * sf->cpp), n, &op);
+		}
+	}
+
+	sp_bo_add_damage(dst, dst_x, dst_y, width, height);
+	return 0;
+}
+
+int sp_bo_blit(struct sp_bo *dst, uint32_t dst_x, uint32_t dst_y,
+		struct sp_bo *src, uint32_t src_x, uint32_t src_y,
+		uint32_t width, uint32_t height)
+{
+	return blit(dst, dst_x, dst_y, src, src_x, src_y, width, height, 0);
+}
+
+int sp_bo_blit_dither(struct sp_bo *dst, uint32_t dst_x, uint32_t dst_y,
+		struct sp_bo *src, uint32_t src_x, uint32_t src_y,
+		uint32_t width, uint32_t height)
+{
+	return blit(dst, dst_x, dst_y, src, src_x, src_y, width, height, 1);
+}
+
+void sp_dither_row_565(uint8_t *dst, const uint8_t *src, uint32_t count,
+		uint32_t x, uint32_t y)
+{
+	struct blit_op op;
+	uint8_t pattern[16];
+
+	build_idx(CANONICAL, CANONICAL, op.idx);
+	op.cpp = 2;
+	build_dither(&op, x, y, pattern);
+	op.dither = pattern;
+	blit_impls[get_blit_impl()].to565(dst, src, count, &op);
+}
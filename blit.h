@@ -0,0 +1,46 @@
+#ifndef __BLIT_H_INCLUDED__
+#define __BLIT_H_INCLUDED__
+
+#include <stdint.h>
+
+struct sp_bo;
+
+/*
+ * Copies a width x height rect from src at (src_x, src_y) to dst at
+ * (dst_x, dst_y), converting between XRGB8888, ARGB8888, RGBA8888,
+ * ABGR8888 and RGB565. The rect is clipped to both bos. Sources without
+ * alpha give opaque pixels, RGB565 is expanded by bit replication and
+ * truncated on the way back. Alpha is not applied, see compositor.h for
+ * blending.
+ *
+ * The 32bpp formats also convert to NV12, YUV420 and P010 dsts, as BT.601
+ * limited range with chroma averaged over 2x2 blocks; dst_x and dst_y must
+ * be even there.
+ *
+ * src and dst may be the same bo if the rects don't overlap. The copied
+ * rect is recorded as damage on dst. Returns -EINVAL for other formats.
+ */
+int sp_bo_blit(struct sp_bo *dst, uint32_t dst_x, uint32_t dst_y,
+		struct sp_bo *src, uint32_t src_x, uint32_t src_y,
+		uint32_t width, uint32_t height);
+
+/*
+ * Like sp_bo_blit(), but 32bpp to RGB565 conversions add a 4x4 ordered
+ * dither before truncating, so gradients don't band on RGB565 scanouts.
+ * The pattern is anchored to dst, so neighbouring blits line up.
+ */
+int sp_bo_blit_dither(struct sp_bo *dst, uint32_t dst_x, uint32_t dst_y,
+		struct sp_bo *src, uint32_t src_x, uint32_t src_y,
+		uint32_t width, uint32_t height);
+
+/*
+ * Dithers count XRGB8888 or ARGB8888 pixels down to RGB565, the same way
+ * sp_bo_blit_dither() does. x and y are where dst lies on screen.
+ */
+void sp_dither_row_565(uint8_t *dst, const uint8_t *src, uint32_t count,
+		uint32_t x, uint32_t y);
+
+/* Name of the conversion kernels in use, SP_BLIT_IMPL=<name> forces one */
+const char *sp_bo_blit_impl(void);
+
+#endif /* __BLIT_H_INCLUDED__ */
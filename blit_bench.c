@@ -0,0 +1,250 @@
+/*
+ * Compares sp_bo_blit() against a naive per-pixel conversion loop for
+ * every pair of supported formats, at 1080p and 4K. Conversions to RGB565
+ * are also timed with ordered dithering, and conversions to YUV on their
+ * own.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <drm_fourcc.h>
+
+#include "blit.h"
+#include "bo.h"
+#include "dev.h"
+
+#define ITERATIONS 5
+
+static const uint32_t formats[] = {
+	DRM_FORMAT_XRGB8888,
+	DRM_FORMAT_ARGB8888,
+	DRM_FORMAT_RGBA8888,
+	DRM_FORMAT_ABGR8888,
+	DRM_FORMAT_RGB565,
+};
+
+static const uint32_t yuv_formats[] = {
+	DRM_FORMAT_NV12,
+	DRM_FORMAT_YUV420,
+	DRM_FORMAT_P010,
+};
+
+static const struct {
+	uint32_t width, height;
+} sizes[] = {
+	{ 1920, 1080 },
+	{ 3840, 2160 },
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void get_pixel(struct sp_bo *bo, uint32_t x, uint32_t y, uint8_t *a,
+		uint8_t *r, uint8_t *g, uint8_t *b)
+{
+	uint8_t *p = (uint8_t *)bo->map_addr + y * bo->pitch;
+	uint16_t v;
+
+	switch (bo->format) {
+	case DRM_FORMAT_RGB565:
+		p += x * 2;
+		v = p[0] | p[1] << 8;
+		*r = (v >> 11) << 3 | (v >> 13);
+		*g = ((v >> 5) & 0x3f) << 2 | ((v >> 9) & 0x3);
+		*b = (v & 0x1f) << 3 | ((v >> 2) & 0x7);
+		*a = 0xff;
+		break;
+	case DRM_FORMAT_XRGB8888:
+	case DRM_FORMAT_ARGB8888:
+		p += x * 4;
+		*b = p[0];
+		*g = p[1];
+		*r = p[2];
+		*a = bo->format == DRM_FORMAT_ARGB8888 ? p[3] : 0xff;
+		break;
+	case DRM_FORMAT_RGBA8888:
+		p += x * 4;
+		*a = p[0];
+		*b = p[1];
+		*g = p[2];
+		*r = p[3];
+		break;
+	case DRM_FORMAT_ABGR8888:
+		p += x * 4;
+		*r = p[0];
+		*g = p[1];
+		*b = p[2];
+		*a = p[3];
+		break;
+	}
+}
+
+static void put_pixel(struct sp_bo *bo, uint32_t x, uint32_t y, uint8_t a,
+		uint8_t r, uint8_t g, uint8_t b)
+{
+	uint8_t *p = (uint8_t *)bo->map_addr + y * bo->pitch;
+	uint16_t v;
+
+	switch (bo->format) {
+	case DRM_FORMAT_RGB565:
+		p += x * 2;
+		v = (r >> 3) << 11 | (g >> 2) << 5 | b >> 3;
+		p[0] = v;
+		p[1] = v >> 8;
+		break;
+	case DRM_FORMAT_XRGB8888:
+	case DRM_FORMAT_ARGB8888:
+		p += x * 4;
+		p[0] = b;
+		p[1] = g;
+		p[2] = r;
+		p[3] = a;
+		break;
+	case DRM_FORMAT_RGBA8888:
+		p += x * 4;
+		p[0] = a;
+		p[1] = b;
+		p[2] = g;
+		p[3] = r;
+		break;
+	case DRM_FORMAT_ABGR8888:
+		p += x * 4;
+		p[0] = r;
+		p[1] = g;
+		p[2] = b;
+		p[3] = a;
+		break;
+	}
+}
+
+static void naive_blit(struct sp_bo *dst, struct sp_bo *src)
+{
+	uint8_t a = 0, r = 0, g = 0, b = 0;
+	uint32_t x, y;
+
+	for (y = 0; y < src->height; y++) {
+		for (x = 0; x < src->width; x++) {
+			get_pixel(src, x, y, &a, &r, &g, &b);
+			put_pixel(dst, x, y, a, r, g, b);
+		}
+	}
+}
+
+static struct sp_bo *create_bo(struct sp_dev *dev, uint32_t width,
+		uint32_t height, uint32_t format)
+{
+	uint32_t bpp = format == DRM_FORMAT_RGB565 ? 16 : 32;
+	struct sp_bo *bo;
+
+	/* YUV formats ignore depth and bpp */
+	bo = create_sp_bo(dev, width, height, bpp == 16 ? 16 : 24, bpp, format,
+			0);
+	if (bo && !sp_bo_map(bo, SP_BO_MAP_POPULATE)) {
+		free_sp_bo(bo);
+		return NULL;
+	}
+	return bo;
+}
+
+int main(int argc, char *argv[])
+{
+	struct sp_bo *src, *dst;
+	struct sp_dev *dev;
+	double start, naive, blit, dither;
+	unsigned s, i, j, k;
+
+	dev = create_sp_dev();
+	if (!dev) {
+		printf("Failed to create sp_dev\n");
+		return -1;
+	}
+
+	printf("%s kernels, %d iterations\n", sp_bo_blit_impl(), ITERATIONS);
+	for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		printf("%ux%u\n", sizes[s].width, sizes[s].height);
+		for (i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+			src = create_bo(dev, sizes[s].width, sizes[s].height,
+					formats[i]);
+			if (!src) {
+				printf("  %.4s unsupported\n",
+					(char *)&formats[i]);
+				continue;
+			}
+			memset(src->map_addr, 0x5a, src->size);
+
+			for (j = 0; j < sizeof(formats) / sizeof(formats[0]);
+					j++) {
+				dst = create_bo(dev, sizes[s].width,
+						sizes[s].height, formats[j]);
+				if (!dst)
+					continue;
+
+				start = now();
+				for (k = 0; k < ITERATIONS; k++)
+					naive_blit(dst, src);
+				naive = (now() - start) * 1e3 / ITERATIONS;
+
+				start = now();
+				for (k = 0; k < ITERATIONS; k++)
+					sp_bo_blit(dst, 0, 0, src, 0, 0,
+						src->width, src->height);
+				blit = (now() - start) * 1e3 / ITERATIONS;
+
+				printf("  %.4s -> %.4s  naive %7.2f ms  "
+					"blit %6.2f ms  %5.1fx",
+					(char *)&formats[i],
+					(char *)&formats[j], naive, blit,
+					naive / blit);
+
+				if (formats[j] == DRM_FORMAT_RGB565 &&
+				    formats[i] != DRM_FORMAT_RGB565) {
+					start = now();
+					for (k = 0; k < ITERATIONS; k++)
+						sp_bo_blit_dither(dst, 0, 0,
+							src, 0, 0, src->width,
+							src->height);
+					dither = (now() - start) * 1e3 /
+						ITERATIONS;
+					printf("  dither %6.2f ms", dither);
+				}
+				printf("\n");
+				free_sp_bo(dst);
+			}
+
+			for (j = 0; formats[i] != DRM_FORMAT_RGB565 &&
+				    j < sizeof(yuv_formats) /
+					sizeof(yuv_formats[0]); j++) {
+				dst = create_bo(dev, sizes[s].width,
+						sizes[s].height, yuv_formats[j]);
+				if (!dst)
+					continue;
+
+				start = now();
+				for (k = 0; k < ITERATIONS; k++)
+					sp_bo_blit(dst, 0, 0, src, 0, 0,
+						src->width, src->height);
+				blit = (now() - start) * 1e3 / ITERATIONS;
+
+				printf("  %.4s -> %.4s  blit %6.2f ms  "
+					"%6.0f Mpix/s\n",
+					(char *)&formats[i],
+					(char *)&yuv_formats[j], blit,
+					(double)src->width * src->height /
+					blit / 1e3);
+				free_sp_bo(dst);
+			}
+			free_sp_bo(src);
+		}
+	}
+
+	destroy_sp_dev(dev);
+	return 0;
+}
@@ -1,176 +1,2203 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/ioctl.h>
 #include <fcntl.h>
 #include <errno.h>
 
+#include <linux/dma-buf.h>
+#include <linux/udmabuf.h>
+#include <gbm.h>
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 #include <drm_fourcc.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+#define HAVE_AVX2_TARGET
+#endif
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #include "bo.h"
 #include "dev.h"
 
+/*
+ * Span writers fill |count| 32bpp pixels at |dst| with an already packed
+ * pixel value. The format is resolved once per draw call, the writer once
+ * per process, so the per-pixel loop only ever stores.
+ */
+typedef void (*fill_span32_fn)(uint8_t *dst, uint32_t pixel, uint32_t count);
+
+static void fill_span32_c(uint8_t *dst, uint32_t pixel, uint32_t count)
+{
+	uint32_t *p = (uint32_t *)dst;
+
+	while (count--)
+		*p++ = pixel;
+}
+
+#if defined(__SSE2__)
+static void fill_span32_sse2(uint8_t *dst, uint32_t pixel, uint32_t count)
+{
+	uint32_t *p = (uint32_t *)dst;
+	__m128i v = _mm_set1_epi32(pixel);
+
+	for (; count && ((uintptr_t)p & 15); count--)
+		*p++ = pixel;
+	for (; count >= 16; count -= 16, p += 16) {
+		_mm_store_si128((__m128i *)p, v);
+		_mm_store_si128((__m128i *)(p + 4), v);
+		_mm_store_si128((__m128i *)(p + 8), v);
+		_mm_store_si128((__m128i *)(p + 12), v);
+	}
+	for (; count >= 4; count -= 4, p += 4)
+		_mm_store_si128((__m128i *)p, v);
+	while (count--)
+		*p++ = pixel;
+}
+
+/*
+ * Non-temporal variant for write-combined and uncached mappings: full lines
+ * go straight to memory instead of through (or around, for uncached) the
+ * cache. Stores are weakly ordered, see sp_bo_flush_writes().
+ */
+static void fill_span32_sse2_stream(uint8_t *dst, uint32_t pixel,
+		uint32_t count)
+{
+	uint32_t *p = (uint32_t *)dst;
+	__m128i v = _mm_set1_epi32(pixel);
+
+	for (; count && ((uintptr_t)p & 15); count--)
+		*p++ = pixel;
+	for (; count >= 16; count -= 16, p += 16) {
+		_mm_stream_si128((__m128i *)p, v);
+		_mm_stream_si128((__m128i *)(p + 4), v);
+		_mm_stream_si128((__m128i *)(p + 8), v);
+		_mm_stream_si128((__m128i *)(p + 12), v);
+	}
+	for (; count >= 4; count -= 4, p += 4)
+		_mm_stream_si128((__m128i *)p, v);
+	while (count--)
+		*p++ = pixel;
+}
+#endif
+
+#if defined(HAVE_AVX2_TARGET)
+__attribute__((target("avx2")))
+static void fill_span32_avx2(uint8_t *dst, uint32_t pixel, uint32_t count)
+{
+	uint32_t *p = (uint32_t *)dst;
+	__m256i v = _mm256_set1_epi32(pixel);
+
+	for (; count && ((uintptr_t)p & 31); count--)
+		*p++ = pixel;
+	for (; count >= 32; count -= 32, p += 32) {
+		_mm256_store_si256((__m256i *)p, v);
+		_mm256_store_si256((__m256i *)(p + 8), v);
+		_mm256_store_si256((__m256i *)(p + 16), v);
+		_mm256_store_si256((__m256i *)(p + 24), v);
+	}
+	for (; count >= 8; count -= 8, p += 8)
+		_mm256_store_si256((__m256i *)p, v);
+	while (count--)
+		*p++ = pixel;
+}
+
+__attribute__((target("avx2")))
+static void fill_span32_avx2_stream(uint8_t *dst, uint32_t pixel,
+		uint32_t count)
+{
+	uint32_t *p = (uint32_t *)dst;
+	__m256i v = _mm256_set1_epi32(pixel);
+
+	for (; count && ((uintptr_t)p & 31); count--)
+		*p++ = pixel;
+	for (; count >= 16; count -= 16, p += 16) {
+		_mm256_stream_si256((__m256i *)p, v);
+		_mm256_stream_si256((__m256i *)(p + 8), v);
+	}
+	for (; count >= 8; count -= 8, p += 8)
+		_mm256_stream_si256((__m256i *)p, v);
+	while (count--)
+		*p++ = pixel;
+}
+#endif
+
+#if defined(__ARM_NEON)
+static void fill_span32_neon(uint8_t *dst, uint32_t pixel, uint32_t count)
+{
+	uint32_t *p = (uint32_t *)dst;
+	uint32x4_t v = vdupq_n_u32(pixel);
+
+	for (; count >= 16; count -= 16, p += 16) {
+		vst1q_u32(p, v);
+		vst1q_u32(p + 4, v);
+		vst1q_u32(p + 8, v);
+		vst1q_u32(p + 12, v);
+	}
+	for (; count >= 4; count -= 4, p += 4)
+		vst1q_u32(p, v);
+	while (count--)
+		*p++ = pixel;
+}
+#endif
+
+static const struct {
+	const char *name;
+	fill_span32_fn fn;
+	fill_span32_fn stream_fn;
+} fill_span32_impls[] = {
+#if defined(HAVE_AVX2_TARGET)
+	{ "avx2", fill_span32_avx2, fill_span32_avx2_stream },
+#endif
+#if defined(__SSE2__)
+	{ "sse2", fill_span32_sse2, fill_span32_sse2_stream },
+#endif
+#if defined(__ARM_NEON)
+	{ "neon", fill_span32_neon, fill_span32_neon },
+#endif
+	{ "c", fill_span32_c, fill_span32_c },
+};
+
+/* Spans shorter than this aren't worth bypassing the cache for */
+#define STREAM_MIN_BYTES 256
+
+static int fill_span32_impl = -1;
+
+static int fill_span32_usable(int i)
+{
+#if defined(HAVE_AVX2_TARGET)
+	if (fill_span32_impls[i].fn == fill_span32_avx2)
+		return __builtin_cpu_supports("avx2");
+#endif
+	return 1;
+}
+
+/*
+ * Picks the widest writer the CPU supports. SP_FILL_IMPL=<name> forces a
+ * specific one so the kernels can be compared against each other.
+ */
+static fill_span32_fn get_fill_span32(int stream)
+{
+	const char *force;
+	int i, n = sizeof(fill_span32_impls) / sizeof(fill_span32_impls[0]);
+
+	if (fill_span32_impl >= 0)
+		return stream ? fill_span32_impls[fill_span32_impl].stream_fn :
+			fill_span32_impls[fill_span32_impl].fn;
+
+	force = getenv("SP_FILL_IMPL");
+	for (i = 0; i < n; i++) {
+		if (!fill_span32_usable(i))
+			continue;
+		if (force && strcmp(force, fill_span32_impls[i].name))
+			continue;
+		break;
+	}
+	if (i == n)
+		i = n - 1;
+
+	fill_span32_impl = i;
+	return get_fill_span32(stream);
+}
+
+const char *sp_bo_fill_impl(void)
+{
+	get_fill_span32(0);
+	return fill_span32_impls[fill_span32_impl].name;
+}
+
+/*
+ * Packers turn 8-bit a/r/g/b into one pixel of a format, in memory order.
+ * They are stamped out per format by the macros below so the channel
+ * layout is resolved at compile time; draw calls look the format up once.
+ */
+typedef void (*pack_pixel_fn)(uint8_t a, uint8_t r, uint8_t g, uint8_t b,
+		uint8_t *px);
+
+#define DEFINE_PACK_BYTES(name, c0, c1, c2, c3)				\
+static void pack_##name(uint8_t a, uint8_t r, uint8_t g, uint8_t b,	\
+		uint8_t *px)						\
+{									\
+	px[0] = c0;							\
+	px[1] = c1;							\
+	px[2] = c2;							\
+	px[3] = c3;							\
+}
+
+/* 24bpp, no alpha */
+#define DEFINE_PACK_BYTES3(name, c0, c1, c2)				\
+static void pack_##name(uint8_t a, uint8_t r, uint8_t g, uint8_t b,	\
+		uint8_t *px)						\
+{									\
+	px[0] = c0;							\
+	px[1] = c1;							\
+	px[2] = c2;							\
+}
+
+/* Little-endian packed words, channels given from the top bits down */
+#define DEFINE_PACK_WORD(name, type, expr)				\
+static void pack_##name(uint8_t a, uint8_t r, uint8_t g, uint8_t b,	\
+		uint8_t *px)						\
+{									\
+	type v = (expr);						\
+	unsigned i;							\
+									\
+	for (i = 0; i < sizeof(v); i++)					\
+		px[i] = v >> (i * 8);					\
+}
+
+/* 8 to 10 bits by replicating the top bits */
+#define UNORM10(c) ((uint32_t)(c) << 2 | (c) >> 6)
+
+/* c / 255 as an IEEE half float, rounded to nearest even */
+static uint64_t unorm8_to_half(uint8_t c)
+{
+	float f = c / 255.0f;
+	uint32_t bits, m, rem;
+	int e;
+
+	if (!c)
+		return 0;
+
+	memcpy(&bits, &f, sizeof(bits));
+	e = (int)((bits >> 23) & 0xff) - 127 + 15;
+	m = (bits & 0x7fffff) >> 13;
+	rem = bits & 0x1fff;
+	if (rem > 0x1000 || (rem == 0x1000 && (m & 1)))
+		m++;
+	if (m == 0x400) {
+		m = 0;
+		e++;
+	}
+	return (uint64_t)e << 10 | m;
+}
+
+DEFINE_PACK_BYTES(XRGB8888, b, g, r, a)
+DEFINE_PACK_BYTES(ARGB8888, b, g, r, a)
+DEFINE_PACK_BYTES(RGBA8888, a, b, g, r)
+DEFINE_PACK_BYTES(ABGR8888, r, g, b, a)
+DEFINE_PACK_BYTES3(BGR888, r, g, b)
+DEFINE_PACK_WORD(RGB565, uint16_t, (r >> 3) << 11 | (g >> 2) << 5 | b >> 3)
+DEFINE_PACK_WORD(XRGB2101010, uint32_t,
+		3u << 30 | UNORM10(r) << 20 | UNORM10(g) << 10 | UNORM10(b))
+DEFINE_PACK_WORD(XBGR2101010, uint32_t,
+		3u << 30 | UNORM10(b) << 20 | UNORM10(g) << 10 | UNORM10(r))
+DEFINE_PACK_WORD(ABGR16161616F, uint64_t,
+		unorm8_to_half(a) << 48 | unorm8_to_half(b) << 32 |
+		unorm8_to_half(g) << 16 | unorm8_to_half(r))
+
+#define PIXEL_FORMAT(name, cpp) { DRM_FORMAT_##name, cpp, pack_##name }
+
+static const struct pixel_format {
+	uint32_t format;
+	uint32_t cpp;
+	pack_pixel_fn pack;
+} pixel_formats[] = {
+	PIXEL_FORMAT(XRGB8888, 4),
+	PIXEL_FORMAT(ARGB8888, 4),
+	PIXEL_FORMAT(RGBA8888, 4),
+	PIXEL_FORMAT(ABGR8888, 4),
+	PIXEL_FORMAT(XRGB2101010, 4),
+	PIXEL_FORMAT(XBGR2101010, 4),
+	PIXEL_FORMAT(ABGR16161616F, 8),
+	PIXEL_FORMAT(RGB565, 2),
+	PIXEL_FORMAT(BGR888, 3),
+};
+
+static const struct pixel_format *find_pixel_format(uint32_t format)
+{
+	unsigned i;
+
+	for (i = 0; i < sizeof(pixel_formats) / sizeof(pixel_formats[0]); i++)
+		if (pixel_formats[i].format == format)
+			return &pixel_formats[i];
+	return NULL;
+}
+
+uint32_t sp_format_bpp(uint32_t format)
+{
+	const struct pixel_format *pf = find_pixel_format(format);
+
+	return pf ? pf->cpp * 8 : 0;
+}
+
+/*
+ * Multi-planar 4:2:0 formats. cpp is per sample of each plane, a U/V pair
+ * for the interleaved chroma planes; 10 bit components sit in the top bits
+ * of 16.
+ */
+static const struct yuv_format {
+	uint32_t format;
+	uint32_t num_planes;
+	uint32_t cpp[3];
+	uint32_t bits;
+	uint32_t hsub;
+	uint32_t vsub;
+} yuv_formats[] = {
+	{ DRM_FORMAT_NV12, 2, { 1, 2 }, 8, 2, 2 },
+	{ DRM_FORMAT_YUV420, 3, { 1, 1, 1 }, 8, 2, 2 },
+	{ DRM_FORMAT_P010, 2, { 2, 4 }, 10, 2, 2 },
+};
+
+static const struct yuv_format *find_yuv_format(uint32_t format)
+{
+	unsigned i;
+
+	for (i = 0; i < sizeof(yuv_formats) / sizeof(yuv_formats[0]); i++)
+		if (yuv_formats[i].format == format)
+			return &yuv_formats[i];
+	return NULL;
+}
+
+uint32_t sp_format_num_planes(uint32_t format)
+{
+	const struct yuv_format *yf = find_yuv_format(format);
+
+	return yf ? yf->num_planes : 1;
+}
+
+uint32_t sp_format_vsub(uint32_t format)
+{
+	const struct yuv_format *yf = find_yuv_format(format);
+
+	return yf ? yf->vsub : 1;
+}
+
+static uint32_t yuv_plane_rows(const struct yuv_format *yf, uint32_t plane,
+		uint32_t height)
+{
+	return plane ? (height + yf->vsub - 1) / yf->vsub : height;
+}
+
+/*
+ * Rows of luma pitch a buffer needs for all planes. Chroma planes take
+ * cpp / (cpp[0] * hsub) of the luma pitch, which the even width keeps
+ * whole.
+ */
+static uint32_t yuv_alloc_rows(const struct yuv_format *yf, uint32_t height)
+{
+	uint32_t i, rows = height, div = yf->cpp[0] * yf->hsub;
+
+	for (i = 1; i < yf->num_planes; i++)
+		rows += (yuv_plane_rows(yf, i, height) * yf->cpp[i] + div - 1) /
+			div;
+	return rows;
+}
+
+/* Puts the chroma planes after the luma plane of a single buffer */
+static void layout_yuv_planes(struct sp_bo *bo, const struct yuv_format *yf)
+{
+	uint32_t i, offset = bo->offset + bo->pitch * bo->height;
+
+	bo->num_planes = yf->num_planes;
+	for (i = 1; i < yf->num_planes; i++) {
+		bo->handles[i] = bo->handle;
+		bo->pitches[i] = bo->pitch * yf->cpp[i] /
+			(yf->cpp[0] * yf->hsub);
+		bo->offsets[i] = offset;
+		offset += bo->pitches[i] * yuv_plane_rows(yf, i, bo->height);
+	}
+}
+
+static uint8_t *plane_addr(struct sp_bo *bo, uint32_t plane)
+{
+	return (uint8_t *)bo->map_addr + bo->offsets[plane] - bo->offset;
+}
+
+/* Stores a 10 bit component as the format holds it, returns its size */
+static uint32_t put_yuv_sample(const struct yuv_format *yf, uint8_t *px,
+		uint32_t v10)
+{
+	if (yf->bits == 8) {
+		px[0] = (v10 + 2) >> 2;
+		return 1;
+	}
+	px[0] = v10 << 6;
+	px[1] = v10 >> 2;
+	return 2;
+}
+
+/* Widens a rect to whole chroma samples */
+static void align_yuv_rect(const struct yuv_format *yf, uint32_t *x,
+		uint32_t *y, uint32_t *width, uint32_t *height)
+{
+	uint32_t xmax = *x + *width, ymax = *y + *height;
+
+	*x -= *x % yf->hsub;
+	*y -= *y % yf->vsub;
+	xmax += (yf->hsub - xmax % yf->hsub) % yf->hsub;
+	ymax += (yf->vsub - ymax % yf->vsub) % yf->vsub;
+	*width = xmax - *x;
+	*height = ymax - *y;
+}
+
+/*
+ * Fills |count| pixels of any size by repeating a 48 byte pattern, which
+ * holds a whole number of 2, 3, 4 and 8 byte pixels. Used for the formats
+ * that aren't 32bpp; those have the fill_span32 writers.
+ */
+#define PATTERN_BYTES 48
+
+static void fill_span_pattern(uint8_t *dst, const uint8_t *px, uint32_t cpp,
+		uint32_t count, int stream)
+{
+	uint8_t pattern[PATTERN_BYTES];
+	uint32_t i, bytes = count * cpp, head = 0;
+
+	for (i = 0; i < PATTERN_BYTES; i++)
+		pattern[i] = px[i % cpp];
+
+#if defined(__SSE2__)
+	/* Align the body and rotate the pattern to the phase it starts at */
+	head = (16 - ((uintptr_t)dst & 15)) & 15;
+	if (bytes >= head + PATTERN_BYTES) {
+		uint8_t rot[PATTERN_BYTES];
+		__m128i v0, v1, v2;
+
+		memcpy(dst, pattern, head);
+		dst += head;
+		bytes -= head;
+		for (i = 0; i < PATTERN_BYTES; i++)
+			rot[i] = pattern[(i + head) % PATTERN_BYTES];
+		memcpy(pattern, rot, PATTERN_BYTES);
+
+		v0 = _mm_loadu_si128((const __m128i *)pattern);
+		v1 = _mm_loadu_si128((const __m128i *)(pattern + 16));
+		v2 = _mm_loadu_si128((const __m128i *)(pattern + 32));
+		for (; bytes >= PATTERN_BYTES; bytes -= PATTERN_BYTES,
+				dst += PATTERN_BYTES) {
+			if (stream) {
+				_mm_stream_si128((__m128i *)dst, v0);
+				_mm_stream_si128((__m128i *)(dst + 16), v1);
+				_mm_stream_si128((__m128i *)(dst + 32), v2);
+			} else {
+				_mm_store_si128((__m128i *)dst, v0);
+				_mm_store_si128((__m128i *)(dst + 16), v1);
+				_mm_store_si128((__m128i *)(dst + 32), v2);
+			}
+		}
+	}
+#else
+	(void)head;
+	(void)stream;
+#endif
+	for (; bytes >= PATTERN_BYTES; bytes -= PATTERN_BYTES,
+			dst += PATTERN_BYTES)
+		memcpy(dst, pattern, PATTERN_BYTES);
+	memcpy(dst, pattern, bytes);
+}
+
 void fill_bo(struct sp_bo *bo, uint8_t a, uint8_t r, uint8_t g, uint8_t b)
 {
 	draw_rect(bo, 0, 0, bo->width, bo->height, a, r, g, b);
 }
 
-void draw_rect(struct sp_bo *bo, uint32_t x, uint32_t y, uint32_t width,
-		uint32_t height, uint8_t a, uint8_t r, uint8_t g, uint8_t b)
+/*
+ * BT.601 limited range, 10 bits. The sp_bo_blit() kernels use the same
+ * formula, with chroma from the sum of a 2x2 block.
+ */
+static void draw_rect_yuv(struct sp_bo *bo, const struct yuv_format *yf,
+		uint32_t x, uint32_t y, uint32_t xmax, uint32_t ymax,
+		uint8_t r, uint8_t g, uint8_t b)
+{
+	uint32_t y10, u10, v10, i, j, n, x0, x1, y1;
+	int32_t r4 = r * 4, g4 = g * 4, b4 = b * 4;
+	uint8_t px[3][4];
+	uint8_t *row;
+	int stream;
+
+	y10 = ((66 * r + 129 * g + 25 * b + 32) >> 6) + 64;
+	u10 = ((112 * b4 - 38 * r4 - 74 * g4 + 128) >> 8) + 512;
+	v10 = ((112 * r4 - 94 * g4 - 18 * b4 + 128) >> 8) + 512;
+
+	put_yuv_sample(yf, px[0], y10);
+	if (yf->num_planes == 2) {
+		n = put_yuv_sample(yf, px[1], u10);
+		put_yuv_sample(yf, px[1] + n, v10);
+	} else {
+		put_yuv_sample(yf, px[1], u10);
+		put_yuv_sample(yf, px[2], v10);
+	}
+
+	for (i = 0; i < yf->num_planes; i++) {
+		x0 = i ? x / yf->hsub : x;
+		x1 = i ? (xmax + yf->hsub - 1) / yf->hsub : xmax;
+		y1 = i ? yuv_plane_rows(yf, i, ymax) : ymax;
+		stream = sp_bo_write_combined(bo) &&
+			(x1 - x0) * yf->cpp[i] >= STREAM_MIN_BYTES;
+
+		row = plane_addr(bo, i) + (i ? y / yf->vsub : y) *
+			bo->pitches[i] + x0 * yf->cpp[i];
+		for (j = i ? y / yf->vsub : y; j < y1;
+				j++, row += bo->pitches[i])
+			fill_span_pattern(row, px[i], yf->cpp[i], x1 - x0,
+					stream);
+	}
+}
+
+void sp_bo_align_rect(const struct sp_bo *bo, uint32_t *x, uint32_t *y,
+		uint32_t *width, uint32_t *height)
+{
+	const struct yuv_format *yf = find_yuv_format(bo->format);
+
+	if (yf)
+		align_yuv_rect(yf, x, y, width, height);
+}
+
+void draw_rect(struct sp_bo *bo, uint32_t x, uint32_t y, uint32_t width,
+		uint32_t height, uint8_t a, uint8_t r, uint8_t g, uint8_t b)
+{
+	sp_bo_align_rect(bo, &x, &y, &width, &height);
+	sp_bo_add_damage(bo, x, y, width, height);
+	draw_rect_nodamage(bo, x, y, width, height, a, r, g, b);
+}
+
+void draw_rect_nodamage(struct sp_bo *bo, uint32_t x, uint32_t y,
+		uint32_t width, uint32_t height, uint8_t a, uint8_t r,
+		uint8_t g, uint8_t b)
+{
+	uint32_t i, cpp, pixel, xmax, ymax;
+	const struct yuv_format *yf = find_yuv_format(bo->format);
+	const struct pixel_format *pf;
+	fill_span32_fn fill_span;
+	uint8_t px[8];
+	uint8_t *row;
+	int stream;
+
+	if (yf)
+		align_yuv_rect(yf, &x, &y, &width, &height);
+	xmax = x + width;
+	ymax = y + height;
+	if (xmax > bo->width)
+		xmax = bo->width;
+	if (ymax > bo->height)
+		ymax = bo->height;
+	if (x >= xmax || y >= ymax)
+		return;
+
+	if (yf) {
+		if (sp_bo_map(bo, x == 0 && y == 0 && xmax == bo->width &&
+				ymax == bo->height ? SP_BO_MAP_POPULATE : 0))
+			draw_rect_yuv(bo, yf, x, y, xmax, ymax, r, g, b);
+		return;
+	}
+
+	pf = find_pixel_format(bo->format);
+	if (!pf)
+		return;
+	pf->pack(a, r, g, b, px);
+	cpp = pf->cpp;
+
+	/* A rect covering the whole bo writes every page, so prefault them */
+	if (!sp_bo_map(bo, x == 0 && y == 0 && xmax == bo->width &&
+			ymax == bo->height ? SP_BO_MAP_POPULATE : 0))
+		return;
+
+	stream = sp_bo_write_combined(bo) &&
+		(xmax - x) * cpp >= STREAM_MIN_BYTES;
+	row = (uint8_t *)bo->map_addr + y * bo->pitch + x * cpp;
+
+	/* Unpadded full-width rects are one contiguous span */
+	if (x == 0 && xmax * cpp == bo->pitch) {
+		xmax *= ymax - y;
+		ymax = y + 1;
+	}
+
+	if (cpp != 4) {
+		for (i = y; i < ymax; i++, row += bo->pitch)
+			fill_span_pattern(row, px, cpp, xmax - x, stream);
+		return;
+	}
+
+	memcpy(&pixel, px, sizeof(pixel));
+	fill_span = get_fill_span32(stream);
+	for (i = y; i < ymax; i++, row += bo->pitch)
+		fill_span(row, pixel, xmax - x);
+}
+
+int sp_bo_write_combined(struct sp_bo *bo)
+{
+	return bo->caching == SP_BO_CACHING_WC ||
+		bo->caching == SP_BO_CACHING_UNCACHED;
+}
+
+void sp_bo_flush_writes(struct sp_bo *bo)
+{
+#if defined(__SSE2__)
+	if (sp_bo_write_combined(bo))
+		_mm_sfence();
+#endif
+}
+
+static uint64_t rect_area(const struct drm_mode_rect *r)
+{
+	return (uint64_t)(r->x2 - r->x1) * (r->y2 - r->y1);
+}
+
+static void rect_union(struct drm_mode_rect *dst, const struct drm_mode_rect *r)
+{
+	if (r->x1 < dst->x1)
+		dst->x1 = r->x1;
+	if (r->y1 < dst->y1)
+		dst->y1 = r->y1;
+	if (r->x2 > dst->x2)
+		dst->x2 = r->x2;
+	if (r->y2 > dst->y2)
+		dst->y2 = r->y2;
+}
+
+/*
+ * Rects are merged whenever their union costs no more area than the two of
+ * them apart, which folds overlapping and abutting draws together. When the
+ * list is full everything collapses into its bounding box.
+ */
+void sp_damage_add_rect(struct drm_mode_rect *damage, int *num_damage,
+		const struct drm_mode_rect *rect)
+{
+	struct drm_mode_rect r = *rect;
+	int i, merged;
+
+	do {
+		merged = 0;
+		for (i = 0; i < *num_damage; i++) {
+			struct drm_mode_rect u = damage[i];
+
+			rect_union(&u, &r);
+			if (rect_area(&u) >
+			    rect_area(&damage[i]) + rect_area(&r))
+				continue;
+
+			/* Take it out of the list and retry with the union */
+			r = u;
+			damage[i] = damage[--*num_damage];
+			merged = 1;
+			break;
+		}
+	} while (merged);
+
+	if (*num_damage < SP_BO_MAX_DAMAGE) {
+		damage[(*num_damage)++] = r;
+		return;
+	}
+
+	for (i = 1; i < *num_damage; i++)
+		rect_union(&damage[0], &damage[i]);
+	rect_union(&damage[0], &r);
+	*num_damage = 1;
+}
+
+void sp_bo_add_damage(struct sp_bo *bo, uint32_t x, uint32_t y,
+		uint32_t width, uint32_t height)
+{
+	struct drm_mode_rect r;
+
+	if (x >= bo->width || y >= bo->height || !width || !height)
+		return;
+
+	r.x1 = x;
+	r.y1 = y;
+	r.x2 = width > bo->width - x ? bo->width : x + width;
+	r.y2 = height > bo->height - y ? bo->height : y + height;
+
+	sp_damage_add_rect(bo->damage, &bo->num_damage, &r);
+}
+
+void sp_bo_clear_damage(struct sp_bo *bo)
+{
+	bo->num_damage = 0;
+}
+
+int sp_bo_flush_damage(struct sp_bo *bo)
+{
+	drmModeClip clips[SP_BO_MAX_DAMAGE];
+	int i, ret;
+
+	sp_bo_flush_writes(bo);
+
+	if (!bo->num_damage || !bo->fb_id)
+		return 0;
+
+	for (i = 0; i < bo->num_damage; i++) {
+		clips[i].x1 = bo->damage[i].x1;
+		clips[i].y1 = bo->damage[i].y1;
+		clips[i].x2 = bo->damage[i].x2;
+		clips[i].y2 = bo->damage[i].y2;
+	}
+
+	bo->dev->stats.ioctls++;
+	ret = bo->dev->ops->dirty_fb(bo->dev, bo->fb_id, clips,
+			bo->num_damage);
+	bo->num_damage = 0;
+
+	/* Drivers without a dirty hook scan out straight from memory */
+	if (ret == -ENOSYS)
+		return 0;
+	if (ret)
+		printf("failed to flush damage ret=%d\n", ret);
+	return ret;
+}
+
+static int add_fb_sp_bo(struct sp_bo *bo, uint32_t format)
+{
+	int ret;
+	uint32_t i;
+	uint64_t modifiers[4] = {};
+
+	/* Plane 0 follows handle/pitch/offset, which atlas moves update */
+	if (!bo->num_planes)
+		bo->num_planes = 1;
+	bo->handles[0] = bo->handle;
+	bo->pitches[0] = bo->pitch;
+	bo->offsets[0] = bo->offset;
+	for (i = 0; i < bo->num_planes; i++)
+		modifiers[i] = bo->modifier;
+
+	bo->dev->stats.ioctls++;
+	if (bo->modifier != DRM_FORMAT_MOD_LINEAR &&
+	    bo->modifier != DRM_FORMAT_MOD_INVALID)
+		ret = bo->dev->ops->add_fb2(bo->dev, bo->width, bo->height,
+				format, bo->handles, bo->pitches, bo->offsets,
+				modifiers, &bo->fb_id,
+				bo->flags | DRM_MODE_FB_MODIFIERS);
+	else
+		ret = bo->dev->ops->add_fb2(bo->dev, bo->width, bo->height,
+				format, bo->handles, bo->pitches, bo->offsets,
+				NULL, &bo->fb_id, bo->flags);
+	if (ret) {
+		printf("failed to create fb ret=%d\n", ret);
+		return ret;
+	}
+	return 0;
+}
+
+static int mmap_sp_bo(struct sp_bo *bo, int fd, off_t offset,
+		uint32_t flags)
+{
+	int ret;
+
+	bo->map_addr = mmap(NULL, bo->size, PROT_READ | PROT_WRITE,
+			MAP_SHARED |
+			(flags & SP_BO_MAP_POPULATE ? MAP_POPULATE : 0),
+			fd, offset);
+	if (bo->map_addr == MAP_FAILED) {
+		ret = -errno;
+		bo->map_addr = NULL;
+		printf("failed to map bo ret=%d\n", ret);
+		return ret;
+	}
+	return 0;
+}
+
+static void munmap_sp_bo(struct sp_bo *bo)
+{
+	munmap(bo->map_addr, bo->size);
+}
+
+/*
+ * Allocation backends. create() fills in the handle on the KMS device,
+ * pitch, size and modifier of a bo whose geometry is already set, map()
+ * sets map_addr and caching, destroy() releases what create() made.
+ */
+struct sp_bo_backend_funcs {
+	const char *name;
+	int (*create)(struct sp_bo *bo, const uint64_t *modifiers,
+			int num_modifiers);
+	int (*map)(struct sp_bo *bo, uint32_t flags);
+	void (*unmap)(struct sp_bo *bo);
+	void (*destroy)(struct sp_bo *bo);
+};
+
+static int dumb_create(struct sp_bo *bo, const uint64_t *modifiers,
+		int num_modifiers)
+{
+	int ret;
+	struct drm_mode_create_dumb cd = {};
+
+	cd.height = bo->height;
+	cd.width = bo->width;
+	cd.bpp = bo->bpp;
+	cd.flags = bo->flags;
+
+	bo->dev->stats.ioctls++;
+	ret = bo->dev->ops->ioctl(bo->dev, DRM_IOCTL_MODE_CREATE_DUMB, &cd);
+	if (ret) {
+		printf("failed to create sp_bo %d\n", ret);
+		return ret;
+	}
+
+	bo->handle = cd.handle;
+	bo->pitch = cd.pitch;
+	bo->size = cd.size;
+	return 0;
+}
+
+static int dumb_map(struct sp_bo *bo, uint32_t flags)
+{
+	int ret;
+	struct drm_mode_map_dumb md = {};
+
+	md.handle = bo->handle;
+	bo->dev->stats.ioctls++;
+	ret = bo->dev->ops->ioctl(bo->dev, DRM_IOCTL_MODE_MAP_DUMB, &md);
+	if (ret) {
+		printf("failed to map sp_bo ret=%d\n", ret);
+		return ret;
+	}
+
+	ret = mmap_sp_bo(bo, bo->dev->fd, md.offset, flags);
+	if (ret)
+		return ret;
+	bo->caching = bo->dev->dumb_caching;
+	return 0;
+}
+
+static void dumb_destroy(struct sp_bo *bo)
+{
+	int ret;
+	struct drm_mode_destroy_dumb dd = {};
+
+	dd.handle = bo->handle;
+	bo->dev->stats.ioctls++;
+	ret = bo->dev->ops->ioctl(bo->dev, DRM_IOCTL_MODE_DESTROY_DUMB, &dd);
+	if (ret)
+		printf("Failed to destroy buffer ret=%d\n", ret);
+}
+
+static void close_handle(struct sp_bo *bo)
+{
+	struct drm_gem_close gc = {};
+
+	gc.handle = bo->handle;
+	bo->dev->stats.ioctls++;
+	bo->dev->ops->ioctl(bo->dev, DRM_IOCTL_GEM_CLOSE, &gc);
+}
+
+static int gbm_create(struct sp_bo *bo, const uint64_t *modifiers,
+		int num_modifiers)
+{
+	struct sp_dev *dev = bo->dev;
+	uint32_t i;
+
+	pthread_mutex_lock(&dev->lock);
+	if (!dev->gbm)
+		dev->gbm = gbm_create_device(dev->fd);
+	pthread_mutex_unlock(&dev->lock);
+	if (!dev->gbm) {
+		printf("failed to create gbm device\n");
+		return -ENODEV;
+	}
+
+	if (num_modifiers)
+		bo->gbm_bo = gbm_bo_create_with_modifiers(dev->gbm, bo->width,
+				bo->height, bo->format, modifiers,
+				num_modifiers);
+	else
+		bo->gbm_bo = gbm_bo_create(dev->gbm, bo->width, bo->height,
+				bo->format,
+				GBM_BO_USE_SCANOUT | GBM_BO_USE_LINEAR);
+	if (!bo->gbm_bo) {
+		printf("failed to create gbm bo\n");
+		return -ENOMEM;
+	}
+
+	bo->handle = gbm_bo_get_handle(bo->gbm_bo).u32;
+	bo->pitch = gbm_bo_get_stride(bo->gbm_bo);
+	bo->offset = gbm_bo_get_offset(bo->gbm_bo, 0);
+	bo->modifier = gbm_bo_get_modifier(bo->gbm_bo);
+	bo->size = bo->pitch * bo->height;
+
+	/* gbm lays out multi-planar formats itself */
+	bo->num_planes = gbm_bo_get_plane_count(bo->gbm_bo);
+	for (i = 1; i < bo->num_planes && i < 4; i++) {
+		bo->handles[i] = gbm_bo_get_handle_for_plane(bo->gbm_bo, i).u32;
+		bo->pitches[i] = gbm_bo_get_stride_for_plane(bo->gbm_bo, i);
+		bo->offsets[i] = gbm_bo_get_offset(bo->gbm_bo, i);
+		if (bo->offsets[i] + bo->pitches[i] * bo->height -
+				bo->offset > bo->size)
+			bo->size = bo->offsets[i] +
+				bo->pitches[i] * bo->height - bo->offset;
+	}
+	return 0;
+}
+
+static int gbm_map(struct sp_bo *bo, uint32_t flags)
+{
+	uint32_t stride;
+
+	/*
+	 * gbm_bo_map() maps plane 0 alone, and the writers reach the other
+	 * planes at their offsets from it.
+	 */
+	if (bo->num_planes > 1) {
+		printf("gbm bos with %u planes can't be mapped\n",
+			bo->num_planes);
+		return -ENOTSUP;
+	}
+
+	bo->map_addr = gbm_bo_map(bo->gbm_bo, 0, 0, bo->width, bo->height,
+			GBM_BO_TRANSFER_READ_WRITE, &stride,
+			&bo->gbm_map_data);
+	if (!bo->map_addr) {
+		printf("failed to map gbm bo\n");
+		return -EINVAL;
+	}
+
+	/* Tiled bos map through a linear staging copy with its own stride */
+	if (stride != bo->pitch) {
+		printf("gbm bo maps with pitch %u, not %u\n", stride,
+			bo->pitch);
+		gbm_bo_unmap(bo->gbm_bo, bo->gbm_map_data);
+		bo->map_addr = NULL;
+		return -EINVAL;
+	}
+	bo->caching = SP_BO_CACHING_UNKNOWN;
+	return 0;
+}
+
+static void gbm_unmap(struct sp_bo *bo)
+{
+	gbm_bo_unmap(bo->gbm_bo, bo->gbm_map_data);
+	bo->gbm_map_data = NULL;
+}
+
+static void gbm_destroy(struct sp_bo *bo)
+{
+	gbm_bo_destroy(bo->gbm_bo);
+}
+
+/* Finds the vgem node by driver name, it has no fixed minor */
+static int find_vgem(void)
+{
+	char path[32];
+	int i, fd;
+
+	for (i = 0; i < 16; i++) {
+		drmVersionPtr version;
+
+		snprintf(path, sizeof(path), "/dev/dri/card%d", i);
+		fd = open(path, O_RDWR | O_CLOEXEC);
+		if (fd < 0)
+			continue;
+
+		version = drmGetVersion(fd);
+		if (version && !strcmp(version->name, "vgem")) {
+			drmFreeVersion(version);
+			return fd;
+		}
+		if (version)
+			drmFreeVersion(version);
+		close(fd);
+	}
+	return -ENODEV;
+}
+
+static int open_vgem(struct sp_dev *dev)
+{
+	int fd;
+
+	pthread_mutex_lock(&dev->lock);
+	if (dev->vgem_fd < 0)
+		dev->vgem_fd = find_vgem();
+	fd = dev->vgem_fd;
+	pthread_mutex_unlock(&dev->lock);
+
+	if (fd < 0)
+		printf("failed to find vgem\n");
+	return fd;
+}
+
+static int vgem_create(struct sp_bo *bo, const uint64_t *modifiers,
+		int num_modifiers)
+{
+	struct drm_mode_create_dumb cd = {};
+	struct drm_mode_destroy_dumb dd = {};
+	int ret, fd, prime_fd;
+
+	fd = open_vgem(bo->dev);
+	if (fd < 0)
+		return fd;
+
+	cd.height = bo->height;
+	cd.width = bo->width;
+	cd.bpp = bo->bpp;
+
+	ret = drmIoctl(fd, DRM_IOCTL_MODE_CREATE_DUMB, &cd);
+	if (ret) {
+		printf("failed to create vgem bo ret=%d\n", ret);
+		return ret;
+	}
+
+	ret = drmPrimeHandleToFD(fd, cd.handle, DRM_CLOEXEC, &prime_fd);
+	if (ret) {
+		printf("failed to export vgem bo ret=%d\n", ret);
+		goto err;
+	}
+
+	bo->dev->stats.ioctls++;
+	ret = drmPrimeFDToHandle(bo->dev->fd, prime_fd, &bo->handle);
+	close(prime_fd);
+	if (ret) {
+		printf("failed to import vgem bo ret=%d\n", ret);
+		goto err;
+	}
+
+	bo->vgem_handle = cd.handle;
+	bo->pitch = cd.pitch;
+	bo->size = cd.size;
+	return 0;
+
+err:
+	dd.handle = cd.handle;
+	drmIoctl(fd, DRM_IOCTL_MODE_DESTROY_DUMB, &dd);
+	return ret;
+}
+
+static int vgem_map(struct sp_bo *bo, uint32_t flags)
+{
+	int ret;
+	struct drm_mode_map_dumb md = {};
+
+	md.handle = bo->vgem_handle;
+	ret = drmIoctl(bo->dev->vgem_fd, DRM_IOCTL_MODE_MAP_DUMB, &md);
+	if (ret) {
+		printf("failed to map vgem bo ret=%d\n", ret);
+		return ret;
+	}
+
+	ret = mmap_sp_bo(bo, bo->dev->vgem_fd, md.offset, flags);
+	if (ret)
+		return ret;
+	bo->caching = SP_BO_CACHING_UNKNOWN;
+	return 0;
+}
+
+static void vgem_destroy(struct sp_bo *bo)
+{
+	struct drm_mode_destroy_dumb dd = {};
+
+	close_handle(bo);
+	dd.handle = bo->vgem_handle;
+	drmIoctl(bo->dev->vgem_fd, DRM_IOCTL_MODE_DESTROY_DUMB, &dd);
+}
+
+/*
+ * udmabuf wraps the pages of a memfd in a dma-buf, so the bo is ordinary
+ * cached system memory that the CPU maps through the memfd.
+ */
+static int udmabuf_create(struct sp_bo *bo, const uint64_t *modifiers,
+		int num_modifiers)
+{
+	struct udmabuf_create create = {};
+	long page_size = sysconf(_SC_PAGESIZE);
+	int ret, fd, dmabuf_fd;
+
+	bo->pitch = (bo->width * bo->bpp / 8 + 63) & ~63;
+	bo->size = (bo->pitch * bo->height + page_size - 1) & ~(page_size - 1);
+
+	bo->memfd = memfd_create("sp_bo", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (bo->memfd < 0) {
+		printf("failed to create memfd ret=%d\n", -errno);
+		return -errno;
+	}
+	if (ftruncate(bo->memfd, bo->size) ||
+	    fcntl(bo->memfd, F_ADD_SEALS, F_SEAL_SHRINK)) {
+		ret = -errno;
+		printf("failed to size memfd ret=%d\n", ret);
+		goto err;
+	}
+
+	fd = open("/dev/udmabuf", O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
+		ret = -errno;
+		printf("failed to open /dev/udmabuf ret=%d\n", ret);
+		goto err;
+	}
+
+	create.memfd = bo->memfd;
+	create.flags = UDMABUF_FLAGS_CLOEXEC;
+	create.offset = 0;
+	create.size = bo->size;
+	dmabuf_fd = ioctl(fd, UDMABUF_CREATE, &create);
+	close(fd);
+	if (dmabuf_fd < 0) {
+		ret = -errno;
+		printf("failed to create udmabuf ret=%d\n", ret);
+		goto err;
+	}
+
+	bo->dev->stats.ioctls++;
+	ret = drmPrimeFDToHandle(bo->dev->fd, dmabuf_fd, &bo->handle);
+	close(dmabuf_fd);
+	if (ret) {
+		printf("failed to import udmabuf ret=%d\n", ret);
+		goto err;
+	}
+	return 0;
+
+err:
+	close(bo->memfd);
+	bo->memfd = -1;
+	return ret;
+}
+
+static int udmabuf_map(struct sp_bo *bo, uint32_t flags)
+{
+	int ret = mmap_sp_bo(bo, bo->memfd, 0, flags);
+
+	if (ret)
+		return ret;
+	bo->caching = SP_BO_CACHING_CACHED;
+	return 0;
+}
+
+static void udmabuf_destroy(struct sp_bo *bo)
+{
+	close_handle(bo);
+	close(bo->memfd);
+}
+
+/* Imported dma-bufs, see sp_bo_import_fd() */
+static int dmabuf_create(struct sp_bo *bo, const uint64_t *modifiers,
+		int num_modifiers)
+{
+	printf("dmabuf bos can only be imported\n");
+	return -EINVAL;
+}
+
+/*
+ * The whole dma-buf is mapped, offsets needn't be page aligned, and
+ * map_addr moved to the pixels at bo->offset like an atlas sub-buffer's.
+ */
+static int dmabuf_map(struct sp_bo *bo, uint32_t flags)
+{
+	int ret = mmap_sp_bo(bo, bo->dmabuf_fd, 0, flags);
+
+	if (ret)
+		return ret;
+	bo->map_addr = (uint8_t *)bo->map_addr + bo->offset;
+	bo->caching = SP_BO_CACHING_UNKNOWN;
+	return 0;
+}
+
+static void dmabuf_unmap(struct sp_bo *bo)
+{
+	munmap((uint8_t *)bo->map_addr - bo->offset, bo->size);
+}
+
+static void dmabuf_destroy(struct sp_bo *bo)
+{
+	/* sp_bo_wrap_fd() bos were never imported */
+	if (bo->handle)
+		close_handle(bo);
+}
+
+static const struct sp_bo_backend_funcs backends[] = {
+	[SP_BO_BACKEND_DUMB] = {
+		"dumb", dumb_create, dumb_map, munmap_sp_bo, dumb_destroy,
+	},
+	[SP_BO_BACKEND_GBM] = {
+		"gbm", gbm_create, gbm_map, gbm_unmap, gbm_destroy,
+	},
+	[SP_BO_BACKEND_VGEM] = {
+		"vgem", vgem_create, vgem_map, munmap_sp_bo, vgem_destroy,
+	},
+	[SP_BO_BACKEND_UDMABUF] = {
+		"udmabuf", udmabuf_create, udmabuf_map, munmap_sp_bo,
+		udmabuf_destroy,
+	},
+	[SP_BO_BACKEND_DMABUF] = {
+		"dmabuf", dmabuf_create, dmabuf_map, dmabuf_unmap,
+		dmabuf_destroy,
+	},
+};
+
+const char *sp_bo_backend_name(enum sp_bo_backend backend)
+{
+	return backends[backend].name;
+}
+
+int sp_bo_backend_from_name(const char *name, enum sp_bo_backend *backend)
+{
+	unsigned i;
+
+	for (i = 0; i < SP_BO_NUM_BACKENDS; i++) {
+		if (!strcmp(name, backends[i].name)) {
+			*backend = i;
+			return 0;
+		}
+	}
+	return -EINVAL;
+}
+
+static struct sp_bo *atlas_backing_bo(struct sp_bo_atlas *atlas);
+
+void *sp_bo_map(struct sp_bo *bo, uint32_t flags)
+{
+	struct sp_bo *backing;
+	uint8_t *base;
+
+	if (bo->map_addr)
+		return bo->map_addr;
+
+	/* Sub-buffers are windows into their atlas' mapping */
+	if (bo->atlas) {
+		backing = atlas_backing_bo(bo->atlas);
+		base = sp_bo_map(backing, flags);
+		if (!base)
+			return NULL;
+		bo->map_addr = base + bo->offset;
+		bo->caching = backing->caching;
+		return bo->map_addr;
+	}
+
+	if (backends[bo->backend].map(bo, flags))
+		return NULL;
+
+	bo->dev->stats.maps++;
+	if (flags & SP_BO_MAP_POPULATE)
+		bo->dev->stats.populated_maps++;
+	bo->dev->stats.mapped_bytes += bo->size;
+	return bo->map_addr;
+}
+
+void sp_bo_unmap(struct sp_bo *bo)
+{
+	if (!bo->map_addr)
+		return;
+
+	sp_bo_flush_writes(bo);
+	if (!bo->atlas) {
+		backends[bo->backend].unmap(bo);
+		bo->dev->stats.unmaps++;
+		bo->dev->stats.mapped_bytes -= bo->size;
+	}
+	bo->map_addr = NULL;
+}
+
+/*
+ * Released buffers are kept on a per-device LRU list with their handle, fb
+ * and mapping intact, and handed back by the next create_sp_bo() asking for
+ * the same geometry. The list is ordered most recently released first.
+ */
+struct sp_bo_pool {
+	uint64_t max_bytes;
+	struct sp_bo_pool_stats stats;
+
+	struct sp_bo *head;
+	struct sp_bo *tail;
+};
+
+static void destroy_sp_bo(struct sp_bo *bo);
+
+static void pool_unlink(struct sp_bo_pool *pool, struct sp_bo *bo)
+{
+	if (bo->pool_prev)
+		bo->pool_prev->pool_next = bo->pool_next;
+	else
+		pool->head = bo->pool_next;
+	if (bo->pool_next)
+		bo->pool_next->pool_prev = bo->pool_prev;
+	else
+		pool->tail = bo->pool_prev;
+
+	bo->pool_prev = NULL;
+	bo->pool_next = NULL;
+	pool->stats.bytes -= bo->size;
+	pool->stats.num_bos--;
+}
+
+static void pool_evict(struct sp_bo_pool *pool, uint64_t max_bytes)
+{
+	while (pool->tail && pool->stats.bytes > max_bytes) {
+		struct sp_bo *bo = pool->tail;
+
+		pool_unlink(pool, bo);
+		pool->stats.evictions++;
+		destroy_sp_bo(bo);
+	}
+}
+
+static struct sp_bo *pool_get(struct sp_bo_pool *pool,
+		enum sp_bo_backend backend, uint32_t width, uint32_t height,
+		uint32_t bpp, uint32_t format, uint32_t flags)
+{
+	struct sp_bo *bo;
+
+	for (bo = pool->head; bo; bo = bo->pool_next) {
+		if (bo->backend == backend &&
+		    bo->width == width && bo->height == height &&
+		    bo->bpp == bpp && bo->format == format &&
+		    bo->flags == flags) {
+			pool_unlink(pool, bo);
+			pool->stats.hits++;
+			return bo;
+		}
+	}
+	pool->stats.misses++;
+	return NULL;
+}
+
+static int pool_put(struct sp_bo_pool *pool, struct sp_bo *bo)
+{
+	if (bo->size > pool->max_bytes)
+		return -ENOSPC;
+
+	bo->pool_prev = NULL;
+	bo->pool_next = pool->head;
+	if (pool->head)
+		pool->head->pool_prev = bo;
+	else
+		pool->tail = bo;
+	pool->head = bo;
+	pool->stats.bytes += bo->size;
+	pool->stats.num_bos++;
+
+	pool_evict(pool, pool->max_bytes);
+	return 0;
+}
+
+int sp_bo_pool_enable(struct sp_dev *dev, uint64_t max_bytes)
+{
+	struct sp_bo_pool *pool;
+
+	pthread_mutex_lock(&dev->lock);
+	pool = dev->bo_pool;
+	if (!pool) {
+		pool = calloc(1, sizeof(*pool));
+		if (!pool) {
+			pthread_mutex_unlock(&dev->lock);
+			printf("failed to allocate bo pool\n");
+			return -ENOMEM;
+		}
+		dev->bo_pool = pool;
+	}
+
+	pool->max_bytes = max_bytes;
+	pool_evict(pool, max_bytes);
+	pthread_mutex_unlock(&dev->lock);
+	return 0;
+}
+
+void sp_bo_pool_disable(struct sp_dev *dev)
+{
+	struct sp_bo_pool *pool;
+
+	pthread_mutex_lock(&dev->lock);
+	pool = dev->bo_pool;
+	if (pool) {
+		pool_evict(pool, 0);
+		dev->bo_pool = NULL;
+		free(pool);
+	}
+	pthread_mutex_unlock(&dev->lock);
+}
+
+void sp_bo_pool_get_stats(struct sp_dev *dev, struct sp_bo_pool_stats *stats)
+{
+	pthread_mutex_lock(&dev->lock);
+	if (dev->bo_pool)
+		*stats = dev->bo_pool->stats;
+	else
+		memset(stats, 0, sizeof(*stats));
+	pthread_mutex_unlock(&dev->lock);
+}
+
+/*
+ * Allocates a buffer, without registering a framebuffer. It is mapped on
+ * first CPU access, see sp_bo_map().
+ */
+static struct sp_bo *alloc_sp_bo(struct sp_dev *dev,
+		enum sp_bo_backend backend, uint32_t width, uint32_t height,
+		uint32_t depth, uint32_t bpp, uint32_t format, uint32_t flags,
+		const uint64_t *modifiers, int num_modifiers)
+{
+	const struct yuv_format *yf = find_yuv_format(format);
+	int ret, layout = yf && backend != SP_BO_BACKEND_GBM;
+	struct sp_bo *bo;
+
+	bo = calloc(1, sizeof(*bo));
+	if (!bo)
+		return NULL;
+
+	bo->dev = dev;
+	bo->backend = backend;
+	bo->width = width;
+	bo->height = height;
+	bo->depth = depth;
+	bo->bpp = bpp;
+	bo->format = format;
+	bo->flags = flags;
+	bo->modifier = DRM_FORMAT_MOD_LINEAR;
+	bo->memfd = -1;
+	bo->dmabuf_fd = -1;
+
+	/* Other backends allocate bytes: one tall luma plane fits them all */
+	if (layout) {
+		bo->width = (width + yf->hsub - 1) / yf->hsub * yf->hsub;
+		bo->height = yuv_alloc_rows(yf, height);
+	}
+
+	ret = backends[backend].create(bo, modifiers, num_modifiers);
+	if (ret) {
+		free(bo);
+		return NULL;
+	}
+
+	if (layout) {
+		bo->width = width;
+		bo->height = height;
+		layout_yuv_planes(bo, yf);
+	}
+	return bo;
+}
+
+struct sp_bo *create_sp_bo_with_backend(struct sp_dev *dev,
+		enum sp_bo_backend backend, uint32_t width, uint32_t height,
+		uint32_t depth, uint32_t bpp, uint32_t format, uint32_t flags,
+		const uint64_t *modifiers, int num_modifiers)
 {
-	uint32_t i, j, xmax = x + width, ymax = y + height;
+	const struct yuv_format *yf = find_yuv_format(format);
+	int ret;
+	struct sp_bo *bo;
 
-	if (xmax > bo->width)
-		xmax = bo->width;
-	if (ymax > bo->height)
-		ymax = bo->height;
+	if (yf) {
+		depth = yf->bits;
+		bpp = yf->cpp[0] * 8;
+	}
 
-	for (i = y; i < ymax; i++) {
-		uint8_t *row = bo->map_addr + i * bo->pitch;
-
-		for (j = x; j < xmax; j++) {
-			uint8_t *pixel = row + j * 4;
-
-			if (bo->format == DRM_FORMAT_ARGB8888 ||
-			    bo->format == DRM_FORMAT_XRGB8888)
-			{
-				pixel[0] = b;
-				pixel[1] = g;
-				pixel[2] = r;
-				pixel[3] = a;
-			} else if (bo->format == DRM_FORMAT_RGBA8888) {
-				pixel[0] = r;
-				pixel[1] = g;
-				pixel[2] = b;
-				pixel[3] = a;
-			}
+	if (!num_modifiers) {
+		pthread_mutex_lock(&dev->lock);
+		bo = dev->bo_pool ? pool_get(dev->bo_pool, backend, width,
+				height, bpp, format, flags) : NULL;
+		pthread_mutex_unlock(&dev->lock);
+		if (bo) {
+			bo->depth = depth;
+			bo->num_damage = 0;
+			return bo;
 		}
 	}
+
+	bo = alloc_sp_bo(dev, backend, width, height, depth, bpp, format,
+			flags, modifiers, num_modifiers);
+	if (!bo)
+		return NULL;
+
+	ret = add_fb_sp_bo(bo, format);
+	if (ret) {
+		printf("failed to add fb ret=%d\n", ret);
+		destroy_sp_bo(bo);
+		return NULL;
+	}
+
+	return bo;
 }
 
-static int add_fb_sp_bo(struct sp_bo *bo, uint32_t format)
+struct sp_bo *create_sp_bo(struct sp_dev *dev, uint32_t width, uint32_t height,
+		uint32_t depth, uint32_t bpp, uint32_t format, uint32_t flags)
+{
+	return create_sp_bo_with_backend(dev, dev->bo_backend, width, height,
+			depth, bpp, format, flags, NULL, 0);
+}
+
+static void atlas_release(struct sp_bo_atlas *atlas, struct sp_bo *bo);
+
+static void destroy_sp_bo(struct sp_bo *bo)
 {
 	int ret;
-	uint32_t handles[4], pitches[4], offsets[4];
 
-	handles[0] = bo->handle;
-	pitches[0] = bo->pitch;
-	offsets[0] = 0;
+	if (bo->fb_id) {
+		bo->dev->stats.ioctls++;
+		ret = bo->dev->ops->rm_fb(bo->dev, bo->fb_id);
+		if (ret)
+			printf("Failed to rmfb ret=%d!\n", ret);
+	}
 
-	ret = drmModeAddFB2(bo->dev->fd, bo->width, bo->height,
-			format, handles, pitches, offsets,
-			&bo->fb_id, bo->flags);
-	if (ret) {
-		printf("failed to create fb ret=%d\n", ret);
-		return ret;
+	/* Atlas sub-allocations share the atlas' handle and mapping */
+	if (bo->atlas) {
+		atlas_release(bo->atlas, bo);
+		free(bo);
+		return;
 	}
-	return 0;
+
+	sp_bo_unmap(bo);
+	backends[bo->backend].destroy(bo);
+	if (bo->dmabuf_fd >= 0)
+		close(bo->dmabuf_fd);
+	free(bo);
+}
+
+void free_sp_bo(struct sp_bo *bo)
+{
+	struct sp_dev *dev;
+	int ret = -ENOENT;
+
+	if (!bo)
+		return;
+
+	/*
+	 * pool_get() hands bos to callers without modifiers, so tiled ones
+	 * can't go back. Without modifiers gbm may report an INVALID
+	 * (implicit) one for what GBM_BO_USE_LINEAR made linear. Exported
+	 * bos may still be read by another device, so they don't go back
+	 * either.
+	 */
+	dev = bo->dev;
+	if (!bo->atlas && bo->backend != SP_BO_BACKEND_DMABUF &&
+	    bo->dmabuf_fd < 0 &&
+	    (bo->modifier == DRM_FORMAT_MOD_LINEAR ||
+	     bo->modifier == DRM_FORMAT_MOD_INVALID)) {
+		pthread_mutex_lock(&dev->lock);
+		if (dev->bo_pool)
+			ret = pool_put(dev->bo_pool, bo);
+		pthread_mutex_unlock(&dev->lock);
+	}
+	if (ret)
+		destroy_sp_bo(bo);
 }
 
-static int map_sp_bo(struct sp_bo *bo)
+/* The dma-buf of a bo, exported once and kept until the bo is destroyed */
+static int get_dmabuf_fd(struct sp_bo *bo)
 {
 	int ret;
-	struct drm_mode_map_dumb md;
 
-	if (bo->map_addr)
-		return 0;
+	if (bo->atlas)
+		return get_dmabuf_fd(atlas_backing_bo(bo->atlas));
+	if (bo->dmabuf_fd >= 0)
+		return bo->dmabuf_fd;
 
-	md.handle = bo->handle;
-	ret = drmIoctl(bo->dev->fd, DRM_IOCTL_MODE_MAP_DUMB, &md);
+	bo->dev->stats.ioctls++;
+	ret = drmPrimeHandleToFD(bo->dev->fd, bo->handle,
+			DRM_CLOEXEC | DRM_RDWR, &bo->dmabuf_fd);
 	if (ret) {
-		printf("failed to map sp_bo ret=%d\n", ret);
+		printf("failed to export bo ret=%d\n", ret);
+		bo->dmabuf_fd = -1;
 		return ret;
 	}
+	return bo->dmabuf_fd;
+}
 
-	bo->map_addr = mmap(NULL, bo->size, PROT_READ | PROT_WRITE, MAP_SHARED,
-				bo->dev->fd, md.offset);
-	if (bo->map_addr == MAP_FAILED) {
-		printf("failed to map bo ret=%d\n", -errno);
+int sp_bo_export_fd(struct sp_bo *bo)
+{
+	int fd = get_dmabuf_fd(bo);
+
+	if (fd < 0)
+		return fd;
+
+	fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	if (fd < 0) {
+		printf("failed to dup dma-buf fd ret=%d\n", -errno);
 		return -errno;
 	}
-	return 0;
+	return fd;
 }
 
-struct sp_bo *create_sp_bo(struct sp_dev *dev, uint32_t width, uint32_t height,
-		uint32_t depth, uint32_t bpp, uint32_t format, uint32_t flags)
+/* An sp_bo holding a dup of fd, checked to be large enough */
+static struct sp_bo *dmabuf_bo_alloc(struct sp_dev *dev, int fd,
+		uint32_t width, uint32_t height, uint32_t depth, uint32_t bpp,
+		uint32_t format, uint32_t pitch, uint32_t offset,
+		uint64_t modifier)
 {
-	int ret;
-	struct drm_mode_create_dumb cd = {};
+	off_t size;
 	struct sp_bo *bo;
 
 	bo = calloc(1, sizeof(*bo));
 	if (!bo)
 		return NULL;
 
-	cd.height = height;
-	cd.width = width;
-	cd.bpp = bpp;
-	cd.flags = flags;
-
-	ret = drmIoctl(dev->fd, DRM_IOCTL_MODE_CREATE_DUMB, &cd);
-	if (ret) {
-		printf("failed to create sp_bo %d\n", ret);
-		goto err;
-	}
-
 	bo->dev = dev;
+	bo->backend = SP_BO_BACKEND_DMABUF;
 	bo->width = width;
 	bo->height = height;
 	bo->depth = depth;
 	bo->bpp = bpp;
 	bo->format = format;
-	bo->flags = flags;
+	bo->pitch = pitch;
+	bo->offset = offset;
+	bo->modifier = modifier;
+	bo->memfd = -1;
+	bo->num_planes = 1;
+	bo->pitches[0] = pitch;
+	bo->offsets[0] = offset;
 
-	bo->handle = cd.handle;
-	bo->pitch = cd.pitch;
-	bo->size = cd.size;
+	bo->dmabuf_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	if (bo->dmabuf_fd < 0) {
+		printf("failed to dup dma-buf fd ret=%d\n", -errno);
+		free(bo);
+		return NULL;
+	}
+
+	/* dma-bufs report their size through lseek */
+	size = lseek(bo->dmabuf_fd, 0, SEEK_END);
+	if (size < 0 || (uint64_t)size < offset + (uint64_t)pitch * height) {
+		printf("dma-buf too small for %ux%u pitch %u\n", width, height,
+			pitch);
+		close(bo->dmabuf_fd);
+		free(bo);
+		return NULL;
+	}
+	bo->size = size;
+	return bo;
+}
+
+struct sp_bo *sp_bo_import_fd(struct sp_dev *dev, int fd, uint32_t width,
+		uint32_t height, uint32_t depth, uint32_t bpp, uint32_t format,
+		uint32_t pitch, uint32_t offset, uint64_t modifier)
+{
+	struct sp_bo *bo;
+	int ret;
+
+	bo = dmabuf_bo_alloc(dev, fd, width, height, depth, bpp, format,
+			pitch, offset, modifier);
+	if (!bo)
+		return NULL;
+
+	dev->stats.ioctls++;
+	ret = drmPrimeFDToHandle(dev->fd, bo->dmabuf_fd, &bo->handle);
+	if (ret) {
+		printf("failed to import dma-buf ret=%d\n", ret);
+		close(bo->dmabuf_fd);
+		free(bo);
+		return NULL;
+	}
 
 	ret = add_fb_sp_bo(bo, format);
 	if (ret) {
 		printf("failed to add fb ret=%d\n", ret);
-		goto err;
+		destroy_sp_bo(bo);
+		return NULL;
 	}
+	return bo;
+}
+
+struct sp_bo *sp_bo_wrap_fd(struct sp_dev *dev, int fd, uint32_t width,
+		uint32_t height, uint32_t depth, uint32_t bpp, uint32_t format,
+		uint32_t pitch, uint32_t offset)
+{
+	return dmabuf_bo_alloc(dev, fd, width, height, depth, bpp, format,
+			pitch, offset, DRM_FORMAT_MOD_LINEAR);
+}
+
+static int dmabuf_sync(struct sp_bo *bo, uint64_t flags)
+{
+	struct dma_buf_sync sync = {};
+	int ret, fd;
+
+	fd = get_dmabuf_fd(bo);
+	if (fd < 0)
+		return fd;
 
-	ret = map_sp_bo(bo);
+	sync.flags = flags;
+	bo->dev->stats.ioctls++;
+	bo->dev->stats.syncs++;
+	ret = drmIoctl(fd, DMA_BUF_IOCTL_SYNC, &sync);
 	if (ret) {
-		printf("failed to map bo ret=%d\n", ret);
+		printf("failed to sync dma-buf ret=%d\n", -errno);
+		return -errno;
+	}
+	return 0;
+}
+
+static uint64_t sync_access_flags(uint32_t access)
+{
+	uint64_t flags = 0;
+
+	if (access & SP_BO_ACCESS_READ)
+		flags |= DMA_BUF_SYNC_READ;
+	if (access & SP_BO_ACCESS_WRITE)
+		flags |= DMA_BUF_SYNC_WRITE;
+	return flags;
+}
+
+int sp_bo_begin_cpu_access(struct sp_bo *bo, uint32_t access)
+{
+	return dmabuf_sync(bo, DMA_BUF_SYNC_START | sync_access_flags(access));
+}
+
+int sp_bo_end_cpu_access(struct sp_bo *bo, uint32_t access)
+{
+	/* Non-temporal stores must land before the device may look */
+	if (access & SP_BO_ACCESS_WRITE)
+		sp_bo_flush_writes(bo);
+	return dmabuf_sync(bo, DMA_BUF_SYNC_END | sync_access_flags(access));
+}
+
+/*
+ * An atlas packs many small framebuffers into one dumb buffer. Placement is
+ * bottom-left skyline: the skyline is the list of horizontal segments that
+ * form the top edge of the packed area, and a new rect goes wherever it ends
+ * lowest. Rects given back below the skyline go on a free list which is
+ * searched first, best fit by area.
+ */
+#define ATLAS_ALIGN 16 /* pixels, keeps sub-buffer rows cache-line aligned */
+
+struct atlas_segment {
+	uint32_t x;
+	uint32_t y;
+	uint32_t width;
+};
+
+struct atlas_rect {
+	uint32_t x;
+	uint32_t y;
+	uint32_t width;
+	uint32_t height;
+};
+
+struct sp_bo_atlas {
+	struct sp_bo *bo;
+	uint32_t cpp;
+
+	int num_segments;
+	struct atlas_segment *segments;
+
+	int num_free;
+	int max_free;
+	struct atlas_rect *free_rects;
+
+	int num_bos;
+	int max_bos;
+	struct sp_bo **bos;
+};
+
+static struct sp_bo *atlas_backing_bo(struct sp_bo_atlas *atlas)
+{
+	return atlas->bo;
+}
+
+static uint32_t atlas_align(uint32_t v)
+{
+	return (v + ATLAS_ALIGN - 1) & ~(ATLAS_ALIGN - 1);
+}
+
+static void skyline_reset(struct sp_bo_atlas *atlas)
+{
+	atlas->num_segments = 1;
+	atlas->segments[0].x = 0;
+	atlas->segments[0].y = 0;
+	atlas->segments[0].width = atlas->bo->width;
+	atlas->num_free = 0;
+}
+
+/* Returns the y at which a width x height rect fits on segment i, or -1 */
+static int64_t skyline_fit(struct sp_bo_atlas *atlas, int i, uint32_t width,
+		uint32_t height)
+{
+	uint32_t x = atlas->segments[i].x, y = 0;
+	int64_t left = width;
+
+	if (x + width > atlas->bo->width)
+		return -1;
+
+	for (; left > 0 && i < atlas->num_segments; i++) {
+		if (atlas->segments[i].y > y)
+			y = atlas->segments[i].y;
+		if (y + height > atlas->bo->height)
+			return -1;
+		left -= atlas->segments[i].width;
+	}
+	return left > 0 ? -1 : y;
+}
+
+static int skyline_alloc(struct sp_bo_atlas *atlas, uint32_t width,
+		uint32_t height, struct atlas_rect *rect)
+{
+	int i, best = -1;
+	uint32_t best_y = 0, best_top = UINT32_MAX, best_width = UINT32_MAX;
+	struct atlas_segment seg;
+
+	for (i = 0; i < atlas->num_segments; i++) {
+		int64_t y = skyline_fit(atlas, i, width, height);
+
+		if (y < 0)
+			continue;
+		if (y + height < best_top || (y + height == best_top &&
+		    atlas->segments[i].width < best_width)) {
+			best = i;
+			best_y = y;
+			best_top = y + height;
+			best_width = atlas->segments[i].width;
+		}
+	}
+	if (best < 0)
+		return -ENOSPC;
+
+	rect->x = atlas->segments[best].x;
+	rect->y = best_y;
+	rect->width = width;
+	rect->height = height;
+
+	/*
+	 * Raise the skyline over the new rect, then trim or drop the segments
+	 * it now covers. Gaps left under it go on the free list.
+	 */
+	seg.x = rect->x;
+	seg.y = best_y + height;
+	seg.width = width;
+	memmove(&atlas->segments[best + 1], &atlas->segments[best],
+		(atlas->num_segments - best) * sizeof(seg));
+	atlas->segments[best] = seg;
+	atlas->num_segments++;
+
+	for (i = best + 1; i < atlas->num_segments; i++) {
+		struct atlas_segment *s = &atlas->segments[i];
+		uint32_t end = seg.x + seg.width, shrink;
+
+		if (s->x >= end)
+			break;
+
+		shrink = end - s->x;
+		if (s->y < best_y) {
+			struct atlas_rect gap = {
+				s->x, s->y,
+				shrink < s->width ? shrink : s->width,
+				best_y - s->y
+			};
+
+			if (atlas->num_free < atlas->max_free)
+				atlas->free_rects[atlas->num_free++] = gap;
+		}
+		if (shrink < s->width) {
+			s->x += shrink;
+			s->width -= shrink;
+			break;
+		}
+		memmove(s, s + 1, (atlas->num_segments - i - 1) * sizeof(*s));
+		atlas->num_segments--;
+		i--;
+	}
+
+	/* Merge neighbours at the same height */
+	for (i = 0; i < atlas->num_segments - 1; i++) {
+		struct atlas_segment *s = &atlas->segments[i];
+
+		if (s->y != s[1].y)
+			continue;
+		s->width += s[1].width;
+		memmove(s + 1, s + 2,
+			(atlas->num_segments - i - 2) * sizeof(*s));
+		atlas->num_segments--;
+		i--;
+	}
+	return 0;
+}
+
+static int free_list_alloc(struct sp_bo_atlas *atlas, uint32_t width,
+		uint32_t height, struct atlas_rect *rect)
+{
+	int i, best = -1;
+	uint64_t best_area = UINT64_MAX;
+	struct atlas_rect r;
+
+	for (i = 0; i < atlas->num_free; i++) {
+		struct atlas_rect *f = &atlas->free_rects[i];
+		uint64_t area = (uint64_t)f->width * f->height;
+
+		if (f->width < width || f->height < height)
+			continue;
+		if (area < best_area) {
+			best = i;
+			best_area = area;
+		}
+	}
+	if (best < 0)
+		return -ENOSPC;
+
+	r = atlas->free_rects[best];
+	atlas->free_rects[best] = atlas->free_rects[--atlas->num_free];
+
+	rect->x = r.x;
+	rect->y = r.y;
+	rect->width = width;
+	rect->height = height;
+
+	/* Split the leftover into the strip to the right and the one below */
+	if (r.width > width && atlas->num_free < atlas->max_free) {
+		struct atlas_rect right = {
+			r.x + width, r.y, r.width - width, height
+		};
+		atlas->free_rects[atlas->num_free++] = right;
+	}
+	if (r.height > height && atlas->num_free < atlas->max_free) {
+		struct atlas_rect below = {
+			r.x, r.y + height, r.width, r.height - height
+		};
+		atlas->free_rects[atlas->num_free++] = below;
+	}
+	return 0;
+}
+
+static int atlas_place(struct sp_bo_atlas *atlas, uint32_t width,
+		uint32_t height, struct atlas_rect *rect)
+{
+	width = atlas_align(width);
+
+	if (!free_list_alloc(atlas, width, height, rect))
+		return 0;
+	return skyline_alloc(atlas, width, height, rect);
+}
+
+static void atlas_bind(struct sp_bo_atlas *atlas, struct sp_bo *bo,
+		const struct atlas_rect *rect)
+{
+	bo->x = rect->x;
+	bo->y = rect->y;
+	bo->offset = rect->y * atlas->bo->pitch + rect->x * atlas->cpp;
+	bo->map_addr = NULL;
+	if (atlas->bo->map_addr)
+		bo->map_addr = (uint8_t *)atlas->bo->map_addr + bo->offset;
+}
+
+static void atlas_free_rect(struct sp_bo_atlas *atlas,
+		const struct atlas_rect *rect)
+{
+	if (atlas->num_bos == 0)
+		skyline_reset(atlas);
+	else if (atlas->num_free < atlas->max_free)
+		atlas->free_rects[atlas->num_free++] = *rect;
+}
+
+static void atlas_release(struct sp_bo_atlas *atlas, struct sp_bo *bo)
+{
+	struct atlas_rect rect = {
+		bo->x, bo->y, atlas_align(bo->width), bo->height
+	};
+	int i;
+
+	for (i = 0; i < atlas->num_bos; i++) {
+		if (atlas->bos[i] == bo) {
+			atlas->bos[i] = atlas->bos[--atlas->num_bos];
+			break;
+		}
+	}
+	atlas_free_rect(atlas, &rect);
+}
+
+struct sp_bo_atlas *create_sp_bo_atlas(struct sp_dev *dev, uint32_t width,
+		uint32_t height, uint32_t depth, uint32_t bpp, uint32_t format)
+{
+	struct sp_bo_atlas *atlas;
+
+	atlas = calloc(1, sizeof(*atlas));
+	if (!atlas)
+		return NULL;
+
+	atlas->bo = alloc_sp_bo(dev, SP_BO_BACKEND_DUMB, width, height, depth,
+			bpp, format, 0, NULL, 0);
+	if (!atlas->bo) {
+		printf("failed to create atlas bo\n");
 		goto err;
 	}
+	atlas->cpp = bpp / 8;
 
-	return bo;
+	/* The skyline never has more segments than aligned columns */
+	atlas->segments = calloc(atlas_align(width) / ATLAS_ALIGN + 1,
+			sizeof(*atlas->segments));
+	atlas->max_free = 256;
+	atlas->free_rects = calloc(atlas->max_free,
+			sizeof(*atlas->free_rects));
+	if (!atlas->segments || !atlas->free_rects) {
+		printf("failed to allocate atlas bookkeeping\n");
+		goto err;
+	}
+	skyline_reset(atlas);
+
+	return atlas;
 
 err:
-	free_sp_bo(bo);
+	destroy_sp_bo_atlas(atlas);
 	return NULL;
 }
 
-void free_sp_bo(struct sp_bo *bo)
+struct sp_bo *sp_bo_atlas_alloc(struct sp_bo_atlas *atlas, uint32_t width,
+		uint32_t height)
 {
+	struct sp_bo *bo;
+	struct atlas_rect rect;
 	int ret;
-	struct drm_mode_destroy_dumb dd;
 
-	if (!bo)
-		return;
+	if (atlas->num_bos == atlas->max_bos) {
+		int max = atlas->max_bos ? atlas->max_bos * 2 : 16;
+		struct sp_bo **bos;
 
-	if (bo->map_addr)
-		munmap(bo->map_addr, bo->size);
+		bos = realloc(atlas->bos, max * sizeof(*bos));
+		if (!bos)
+			return NULL;
+		atlas->bos = bos;
+		atlas->max_bos = max;
+	}
 
-	if (bo->fb_id) {
-		ret = drmModeRmFB(bo->dev->fd, bo->fb_id);
-		if (ret)
-			printf("Failed to rmfb ret=%d!\n", ret);
+	ret = atlas_place(atlas, width, height, &rect);
+	if (ret)
+		return NULL;
+
+	bo = calloc(1, sizeof(*bo));
+	if (!bo) {
+		atlas_free_rect(atlas, &rect);
+		return NULL;
 	}
 
-	if (bo->handle) {
-		dd.handle = bo->handle;
-		ret = drmIoctl(bo->dev->fd, DRM_IOCTL_MODE_DESTROY_DUMB, &dd);
-		if (ret)
-			printf("Failed to destroy buffer ret=%d\n", ret);
+	bo->dev = atlas->bo->dev;
+	bo->atlas = atlas;
+	bo->dmabuf_fd = -1;
+	bo->width = width;
+	bo->height = height;
+	bo->depth = atlas->bo->depth;
+	bo->bpp = atlas->bo->bpp;
+	bo->format = atlas->bo->format;
+	bo->handle = atlas->bo->handle;
+	bo->pitch = atlas->bo->pitch;
+	bo->size = (height - 1) * bo->pitch + width * atlas->cpp;
+	atlas_bind(atlas, bo, &rect);
+	atlas->bos[atlas->num_bos++] = bo;
+
+	ret = add_fb_sp_bo(bo, bo->format);
+	if (ret) {
+		printf("failed to add atlas fb ret=%d\n", ret);
+		destroy_sp_bo(bo);
+		return NULL;
 	}
+	return bo;
+}
 
-	free(bo);
+static int compare_height(const void *a, const void *b)
+{
+	const struct sp_bo *x = *(struct sp_bo * const *)a;
+	const struct sp_bo *y = *(struct sp_bo * const *)b;
+
+	if (x->height != y->height)
+		return x->height < y->height ? 1 : -1;
+	return x->width < y->width ? 1 : x->width > y->width ? -1 : 0;
+}
+
+/*
+ * Repacks every live sub-buffer tallest first, which gives the free space
+ * back to the skyline as one piece. Pixels move with their buffer, and
+ * buffers that moved get a new fb_id (the old one is removed), so callers
+ * must not have them on screen. Nothing changes if the repack doesn't fit.
+ */
+int sp_bo_atlas_defrag(struct sp_bo_atlas *atlas)
+{
+	struct atlas_rect *rects = NULL;
+	uint8_t *staging = NULL, *base;
+	size_t staged = 0;
+	int i, ret = 0, err, num_free = atlas->num_free, num_segments;
+	struct atlas_segment *segments = NULL;
+	struct atlas_rect *free_rects = NULL;
+
+	if (!atlas->num_bos)
+		return 0;
+
+	rects = calloc(atlas->num_bos, sizeof(*rects));
+	segments = malloc((atlas_align(atlas->bo->width) / ATLAS_ALIGN + 1) *
+			sizeof(*segments));
+	free_rects = malloc(atlas->max_free * sizeof(*free_rects));
+	if (!rects || !segments || !free_rects) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	/* Keep the current layout around in case the repack doesn't fit */
+	num_segments = atlas->num_segments;
+	memcpy(segments, atlas->segments, num_segments * sizeof(*segments));
+	memcpy(free_rects, atlas->free_rects, num_free * sizeof(*free_rects));
+
+	/* Sources and destinations may overlap, so stage through memory */
+	for (i = 0; i < atlas->num_bos; i++)
+		staged += (size_t)atlas->bos[i]->width * atlas->cpp *
+			atlas->bos[i]->height;
+	staging = malloc(staged);
+	base = sp_bo_map(atlas->bo, 0);
+	if (!staging || !base) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	qsort(atlas->bos, atlas->num_bos, sizeof(*atlas->bos),
+		compare_height);
+
+	skyline_reset(atlas);
+	for (i = 0; i < atlas->num_bos; i++) {
+		struct sp_bo *bo = atlas->bos[i];
+
+		ret = skyline_alloc(atlas, atlas_align(bo->width), bo->height,
+				&rects[i]);
+		if (ret) {
+			atlas->num_segments = num_segments;
+			memcpy(atlas->segments, segments,
+				num_segments * sizeof(*segments));
+			atlas->num_free = num_free;
+			memcpy(atlas->free_rects, free_rects,
+				num_free * sizeof(*free_rects));
+			goto out;
+		}
+	}
+
+	for (i = 0, staged = 0; i < atlas->num_bos; i++) {
+		struct sp_bo *bo = atlas->bos[i];
+		uint32_t row, len = bo->width * atlas->cpp;
+
+		for (row = 0; row < bo->height; row++, staged += len)
+			memcpy(staging + staged,
+				base + bo->offset + row * bo->pitch, len);
+	}
+
+	for (i = 0, staged = 0; i < atlas->num_bos; i++) {
+		struct sp_bo *bo = atlas->bos[i];
+		uint32_t row, len = bo->width * atlas->cpp, old_fb = bo->fb_id;
+		int moved = bo->x != rects[i].x || bo->y != rects[i].y;
+
+		atlas_bind(atlas, bo, &rects[i]);
+		for (row = 0; row < bo->height; row++, staged += len)
+			memcpy((uint8_t *)bo->map_addr + row * bo->pitch,
+				staging + staged, len);
+
+		if (!moved)
+			continue;
+
+		/* The first failure is the one returned */
+		err = add_fb_sp_bo(bo, bo->format);
+		if (err) {
+			printf("failed to re-add atlas fb ret=%d\n", err);
+			bo->fb_id = 0;
+			if (!ret)
+				ret = err;
+		}
+		atlas->bo->dev->stats.ioctls++;
+		atlas->bo->dev->ops->rm_fb(atlas->bo->dev, old_fb);
+	}
+
+out:
+	free(staging);
+	free(free_rects);
+	free(segments);
+	free(rects);
+	return ret;
+}
+
+/* Also destroys any sub-buffers that are still allocated */
+void destroy_sp_bo_atlas(struct sp_bo_atlas *atlas)
+{
+	if (!atlas)
+		return;
+
+	while (atlas->num_bos)
+		destroy_sp_bo(atlas->bos[0]);
+
+	if (atlas->bo)
+		destroy_sp_bo(atlas->bo);
+	free(atlas->bos);
+	free(atlas->free_rects);
+	free(atlas->segments);
+	free(atlas);
 }
@@ -2,11 +2,49 @@
 #define __BO_H_INCLUDED__
 
 #include <stdint.h>
+#include <xf86drmMode.h>
+
+/*
+ * Damage rects kept per bo before they are merged into a bounding box. This
+ * is also the most clips a flush hands to the kernel.
+ */
+#define SP_BO_MAX_DAMAGE 8
+
+/* sp_bo_map() flags */
+#define SP_BO_MAP_POPULATE (1 << 0) /* prefault, for buffers written whole */
 
 struct sp_dev;
+struct sp_bo_atlas;
+struct gbm_bo;
+
+/*
+ * Where a bo's memory comes from. All of them end up as a GEM handle on the
+ * KMS device with a framebuffer, and are mapped through sp_bo_map().
+ */
+enum sp_bo_backend {
+	SP_BO_BACKEND_DUMB = 0,	/* dumb buffer on the KMS device */
+	SP_BO_BACKEND_GBM,	/* gbm bo, optionally with modifiers */
+	SP_BO_BACKEND_VGEM,	/* vgem dumb buffer imported over PRIME */
+	SP_BO_BACKEND_UDMABUF,	/* memfd pages imported over udmabuf */
+	SP_BO_BACKEND_DMABUF,	/* foreign dma-buf, see sp_bo_import_fd() */
+	SP_BO_NUM_BACKENDS,
+};
+
+/*
+ * How the CPU mapping of a bo is cached, as far as it can be told. Reads
+ * and read-modify-write cycles through WC or uncached mappings are very
+ * slow, so such bos should be written whole rows at a time, never read.
+ */
+enum sp_bo_caching {
+	SP_BO_CACHING_UNKNOWN = 0,
+	SP_BO_CACHING_CACHED,
+	SP_BO_CACHING_WC,
+	SP_BO_CACHING_UNCACHED,
+};
 
 struct sp_bo {
 	struct sp_dev *dev;
+	enum sp_bo_backend backend;
 
 	uint32_t width;
 	uint32_t height;
@@ -17,18 +55,202 @@ struct sp_bo {
 
 	uint32_t fb_id;
 	uint32_t handle;
-	void *map_addr;
+	void *map_addr; /* NULL until sp_bo_map() */
+	enum sp_bo_caching caching;
 	uint32_t pitch;
 	uint32_t size;
+
+	/* Byte offset of the pixels within the GEM object behind handle */
+	uint32_t offset;
+	uint64_t modifier;
+
+	/*
+	 * Framebuffer planes as given to ADDFB2. Plane 0 is handle, pitch
+	 * and offset; multi-planar YUV formats put their chroma planes
+	 * after it in the same GEM object.
+	 */
+	uint32_t num_planes;
+	uint32_t handles[4];
+	uint32_t pitches[4];
+	uint32_t offsets[4];
+
+	/* Backend private */
+	struct gbm_bo *gbm_bo;
+	void *gbm_map_data;
+	uint32_t vgem_handle;
+	int memfd;
+
+	/* dma-buf of the bo once exported or imported, owned by the bo */
+	int dmabuf_fd;
+
+	/* Set for sub-buffers of an atlas, placed at x/y in the atlas bo */
+	struct sp_bo_atlas *atlas;
+	uint32_t x;
+	uint32_t y;
+
+	/*
+	 * Regions drawn since the last flush, in framebuffer coordinates.
+	 * Rects are exclusive of x2/y2, the same as FB_DAMAGE_CLIPS.
+	 */
+	int num_damage;
+	struct drm_mode_rect damage[SP_BO_MAX_DAMAGE];
+
+	/* Links on the device's bo pool while the bo is released */
+	struct sp_bo *pool_prev;
+	struct sp_bo *pool_next;
 };
 
+struct sp_bo_pool_stats {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+
+	/* Buffers currently held by the pool */
+	uint64_t num_bos;
+	uint64_t bytes;
+};
+
+/*
+ * Allocates from dev->bo_backend, SP_BO_BACKEND=<name> sets the default.
+ * NV12, YUV420 and P010 bos get all their planes in one buffer; depth and
+ * bpp are ignored for them and bo->bpp is that of the luma plane.
+ */
 struct sp_bo *create_sp_bo(struct sp_dev *dev, uint32_t width, uint32_t height,
 		uint32_t depth, uint32_t bpp, uint32_t format, uint32_t flags);
+/*
+ * modifiers only apply to the gbm backend, without them it allocates a
+ * linear scanout buffer. Buffers with modifiers don't come from the bo
+ * pool, and only linear ones go back to it.
+ */
+struct sp_bo *create_sp_bo_with_backend(struct sp_dev *dev,
+		enum sp_bo_backend backend, uint32_t width, uint32_t height,
+		uint32_t depth, uint32_t bpp, uint32_t format, uint32_t flags,
+		const uint64_t *modifiers, int num_modifiers);
+
+const char *sp_bo_backend_name(enum sp_bo_backend backend);
+int sp_bo_backend_from_name(const char *name, enum sp_bo_backend *backend);
+
+/*
+ * Returns a new dma-buf fd for the bo, which the caller closes. Atlas
+ * sub-buffers export the whole atlas, at bo->offset/bo->pitch.
+ */
+int sp_bo_export_fd(struct sp_bo *bo);
+/* Wraps a dma-buf from another device or process, fd stays the caller's */
+struct sp_bo *sp_bo_import_fd(struct sp_dev *dev, int fd, uint32_t width,
+		uint32_t height, uint32_t depth, uint32_t bpp, uint32_t format,
+		uint32_t pitch, uint32_t offset, uint64_t modifier);
+/*
+ * A CPU view of a linear dma-buf dev could not import: mapped through the
+ * dma-buf, without a GEM handle or framebuffer. It can be drawn to and
+ * blitted from, not scanned out.
+ */
+struct sp_bo *sp_bo_wrap_fd(struct sp_dev *dev, int fd, uint32_t width,
+		uint32_t height, uint32_t depth, uint32_t bpp, uint32_t format,
+		uint32_t pitch, uint32_t offset);
 
+/*
+ * Brackets CPU access to a bo shared with other devices with
+ * DMA_BUF_IOCTL_SYNC, so caches are cleaned or invalidated around it and
+ * the access waits for the devices' fences. access is the same
+ * SP_BO_ACCESS_* mask on both calls.
+ */
+#define SP_BO_ACCESS_READ (1 << 0)
+#define SP_BO_ACCESS_WRITE (1 << 1)
+int sp_bo_begin_cpu_access(struct sp_bo *bo, uint32_t access);
+int sp_bo_end_cpu_access(struct sp_bo *bo, uint32_t access);
+
+/*
+ * Buffers are only mapped on first CPU access: draw_rect()/fill_bo() map on
+ * their own, direct writers call sp_bo_map() to get (or create) the
+ * mapping. Unmapping is optional, free_sp_bo() does it. Multi-planar gbm
+ * bos can't be mapped, as gbm maps only their first plane.
+ */
+void *sp_bo_map(struct sp_bo *bo, uint32_t flags);
+void sp_bo_unmap(struct sp_bo *bo);
+
+/*
+ * fill_bo() and draw_rect() write XRGB8888, ARGB8888, RGBA8888, ABGR8888,
+ * XRGB2101010, XBGR2101010, ABGR16161616F, RGB565 and BGR888, and ignore
+ * other formats. sp_format_bpp() gives the bpp of those, 0 for others.
+ * They also fill NV12, YUV420 and P010 bos, converting the colour to BT.601
+ * limited range; rects on those are widened to whole chroma samples.
+ */
+uint32_t sp_format_bpp(uint32_t format);
+/* Planes of a format: 2 or 3 for the YUV formats above, else 1 */
+uint32_t sp_format_num_planes(uint32_t format);
+/* Luma rows per chroma row: 2 for the YUV formats above, else 1 */
+uint32_t sp_format_vsub(uint32_t format);
 void fill_bo(struct sp_bo *bo, uint8_t a, uint8_t r, uint8_t g, uint8_t b);
 void draw_rect(struct sp_bo *bo, uint32_t x, uint32_t y, uint32_t width,
 		uint32_t height, uint8_t a, uint8_t r, uint8_t g, uint8_t b);
 
+/*
+ * Widens a rect to whole chroma samples of a YUV bo, which is what
+ * draw_rect() writes and records as damage. Other formats are left as
+ * they are.
+ */
+void sp_bo_align_rect(const struct sp_bo *bo, uint32_t *x, uint32_t *y,
+		uint32_t *width, uint32_t *height);
+
+/*
+ * draw_rect() without the damage bookkeeping, so disjoint rows of one bo can
+ * be drawn from several threads, in whole chroma rows (sp_format_vsub())
+ * for the YUV formats. The caller records the damage.
+ */
+void draw_rect_nodamage(struct sp_bo *bo, uint32_t x, uint32_t y,
+		uint32_t width, uint32_t height, uint8_t a, uint8_t r,
+		uint8_t g, uint8_t b);
+
+/*
+ * With the pool enabled, free_sp_bo() keeps the buffer's handle, fb and
+ * mapping alive (contents are not cleared) and create_sp_bo() hands it back
+ * for a matching width/height/bpp/format/flags. Least recently released
+ * buffers are destroyed once the pool holds more than max_bytes. Buffers
+ * that were exported as a dma-buf are destroyed rather than pooled.
+ */
 void free_sp_bo(struct sp_bo *bo);
 
+int sp_bo_pool_enable(struct sp_dev *dev, uint64_t max_bytes);
+void sp_bo_pool_disable(struct sp_dev *dev);
+void sp_bo_pool_get_stats(struct sp_dev *dev, struct sp_bo_pool_stats *stats);
+
+/*
+ * draw_rect() and fill_bo() record what they touch, other CPU writers can
+ * call sp_bo_add_damage() themselves. sp_bo_flush_damage() hands the region
+ * to the driver with DIRTYFB and clears it; on the atomic path
+ * set_sp_plane_pset() sends it as FB_DAMAGE_CLIPS instead.
+ */
+void sp_bo_add_damage(struct sp_bo *bo, uint32_t x, uint32_t y,
+		uint32_t width, uint32_t height);
+void sp_bo_clear_damage(struct sp_bo *bo);
+/* The merge behind sp_bo_add_damage(), for lists of up to SP_BO_MAX_DAMAGE */
+void sp_damage_add_rect(struct drm_mode_rect *damage, int *num_damage,
+		const struct drm_mode_rect *rect);
+int sp_bo_flush_damage(struct sp_bo *bo);
+
+/*
+ * For WC/uncached bos long spans are written with non-temporal stores,
+ * which are not ordered against later writes: sp_bo_flush_writes() must
+ * be called before the buffer is handed to the display or another device.
+ * sp_bo_flush_damage(), set_sp_plane() and set_sp_plane_pset() do so.
+ */
+int sp_bo_write_combined(struct sp_bo *bo);
+void sp_bo_flush_writes(struct sp_bo *bo);
+
+/* Name of the span writer used by fill_bo()/draw_rect() ("avx2", "c", ...) */
+const char *sp_bo_fill_impl(void);
+
+/*
+ * An atlas carves many small framebuffers out of one dumb buffer, so each
+ * costs an ADDFB2 rather than a GEM object, an mmap and an fb. Sub-buffers
+ * are ordinary sp_bos (draw into them, scan them out, free_sp_bo() them)
+ * sharing the atlas' handle, pitch and format.
+ */
+struct sp_bo_atlas *create_sp_bo_atlas(struct sp_dev *dev, uint32_t width,
+		uint32_t height, uint32_t depth, uint32_t bpp, uint32_t format);
+struct sp_bo *sp_bo_atlas_alloc(struct sp_bo_atlas *atlas, uint32_t width,
+		uint32_t height);
+int sp_bo_atlas_defrag(struct sp_bo_atlas *atlas);
+void destroy_sp_bo_atlas(struct sp_bo_atlas *atlas);
+
 #endif /* __BO_H_INCLUDED__ */
@@ -0,0 +1,141 @@
+/*
+ * Measures the CPU compositor against layer count and how much of the
+ * target each layer covers. "full" recomposes the whole target, "move"
+ * moves the top layer a few pixels per frame and only recomposes what it
+ * uncovered and covers.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <drm_fourcc.h>
+
+#include "bo.h"
+#include "compositor.h"
+#include "dev.h"
+
+#define WIDTH 1920
+#define HEIGHT 1080
+#define ITERATIONS 20
+
+static const int layer_counts[] = { 1, 2, 4, 8, 16 };
+static const int coverages[] = { 10, 25, 50, 100 };
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Premultiplied gradient, opaque at the top fading out at the bottom */
+static void fill_layer(struct sp_bo *bo, int seed)
+{
+	uint32_t y, a;
+
+	for (y = 0; y < bo->height; y++) {
+		a = 255 - y * 255 / bo->height;
+		draw_rect_nodamage(bo, 0, y, bo->width, 1, a,
+				a * ((seed * 40) & 0xff) / 255,
+				a * ((seed * 90) & 0xff) / 255, a / 2);
+	}
+}
+
+static int bench(struct sp_dev *dev, struct sp_bo *target, int num_layers,
+		int coverage)
+{
+	struct sp_bo *bos[SP_COMPOSITOR_MAX_LAYERS] = {};
+	struct sp_compositor *comp;
+	struct sp_layer *top = NULL;
+	double scale = sqrt(coverage / 100.0), start, full, move;
+	uint32_t w = WIDTH * scale, h = HEIGHT * scale;
+	uint64_t pixels = 0;
+	int i, ret = -1;
+
+	comp = create_sp_compositor(target, NULL, 0xFF202020);
+	if (!comp)
+		return -1;
+
+	for (i = 0; i < num_layers; i++) {
+		bos[i] = create_sp_bo(dev, w, h, 32, 32, DRM_FORMAT_ARGB8888,
+				0);
+		if (!bos[i]) {
+			printf("failed to create layer bo\n");
+			goto out;
+		}
+		fill_layer(bos[i], i);
+
+		/* Spread the layers over the target */
+		top = sp_compositor_add_layer(comp, bos[i],
+				(WIDTH - w) * i / num_layers,
+				(HEIGHT - h) * i / num_layers,
+				i & 1 ? 0xC0 : 0xFF);
+		if (!top)
+			goto out;
+	}
+	sp_compositor_compose(comp);
+
+	start = now();
+	for (i = 0; i < ITERATIONS; i++) {
+		sp_compositor_damage_all(comp);
+		sp_compositor_compose(comp);
+	}
+	full = (now() - start) * 1e3 / ITERATIONS;
+
+	start = now();
+	for (i = 0; i < ITERATIONS; i++) {
+		top->x += i & 1 ? -8 : 8;
+		sp_compositor_compose(comp);
+		pixels += comp->composed_pixels;
+	}
+	move = (now() - start) * 1e3 / ITERATIONS;
+
+	printf("%6d %7d%%  full %7.2f ms (%6.0f Mpix/s)  move %6.2f ms "
+		"(%4.1f%% of target)\n", num_layers, coverage, full,
+		(double)WIDTH * HEIGHT / full / 1e3, move,
+		100.0 * pixels / ITERATIONS / (WIDTH * HEIGHT));
+	ret = 0;
+
+out:
+	destroy_sp_compositor(comp);
+	for (i = 0; i < num_layers; i++)
+		free_sp_bo(bos[i]);
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	struct sp_dev *dev;
+	struct sp_bo *target;
+	unsigned i, j;
+
+	dev = create_sp_dev();
+	if (!dev) {
+		printf("Failed to create sp_dev\n");
+		return -1;
+	}
+
+	target = create_sp_bo(dev, WIDTH, HEIGHT, 24, 32, DRM_FORMAT_XRGB8888,
+			0);
+	if (!target) {
+		printf("Failed to create target bo\n");
+		destroy_sp_dev(dev);
+		return -1;
+	}
+
+	printf("%dx%d target, %s kernel, %d iterations\n", WIDTH, HEIGHT,
+		sp_compositor_impl(), ITERATIONS);
+	printf("layers coverage\n");
+	for (i = 0; i < sizeof(layer_counts) / sizeof(layer_counts[0]); i++)
+		for (j = 0; j < sizeof(coverages) / sizeof(coverages[0]); j++)
+			if (bench(dev, target, layer_counts[i], coverages[j]))
+				break;
+
+	free_sp_bo(target);
+	destroy_sp_dev(dev);
+	return 0;
+}
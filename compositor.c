@@ -0,0 +1,543 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <drm_fourcc.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+#define HAVE_AVX2_TARGET
+#endif
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "blit.h"
+#include "bo.h"
+#include "compositor.h"
+
+/*
+ * Blend kernels composite |count| premultiplied ARGB8888 pixels from |src|
+ * over |dst|, both in memory order B, G, R, A:
+ *
+ *	s = src * alpha / 255
+ *	dst = s + dst * (255 - s.a) / 255
+ *
+ * |opaque| sources (XRGB8888) have their alpha byte taken as 255. All
+ * kernels round x / 255 the same way, so they give identical results.
+ */
+typedef void (*over_span32_fn)(uint8_t *dst, const uint8_t *src,
+		uint32_t count, uint8_t alpha, int opaque);
+
+static inline uint32_t div255(uint32_t x)
+{
+	x += 128;
+	return (x + (x >> 8)) >> 8;
+}
+
+static void over_span32_c(uint8_t *dst, const uint8_t *src, uint32_t count,
+		uint8_t alpha, int opaque)
+{
+	uint32_t i, c, sa, inv;
+
+	for (; count; count--, dst += 4, src += 4) {
+		sa = opaque ? 255 : src[3];
+		if (alpha != 255)
+			sa = div255(sa * alpha);
+		inv = 255 - sa;
+
+		for (i = 0; i < 3; i++) {
+			c = alpha != 255 ? div255(src[i] * alpha) : src[i];
+			c += div255(dst[i] * inv);
+			dst[i] = c > 255 ? 255 : c;
+		}
+		dst[3] = sa + div255(dst[3] * inv);
+	}
+}
+
+#if defined(__SSE2__)
+static inline __m128i div255_epi16(__m128i x)
+{
+	x = _mm_add_epi16(x, _mm_set1_epi16(128));
+	return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+}
+
+/* Blends two pixels widened to 16 bits per channel */
+static inline __m128i over_epi16(__m128i s, __m128i d, __m128i pa, int scale)
+{
+	__m128i a;
+
+	if (scale)
+		s = div255_epi16(_mm_mullo_epi16(s, pa));
+	a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s, 0xff), 0xff);
+	a = _mm_sub_epi16(_mm_set1_epi16(255), a);
+	return _mm_add_epi16(s, div255_epi16(_mm_mullo_epi16(d, a)));
+}
+
+static void over_span32_sse2(uint8_t *dst, const uint8_t *src,
+		uint32_t count, uint8_t alpha, int opaque)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i amask = _mm_set1_epi32(0xff000000);
+	const __m128i pa = _mm_set1_epi16(alpha);
+	const __m128i force_a = opaque ? amask : zero;
+	int scale = alpha != 255;
+
+	for (; count >= 4; count -= 4, dst += 16, src += 16) {
+		__m128i s = _mm_or_si128(_mm_loadu_si128((const __m128i *)src),
+				force_a);
+		__m128i d, lo, hi;
+
+		/* Runs of fully opaque or fully clear pixels are common */
+		if (!scale && _mm_movemask_epi8(_mm_cmpeq_epi32(
+				_mm_and_si128(s, amask), amask)) == 0xffff) {
+			_mm_storeu_si128((__m128i *)dst, s);
+			continue;
+		}
+		if (_mm_movemask_epi8(_mm_cmpeq_epi32(s, zero)) == 0xffff)
+			continue;
+
+		d = _mm_loadu_si128((const __m128i *)dst);
+		lo = over_epi16(_mm_unpacklo_epi8(s, zero),
+				_mm_unpacklo_epi8(d, zero), pa, scale);
+		hi = over_epi16(_mm_unpackhi_epi8(s, zero),
+				_mm_unpackhi_epi8(d, zero), pa, scale);
+		_mm_storeu_si128((__m128i *)dst, _mm_packus_epi16(lo, hi));
+	}
+	over_span32_c(dst, src, count, alpha, opaque);
+}
+#endif
+
+#if defined(HAVE_AVX2_TARGET)
+__attribute__((target("avx2")))
+static inline __m256i div255_epi16_avx2(__m256i x)
+{
+	x = _mm256_add_epi16(x, _mm256_set1_epi16(128));
+	return _mm256_srli_epi16(_mm256_add_epi16(x, _mm256_srli_epi16(x, 8)),
+			8);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i over_epi16_avx2(__m256i s, __m256i d, __m256i pa,
+		int scale)
+{
+	__m256i a;
+
+	if (scale)
+		s = div255_epi16_avx2(_mm256_mullo_epi16(s, pa));
+	a = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(s, 0xff), 0xff);
+	a = _mm256_sub_epi16(_mm256_set1_epi16(255), a);
+	return _mm256_add_epi16(s,
+			div255_epi16_avx2(_mm256_mullo_epi16(d, a)));
+}
+
+__attribute__((target("avx2")))
+static void over_span32_avx2(uint8_t *dst, const uint8_t *src,
+		uint32_t count, uint8_t alpha, int opaque)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i amask = _mm256_set1_epi32(0xff000000);
+	const __m256i pa = _mm256_set1_epi16(alpha);
+	const __m256i force_a = opaque ? amask : zero;
+	int scale = alpha != 255;
+
+	for (; count >= 8; count -= 8, dst += 32, src += 32) {
+		__m256i s = _mm256_or_si256(
+				_mm256_loadu_si256((const __m256i *)src), force_a);
+		__m256i d, lo, hi;
+
+		if (!scale && _mm256_movemask_epi8(_mm256_cmpeq_epi32(
+				_mm256_and_si256(s, amask), amask)) == -1) {
+			_mm256_storeu_si256((__m256i *)dst, s);
+			continue;
+		}
+		if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(s, zero)) == -1)
+			continue;
+
+		/* unpack and pack both work per 128-bit lane, order is kept */
+		d = _mm256_loadu_si256((const __m256i *)dst);
+		lo = over_epi16_avx2(_mm256_unpacklo_epi8(s, zero),
+				_mm256_unpacklo_epi8(d, zero), pa, scale);
+		hi = over_epi16_avx2(_mm256_unpackhi_epi8(s, zero),
+				_mm256_unpackhi_epi8(d, zero), pa, scale);
+		_mm256_storeu_si256((__m256i *)dst,
+				_mm256_packus_epi16(lo, hi));
+	}
+	over_span32_c(dst, src, count, alpha, opaque);
+}
+#endif
+
+#if defined(__ARM_NEON)
+/* a * b / 255, rounded like div255() */
+static inline uint8x16_t mul_div255_neon(uint8x16_t a, uint8x16_t b)
+{
+	uint16x8_t lo = vmull_u8(vget_low_u8(a), vget_low_u8(b));
+	uint16x8_t hi = vmull_u8(vget_high_u8(a), vget_high_u8(b));
+
+	return vcombine_u8(vraddhn_u16(lo, vrshrq_n_u16(lo, 8)),
+			vraddhn_u16(hi, vrshrq_n_u16(hi, 8)));
+}
+
+static void over_span32_neon(uint8_t *dst, const uint8_t *src,
+		uint32_t count, uint8_t alpha, int opaque)
+{
+	const uint8x16_t pa = vdupq_n_u8(alpha);
+	int i;
+
+	for (; count >= 16; count -= 16, dst += 64, src += 64) {
+		uint8x16x4_t s = vld4q_u8(src);
+		uint8x16x4_t d = vld4q_u8(dst);
+		uint8x16_t inv;
+
+		if (opaque)
+			s.val[3] = vdupq_n_u8(255);
+		if (alpha != 255)
+			for (i = 0; i < 4; i++)
+				s.val[i] = mul_div255_neon(s.val[i], pa);
+		inv = vmvnq_u8(s.val[3]);
+		for (i = 0; i < 4; i++)
+			d.val[i] = vqaddq_u8(s.val[i],
+					mul_div255_neon(d.val[i], inv));
+		vst4q_u8(dst, d);
+	}
+	over_span32_c(dst, src, count, alpha, opaque);
+}
+#endif
+
+static const struct {
+	const char *name;
+	over_span32_fn fn;
+} over_span32_impls[] = {
+#if defined(HAVE_AVX2_TARGET)
+	{ "avx2", over_span32_avx2 },
+#endif
+#if defined(__SSE2__)
+	{ "sse2", over_span32_sse2 },
+#endif
+#if defined(__ARM_NEON)
+	{ "neon", over_span32_neon },
+#endif
+	{ "c", over_span32_c },
+};
+
+static int over_span32_impl = -1;
+
+static int over_span32_usable(int i)
+{
+#if defined(HAVE_AVX2_TARGET)
+	if (over_span32_impls[i].fn == over_span32_avx2)
+		return __builtin_cpu_supports("avx2");
+#endif
+	return 1;
+}
+
+static over_span32_fn get_over_span32(void)
+{
+	const char *force;
+	int i, n = sizeof(over_span32_impls) / sizeof(over_span32_impls[0]);
+
+	if (over_span32_impl >= 0)
+		return over_span32_impls[over_span32_impl].fn;
+
+	force = getenv("SP_COMPOSE_IMPL");
+	for (i = 0; i < n; i++) {
+		if (!over_span32_usable(i))
+			continue;
+		if (force && strcmp(force, over_span32_impls[i].name))
+			continue;
+		break;
+	}
+	if (i == n)
+		i = n - 1;
+
+	over_span32_impl = i;
+	return over_span32_impls[i].fn;
+}
+
+const char *sp_compositor_impl(void)
+{
+	get_over_span32();
+	return over_span32_impls[over_span32_impl].name;
+}
+
+static int is_32bpp_rgb(uint32_t format)
+{
+	return format == DRM_FORMAT_XRGB8888 || format == DRM_FORMAT_ARGB8888;
+}
+
+/* Clips a layer-space rect to the target, returns 0 if nothing is left */
+static int clip_rect(struct sp_compositor *comp, int x, int y, int w, int h,
+		struct drm_mode_rect *r)
+{
+	r->x1 = x < 0 ? 0 : x;
+	r->y1 = y < 0 ? 0 : y;
+	r->x2 = x + w > (int)comp->target->width ? (int)comp->target->width :
+		x + w;
+	r->y2 = y + h > (int)comp->target->height ?
+		(int)comp->target->height : y + h;
+	return r->x1 < r->x2 && r->y1 < r->y2;
+}
+
+static void add_damage(struct sp_compositor *comp, int x, int y, int w,
+		int h)
+{
+	struct drm_mode_rect r;
+
+	if (clip_rect(comp, x, y, w, h, &r))
+		sp_damage_add_rect(comp->damage, &comp->num_damage, &r);
+}
+
+static void damage_last(struct sp_compositor *comp, struct sp_layer *layer)
+{
+	if (layer->composed)
+		add_damage(comp, layer->last_x, layer->last_y,
+				layer->last_bo->width, layer->last_bo->height);
+}
+
+struct sp_compositor *create_sp_compositor(struct sp_bo *target,
+		struct sp_bo *background, uint32_t background_color)
+{
+	struct sp_compositor *comp;
+
+	if (!is_32bpp_rgb(target->format) &&
+	    target->format != DRM_FORMAT_RGB565) {
+		printf("unsupported compositor target format %.4s\n",
+			(char *)&target->format);
+		return NULL;
+	}
+	if (background && (!is_32bpp_rgb(background->format) ||
+			(is_32bpp_rgb(target->format) &&
+			 background->format != target->format) ||
+			background->width < target->width ||
+			background->height < target->height)) {
+		printf("compositor background doesn't match the target\n");
+		return NULL;
+	}
+
+	comp = calloc(1, sizeof(*comp));
+	if (!comp)
+		return NULL;
+
+	comp->scratch = malloc(target->width * 4);
+	if (!comp->scratch) {
+		free(comp);
+		return NULL;
+	}
+
+	comp->target = target;
+	comp->background = background;
+	comp->background_color = background_color;
+
+	/* Whatever target held before isn't ours, paint all of it once */
+	sp_compositor_damage_all(comp);
+	return comp;
+}
+
+void destroy_sp_compositor(struct sp_compositor *comp)
+{
+	int i;
+
+	for (i = 0; i < comp->num_layers; i++)
+		free(comp->layers[i]);
+	free(comp->scratch);
+	free(comp);
+}
+
+struct sp_layer *sp_compositor_add_layer(struct sp_compositor *comp,
+		struct sp_bo *bo, int x, int y, uint8_t alpha)
+{
+	struct sp_layer *layer;
+
+	if (!is_32bpp_rgb(bo->format)) {
+		printf("unsupported layer format %.4s\n", (char *)&bo->format);
+		return NULL;
+	}
+	if (comp->num_layers == SP_COMPOSITOR_MAX_LAYERS) {
+		printf("too many compositor layers\n");
+		return NULL;
+	}
+
+	layer = calloc(1, sizeof(*layer));
+	if (!layer)
+		return NULL;
+
+	layer->bo = bo;
+	layer->x = x;
+	layer->y = y;
+	layer->alpha = alpha;
+	comp->layers[comp->num_layers++] = layer;
+	return layer;
+}
+
+void sp_compositor_remove_layer(struct sp_compositor *comp,
+		struct sp_layer *layer)
+{
+	int i;
+
+	for (i = 0; i < comp->num_layers; i++)
+		if (comp->layers[i] == layer)
+			break;
+	if (i == comp->num_layers)
+		return;
+
+	damage_last(comp, layer);
+	memmove(&comp->layers[i], &comp->layers[i + 1],
+		(comp->num_layers - i - 1) * sizeof(comp->layers[0]));
+	comp->num_layers--;
+	free(layer);
+}
+
+void sp_compositor_damage_all(struct sp_compositor *comp)
+{
+	add_damage(comp, 0, 0, comp->target->width, comp->target->height);
+}
+
+/* Turns layer changes since the last compose into damage */
+static void collect_damage(struct sp_compositor *comp)
+{
+	struct sp_layer *layer;
+	struct sp_bo *bo;
+	int i, j;
+
+	for (i = 0; i < comp->num_layers; i++) {
+		layer = comp->layers[i];
+		bo = layer->bo;
+
+		if (!layer->composed || layer->last_bo != bo ||
+		    layer->last_x != layer->x || layer->last_y != layer->y ||
+		    layer->last_alpha != layer->alpha) {
+			damage_last(comp, layer);
+			add_damage(comp, layer->x, layer->y, bo->width,
+					bo->height);
+		} else {
+			for (j = 0; j < bo->num_damage; j++)
+				add_damage(comp,
+					layer->x + bo->damage[j].x1,
+					layer->y + bo->damage[j].y1,
+					bo->damage[j].x2 - bo->damage[j].x1,
+					bo->damage[j].y2 - bo->damage[j].y1);
+		}
+		sp_bo_clear_damage(bo);
+
+		layer->composed = 1;
+		layer->last_bo = bo;
+		layer->last_x = layer->x;
+		layer->last_y = layer->y;
+		layer->last_alpha = layer->alpha;
+	}
+}
+
+static int layer_opaque(struct sp_layer *layer)
+{
+	return layer->alpha == 255 &&
+		layer->bo->format == DRM_FORMAT_XRGB8888;
+}
+
+static int layer_covers(struct sp_layer *layer, const struct drm_mode_rect *r)
+{
+	return layer->x <= r->x1 && layer->y <= r->y1 &&
+		layer->x + (int)layer->bo->width >= r->x2 &&
+		layer->y + (int)layer->bo->height >= r->y2;
+}
+
+static void fill_background(struct sp_compositor *comp, uint8_t *line,
+		int x, int y, int w)
+{
+	struct sp_bo *bg = comp->background;
+	uint32_t *p = (uint32_t *)line;
+	int i;
+
+	if (bg) {
+		memcpy(line, (uint8_t *)bg->map_addr + y * bg->pitch + x * 4,
+			w * 4);
+		return;
+	}
+	for (i = 0; i < w; i++)
+		p[i] = comp->background_color;
+}
+
+static void compose_rect(struct sp_compositor *comp,
+		const struct drm_mode_rect *r, over_span32_fn over)
+{
+	struct sp_bo *target = comp->target;
+	int i, y, first = 0, covered = 0, w = r->x2 - r->x1;
+	uint8_t *line = comp->scratch;
+
+	/* Nothing under an opaque layer covering the whole rect shows */
+	for (i = comp->num_layers - 1; i >= 0; i--) {
+		if (layer_opaque(comp->layers[i]) &&
+		    layer_covers(comp->layers[i], r)) {
+			first = i;
+			covered = 1;
+			break;
+		}
+	}
+
+	for (y = r->y1; y < r->y2; y++) {
+		if (!covered)
+			fill_background(comp, line, r->x1, y, w);
+
+		for (i = first; i < comp->num_layers; i++) {
+			struct sp_layer *layer = comp->layers[i];
+			struct sp_bo *bo = layer->bo;
+			int x1, x2, sy = y - layer->y;
+			const uint8_t *src;
+
+			if (sy < 0 || sy >= (int)bo->height)
+				continue;
+			x1 = layer->x > r->x1 ? layer->x : r->x1;
+			x2 = layer->x + (int)bo->width < r->x2 ?
+				layer->x + (int)bo->width : r->x2;
+			if (x1 >= x2)
+				continue;
+
+			src = (const uint8_t *)bo->map_addr + sy * bo->pitch +
+				(x1 - layer->x) * 4;
+			if (layer_opaque(layer))
+				memcpy(line + (x1 - r->x1) * 4, src,
+					(x2 - x1) * 4);
+			else
+				over(line + (x1 - r->x1) * 4, src, x2 - x1,
+					layer->alpha,
+					bo->format == DRM_FORMAT_XRGB8888);
+		}
+
+		if (target->format == DRM_FORMAT_RGB565)
+			sp_dither_row_565((uint8_t *)target->map_addr +
+				y * target->pitch + r->x1 * 2, line, w,
+				r->x1, y);
+		else
+			memcpy((uint8_t *)target->map_addr +
+				y * target->pitch + r->x1 * 4, line, w * 4);
+	}
+
+	comp->composed_pixels += (uint64_t)w * (r->y2 - r->y1);
+	sp_bo_add_damage(target, r->x1, r->y1, w, r->y2 - r->y1);
+}
+
+int sp_compositor_compose(struct sp_compositor *comp)
+{
+	over_span32_fn over = get_over_span32();
+	int i;
+
+	comp->composed_pixels = 0;
+	collect_damage(comp);
+	if (!comp->num_damage)
+		return 0;
+
+	if (!sp_bo_map(comp->target, 0) ||
+	    (comp->background && !sp_bo_map(comp->background, 0)))
+		return -ENOMEM;
+	for (i = 0; i < comp->num_layers; i++)
+		if (!sp_bo_map(comp->layers[i]->bo, 0))
+			return -ENOMEM;
+
+	for (i = 0; i < comp->num_damage; i++)
+		compose_rect(comp, &comp->damage[i], over);
+	comp->num_damage = 0;
+	return 0;
+}
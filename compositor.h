@@ -0,0 +1,82 @@
+#ifndef __COMPOSITOR_H_INCLUDED__
+#define __COMPOSITOR_H_INCLUDED__
+
+#include <stdint.h>
+
+#include "bo.h"
+
+#define SP_COMPOSITOR_MAX_LAYERS 32
+
+/*
+ * A layer the display has no plane for. bo is premultiplied ARGB8888, or
+ * XRGB8888 which is taken as opaque. x, y and alpha (plane alpha, 255 is
+ * opaque) may be changed freely between composes.
+ *
+ * The compositor reads layer bos through their CPU mapping, so they should
+ * be in cached memory; reading back WC dumb buffers is very slow.
+ */
+struct sp_layer {
+	struct sp_bo *bo;
+	int x, y;
+	uint8_t alpha;
+
+	/* Where the layer was last composed, owned by the compositor */
+	int composed;
+	struct sp_bo *last_bo;
+	int last_x, last_y;
+	uint8_t last_alpha;
+};
+
+/*
+ * Blends layers bottom to top over a background into target, normally the
+ * primary plane's scanout buffer, recomposing only what changed: layers
+ * that moved, changed alpha, were added or removed, and damage recorded on
+ * the layer bos. The result is recorded as damage on target, to be flushed
+ * with sp_bo_flush_damage() or sent along by set_sp_plane_pset().
+ *
+ * Each row is composed in a cached scratch line and written to target
+ * once, so a WC target is never read back. Rows for an RGB565 target are
+ * composed in XRGB8888 and dithered down on the way out.
+ */
+struct sp_compositor {
+	struct sp_bo *target;
+
+	/*
+	 * What lies under the layers: a bo the size of target if set, else
+	 * background_color, a pixel in target's format. With an RGB565
+	 * target both are XRGB8888 or ARGB8888 instead.
+	 */
+	struct sp_bo *background;
+	uint32_t background_color;
+
+	int num_layers;
+	struct sp_layer *layers[SP_COMPOSITOR_MAX_LAYERS];
+
+	int num_damage;
+	struct drm_mode_rect damage[SP_BO_MAX_DAMAGE];
+
+	uint8_t *scratch;
+
+	/* Pixels written to target by the last compose */
+	uint64_t composed_pixels;
+};
+
+struct sp_compositor *create_sp_compositor(struct sp_bo *target,
+		struct sp_bo *background, uint32_t background_color);
+void destroy_sp_compositor(struct sp_compositor *comp);
+
+/* Adds a layer on top of the others */
+struct sp_layer *sp_compositor_add_layer(struct sp_compositor *comp,
+		struct sp_bo *bo, int x, int y, uint8_t alpha);
+void sp_compositor_remove_layer(struct sp_compositor *comp,
+		struct sp_layer *layer);
+
+/* Recompose everything, e.g. after the background changed */
+void sp_compositor_damage_all(struct sp_compositor *comp);
+
+int sp_compositor_compose(struct sp_compositor *comp);
+
+/* Name of the blend kernel in use, SP_COMPOSE_IMPL=<name> forces one */
+const char *sp_compositor_impl(void);
+
+#endif /* __COMPOSITOR_H_INCLUDED__ */
@@ -0,0 +1,132 @@
+/*
+ * Moves a small rect across the scanout of the first lit CRTC and flushes
+ * each frame with DIRTYFB, once with only the damaged rects and once with
+ * the whole buffer, reporting flush time and bytes flagged dirty per frame.
+ * Drivers that copy on dirty (udl, virtio-gpu, ...) show the difference in
+ * time; the byte counts show what a damage-aware driver has to copy.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+#include "bo.h"
+#include "dev.h"
+#include "modeset.h"
+
+#define RECT_SIZE 64
+#define FRAMES 600
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t dirty_bytes(struct sp_bo *bo)
+{
+	uint64_t bytes = 0;
+	int i;
+
+	for (i = 0; i < bo->num_damage; i++)
+		bytes += (uint64_t)(bo->damage[i].x2 - bo->damage[i].x1) *
+			(bo->damage[i].y2 - bo->damage[i].y1) * bo->bpp / 8;
+	return bytes;
+}
+
+static int run(struct sp_bo *bo, int full, double *secs, uint64_t *bytes)
+{
+	uint32_t x = 0, y = 0, px = 0, py = 0;
+	int i, ret;
+	double start;
+
+	fill_bo(bo, 0xFF, 0x20, 0x20, 0x20);
+	ret = sp_bo_flush_damage(bo);
+	if (ret)
+		return ret;
+
+	*secs = 0;
+	*bytes = 0;
+	for (i = 0; i < FRAMES; i++) {
+		x = (x + 7) % (bo->width - RECT_SIZE);
+		y = (y + 3) % (bo->height - RECT_SIZE);
+
+		draw_rect(bo, px, py, RECT_SIZE, RECT_SIZE, 0xFF, 0x20, 0x20,
+			0x20);
+		draw_rect(bo, x, y, RECT_SIZE, RECT_SIZE, 0xFF, 0xFF, 0x00,
+			0x00);
+		px = x;
+		py = y;
+
+		if (full)
+			sp_bo_add_damage(bo, 0, 0, bo->width, bo->height);
+		*bytes += dirty_bytes(bo);
+
+		start = now();
+		ret = sp_bo_flush_damage(bo);
+		*secs += now() - start;
+		if (ret)
+			return ret;
+	}
+	*secs /= FRAMES;
+	*bytes /= FRAMES;
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct sp_dev *dev;
+	struct sp_bo *bo = NULL;
+	double damage_secs, full_secs;
+	uint64_t damage_bytes, full_bytes;
+	int i, ret;
+
+	dev = create_sp_dev();
+	if (!dev) {
+		printf("Failed to create sp_dev\n");
+		return -1;
+	}
+
+	ret = initialize_screens(dev);
+	if (ret) {
+		printf("Failed to initialize screens\n");
+		goto out;
+	}
+
+	for (i = 0; !bo && i < dev->num_crtcs; i++)
+		bo = dev->crtcs[i].scanout;
+	if (!bo || bo->width <= RECT_SIZE || bo->height <= RECT_SIZE) {
+		printf("No usable scanout\n");
+		ret = -1;
+		goto out;
+	}
+
+	printf("%ux%u scanout, %dx%d rect, %d frames\n", bo->width,
+		bo->height, RECT_SIZE, RECT_SIZE, FRAMES);
+
+	ret = run(bo, 0, &damage_secs, &damage_bytes);
+	if (!ret)
+		ret = run(bo, 1, &full_secs, &full_bytes);
+	if (ret) {
+		printf("Failed to flush damage ret=%d\n", ret);
+		goto out;
+	}
+
+	printf("damage clips: %8.1f us/frame %10llu bytes/frame\n",
+		damage_secs * 1e6, (unsigned long long)damage_bytes);
+	printf("full buffer:  %8.1f us/frame %10llu bytes/frame\n",
+		full_secs * 1e6, (unsigned long long)full_bytes);
+	printf("reduction:    %8.1fx time %9.1fx bytes\n",
+		damage_secs > 0 ? full_secs / damage_secs : 0,
+		damage_bytes ? (double)full_bytes / damage_bytes : 0);
+
+out:
+	destroy_sp_dev(dev);
+	return ret;
+}
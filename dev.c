@@ -1,106 +1,756 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <limits.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <time.h>
 #include <string.h>
 #include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include <dirent.h>
 
 #include <drm.h>
 #include <drm_fourcc.h>
+#include <gbm.h>
 #include <errno.h>
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 
 #include "bo.h"
 #include "dev.h"
+#include "fake.h"
 #include "modeset.h"
+#include "snapshot.h"
 
-#ifdef USE_ATOMIC_API
-static uint32_t get_prop_id(struct sp_dev *dev,
-			drmModeObjectPropertiesPtr props, const char *name)
+/* FNV-1a */
+static uint32_t hash_name(const char *name)
 {
+	uint32_t h = 2166136261u;
+
+	while (*name)
+		h = (h ^ (uint8_t)*name++) * 16777619u;
+	return h;
+}
+
+struct sp_props *sp_props_alloc(uint32_t object_id, uint32_t object_type,
+		int count)
+{
+	struct sp_props *props;
+	uint32_t size;
+
+	props = calloc(1, sizeof(*props));
+	if (!props)
+		return NULL;
+	props->object_id = object_id;
+	props->object_type = object_type;
+	props->max_count = count;
+
+	/* At most half full */
+	for (size = 8; size < (uint32_t)count * 2; size <<= 1)
+		;
+	props->mask = size - 1;
+	props->slots = malloc(size * sizeof(*props->slots));
+	props->props = calloc(count ? count : 1, sizeof(*props->props));
+	if (!props->slots || !props->props) {
+		sp_props_free(props);
+		return NULL;
+	}
+	memset(props->slots, -1, size * sizeof(*props->slots));
+	return props;
+}
+
+int sp_props_add(struct sp_props *props, const struct sp_prop *prop)
+{
+	struct sp_prop *p;
+	uint32_t h;
+
+	if (props->count == props->max_count)
+		return -ENOSPC;
+
+	p = &props->props[props->count];
+	*p = *prop;
+	p->name[sizeof(p->name) - 1] = '\0';
+	p->values = NULL;
+	p->enums = NULL;
+	p->count_values = 0;
+	p->count_enums = 0;
+
+	if (prop->count_values) {
+		p->values = malloc(prop->count_values * sizeof(*p->values));
+		if (!p->values)
+			return -ENOMEM;
+		memcpy(p->values, prop->values,
+			prop->count_values * sizeof(*p->values));
+		p->count_values = prop->count_values;
+	}
+	if (prop->count_enums) {
+		p->enums = malloc(prop->count_enums * sizeof(*p->enums));
+		if (!p->enums) {
+			free(p->values);
+			return -ENOMEM;
+		}
+		memcpy(p->enums, prop->enums,
+			prop->count_enums * sizeof(*p->enums));
+		p->count_enums = prop->count_enums;
+	}
+
+	for (h = hash_name(p->name); props->slots[h & props->mask] >= 0; h++)
+		;
+	props->slots[h & props->mask] = props->count++;
+	return 0;
+}
+
+static struct sp_props *drm_get_props(struct sp_dev *dev, uint32_t object_id,
+		uint32_t object_type)
+{
+	drmModeObjectPropertiesPtr op;
 	drmModePropertyPtr p;
-	uint32_t i, prop_id = 0; /* Property ID should always be > 0 */
+	struct sp_props *props;
+	struct sp_prop prop;
+	uint32_t i;
+	int ret;
+
+	op = drmModeObjectGetProperties(dev->fd, object_id, object_type);
+	dev->stats.ioctls++;
+	if (!op) {
+		printf("failed to get properties of object %u\n", object_id);
+		return NULL;
+	}
+
+	props = sp_props_alloc(object_id, object_type, op->count_props);
+	if (!props)
+		goto err;
 
-	for (i = 0; !prop_id && i < props->count_props; i++) {
-		p = drmModeGetProperty(dev->fd, props->props[i]);
-		if (!strcmp(p->name, name))
-			prop_id = p->prop_id;
+	for (i = 0; i < op->count_props; i++) {
+		p = drmModeGetProperty(dev->fd, op->props[i]);
+		dev->stats.ioctls++;
+		if (!p) {
+			printf("failed to get property %u\n", op->props[i]);
+			goto err;
+		}
+		memset(&prop, 0, sizeof(prop));
+		prop.id = p->prop_id;
+		prop.flags = p->flags;
+		memcpy(prop.name, p->name, sizeof(prop.name));
+		prop.value = op->prop_values[i];
+		prop.count_values = p->count_values;
+		prop.values = p->values;
+		prop.count_enums = p->count_enums;
+		prop.enums = p->enums;
+		ret = sp_props_add(props, &prop);
 		drmModeFreeProperty(p);
+		if (ret)
+			goto err;
 	}
-	if (!prop_id)
-		printf("Could not find %s property\n", name);
-	return prop_id;
+
+	drmModeFreeObjectProperties(op);
+	return props;
+
+err:
+	drmModeFreeObjectProperties(op);
+	sp_props_free(props);
+	return NULL;
 }
-#endif
 
-static int get_supported_format(struct sp_plane *plane, uint32_t *format)
+struct sp_props *sp_props_get(struct sp_dev *dev, uint32_t object_id,
+		uint32_t object_type)
 {
-	uint32_t i;
+	return dev->ops->get_props(dev, object_id, object_type);
+}
 
-	for (i = 0; i < plane->plane->count_formats; i++) {
-		if (plane->plane->formats[i] == DRM_FORMAT_XRGB8888 ||
-		    plane->plane->formats[i] == DRM_FORMAT_ARGB8888 ||
-		    plane->plane->formats[i] == DRM_FORMAT_RGBA8888) {
-			*format = plane->plane->formats[i];
+static int drm_ioctl(struct sp_dev *dev, unsigned long request, void *arg)
+{
+	return drmIoctl(dev->fd, request, arg);
+}
+
+static int drm_add_fb2(struct sp_dev *dev, uint32_t width, uint32_t height,
+		uint32_t format, const uint32_t handles[4],
+		const uint32_t pitches[4], const uint32_t offsets[4],
+		const uint64_t modifiers[4], uint32_t *fb_id, uint32_t flags)
+{
+	if (modifiers)
+		return drmModeAddFB2WithModifiers(dev->fd, width, height,
+				format, handles, pitches, offsets, modifiers,
+				fb_id, flags);
+	return drmModeAddFB2(dev->fd, width, height, format, handles, pitches,
+			offsets, fb_id, flags);
+}
+
+static int drm_rm_fb(struct sp_dev *dev, uint32_t fb_id)
+{
+	return drmModeRmFB(dev->fd, fb_id);
+}
+
+static int drm_dirty_fb(struct sp_dev *dev, uint32_t fb_id,
+		drmModeClipPtr clips, uint32_t num_clips)
+{
+	return drmModeDirtyFB(dev->fd, fb_id, clips, num_clips);
+}
+
+static int drm_set_crtc(struct sp_dev *dev, uint32_t crtc_id, uint32_t fb_id,
+		uint32_t x, uint32_t y, uint32_t *connectors, int count,
+		drmModeModeInfoPtr mode)
+{
+	return drmModeSetCrtc(dev->fd, crtc_id, fb_id, x, y, connectors, count,
+			mode);
+}
+
+static int drm_set_plane(struct sp_dev *dev, uint32_t plane_id,
+		uint32_t crtc_id, uint32_t fb_id, uint32_t flags,
+		int32_t crtc_x, int32_t crtc_y, uint32_t crtc_w,
+		uint32_t crtc_h, uint32_t src_x, uint32_t src_y,
+		uint32_t src_w, uint32_t src_h)
+{
+	return drmModeSetPlane(dev->fd, plane_id, crtc_id, fb_id, flags,
+			crtc_x, crtc_y, crtc_w, crtc_h, src_x, src_y, src_w,
+			src_h);
+}
+
+static drmModePlanePtr drm_get_plane(struct sp_dev *dev, uint32_t plane_id)
+{
+	return drmModeGetPlane(dev->fd, plane_id);
+}
+
+static int drm_create_blob(struct sp_dev *dev, const void *data, size_t size,
+		uint32_t *blob_id)
+{
+	return drmModeCreatePropertyBlob(dev->fd, data, size, blob_id);
+}
+
+static int drm_destroy_blob(struct sp_dev *dev, uint32_t blob_id)
+{
+	return drmModeDestroyPropertyBlob(dev->fd, blob_id);
+}
+
+static drmModePropertyBlobPtr drm_get_blob(struct sp_dev *dev,
+		uint32_t blob_id)
+{
+	dev->stats.ioctls++;
+	return drmModeGetPropertyBlob(dev->fd, blob_id);
+}
+
+static drmModeResPtr drm_get_resources(struct sp_dev *dev)
+{
+	return drmModeGetResources(dev->fd);
+}
+
+static drmModeConnectorPtr drm_get_connector(struct sp_dev *dev,
+		uint32_t connector_id, int probe)
+{
+	if (probe)
+		return drmModeGetConnector(dev->fd, connector_id);
+	return drmModeGetConnectorCurrent(dev->fd, connector_id);
+}
+
+static int drm_commit(struct sp_dev *dev, const struct sp_atomic *req,
+		uint32_t flags, void *user_data)
+{
+	drmModePropertySetPtr pset;
+	int i, ret = 0;
+
+	if (!dev->atomic)
+		return -ENOSYS;
+	pset = drmModePropertySetAlloc();
+	if (!pset)
+		return -ENOMEM;
+	for (i = 0; i < req->count && !ret; i++)
+		ret = drmModePropertySetAdd(pset, req->props[i].object_id,
+				req->props[i].property_id,
+				req->props[i].value);
+	if (!ret)
+		ret = drmModePropertySetCommit(dev->fd, flags, user_data, pset);
+	drmModePropertySetFree(pset);
+	return ret;
+}
+
+static int drm_page_flip(struct sp_dev *dev, uint32_t crtc_id, uint32_t fb_id,
+		uint32_t flags, void *user_data)
+{
+	return drmModePageFlip(dev->fd, crtc_id, fb_id, flags, user_data);
+}
+
+static int drm_handle_event(struct sp_dev *dev, drmEventContextPtr ctx)
+{
+	return drmHandleEvent(dev->fd, ctx);
+}
+
+const struct sp_kms_ops sp_drm_kms_ops = {
+	.ioctl = drm_ioctl,
+	.add_fb2 = drm_add_fb2,
+	.rm_fb = drm_rm_fb,
+	.dirty_fb = drm_dirty_fb,
+	.set_crtc = drm_set_crtc,
+	.set_plane = drm_set_plane,
+	.get_plane = drm_get_plane,
+	.create_blob = drm_create_blob,
+	.destroy_blob = drm_destroy_blob,
+	.get_blob = drm_get_blob,
+	.get_props = drm_get_props,
+	.get_resources = drm_get_resources,
+	.get_connector = drm_get_connector,
+	.commit = drm_commit,
+	.page_flip = drm_page_flip,
+	.handle_event = drm_handle_event,
+};
+
+struct sp_atomic *sp_atomic_alloc(void)
+{
+	return calloc(1, sizeof(struct sp_atomic));
+}
+
+void sp_atomic_free(struct sp_atomic *req)
+{
+	if (!req)
+		return;
+	free(req->props);
+	free(req);
+}
+
+void sp_atomic_reset(struct sp_atomic *req)
+{
+	req->count = 0;
+}
+
+int sp_atomic_add(struct sp_atomic *req, uint32_t object_id,
+		uint32_t property_id, uint64_t value)
+{
+	struct sp_atomic_prop *props;
+
+	if (!property_id)
+		return -EINVAL;
+
+	if (req->count == req->max_count) {
+		int max = req->max_count ? req->max_count * 2 : 32;
+
+		props = realloc(req->props, max * sizeof(*props));
+		if (!props)
+			return -ENOMEM;
+		req->props = props;
+		req->max_count = max;
+	}
+	props = &req->props[req->count++];
+	props->object_id = object_id;
+	props->property_id = property_id;
+	props->value = value;
+	return 0;
+}
+
+int sp_atomic_commit(struct sp_dev *dev, const struct sp_atomic *req,
+		uint32_t flags, void *user_data)
+{
+	dev->stats.ioctls++;
+	return dev->ops->commit(dev, req, flags, user_data);
+}
+
+void sp_props_free(struct sp_props *props)
+{
+	int i;
+
+	if (!props)
+		return;
+	for (i = 0; props->props && i < props->count; i++) {
+		free(props->props[i].values);
+		free(props->props[i].enums);
+	}
+	free(props->props);
+	free(props->slots);
+	free(props);
+}
+
+const struct sp_prop *sp_props_find(const struct sp_props *props,
+		const char *name)
+{
+	uint32_t h;
+	int slot;
+
+	for (h = hash_name(name); (slot = props->slots[h & props->mask]) >= 0;
+	     h++) {
+		if (!strcmp(props->props[slot].name, name))
+			return &props->props[slot];
+	}
+	return NULL;
+}
+
+uint32_t sp_props_id(const struct sp_props *props, const char *name)
+{
+	const struct sp_prop *prop = sp_props_find(props, name);
+
+	return prop ? prop->id : 0; /* Property ID should always be > 0 */
+}
+
+int sp_prop_enum_value(const struct sp_prop *prop, const char *name,
+		uint64_t *value)
+{
+	int i;
+
+	for (i = 0; i < prop->count_enums; i++) {
+		if (!strcmp(prop->enums[i].name, name)) {
+			*value = prop->enums[i].value;
 			return 0;
 		}
 	}
-	printf("No suitable formats found!\n");
 	return -ENOENT;
 }
 
-static struct sp_dev *create_sp_dev_from_name(char *name)
+struct sp_props *sp_plane_props(struct sp_plane *plane)
 {
-	struct sp_dev *dev;
-	int ret, fd, i, j;
-	drmModeRes *r = NULL;
-	drmModePlaneRes *pr = NULL;
-	char devPath[PATH_MAX];
+	if (!plane->props)
+		plane->props = sp_props_get(plane->dev, plane->plane->plane_id,
+				DRM_MODE_OBJECT_PLANE);
+	return plane->props;
+}
 
-	strcpy(devPath, "/dev/dri/");
-	strcat(devPath, name);
-	fd = open(devPath, O_RDWR);
-	if (fd < 0) {
-		printf("failed to open card0\n");
-		return NULL;
+struct sp_props *sp_crtc_props(struct sp_dev *dev, struct sp_crtc *crtc)
+{
+	if (!crtc->props)
+		crtc->props = sp_props_get(dev, crtc->crtc->crtc_id,
+				DRM_MODE_OBJECT_CRTC);
+	return crtc->props;
+}
+
+struct sp_props *sp_connector_props(struct sp_dev *dev, int index)
+{
+	if (!dev->connector_props[index])
+		dev->connector_props[index] = sp_props_get(dev,
+				dev->connectors[index]->connector_id,
+				DRM_MODE_OBJECT_CONNECTOR);
+	return dev->connector_props[index];
+}
+
+static const struct {
+	const char *name;
+	size_t offset;
+} plane_pids[] = {
+	{ "CRTC_ID", offsetof(struct sp_plane, crtc_pid) },
+	{ "FB_ID", offsetof(struct sp_plane, fb_pid) },
+	{ "CRTC_X", offsetof(struct sp_plane, crtc_x_pid) },
+	{ "CRTC_Y", offsetof(struct sp_plane, crtc_y_pid) },
+	{ "CRTC_W", offsetof(struct sp_plane, crtc_w_pid) },
+	{ "CRTC_H", offsetof(struct sp_plane, crtc_h_pid) },
+	{ "SRC_X", offsetof(struct sp_plane, src_x_pid) },
+	{ "SRC_Y", offsetof(struct sp_plane, src_y_pid) },
+	{ "SRC_W", offsetof(struct sp_plane, src_w_pid) },
+	{ "SRC_H", offsetof(struct sp_plane, src_h_pid) },
+};
+
+int sp_plane_pids(struct sp_plane *plane)
+{
+	struct sp_props *props;
+	uint32_t *pid;
+	unsigned i;
+
+	if (plane->fb_pid)
+		return 0;
+
+	props = sp_plane_props(plane);
+	if (!props)
+		return -ENODEV;
+
+	for (i = 0; i < sizeof(plane_pids) / sizeof(plane_pids[0]); i++) {
+		pid = (uint32_t *)((char *)plane + plane_pids[i].offset);
+		*pid = sp_props_id(props, plane_pids[i].name);
+		if (!*pid) {
+			printf("Could not find %s property\n",
+				plane_pids[i].name);
+			return -ENOENT;
+		}
 	}
+	/* Optional, older kernels don't take damage hints */
+	plane->damage_clips_pid = sp_props_id(props, "FB_DAMAGE_CLIPS");
+	/* Drivers only have these where the hardware does */
+	plane->zpos_pid = sp_props_id(props, "zpos");
+	plane->alpha_pid = sp_props_id(props, "alpha");
+	return 0;
+}
 
-	dev = calloc(1, sizeof(*dev));
-	if (!dev) {
-		printf("failed to allocate dev\n");
+/* Takes the first free plane in both masks, b may be NULL */
+static struct sp_plane *claim_masked(struct sp_dev *dev, const uint64_t *a,
+		const uint64_t *b, uint64_t *retries)
+{
+	uint64_t old, mask, avail, bit;
+	int i;
+
+	for (i = 0; i < dev->num_plane_words; i++) {
+		mask = a[i] & (b ? b[i] : ~0ull);
+		if (!mask)
+			continue;
+		old = __atomic_load_n(&dev->planes_in_use[i], __ATOMIC_RELAXED);
+		for (;;) {
+			avail = mask & ~old;
+			if (!avail)
+				break;
+			bit = avail & -avail;
+			/* On failure old is what another thread left */
+			if (__atomic_compare_exchange_n(&dev->planes_in_use[i],
+					&old, old | bit, 0, __ATOMIC_ACQUIRE,
+					__ATOMIC_RELAXED))
+				return &dev->planes[i * 64 +
+					__builtin_ctzll(bit)];
+			if (retries)
+				(*retries)++;
+		}
+	}
+	return NULL;
+}
+
+struct sp_plane *sp_plane_claim(struct sp_dev *dev, struct sp_crtc *crtc,
+		uint64_t *retries)
+{
+	return claim_masked(dev, crtc->possible_planes, NULL, retries);
+}
+
+int sp_plane_try_claim(struct sp_plane *plane)
+{
+	struct sp_dev *dev = plane->dev;
+	int index = plane - dev->planes;
+	uint64_t bit = 1ull << (index % 64);
+
+	if (__atomic_fetch_or(&dev->planes_in_use[index / 64], bit,
+			__ATOMIC_ACQUIRE) & bit)
+		return -EBUSY;
+	return 0;
+}
+
+void sp_plane_release(struct sp_plane *plane)
+{
+	struct sp_dev *dev = plane->dev;
+	int index = plane - dev->planes;
+
+	__atomic_fetch_and(&dev->planes_in_use[index / 64],
+		~(1ull << (index % 64)), __ATOMIC_RELEASE);
+}
+
+int sp_plane_in_use(const struct sp_plane *plane)
+{
+	struct sp_dev *dev = plane->dev;
+	int index;
+
+	/* Enumeration may have failed before the planes were set up */
+	if (!dev || !dev->planes_in_use)
+		return 0;
+	index = plane - dev->planes;
+	return !!(__atomic_load_n(&dev->planes_in_use[index / 64],
+			__ATOMIC_ACQUIRE) & (1ull << (index % 64)));
+}
+
+static uint32_t hash_u64(uint64_t key)
+{
+	return (key * 0x9e3779b97f4a7c15ull) >> 32;
+}
+
+int sp_dev_format_index(const struct sp_dev *dev, uint32_t format)
+{
+	uint32_t h;
+	int i;
+
+	if (!dev->format_slots)
+		return -1;
+	for (h = hash_u64(format);; h++) {
+		i = dev->format_slots[h & dev->format_mask];
+		if (i < 0 || dev->formats[i] == format)
+			return i;
+	}
+}
+
+int sp_dev_modifier_index(const struct sp_dev *dev, uint64_t modifier)
+{
+	uint32_t h;
+	int i;
+
+	if (!dev->modifier_slots)
+		return -1;
+	for (h = hash_u64(modifier);; h++) {
+		i = dev->modifier_slots[h & dev->modifier_mask];
+		if (i < 0 || dev->modifiers[i] == modifier)
+			return i;
+	}
+}
+
+const uint64_t *sp_dev_format_planes(const struct sp_dev *dev,
+		uint32_t format, uint64_t modifier)
+{
+	int f, m = dev->num_modifiers;
+
+	f = sp_dev_format_index(dev, format);
+	if (modifier != DRM_FORMAT_MOD_INVALID)
+		m = sp_dev_modifier_index(dev, modifier);
+	if (f < 0 || m < 0)
 		return NULL;
+	return &dev->format_planes[(f * (dev->num_modifiers + 1) + m) *
+		dev->num_plane_words];
+}
+
+int sp_plane_supports(const struct sp_plane *plane, uint32_t format,
+		uint64_t modifier)
+{
+	int f, m;
+
+	f = sp_dev_format_index(plane->dev, format);
+	if (f < 0)
+		return 0;
+	if (modifier == DRM_FORMAT_MOD_INVALID)
+		return !!plane->format_modifiers[f];
+	m = sp_dev_modifier_index(plane->dev, modifier);
+	return m >= 0 && (plane->format_modifiers[f] & (1ull << m));
+}
+
+struct sp_plane *sp_plane_claim_for(struct sp_dev *dev, struct sp_crtc *crtc,
+		int type, uint32_t format, uint64_t modifier,
+		uint64_t *retries)
+{
+	const uint64_t *planes = sp_dev_format_planes(dev, format, modifier);
+
+	if (!planes || type >= SP_NUM_PLANE_TYPES)
+		return NULL;
+	return claim_masked(dev, type < 0 ? crtc->possible_planes :
+			crtc->type_planes[type], planes, retries);
+}
+
+/*
+ * Guesses how dumb buffer mappings are cached. Drivers that ask for a
+ * shadow buffer do so because their mappings are slow to read (WC or
+ * uncached), and the shmem based virtual and USB drivers hand out plain
+ * cached pages. SP_BO_CACHING=cached|wc|uncached overrides the guess.
+ */
+static int get_dumb_caching(int fd)
+{
+	static const char * const cached_drivers[] = {
+		"vkms", "udl", "gud", "evdi", "virtio_gpu",
+	};
+	const char *env = getenv("SP_BO_CACHING");
+	int caching = SP_BO_CACHING_UNKNOWN;
+	drmVersionPtr version;
+	uint64_t shadow = 0;
+	unsigned i;
+
+	if (env) {
+		if (!strcmp(env, "cached"))
+			return SP_BO_CACHING_CACHED;
+		if (!strcmp(env, "wc"))
+			return SP_BO_CACHING_WC;
+		if (!strcmp(env, "uncached"))
+			return SP_BO_CACHING_UNCACHED;
 	}
 
-	dev->fd = fd;
+	if (!drmGetCap(fd, DRM_CAP_DUMB_PREFER_SHADOW, &shadow) && shadow)
+		return SP_BO_CACHING_WC;
 
-#ifdef SET_CLIENT_CAP_UNIVERSAL_PLANES
-	ret = drmSetClientCap(dev->fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1);
-	if (ret) {
-		printf("failed to set client cap\n");
-		goto err;
+	version = drmGetVersion(fd);
+	if (!version)
+		return caching;
+	for (i = 0; i < sizeof(cached_drivers) / sizeof(cached_drivers[0]);
+	     i++) {
+		if (!strcmp(version->name, cached_drivers[i]))
+			caching = SP_BO_CACHING_CACHED;
 	}
-#endif
+	drmFreeVersion(version);
+	return caching;
+}
+
+/* A fourcc such as XR30 from the environment that draw_rect() can fill */
+static uint32_t get_env_format(const char *name, uint32_t format)
+{
+	const char *env = getenv(name);
+	uint32_t f;
+
+	if (!env)
+		return format;
+
+	f = strlen(env) == 4 ? fourcc_code(env[0], env[1], env[2], env[3]) : 0;
+	if (!f || !sp_format_bpp(f)) {
+		printf("ignoring unsupported %s=%s\n", name, env);
+		return format;
+	}
+	return f;
+}
+
+/*
+ * Formats draw_rect() can fill, best first. The 8888 formats are equally good
+ * and keep the order the plane lists them in. SP_PLANE_FORMAT=<fourcc> (e.g.
+ * XR30) moves a format to the front when a test needs the extra precision,
+ * an RGB565 scanout format does the same for RGB565.
+ */
+static const uint32_t plane_formats[] = {
+	DRM_FORMAT_XRGB8888,
+	DRM_FORMAT_ARGB8888,
+	DRM_FORMAT_RGBA8888,
+	DRM_FORMAT_ABGR8888,
+	DRM_FORMAT_XRGB2101010,
+	DRM_FORMAT_XBGR2101010,
+	DRM_FORMAT_ABGR16161616F,
+	DRM_FORMAT_BGR888,
+	DRM_FORMAT_RGB565,
+};
+
+static int get_format_rank(uint32_t format, uint32_t preferred)
+{
+	uint32_t i;
+
+	if (format == preferred)
+		return -1;
+	for (i = 0; i < sizeof(plane_formats) / sizeof(plane_formats[0]); i++) {
+		if (plane_formats[i] != format)
+			continue;
+		return i < 4 ? 0 : i;
+	}
+	return INT_MAX;
+}
+
+static int get_supported_format(struct sp_plane *plane, uint32_t *format)
+{
+	uint32_t i, preferred = 0;
+	int rank, best = INT_MAX;
+
+	if (plane->dev->scanout_format == DRM_FORMAT_RGB565)
+		preferred = DRM_FORMAT_RGB565;
+	preferred = get_env_format("SP_PLANE_FORMAT", preferred);
+
+	for (i = 0; i < plane->plane->count_formats; i++) {
+		rank = get_format_rank(plane->plane->formats[i], preferred);
+		if (rank >= best || !sp_format_bpp(plane->plane->formats[i]))
+			continue;
+		best = rank;
+		*format = plane->plane->formats[i];
+	}
+	if (best != INT_MAX)
+		return 0;
+
+	printf("No suitable formats found!\n");
+	return -ENOENT;
+}
+
+/* The objects behind dev->connectors, encoders, crtcs and planes */
+static int enumerate_sp_dev(struct sp_dev *dev)
+{
+	drmModeRes *r = NULL;
+	drmModePlaneRes *pr = NULL;
+	int i, ret = -1;
 
 	r = drmModeGetResources(dev->fd);
+	dev->stats.ioctls++;
 	if (!r) {
 		printf("failed to get r\n");
-		goto err;
+		goto out;
 	}
 
 	dev->num_connectors = r->count_connectors;
 	dev->connectors = calloc(dev->num_connectors, sizeof(*dev->connectors));
-	if (!dev->connectors) {
+	dev->connector_props = calloc(dev->num_connectors,
+			sizeof(*dev->connector_props));
+	if (!dev->connectors || !dev->connector_props) {
 		printf("failed to allocate connectors\n");
-		goto err;
+		goto out;
 	}
 	for (i = 0; i < dev->num_connectors; i++) {
 		dev->connectors[i] = drmModeGetConnector(dev->fd,
 					r->connectors[i]);
+		dev->stats.ioctls++;
 		if (!dev->connectors[i]) {
 			printf("failed to get connector %d\n", i);
-			goto err;
+			goto out;
 		}
 	}
 
@@ -108,13 +758,14 @@ static struct sp_dev *create_sp_dev_from_name(char *name)
 	dev->encoders = calloc(dev->num_encoders, sizeof(*dev->encoders));
 	if (!dev->encoders) {
 		printf("failed to allocate encoders\n");
-		goto err;
+		goto out;
 	}
 	for (i = 0; i < dev->num_encoders; i++) {
 		dev->encoders[i] = drmModeGetEncoder(dev->fd, r->encoders[i]);
+		dev->stats.ioctls++;
 		if (!dev->encoders[i]) {
 			printf("failed to get encoder %d\n", i);
-			goto err;
+			goto out;
 		}
 	}
 
@@ -122,168 +773,675 @@ static struct sp_dev *create_sp_dev_from_name(char *name)
 	dev->crtcs = calloc(dev->num_crtcs, sizeof(struct sp_crtc));
 	if (!dev->crtcs) {
 		printf("failed to allocate crtcs\n");
-		goto err;
+		goto out;
 	}
 	for (i = 0; i < dev->num_crtcs; i++) {
 		dev->crtcs[i].crtc = drmModeGetCrtc(dev->fd, r->crtcs[i]);
+		dev->stats.ioctls++;
 		if (!dev->crtcs[i].crtc) {
 			printf("failed to get crtc %d\n", i);
-			goto err;
+			goto out;
 		}
-		dev->crtcs[i].scanout = NULL;
-		dev->crtcs[i].pipe = i;
-		dev->crtcs[i].num_planes = 0;
 	}
 
 	pr = drmModeGetPlaneResources(dev->fd);
+	dev->stats.ioctls++;
 	if (!pr) {
 		printf("failed to get plane resources\n");
-		goto err;
+		goto out;
 	}
 	dev->num_planes = pr->count_planes;
 	dev->planes = calloc(dev->num_planes, sizeof(struct sp_plane));
+	if (!dev->planes) {
+		printf("failed to allocate planes\n");
+		goto out;
+	}
+	for(i = 0; i < dev->num_planes; i++) {
+		dev->planes[i].plane = drmModeGetPlane(dev->fd, pr->planes[i]);
+		dev->stats.ioctls++;
+		if (!dev->planes[i].plane) {
+			printf("failed to get plane %d\n", i);
+			goto out;
+		}
+	}
+	ret = 0;
+
+out:
+	if (pr)
+		drmModeFreePlaneResources(pr);
+	if (r)
+		drmModeFreeResources(r);
+	return ret;
+}
+
+static int add_format(struct sp_dev *dev, uint32_t format)
+{
+	uint32_t h;
+	int *slot;
+
+	for (h = hash_u64(format);; h++) {
+		slot = &dev->format_slots[h & dev->format_mask];
+		if (*slot >= 0 && dev->formats[*slot] == format)
+			return *slot;
+		if (*slot < 0) {
+			dev->formats[dev->num_formats] = format;
+			*slot = dev->num_formats++;
+			return *slot;
+		}
+	}
+}
+
+/* -1 once 64 modifiers are known, they are bits of a uint64_t */
+static int add_modifier(struct sp_dev *dev, uint64_t modifier)
+{
+	uint32_t h;
+	int *slot;
+
+	for (h = hash_u64(modifier);; h++) {
+		slot = &dev->modifier_slots[h & dev->modifier_mask];
+		if (*slot >= 0 && dev->modifiers[*slot] == modifier)
+			return *slot;
+		if (*slot >= 0)
+			continue;
+		if (dev->num_modifiers == 64)
+			return -1;
+		dev->modifiers[dev->num_modifiers] = modifier;
+		*slot = dev->num_modifiers++;
+		return *slot;
+	}
+}
+
+/* The plane's IN_FORMATS blob, NULL without one that makes sense */
+static drmModePropertyBlobPtr get_in_formats(struct sp_plane *plane)
+{
+	const struct drm_format_modifier_blob *h;
+	struct sp_props *props = sp_plane_props(plane);
+	struct sp_dev *dev = plane->dev;
+	const struct sp_prop *prop;
+	drmModePropertyBlobPtr blob;
+
+	prop = props ? sp_props_find(props, "IN_FORMATS") : NULL;
+	if (!prop || !prop->value || !dev->ops->get_blob)
+		return NULL;
+	blob = dev->ops->get_blob(dev, prop->value);
+	if (!blob)
+		return NULL;
+	h = blob->data;
+	if (blob->length < sizeof(*h) || !h->version ||
+	    h->formats_offset + (uint64_t)h->count_formats *
+	    sizeof(uint32_t) > blob->length ||
+	    h->modifiers_offset + (uint64_t)h->count_modifiers *
+	    sizeof(struct drm_format_modifier) > blob->length) {
+		printf("ignoring bad IN_FORMATS of plane %u\n",
+			plane->plane->plane_id);
+		drmModeFreePropertyBlob(blob);
+		return NULL;
+	}
+	return blob;
+}
+
+/* Sets the plane's bits for the formats and modifiers blob pairs up */
+static void parse_in_formats(struct sp_plane *plane,
+		drmModePropertyBlobPtr blob)
+{
+	const struct drm_format_modifier_blob *h = blob->data;
+	const struct drm_format_modifier *mods;
+	const uint32_t *formats;
+	struct sp_dev *dev = plane->dev;
+	uint64_t bits;
+	uint32_t i, n;
+	int f, m;
+
+	formats = (const uint32_t *)((const char *)h + h->formats_offset);
+	mods = (const struct drm_format_modifier *)((const char *)h +
+			h->modifiers_offset);
+	for (i = 0; i < h->count_modifiers; i++) {
+		m = sp_dev_modifier_index(dev, mods[i].modifier);
+		if (m < 0)
+			continue;
+		/* Bit n stands for formats[offset + n] */
+		for (bits = mods[i].formats; bits; bits &= bits - 1) {
+			n = mods[i].offset + __builtin_ctzll(bits);
+			if (n >= h->count_formats)
+				break;
+			f = sp_dev_format_index(dev, formats[n]);
+			plane->format_modifiers[f] |= 1ull << m;
+		}
+	}
+}
+
+/*
+ * The format and modifier tables in struct sp_dev and sp_plane. Planes
+ * without IN_FORMATS, and all of them in replayed snapshots, which don't
+ * keep blobs, take their formats LINEAR.
+ */
+static int init_plane_formats(struct sp_dev *dev)
+{
+	const struct drm_format_modifier_blob *h;
+	const struct drm_format_modifier *mods;
+	drmModePropertyBlobPtr *blobs;
+	int i, f, m, w, words, max = 0, ret = -ENOMEM;
+	uint32_t j, size = 16;
+	uint64_t bits, *planes;
+	const uint32_t *formats;
+
+	blobs = calloc(dev->num_planes + 1, sizeof(*blobs));
+	if (!blobs)
+		return -ENOMEM;
+	for (i = 0; i < dev->num_planes; i++) {
+		blobs[i] = get_in_formats(&dev->planes[i]);
+		max += dev->planes[i].plane->count_formats;
+		if (blobs[i]) {
+			h = blobs[i]->data;
+			max += h->count_formats;
+		}
+	}
+	while (size < 2 * max)
+		size *= 2;
+
+	dev->formats = malloc((max + 1) * sizeof(*dev->formats));
+	dev->format_slots = malloc(size * sizeof(*dev->format_slots));
+	dev->modifiers = malloc(64 * sizeof(*dev->modifiers));
+	dev->modifier_slots = malloc(128 * sizeof(*dev->modifier_slots));
+	if (!dev->formats || !dev->format_slots || !dev->modifiers ||
+	    !dev->modifier_slots)
+		goto out;
+	memset(dev->format_slots, 0xff, size * sizeof(*dev->format_slots));
+	memset(dev->modifier_slots, 0xff, 128 * sizeof(*dev->modifier_slots));
+	dev->format_mask = size - 1;
+	dev->modifier_mask = 127;
+
+	add_modifier(dev, DRM_FORMAT_MOD_LINEAR);
+	for (i = 0; i < dev->num_planes; i++) {
+		drmModePlanePtr p = dev->planes[i].plane;
+
+		for (j = 0; j < p->count_formats; j++)
+			add_format(dev, p->formats[j]);
+		if (!blobs[i])
+			continue;
+		h = blobs[i]->data;
+		formats = (const uint32_t *)((const char *)h +
+				h->formats_offset);
+		mods = (const struct drm_format_modifier *)((const char *)h +
+				h->modifiers_offset);
+		for (j = 0; j < h->count_formats; j++)
+			add_format(dev, formats[j]);
+		for (j = 0; j < h->count_modifiers; j++) {
+			if (add_modifier(dev, mods[j].modifier) < 0)
+				printf("ignoring modifier 0x%llx of plane %u\n",
+					(unsigned long long)mods[j].modifier,
+					p->plane_id);
+		}
+	}
+
+	words = (dev->num_formats + 63) / 64;
+	for (i = 0; i < dev->num_planes; i++) {
+		struct sp_plane *plane = &dev->planes[i];
+
+		plane->format_mask = calloc(words + 1,
+				sizeof(*plane->format_mask));
+		plane->format_modifiers = calloc(dev->num_formats + 1,
+				sizeof(*plane->format_modifiers));
+		if (!plane->format_mask || !plane->format_modifiers)
+			goto out;
+		if (blobs[i]) {
+			parse_in_formats(plane, blobs[i]);
+		} else {
+			for (j = 0; j < plane->plane->count_formats; j++) {
+				f = sp_dev_format_index(dev,
+						plane->plane->formats[j]);
+				plane->format_modifiers[f] |= 1;
+			}
+		}
+		for (f = 0; f < dev->num_formats; f++) {
+			if (plane->format_modifiers[f])
+				plane->format_mask[f / 64] |= 1ull << (f % 64);
+		}
+	}
+
+	dev->format_planes = calloc((size_t)dev->num_formats *
+			(dev->num_modifiers + 1) * dev->num_plane_words + 1,
+			sizeof(*dev->format_planes));
+	if (!dev->format_planes)
+		goto out;
+	for (i = 0; i < dev->num_planes; i++) {
+		w = i / 64;
+		for (f = 0; f < dev->num_formats; f++) {
+			bits = dev->planes[i].format_modifiers[f];
+			if (!bits)
+				continue;
+			planes = &dev->format_planes[f * (dev->num_modifiers +
+					1) * dev->num_plane_words];
+			planes[dev->num_modifiers * dev->num_plane_words + w] |=
+				1ull << (i % 64);
+			for (; bits; bits &= bits - 1) {
+				m = __builtin_ctzll(bits);
+				planes[m * dev->num_plane_words + w] |=
+					1ull << (i % 64);
+			}
+		}
+	}
+	ret = 0;
+
+out:
+	for (i = 0; i < dev->num_planes; i++) {
+		if (blobs[i])
+			drmModeFreePropertyBlob(blobs[i]);
+	}
+	free(blobs);
+	return ret;
+}
+
+/* What we keep per CRTC and plane besides the kernel's view of them */
+static int init_sp_planes(struct sp_dev *dev)
+{
+	const struct sp_prop *prop;
+	struct sp_props *props;
+	int ret, i, j;
+
+	dev->num_plane_words = (dev->num_planes + 63) / 64;
+	dev->planes_in_use = calloc(dev->num_plane_words + 1,
+			sizeof(*dev->planes_in_use));
+	if (!dev->planes_in_use)
+		return -ENOMEM;
+
+	for (i = 0; i < dev->num_crtcs; i++) {
+		dev->crtcs[i].scanout = NULL;
+		dev->crtcs[i].pipe = i;
+		dev->crtcs[i].num_planes = 0;
+		dev->crtcs[i].possible_planes = calloc(dev->num_plane_words + 1,
+				sizeof(*dev->crtcs[i].possible_planes));
+		if (!dev->crtcs[i].possible_planes)
+			return -ENOMEM;
+		for (j = 0; j < SP_NUM_PLANE_TYPES; j++) {
+			dev->crtcs[i].type_planes[j] = calloc(
+					dev->num_plane_words + 1,
+					sizeof(*dev->crtcs[i].type_planes[j]));
+			if (!dev->crtcs[i].type_planes[j])
+				return -ENOMEM;
+		}
+	}
+
 	for(i = 0; i < dev->num_planes; i++) {
-		drmModeObjectPropertiesPtr props;
 		struct sp_plane *plane = &dev->planes[i];
 
 		plane->dev = dev;
-		plane->plane = drmModeGetPlane(dev->fd, pr->planes[i]);
-		if (!plane->plane) {
-			printf("failed to get plane %d\n", i);
-			goto err;
-		}
 		plane->bo = NULL;
-		plane->in_use = 0;
+
+		props = sp_plane_props(plane);
+		prop = props ? sp_props_find(props, "type") : NULL;
+		plane->type = prop && prop->value < SP_NUM_PLANE_TYPES ?
+			prop->value : DRM_PLANE_TYPE_OVERLAY;
 
 		ret = get_supported_format(plane, &plane->format);
 		if (ret) {
 			printf("failed to get supported format: %d\n", ret);
-			goto err;
+			return ret;
 		}
 
 		for (j = 0; j < dev->num_crtcs; j++) {
-			if (plane->plane->possible_crtcs & (1 << j))
-				dev->crtcs[j].num_planes++;
+			if (!(plane->plane->possible_crtcs & (1 << j)))
+				continue;
+			dev->crtcs[j].num_planes++;
+			dev->crtcs[j].possible_planes[i / 64] |=
+				1ull << (i % 64);
+			dev->crtcs[j].type_planes[plane->type][i / 64] |=
+				1ull << (i % 64);
 		}
 
-		props = drmModeObjectGetProperties(dev->fd, pr->planes[i],
-				DRM_MODE_OBJECT_PLANE);
-		if (!props) {
-			printf("failed to get plane properties\n");
-			goto err;
-		}
-#ifdef USE_ATOMIC_API
-		plane->crtc_pid = get_prop_id(dev, props, "CRTC_ID");
-		if (!plane->crtc_pid) {
-			drmModeFreeObjectProperties(props);
-			goto err;
+		if (dev->atomic) {
+			ret = sp_plane_pids(plane);
+			if (ret) {
+				printf("failed to get plane properties: %d\n",
+					ret);
+				return ret;
+			}
 		}
-		plane->fb_pid = get_prop_id(dev, props, "FB_ID");
-		if (!plane->fb_pid) {
-			drmModeFreeObjectProperties(props);
-			goto err;
-		}
-		plane->crtc_x_pid = get_prop_id(dev, props, "CRTC_X");
-		if (!plane->crtc_x_pid) {
-			drmModeFreeObjectProperties(props);
-			goto err;
-		}
-		plane->crtc_y_pid = get_prop_id(dev, props, "CRTC_Y");
-		if (!plane->crtc_y_pid) {
-			drmModeFreeObjectProperties(props);
-			goto err;
+	}
+	return init_plane_formats(dev);
+}
+
+struct sp_dev *create_sp_dev_from_path(const char *path)
+{
+	const struct sp_kms_ops *ops = &sp_drm_kms_ops;
+	const char *backend_name, *cache = NULL, *fake = NULL;
+	struct sp_fake_config config;
+	enum sp_bo_backend backend;
+	struct sp_dev *dev;
+	struct stat st;
+	int ret, fd = -1;
+
+	/*
+	 * "fake[:options]" makes a device up (see fake.h). Nodes are
+	 * character devices, snapshots regular files.
+	 */
+	if (!strncmp(path, "fake", 4) && (!path[4] || path[4] == ':')) {
+		fake = path[4] ? path + 5 : "";
+		sp_fake_default_config(&config);
+		if (sp_fake_parse_config(fake, &config)) {
+			printf("bad fake device options %s\n", fake);
+			return NULL;
 		}
-		plane->crtc_w_pid = get_prop_id(dev, props, "CRTC_W");
-		if (!plane->crtc_w_pid) {
-			drmModeFreeObjectProperties(props);
-			goto err;
+		ops = &sp_fake_kms_ops;
+	} else if (!stat(path, &st) && S_ISREG(st.st_mode)) {
+		ops = &sp_fake_kms_ops;
+	} else {
+		fd = open(path, O_RDWR | O_CLOEXEC);
+		if (fd < 0) {
+			printf("failed to open %s\n", path);
+			return NULL;
 		}
-		plane->crtc_h_pid = get_prop_id(dev, props, "CRTC_H");
-		if (!plane->crtc_h_pid) {
-			drmModeFreeObjectProperties(props);
+		cache = getenv("SP_DEV_CACHE");
+	}
+
+	dev = calloc(1, sizeof(*dev));
+	if (!dev) {
+		printf("failed to allocate dev\n");
+		if (fd >= 0)
+			close(fd);
+		return NULL;
+	}
+
+	dev->fd = fd;
+	dev->ops = ops;
+	dev->atomic = ops == &sp_fake_kms_ops;
+	dev->vgem_fd = -1;
+	pthread_mutex_init(&dev->lock, NULL);
+	dev->scanout_format = get_env_format("SP_SCANOUT_FORMAT",
+			DRM_FORMAT_XRGB8888);
+
+	backend_name = getenv("SP_BO_BACKEND");
+	if (backend_name) {
+		if (sp_bo_backend_from_name(backend_name, &backend))
+			printf("unknown bo backend %s, using dumb\n",
+				backend_name);
+		else
+			dev->bo_backend = backend;
+	}
+
+	if (ops->init) {
+		ret = ops->init(dev);
+		if (ret) {
+			printf("failed to init %s ret=%d\n", path, ret);
 			goto err;
 		}
-		plane->src_x_pid = get_prop_id(dev, props, "SRC_X");
-		if (!plane->src_x_pid) {
-			drmModeFreeObjectProperties(props);
+	}
+	dev->dumb_caching = get_dumb_caching(dev->fd);
+
+	if (fake) {
+		ret = sp_fake_load_topology(dev, &config);
+		if (ret) {
+			printf("failed to make up a device ret=%d\n", ret);
 			goto err;
 		}
-		plane->src_y_pid = get_prop_id(dev, props, "SRC_Y");
-		if (!plane->src_y_pid) {
-			drmModeFreeObjectProperties(props);
+	} else if (ops == &sp_fake_kms_ops) {
+		ret = sp_dev_load_snapshot(dev, path, 0);
+		if (ret) {
+			printf("failed to load snapshot %s ret=%d\n", path,
+				ret);
 			goto err;
 		}
-		plane->src_w_pid = get_prop_id(dev, props, "SRC_W");
-		if (!plane->src_w_pid) {
-			drmModeFreeObjectProperties(props);
-			goto err;
+	} else {
+		/*
+		 * Before anything, they change which planes the node lists.
+		 * Nodes that can't commit may still list primaries and cursors,
+		 * and the legacy calls do without either.
+		 */
+		dev->atomic = !drmSetClientCap(dev->fd, DRM_CLIENT_CAP_ATOMIC,
+				1);
+		dev->stats.ioctls++;
+		if (!dev->atomic) {
+			drmSetClientCap(dev->fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES,
+					1);
+			dev->stats.ioctls++;
 		}
-		plane->src_h_pid = get_prop_id(dev, props, "SRC_H");
-		if (!plane->src_h_pid) {
-			drmModeFreeObjectProperties(props);
-			goto err;
+		if (cache && !sp_dev_load_snapshot(dev, cache, 1)) {
+			/* Still valid, nothing to write back */
+			cache = NULL;
+		} else {
+			ret = enumerate_sp_dev(dev);
+			if (ret)
+				goto err;
 		}
-#endif
-		drmModeFreeObjectProperties(props);
 	}
 
-	if (pr)
-		drmModeFreePlaneResources(pr);
-	if (r)
-		drmModeFreeResources(r);
+	ret = init_sp_planes(dev);
+	if (ret)
+		goto err;
 
+	if (cache) {
+		ret = sp_dev_save_snapshot(dev, cache);
+		if (ret)
+			printf("failed to save snapshot %s ret=%d\n", cache,
+				ret);
+	}
 	return dev;
+
 err:
-	if (pr)
-		drmModeFreePlaneResources(pr);
-	if (r)
-		drmModeFreeResources(r);
 	destroy_sp_dev(dev);
 	return NULL;
 }
 
-struct sp_dev *create_sp_dev(void)
+static double probe_now(void)
 {
-	struct dirent de, *pde;
-	struct sp_dev *dev = NULL;
-	DIR *dir = opendir("/dev/dri");
-	int res;
+	struct timespec ts;
 
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * The few ioctls it takes to tell whether a node can drive displays, none
+ * of the per-object enumeration create_sp_dev_from_path() does.
+ */
+static void *probe_device(void *arg)
+{
+	struct sp_dev_probe *probe = arg;
+	double start = probe_now();
+	drmVersionPtr version;
+	drmModeRes *r;
+	uint64_t cap = 0;
+	int fd;
+
+	fd = open(probe->path, O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
+		probe->error = -errno;
+		goto out;
+	}
+
+	version = drmGetVersion(fd);
+	if (version) {
+		snprintf(probe->driver, sizeof(probe->driver), "%s",
+			version->name);
+		drmFreeVersion(version);
+	}
+
+	probe->dumb = !drmGetCap(fd, DRM_CAP_DUMB_BUFFER, &cap) && cap;
+	cap = 0;
+	if (!drmGetCap(fd, DRM_CAP_PRIME, &cap))
+		probe->prime = cap;
+
+	r = drmModeGetResources(fd);
+	if (r) {
+		probe->kms = r->count_crtcs > 0 && r->count_connectors > 0;
+		drmModeFreeResources(r);
+	}
+
+	/* The first opener becomes master if there is none */
+	probe->master = drmIsMaster(fd);
+	close(fd);
+out:
+	probe->ready_ms = (probe_now() - start) * 1e3;
+	return NULL;
+}
+
+static int compare_probes(const void *a, const void *b)
+{
+	const struct sp_dev_probe *pa = a, *pb = b;
+
+	return strcmp(pa->path, pb->path);
+}
+
+static int probe_nodes(struct sp_dev_probe **probes, int render)
+{
+	struct sp_dev_probe *p = NULL, *tmp;
+	struct probe_thread {
+		pthread_t thread;
+		int started;
+	} *threads;
+	struct dirent *de;
+	int i, n = 0, size = 0;
+	DIR *dir;
+
+	dir = opendir("/dev/dri");
 	if (!dir)
-		return NULL;
+		return -errno;
 
-	while ((res = readdir_r(dir, &de, &pde)) == 0) {
-		if (!pde)
-			break;
-		if (de.d_type != DT_CHR)
+	while ((de = readdir(dir))) {
+		if (de->d_type != DT_CHR)
 			continue;
-		dev = create_sp_dev_from_name(de.d_name);
-		if (dev)
-			break;
+		/* Render nodes never have KMS */
+		if (!render && !strncmp(de->d_name, "renderD", 7))
+			continue;
+		if (n == size) {
+			size = size ? size * 2 : 4;
+			tmp = realloc(p, size * sizeof(*p));
+			if (!tmp) {
+				free(p);
+				closedir(dir);
+				return -ENOMEM;
+			}
+			p = tmp;
+		}
+		memset(&p[n], 0, sizeof(p[n]));
+		snprintf(p[n].path, sizeof(p[n].path), "/dev/dri/%s",
+			de->d_name);
+		p[n].render = !strncmp(de->d_name, "renderD", 7);
+		n++;
 	}
 	closedir(dir);
+
+	/* readdir() order is arbitrary, card0 should come first */
+	if (n > 1)
+		qsort(p, n, sizeof(*p), compare_probes);
+
+	/* Opening a node can block on a driver waking its device up */
+	threads = n > 1 ? calloc(n, sizeof(*threads)) : NULL;
+	for (i = 0; i < n; i++) {
+		if (threads && !pthread_create(&threads[i].thread, NULL,
+				probe_device, &p[i]))
+			threads[i].started = 1;
+		else
+			probe_device(&p[i]);
+	}
+	for (i = 0; threads && i < n; i++) {
+		if (threads[i].started)
+			pthread_join(threads[i].thread, NULL);
+	}
+	free(threads);
+
+	*probes = p;
+	return n;
+}
+
+int sp_probe_devices(struct sp_dev_probe **probes)
+{
+	return probe_nodes(probes, 0);
+}
+
+int sp_probe_all_devices(struct sp_dev_probe **probes)
+{
+	return probe_nodes(probes, 1);
+}
+
+int sp_dev_probe_usable(const struct sp_dev_probe *probe)
+{
+	return !probe->error && probe->kms && probe->dumb;
+}
+
+/* Usable nodes we can be master of first, then the rest */
+static int probe_rank(const struct sp_dev_probe *probe)
+{
+	if (!sp_dev_probe_usable(probe))
+		return -1;
+	return probe->master;
+}
+
+struct sp_dev *create_sp_dev_for_driver(const char *driver)
+{
+	struct sp_dev_probe *probes;
+	struct sp_dev *dev = NULL;
+	int i, n, rank, best;
+
+	n = sp_probe_devices(&probes);
+	if (n < 0) {
+		printf("failed to probe devices: %d\n", n);
+		return NULL;
+	}
+
+	while (!dev) {
+		for (i = 0, best = -1; i < n; i++) {
+			if (driver && strcmp(probes[i].driver, driver))
+				continue;
+			rank = probe_rank(&probes[i]);
+			if (rank >= 0 && (best < 0 ||
+					rank > probe_rank(&probes[best])))
+				best = i;
+		}
+		if (best < 0)
+			break;
+		dev = create_sp_dev_from_path(probes[best].path);
+		/* Don't pick it again */
+		probes[best].kms = 0;
+	}
+	if (!dev)
+		printf("no usable KMS device%s%s\n", driver ? " for " : "",
+			driver ? driver : "");
+	free(probes);
 	return dev;
 }
 
+struct sp_dev *create_sp_dev(void)
+{
+	const char *env = getenv("SP_DEV");
+
+	if (env && (strchr(env, '/') || !strncmp(env, "fake", 4)))
+		return create_sp_dev_from_path(env);
+	return create_sp_dev_for_driver(env);
+}
+
 void destroy_sp_dev(struct sp_dev *dev)
 {
-	int i;
+	int i, j;
 
 	if (dev->planes) {
 		for (i = 0; i< dev->num_planes; i++) {
-			if (dev->planes[i].in_use)
+			if (sp_plane_in_use(&dev->planes[i]))
 				put_sp_plane(&dev->planes[i]);
 			if (dev->planes[i].plane)
 				drmModeFreePlane(dev->planes[i].plane);
+			sp_props_free(dev->planes[i].props);
 			if (dev->planes[i].bo)
 				free_sp_bo(dev->planes[i].bo);
+			free(dev->planes[i].format_mask);
+			free(dev->planes[i].format_modifiers);
 		}
 		free(dev->planes);
 	}
+	free(dev->planes_in_use);
+	free(dev->formats);
+	free(dev->format_slots);
+	free(dev->modifiers);
+	free(dev->modifier_slots);
+	free(dev->format_planes);
 	if (dev->crtcs) {
 		for (i = 0; i< dev->num_crtcs; i++) {
 			if (dev->crtcs[i].crtc)
 				drmModeFreeCrtc(dev->crtcs[i].crtc);
+			sp_props_free(dev->crtcs[i].props);
+			free(dev->crtcs[i].possible_planes);
+			for (j = 0; j < SP_NUM_PLANE_TYPES; j++)
+				free(dev->crtcs[i].type_planes[j]);
 			if (dev->crtcs[i].scanout)
 				free_sp_bo(dev->crtcs[i].scanout);
 		}
@@ -300,10 +1458,43 @@ void destroy_sp_dev(struct sp_dev *dev)
 		for (i = 0; i< dev->num_connectors; i++) {
 			if (dev->connectors[i])
 				drmModeFreeConnector(dev->connectors[i]);
+			if (dev->connector_props)
+				sp_props_free(dev->connector_props[i]);
 		}
 		free(dev->connectors);
 	}
+	free(dev->connector_props);
+
+	/* Plane and scanout buffers above went back to the pool, drop them */
+	sp_bo_pool_disable(dev);
 
-	close(dev->fd);
+	if (dev->gbm)
+		gbm_device_destroy(dev->gbm);
+	if (dev->vgem_fd >= 0)
+		close(dev->vgem_fd);
+
+	if (dev->ops && dev->ops->destroy)
+		dev->ops->destroy(dev);
+	if (dev->fd >= 0)
+		close(dev->fd);
+	pthread_mutex_destroy(&dev->lock);
 	free(dev);
 }
+
+void print_sp_dev_stats(struct sp_dev *dev)
+{
+	struct rusage usage;
+
+	printf("ioctls: %llu, maps: %llu (%llu prefaulted), unmaps: %llu, "
+		"mapped: %llu bytes, dma-buf syncs: %llu\n",
+		(unsigned long long)dev->stats.ioctls,
+		(unsigned long long)dev->stats.maps,
+		(unsigned long long)dev->stats.populated_maps,
+		(unsigned long long)dev->stats.unmaps,
+		(unsigned long long)dev->stats.mapped_bytes,
+		(unsigned long long)dev->stats.syncs);
+
+	if (!getrusage(RUSAGE_SELF, &usage))
+		printf("page faults: %ld minor, %ld major\n",
+			usage.ru_minflt, usage.ru_majflt);
+}
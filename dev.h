@@ -1,19 +1,74 @@
 #ifndef __DEV_H_INCLUDED__
 #define __DEV_H_INCLUDED__
 
+#include <limits.h>
+#include <pthread.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <xf86drm.h>
 #include <xf86drmMode.h>
 
 struct sp_bo;
+struct sp_bo_pool;
+struct sp_crtc;
 struct sp_dev;
+struct gbm_device;
+
+/*
+ * A KMS object property, fetched once with drmModeGetProperty(). values
+ * holds the min and max of range properties, enums the names of enum and
+ * bitmask ones.
+ */
+struct sp_prop {
+	uint32_t id;
+	uint32_t flags;
+	char name[DRM_PROP_NAME_LEN];
+	uint64_t value;		/* when the index was built */
+	int count_values;
+	uint64_t *values;
+	int count_enums;
+	struct drm_mode_property_enum *enums;
+};
+
+/* The properties of one object, hashed by name */
+struct sp_props {
+	uint32_t object_id;
+	uint32_t object_type;
+	int count;
+	int max_count;
+	struct sp_prop *props;
+
+	/* Open addressed, indices into props or -1 */
+	uint32_t mask;
+	int *slots;
+};
+
+/* DRM_PLANE_TYPE_OVERLAY, PRIMARY and CURSOR */
+#define SP_NUM_PLANE_TYPES 3
 
 struct sp_plane {
 	struct sp_dev *dev;
 	drmModePlanePtr plane;
 	struct sp_bo *bo;
-	int in_use;
 	uint32_t format;
 
+	/* DRM_PLANE_TYPE_*, overlay when the plane has no type property */
+	int type;
+
+	/*
+	 * A bit per dev->formats index the plane takes, and for each of those
+	 * a bit per dev->modifiers index it takes the format with. Built from
+	 * IN_FORMATS, planes without it take their formats LINEAR only.
+	 */
+	uint64_t *format_mask;
+	uint64_t *format_modifiers;
+
+	/* Where set_sp_plane() or set_sp_plane_pset() last put the plane */
+	struct sp_crtc *crtc;
+
+	/* Built on first use, see sp_plane_props() */
+	struct sp_props *props;
+
 	/* Property ID's */
 	uint32_t crtc_pid;
 	uint32_t fb_pid;
@@ -26,6 +81,11 @@ struct sp_plane {
 	uint32_t src_y_pid;
 	uint32_t src_w_pid;
 	uint32_t src_h_pid;
+	uint32_t damage_clips_pid; /* 0 if the plane doesn't have it */
+	uint32_t alpha_pid;	/* the same */
+
+	/* FB_DAMAGE_CLIPS blob of the last set_sp_plane_pset() */
+	uint32_t damage_blob_id;
 };
 
 struct sp_crtc {
@@ -33,13 +93,141 @@ struct sp_crtc {
 	int pipe;
 	int num_planes;
 	struct sp_bo *scanout;
+	/*
+	 * The plane initialize_screens() put scanout on, NULL without
+	 * universal planes. It isn't claimed, get_sp_plane() may hand it out.
+	 */
+	struct sp_plane *primary;
+
+	/* Built on first use, see sp_crtc_props() */
+	struct sp_props *props;
+
+	/* The planes possible_crtcs allows here, laid out like planes_in_use */
+	uint64_t *possible_planes;
+	/* The same by DRM_PLANE_TYPE_* */
+	uint64_t *type_planes[SP_NUM_PLANE_TYPES];
+};
+
+/* One property update of an atomic commit */
+struct sp_atomic_prop {
+	uint32_t object_id;
+	uint32_t property_id;
+	uint64_t value;
+};
+
+/*
+ * The property updates of an atomic commit, in the order they were added.
+ * Unlike a drmModePropertySet it can be looked into, so the fake device
+ * checks commits the way the kernel would, and sp_atomic_reset() keeps
+ * its memory for the next frame.
+ */
+struct sp_atomic {
+	int count;
+	int max_count;
+	struct sp_atomic_prop *props;
+};
+
+/*
+ * The kernel calls made once a device is enumerated. Nodes opened from
+ * /dev/dri use sp_drm_kms_ops, which call libdrm on dev->fd; made up
+ * devices and replayed snapshots answer them in memory (see fake.h).
+ * ioctl() follows drmIoctl() and returns -1 with errno set, the others
+ * follow the libdrm call they are named after and return -errno.
+ */
+struct sp_kms_ops {
+	/* Optional, called by create_sp_dev_from_path() and destroy_sp_dev() */
+	int (*init)(struct sp_dev *dev);
+	void (*destroy)(struct sp_dev *dev);
+
+	/* Dumb buffer and GEM ioctls, MAP_DUMB offsets are into dev->fd */
+	int (*ioctl)(struct sp_dev *dev, unsigned long request, void *arg);
+	/* modifiers is NULL without DRM_MODE_FB_MODIFIERS */
+	int (*add_fb2)(struct sp_dev *dev, uint32_t width, uint32_t height,
+			uint32_t format, const uint32_t handles[4],
+			const uint32_t pitches[4], const uint32_t offsets[4],
+			const uint64_t modifiers[4], uint32_t *fb_id,
+			uint32_t flags);
+	int (*rm_fb)(struct sp_dev *dev, uint32_t fb_id);
+	int (*dirty_fb)(struct sp_dev *dev, uint32_t fb_id,
+			drmModeClipPtr clips, uint32_t num_clips);
+	int (*set_crtc)(struct sp_dev *dev, uint32_t crtc_id, uint32_t fb_id,
+			uint32_t x, uint32_t y, uint32_t *connectors,
+			int count, drmModeModeInfoPtr mode);
+	int (*set_plane)(struct sp_dev *dev, uint32_t plane_id,
+			uint32_t crtc_id, uint32_t fb_id, uint32_t flags,
+			int32_t crtc_x, int32_t crtc_y, uint32_t crtc_w,
+			uint32_t crtc_h, uint32_t src_x, uint32_t src_y,
+			uint32_t src_w, uint32_t src_h);
+	/* The plane's current state, freed with drmModeFreePlane() */
+	drmModePlanePtr (*get_plane)(struct sp_dev *dev, uint32_t plane_id);
+	int (*create_blob)(struct sp_dev *dev, const void *data, size_t size,
+			uint32_t *blob_id);
+	int (*destroy_blob)(struct sp_dev *dev, uint32_t blob_id);
+	/* Freed with drmModeFreePropertyBlob(), NULL if there is no such blob */
+	drmModePropertyBlobPtr (*get_blob)(struct sp_dev *dev,
+			uint32_t blob_id);
+	/* Backs sp_props_get() */
+	struct sp_props *(*get_props)(struct sp_dev *dev, uint32_t object_id,
+			uint32_t object_type);
+	/*
+	 * For refreshing connectors after enumeration. Without probe the
+	 * connector's cached state is returned, as drmModeGetConnectorCurrent()
+	 * does; with it the connector is probed.
+	 */
+	drmModeResPtr (*get_resources)(struct sp_dev *dev);
+	drmModeConnectorPtr (*get_connector)(struct sp_dev *dev,
+			uint32_t connector_id, int probe);
+	/*
+	 * flags are DRM_MODE_ATOMIC_* and DRM_MODE_PAGE_FLIP_EVENT. A kernel
+	 * device that didn't take the atomic client cap returns -ENOSYS.
+	 */
+	int (*commit)(struct sp_dev *dev, const struct sp_atomic *req,
+			uint32_t flags, void *user_data);
+	int (*page_flip)(struct sp_dev *dev, uint32_t crtc_id, uint32_t fb_id,
+			uint32_t flags, void *user_data);
+	/* drmHandleEvent(), once select() or poll() found dev->fd readable */
+	int (*handle_event)(struct sp_dev *dev, drmEventContextPtr ctx);
+};
+
+extern const struct sp_kms_ops sp_drm_kms_ops;
+
+/* Counts of the kernel calls made on behalf of a device */
+struct sp_dev_stats {
+	uint64_t ioctls;
+	uint64_t maps;
+	uint64_t populated_maps;
+	uint64_t unmaps;
+	uint64_t syncs;		/* DMA_BUF_IOCTL_SYNC */
+	uint64_t mapped_bytes; /* currently mapped */
 };
 
+/*
+ * Threading: one thread creates, enumerates and destroys an sp_dev, and
+ * reads connector properties before others start. After that a thread per
+ * CRTC may take and put planes, create and free bos, build and commit
+ * sp_atomic requests and flip, touching only its own CRTC, the planes it
+ * claimed and its own bos. Any thread may enable or disable the bo pool.
+ * dev->fd carries every CRTC's events, so handle_event() may run another
+ * thread's flip handler: have user_data point at what the owner waits on
+ * and set it atomically. dev->stats is counted without atomics and is only
+ * approximate then.
+ */
 struct sp_dev {
 	int fd;
+	const struct sp_kms_ops *ops;
+	void *ops_priv;
+
+	/*
+	 * Set when the node took DRM_CLIENT_CAP_ATOMIC, which brings universal
+	 * planes along; made up devices always commit. Without it the node is
+	 * asked for universal planes alone, and modesets go through the
+	 * legacy calls.
+	 */
+	int atomic;
 
 	int num_connectors;
 	drmModeConnectorPtr *connectors;
+	struct sp_props **connector_props; /* see sp_connector_props() */
 
 	int num_encoders;
 	drmModeEncoderPtr *encoders;
@@ -49,9 +237,184 @@ struct sp_dev {
 
 	int num_planes;
 	struct sp_plane *planes;
+
+	/*
+	 * A bit per dev->planes index, set while the plane is taken. Only
+	 * changed with compare and swap, see sp_plane_claim().
+	 */
+	uint64_t *planes_in_use;
+	int num_plane_words;
+
+	/*
+	 * Every format and modifier some plane takes, in the order the planes
+	 * list them, LINEAR being modifier 0. Only the first 64 modifiers are
+	 * kept. See sp_dev_format_index() and sp_dev_modifier_index().
+	 */
+	int num_formats;
+	uint32_t *formats;
+	int num_modifiers;
+	uint64_t *modifiers;
+
+	/* Open addressed, indices into formats and modifiers or -1 */
+	uint32_t format_mask;
+	int *format_slots;
+	uint32_t modifier_mask;
+	int *modifier_slots;
+
+	/*
+	 * The planes taking format index f with modifier index m, laid out
+	 * like planes_in_use at (f * (num_modifiers + 1) + m) *
+	 * num_plane_words. m = num_modifiers has those taking it with any.
+	 */
+	uint64_t *format_planes;
+
+	/* Guards the bo pool and the gbm device and vgem node below */
+	pthread_mutex_t lock;
+
+	/* Recycled buffers, see sp_bo_pool_enable() */
+	struct sp_bo_pool *bo_pool;
+
+	struct sp_dev_stats stats;
+
+	/* enum sp_bo_caching of dumb buffer mappings */
+	int dumb_caching;
+
+	/*
+	 * Format of the scanouts initialize_screens() creates, XRGB8888
+	 * unless SP_SCANOUT_FORMAT=<fourcc> says otherwise. RG16 (RGB565)
+	 * halves the memory bandwidth scanout takes, and planes then prefer
+	 * RGB565 too.
+	 */
+	uint32_t scanout_format;
+
+	/* enum sp_bo_backend used by create_sp_bo() */
+	int bo_backend;
+
+	/* Opened by the gbm and vgem bo backends on first use */
+	struct gbm_device *gbm;
+	int vgem_fd;
+};
+
+/*
+ * What a quick look at a node found: the driver name, whether it has CRTCs
+ * and connectors and dumb buffers, and whether we got DRM master.
+ */
+struct sp_dev_probe {
+	char path[PATH_MAX];
+	char driver[64];
+	int render;		/* a renderD node */
+	int kms;
+	int dumb;
+	int master;
+	uint64_t prime;		/* DRM_PRIME_CAP_IMPORT/EXPORT */
+	int error;		/* -errno from open() */
+	double ready_ms;	/* open to probe result */
 };
 
+/*
+ * Probes every primary node in /dev/dri in parallel, skipping render nodes.
+ * Returns the number of nodes, sorted by path, or -errno. The caller frees
+ * *probes.
+ */
+int sp_probe_devices(struct sp_dev_probe **probes);
+/* The same with render nodes, which sort after the primary ones */
+int sp_probe_all_devices(struct sp_dev_probe **probes);
+/* Has what create_sp_dev() needs: KMS resources and dumb buffers */
+int sp_dev_probe_usable(const struct sp_dev_probe *probe);
+
+/*
+ * Only the node picked is fully enumerated. SP_DEV=<path> or
+ * SP_DEV=<driver> (e.g. vkms) chooses it, otherwise it is the first usable
+ * node, preferring ones we are master of. SP_DEV=fake[:options] makes one
+ * up, see fake.h.
+ */
 struct sp_dev *create_sp_dev(void);
+/* The first usable node of driver, or of any driver if NULL */
+struct sp_dev *create_sp_dev_for_driver(const char *driver);
+/*
+ * path is a DRM node, a snapshot file, which is replayed without a kernel
+ * device, or fake[:options]. With SP_DEV_CACHE=<file> a node's topology
+ * is read from that snapshot while it still matches the node, and written
+ * to it when it doesn't. Connector, CRTC and plane state is always read
+ * from the node, see sp_dev_load_snapshot().
+ */
+struct sp_dev *create_sp_dev_from_path(const char *path);
 void destroy_sp_dev(struct sp_dev *dev);
 
+/*
+ * Reads all properties of an object in one pass: a drmModeGetProperty()
+ * per property rather than per property and name looked up.
+ */
+struct sp_props *sp_props_get(struct sp_dev *dev, uint32_t object_id,
+		uint32_t object_type);
+void sp_props_free(struct sp_props *props);
+/* Builds an index by hand, sp_props_add() copies prop's values and enums */
+struct sp_props *sp_props_alloc(uint32_t object_id, uint32_t object_type,
+		int count);
+int sp_props_add(struct sp_props *props, const struct sp_prop *prop);
+/* NULL, or 0 for the ID, if the object has no such property */
+const struct sp_prop *sp_props_find(const struct sp_props *props,
+		const char *name);
+uint32_t sp_props_id(const struct sp_props *props, const char *name);
+/* Value of an enum property's named entry, -ENOENT if it has none */
+int sp_prop_enum_value(const struct sp_prop *prop, const char *name,
+		uint64_t *value);
+
+struct sp_atomic *sp_atomic_alloc(void);
+void sp_atomic_free(struct sp_atomic *req);
+/* Empties req for the next commit */
+void sp_atomic_reset(struct sp_atomic *req);
+int sp_atomic_add(struct sp_atomic *req, uint32_t object_id,
+		uint32_t property_id, uint64_t value);
+/* Returns -errno, see sp_kms_ops.commit */
+int sp_atomic_commit(struct sp_dev *dev, const struct sp_atomic *req,
+		uint32_t flags, void *user_data);
+
+/* Cached sp_props_get() of a plane, CRTC or connector (by index) */
+struct sp_props *sp_plane_props(struct sp_plane *plane);
+struct sp_props *sp_crtc_props(struct sp_dev *dev, struct sp_crtc *crtc);
+struct sp_props *sp_connector_props(struct sp_dev *dev, int index);
+/*
+ * Looks up the property IDs in struct sp_plane that set_sp_plane_pset()
+ * uses, once. Devices that commit have that done at enumeration.
+ */
+int sp_plane_pids(struct sp_plane *plane);
+
+/*
+ * Takes the first free plane that can go on crtc, NULL if there is none.
+ * Lock free, compare and swaps lost to other threads are added to *retries
+ * unless it is NULL.
+ */
+struct sp_plane *sp_plane_claim(struct sp_dev *dev, struct sp_crtc *crtc,
+		uint64_t *retries);
+/* Takes that plane, -EBUSY if it is taken */
+int sp_plane_try_claim(struct sp_plane *plane);
+/* What the owner wrote to the plane is seen by whoever claims it next */
+void sp_plane_release(struct sp_plane *plane);
+int sp_plane_in_use(const struct sp_plane *plane);
+
+/* Index into dev->formats and dev->modifiers, -1 if no plane takes it */
+int sp_dev_format_index(const struct sp_dev *dev, uint32_t format);
+int sp_dev_modifier_index(const struct sp_dev *dev, uint64_t modifier);
+/*
+ * The planes taking format with modifier, DRM_FORMAT_MOD_INVALID for any,
+ * laid out like planes_in_use. NULL if there are none.
+ */
+const uint64_t *sp_dev_format_planes(const struct sp_dev *dev,
+		uint32_t format, uint64_t modifier);
+/* Whether the plane scans out format with modifier, as above */
+int sp_plane_supports(const struct sp_plane *plane, uint32_t format,
+		uint64_t modifier);
+/*
+ * sp_plane_claim() of a plane of type, a DRM_PLANE_TYPE_* or -1 for any,
+ * taking format with modifier. Decided a word of planes at a time from the
+ * tables built at enumeration, so no plane's format list is looked at.
+ */
+struct sp_plane *sp_plane_claim_for(struct sp_dev *dev, struct sp_crtc *crtc,
+		int type, uint32_t format, uint64_t modifier,
+		uint64_t *retries);
+
+/* Prints dev->stats along with the page faults taken by the process */
+void print_sp_dev_stats(struct sp_dev *dev);
+
 #endif /* __DEV_H_INCLUDED__ */
@@ -0,0 +1,291 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <drm_fourcc.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+#include "blit.h"
+#include "bo.h"
+#include "dev.h"
+#include "devset.h"
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint32_t node_caps(const struct sp_dev_probe *probe)
+{
+	uint32_t caps = 0;
+
+	if (probe->kms)
+		caps |= SP_NODE_KMS;
+	if (probe->dumb)
+		caps |= SP_NODE_DUMB;
+	if (probe->render)
+		caps |= SP_NODE_RENDER;
+	if (probe->master)
+		caps |= SP_NODE_MASTER;
+	if (probe->prime & DRM_PRIME_CAP_IMPORT)
+		caps |= SP_NODE_PRIME_IMPORT;
+	if (probe->prime & DRM_PRIME_CAP_EXPORT)
+		caps |= SP_NODE_PRIME_EXPORT;
+	return caps;
+}
+
+struct sp_devset *create_sp_devset(void)
+{
+	struct sp_dev_probe *probes;
+	struct sp_devset *set;
+	int i, n;
+
+	n = sp_probe_all_devices(&probes);
+	if (n < 0) {
+		printf("failed to probe devices: %d\n", n);
+		return NULL;
+	}
+
+	set = calloc(1, sizeof(*set));
+	if (!set)
+		goto err;
+	set->nodes = calloc(n ? n : 1, sizeof(*set->nodes));
+	if (!set->nodes)
+		goto err;
+
+	for (i = 0; i < n; i++) {
+		struct sp_devset_node *node = &set->nodes[set->num_nodes];
+
+		if (probes[i].error)
+			continue;
+		node->probe = probes[i];
+		node->caps = node_caps(&probes[i]);
+		node->fd = -1;
+		set->num_nodes++;
+	}
+	free(probes);
+	return set;
+
+err:
+	printf("failed to allocate devset\n");
+	free(set);
+	free(probes);
+	return NULL;
+}
+
+void destroy_sp_devset(struct sp_devset *set)
+{
+	int i;
+
+	for (i = 0; i < set->num_nodes; i++) {
+		if (set->nodes[i].dev)
+			destroy_sp_dev(set->nodes[i].dev);
+		if (set->nodes[i].fd >= 0)
+			close(set->nodes[i].fd);
+	}
+	free(set->nodes);
+	free(set);
+}
+
+static int node_matches(const struct sp_devset_node *node, uint32_t caps,
+		const char *driver, const struct sp_devset_node *not)
+{
+	return node != not && (node->caps & caps) == caps &&
+		(!driver || !strcmp(node->probe.driver, driver));
+}
+
+struct sp_devset_node *sp_devset_find(struct sp_devset *set, uint32_t caps,
+		const char *driver, const struct sp_devset_node *not)
+{
+	const char *env = getenv("SP_DEV");
+	int i;
+
+	if (env && (caps & SP_NODE_KMS)) {
+		for (i = 0; i < set->num_nodes; i++) {
+			struct sp_devset_node *node = &set->nodes[i];
+
+			if ((!strcmp(node->probe.path, env) ||
+			     !strcmp(node->probe.driver, env)) &&
+			    node_matches(node, caps, driver, not))
+				return node;
+		}
+	}
+
+	for (i = 0; i < set->num_nodes; i++) {
+		if (node_matches(&set->nodes[i], caps, driver, not))
+			return &set->nodes[i];
+	}
+	return NULL;
+}
+
+struct sp_dev *sp_devset_node_dev(struct sp_devset_node *node)
+{
+	if (!node->dev && (node->caps & SP_NODE_KMS))
+		node->dev = create_sp_dev_from_path(node->probe.path);
+	return node->dev;
+}
+
+/* Render buffers are allocated on an fd of their own, never master */
+static int node_fd(struct sp_devset_node *node)
+{
+	if (node->fd >= 0)
+		return node->fd;
+
+	node->fd = open(node->probe.path, O_RDWR | O_CLOEXEC);
+	if (node->fd < 0) {
+		int ret = -errno;
+
+		printf("failed to open %s\n", node->probe.path);
+		return ret;
+	}
+	return node->fd;
+}
+
+/* A linear dumb buffer on the render node, exported as a dma-buf */
+static int create_render_buffer(struct sp_devset_node *render,
+		uint32_t width, uint32_t height, uint32_t bpp,
+		uint32_t *pitch)
+{
+	struct drm_mode_create_dumb cd = {};
+	struct drm_gem_close gc = {};
+	int ret, fd, prime_fd;
+
+	fd = node_fd(render);
+	if (fd < 0)
+		return fd;
+
+	cd.width = width;
+	cd.height = height;
+	cd.bpp = bpp;
+	ret = drmIoctl(fd, DRM_IOCTL_MODE_CREATE_DUMB, &cd);
+	if (ret) {
+		ret = -errno;
+		printf("failed to create %s bo ret=%d\n", render->probe.driver,
+			ret);
+		return ret;
+	}
+
+	ret = drmPrimeHandleToFD(fd, cd.handle, DRM_CLOEXEC | DRM_RDWR,
+			&prime_fd);
+	if (ret)
+		printf("failed to export %s bo ret=%d\n", render->probe.driver,
+			ret);
+
+	/* The dma-buf keeps the memory */
+	gc.handle = cd.handle;
+	drmIoctl(fd, DRM_IOCTL_GEM_CLOSE, &gc);
+	if (ret)
+		return ret;
+
+	*pitch = cd.pitch;
+	return prime_fd;
+}
+
+struct sp_xbo *sp_devset_create_xbo(struct sp_devset_node *render,
+		struct sp_dev *scanout_dev, uint32_t width, uint32_t height,
+		uint32_t depth, uint32_t bpp, uint32_t format)
+{
+	const char *env = getenv("SP_DEVSET_COPY");
+	struct sp_xbo *xbo;
+	uint32_t pitch = 0;
+	int prime_fd;
+
+	if (sp_format_num_planes(format) != 1) {
+		printf("only single plane formats cross devices\n");
+		return NULL;
+	}
+
+	xbo = calloc(1, sizeof(*xbo));
+	if (!xbo)
+		return NULL;
+	xbo->render = render;
+
+	prime_fd = create_render_buffer(render, width, height, bpp, &pitch);
+	if (prime_fd < 0)
+		goto err;
+
+	if (!env || !atoi(env))
+		xbo->bo = sp_bo_import_fd(scanout_dev, prime_fd, width, height,
+				depth, bpp, format, pitch, 0,
+				DRM_FORMAT_MOD_LINEAR);
+	if (xbo->bo) {
+		xbo->scanout = xbo->bo;
+		xbo->zero_copy = 1;
+	} else {
+		/* e.g. the display needs contiguous or its own memory */
+		xbo->bo = sp_bo_wrap_fd(scanout_dev, prime_fd, width, height,
+				depth, bpp, format, pitch, 0);
+		if (xbo->bo)
+			xbo->scanout = create_sp_bo(scanout_dev, width, height,
+					depth, bpp, format, 0);
+	}
+	close(prime_fd);
+	if (!xbo->bo || !xbo->scanout)
+		goto err;
+	return xbo;
+
+err:
+	sp_xbo_free(xbo);
+	return NULL;
+}
+
+static int copy_rect(struct sp_xbo *xbo, const struct drm_mode_rect *r)
+{
+	int ret;
+
+	ret = sp_bo_blit(xbo->scanout, r->x1, r->y1, xbo->bo, r->x1, r->y1,
+			r->x2 - r->x1, r->y2 - r->y1);
+	if (ret)
+		return ret;
+	xbo->copied_bytes += (uint64_t)(r->x2 - r->x1) * (r->y2 - r->y1) *
+		xbo->bo->bpp / 8;
+	return 0;
+}
+
+int sp_xbo_present(struct sp_xbo *xbo)
+{
+	struct sp_bo *bo = xbo->bo;
+	struct drm_mode_rect all = { 0, 0, bo->width, bo->height };
+	double start;
+	int i, ret;
+
+	if (xbo->zero_copy)
+		return 0;
+
+	start = now();
+	ret = sp_bo_begin_cpu_access(bo, SP_BO_ACCESS_READ);
+	if (ret)
+		return ret;
+
+	/* The scanout bo starts out with none of it */
+	if (!xbo->copies) {
+		ret = copy_rect(xbo, &all);
+	} else {
+		for (i = 0; i < bo->num_damage && !ret; i++)
+			ret = copy_rect(xbo, &bo->damage[i]);
+	}
+	sp_bo_clear_damage(bo);
+
+	sp_bo_end_cpu_access(bo, SP_BO_ACCESS_READ);
+	xbo->copies++;
+	xbo->copy_ms += (now() - start) * 1e3;
+	return ret;
+}
+
+void sp_xbo_free(struct sp_xbo *xbo)
+{
+	if (!xbo)
+		return;
+	if (xbo->scanout && xbo->scanout != xbo->bo)
+		free_sp_bo(xbo->scanout);
+	free_sp_bo(xbo->bo);
+	free(xbo);
+}
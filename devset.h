@@ -0,0 +1,82 @@
+#ifndef __DEVSET_H_INCLUDED__
+#define __DEVSET_H_INCLUDED__
+
+#include <stdint.h>
+
+#include "dev.h"
+
+struct sp_bo;
+
+/* sp_devset_node caps */
+#define SP_NODE_KMS		(1 << 0) /* CRTCs and connectors */
+#define SP_NODE_DUMB		(1 << 1) /* dumb buffers, CPU rendering */
+#define SP_NODE_RENDER		(1 << 2) /* a renderD node */
+#define SP_NODE_MASTER		(1 << 3)
+#define SP_NODE_PRIME_IMPORT	(1 << 4)
+#define SP_NODE_PRIME_EXPORT	(1 << 5)
+
+struct sp_devset_node {
+	struct sp_dev_probe probe;
+	uint32_t caps;
+
+	/*
+	 * Opened on first use: the sp_dev of a KMS node, and the fd render
+	 * buffers are allocated on.
+	 */
+	struct sp_dev *dev;
+	int fd;
+};
+
+/* Every DRM node of the machine, primary and render ones, sorted by path */
+struct sp_devset {
+	int num_nodes;
+	struct sp_devset_node *nodes;
+};
+
+struct sp_devset *create_sp_devset(void);
+void destroy_sp_devset(struct sp_devset *set);
+
+/*
+ * The first node with all of caps, of driver unless that is NULL, other
+ * than not (which may be NULL). SP_DEV overrides which KMS node comes
+ * first, as for create_sp_dev().
+ */
+struct sp_devset_node *sp_devset_find(struct sp_devset *set, uint32_t caps,
+		const char *driver, const struct sp_devset_node *not);
+/* The node's sp_dev, enumerated on first use. NULL for non-KMS nodes. */
+struct sp_dev *sp_devset_node_dev(struct sp_devset_node *node);
+
+/*
+ * A buffer drawn on one node and scanned out on another. It is allocated
+ * on the render node and exported as a dma-buf; if the scanout device
+ * imports it and can make a framebuffer of it, that is scanned out
+ * directly (zero copy). Otherwise the scanout device gets a buffer of its
+ * own which sp_xbo_present() copies the damaged region into, and the time
+ * that takes is counted. SP_DEVSET_COPY=1 forces the copy.
+ */
+struct sp_xbo {
+	struct sp_devset_node *render;
+	int zero_copy;
+
+	/* Draw into bo, scan out scanout; the same bo when zero copy */
+	struct sp_bo *bo;
+	struct sp_bo *scanout;
+
+	/* What the copies cost so far */
+	uint64_t copies;
+	uint64_t copied_bytes;
+	double copy_ms;
+};
+
+/* Only single plane formats that sp_bo_blit() handles can be copied */
+struct sp_xbo *sp_devset_create_xbo(struct sp_devset_node *render,
+		struct sp_dev *scanout_dev, uint32_t width, uint32_t height,
+		uint32_t depth, uint32_t bpp, uint32_t format);
+/*
+ * Makes what was drawn since the last call visible on the scanout bo. Call
+ * before set_sp_plane() or a flip; damage on bo is moved to scanout.
+ */
+int sp_xbo_present(struct sp_xbo *xbo);
+void sp_xbo_free(struct sp_xbo *xbo);
+
+#endif /* __DEVSET_H_INCLUDED__ */
@@ -0,0 +1,154 @@
+/*
+ * Lists every DRM node with its capabilities, then renders on one node and
+ * scans out on another: vgem and vkms on any machine, a render GPU and a
+ * display controller on others. Each lit CRTC gets an overlay drawn on the
+ * render node, first zero copy if the scanout device imports it, then
+ * forced through a copy, and what the copies cost per frame is printed.
+ *
+ *   devset_test [render driver]	e.g. vgem (the default)
+ *
+ * SP_DEV picks the scanout node as for the other tests.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+#include "bo.h"
+#include "dev.h"
+#include "devset.h"
+#include "modeset.h"
+
+#define FRAMES 60
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void print_node(const struct sp_devset_node *node)
+{
+	printf("%-20s %-10s%s%s%s%s%s%s\n", node->probe.path,
+		node->probe.driver,
+		node->caps & SP_NODE_KMS ? " kms" : "",
+		node->caps & SP_NODE_DUMB ? " dumb" : "",
+		node->caps & SP_NODE_RENDER ? " render" : "",
+		node->caps & SP_NODE_MASTER ? " master" : "",
+		node->caps & SP_NODE_PRIME_IMPORT ? " import" : "",
+		node->caps & SP_NODE_PRIME_EXPORT ? " export" : "");
+}
+
+/* Moves a small square across the overlay, one frame after another */
+static int run(struct sp_dev *dev, struct sp_crtc *cr,
+		struct sp_devset_node *render)
+{
+	uint32_t w = cr->crtc->mode.hdisplay / 2;
+	uint32_t h = cr->crtc->mode.vdisplay / 2;
+	struct sp_plane *plane;
+	struct sp_xbo *xbo;
+	double start;
+	int i, ret;
+
+	plane = get_sp_plane(dev, cr);
+	if (!plane) {
+		printf("no plane for crtc %d\n", cr->pipe);
+		return 0;
+	}
+
+	xbo = sp_devset_create_xbo(render, dev, w, h, 24,
+			sp_format_bpp(plane->format), plane->format);
+	if (!xbo) {
+		put_sp_plane(plane);
+		return -1;
+	}
+
+	fill_bo(xbo->bo, 0xff, 0x00, 0x00, 0xff);
+	start = now();
+	for (i = 0; i < FRAMES; i++) {
+		if (i)
+			draw_rect(xbo->bo, (i - 1) * 8 % (w - 32), h / 2, 32,
+				32, 0xff, 0x00, 0x00, 0xff);
+		draw_rect(xbo->bo, i * 8 % (w - 32), h / 2, 32, 32, 0xff,
+			0xff, 0xff, 0x00);
+		ret = sp_xbo_present(xbo);
+		if (ret) {
+			printf("failed to present ret=%d\n", ret);
+			break;
+		}
+		plane->bo = xbo->scanout;
+		ret = set_sp_plane(dev, plane, cr, 0, 0);
+		if (ret) {
+			printf("failed to set plane ret=%d\n", ret);
+			break;
+		}
+	}
+	printf("crtc %d, drawn on %s: %s, %d frames in %.3f ms", cr->pipe,
+		render->probe.driver, xbo->zero_copy ? "zero copy" : "copy", i,
+		(now() - start) * 1e3);
+	if (!xbo->zero_copy && xbo->copies)
+		printf(", copies %.3f ms/frame %.1f KiB/frame",
+			xbo->copy_ms / xbo->copies,
+			xbo->copied_bytes / 1024.0 / xbo->copies);
+	printf("\n");
+
+	plane->bo = NULL;
+	put_sp_plane(plane);
+	sp_xbo_free(xbo);
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *driver = argc > 1 ? argv[1] : "vgem";
+	struct sp_devset_node *scanout, *render;
+	struct sp_devset *set;
+	struct sp_dev *dev;
+	int i, pass, ret = 0;
+
+	set = create_sp_devset();
+	if (!set)
+		return -1;
+	for (i = 0; i < set->num_nodes; i++)
+		print_node(&set->nodes[i]);
+
+	scanout = sp_devset_find(set, SP_NODE_KMS | SP_NODE_DUMB, NULL, NULL);
+	render = sp_devset_find(set, SP_NODE_DUMB | SP_NODE_PRIME_EXPORT,
+			driver, scanout);
+	if (!scanout || !render) {
+		printf("need a KMS node and a %s node besides it\n", driver);
+		ret = -1;
+		goto out;
+	}
+
+	dev = sp_devset_node_dev(scanout);
+	if (!dev) {
+		ret = -1;
+		goto out;
+	}
+	ret = initialize_screens(dev);
+	if (ret) {
+		printf("failed to initialize screens ret=%d\n", ret);
+		goto out;
+	}
+
+	/* Zero copy where the scanout device takes the buffer, then copying */
+	for (pass = 0; pass < 2 && !ret; pass++) {
+		if (pass)
+			setenv("SP_DEVSET_COPY", "1", 1);
+		for (i = 0; i < dev->num_crtcs && !ret; i++) {
+			if (dev->crtcs[i].scanout)
+				ret = run(dev, &dev->crtcs[i], render);
+		}
+	}
+
+out:
+	printf("%s\n", ret ? "FAIL" : "PASS");
+	destroy_sp_devset(set);
+	return ret;
+}
@@ -0,0 +1,192 @@
+/*
+ * Checks that bos wrapping or importing a dma-buf at an offset draw, blit
+ * and read back at that offset. A memfd stands in for the dma-buf of
+ * sp_bo_wrap_fd(), which runs anywhere; devices with PRIME also import an
+ * atlas sub-buffer, exported at its offset into the atlas.
+ *
+ * SP_DEV defaults to fake, which has no PRIME; SP_DEV=vkms imports too.
+ */
+
+#define _GNU_SOURCE /* memfd_create() */
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+#include <drm_fourcc.h>
+
+#include "blit.h"
+#include "bo.h"
+#include "dev.h"
+
+#define WIDTH 256
+#define HEIGHT 128
+#define PITCH (WIDTH * 4 + 64)
+/* Past a few pages and rows, and not page aligned */
+#define OFFSET (3 * 4096 + 5 * PITCH + 16)
+
+#define RECT_X 10
+#define RECT_Y 20
+#define RECT_W 30
+#define RECT_H 40
+#define COLOR 0x112233
+
+static int in_rect(uint32_t x, uint32_t y)
+{
+	return x >= RECT_X && x < RECT_X + RECT_W && y >= RECT_Y &&
+		y < RECT_Y + RECT_H;
+}
+
+/* Pixels laid out from base with pitch, only the rect drawn */
+static int check_pixels(const char *name, const uint8_t *base,
+		uint32_t pitch)
+{
+	uint32_t x, y, pixel;
+
+	for (y = 0; y < HEIGHT; y++) {
+		for (x = 0; x < WIDTH; x++) {
+			pixel = *(const uint32_t *)(base + y * pitch + x * 4);
+			pixel &= 0xffffff;
+			if (pixel != (in_rect(x, y) ? COLOR : 0)) {
+				printf("%s: %06x at %u,%u\n", name, pixel, x,
+					y);
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+static int test_wrap(struct sp_dev *dev)
+{
+	size_t size = OFFSET + PITCH * HEIGHT + 4096;
+	struct sp_bo *bo = NULL, *copy = NULL;
+	uint8_t *mem = MAP_FAILED;
+	int fd, ret = -1;
+	size_t i;
+
+	fd = memfd_create("dmabuf_test", MFD_CLOEXEC);
+	if (fd < 0 || ftruncate(fd, size)) {
+		printf("failed to create memfd\n");
+		goto out;
+	}
+
+	bo = sp_bo_wrap_fd(dev, fd, WIDTH, HEIGHT, 24, 32,
+			DRM_FORMAT_XRGB8888, PITCH, OFFSET);
+	copy = create_sp_bo(dev, WIDTH, HEIGHT, 24, 32, DRM_FORMAT_XRGB8888,
+			0);
+	if (!bo || !copy)
+		goto out;
+	draw_rect(bo, RECT_X, RECT_Y, RECT_W, RECT_H, 0xff, COLOR >> 16,
+		(COLOR >> 8) & 0xff, COLOR & 0xff);
+	sp_bo_unmap(bo);
+
+	mem = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	if (mem == MAP_FAILED) {
+		printf("failed to map memfd\n");
+		goto out;
+	}
+	for (i = 0; i < OFFSET; i++) {
+		if (mem[i]) {
+			printf("wrap: wrote %zu bytes before the offset\n",
+				OFFSET - i);
+			goto out;
+		}
+	}
+	if (check_pixels("wrap", mem + OFFSET, PITCH))
+		goto out;
+
+	/* Mapped again, and read by the blitter */
+	fill_bo(copy, 0xff, 0, 0, 0);
+	if (sp_bo_blit(copy, 0, 0, bo, 0, 0, WIDTH, HEIGHT) ||
+	    !sp_bo_map(copy, 0) ||
+	    check_pixels("blit", copy->map_addr, copy->pitch))
+		goto out;
+	ret = 0;
+
+out:
+	if (mem != MAP_FAILED)
+		munmap(mem, size);
+	free_sp_bo(copy);
+	free_sp_bo(bo);
+	if (fd >= 0)
+		close(fd);
+	return ret;
+}
+
+static int test_import(struct sp_dev *dev)
+{
+	struct sp_bo *first = NULL, *sub = NULL, *bo = NULL;
+	struct sp_bo_atlas *atlas;
+	uint64_t cap = 0;
+	int fd = -1, ret = -1;
+
+	if (drmGetCap(dev->fd, DRM_CAP_PRIME, &cap) ||
+	    (cap & (DRM_PRIME_CAP_IMPORT | DRM_PRIME_CAP_EXPORT)) !=
+	    (DRM_PRIME_CAP_IMPORT | DRM_PRIME_CAP_EXPORT)) {
+		printf("import: no PRIME, skipped\n");
+		return 0;
+	}
+
+	atlas = create_sp_bo_atlas(dev, WIDTH * 2, HEIGHT * 2, 24, 32,
+			DRM_FORMAT_XRGB8888);
+	if (!atlas)
+		return -1;
+	/* The first one takes the atlas' origin */
+	first = sp_bo_atlas_alloc(atlas, WIDTH, HEIGHT);
+	sub = sp_bo_atlas_alloc(atlas, WIDTH, HEIGHT);
+	if (!first || !sub)
+		goto out;
+	if (!sub->offset) {
+		printf("import: sub-buffer at the atlas' origin\n");
+		goto out;
+	}
+	fill_bo(first, 0xff, 0xff, 0xff, 0xff);
+	fill_bo(sub, 0xff, 0, 0, 0);
+	draw_rect(sub, RECT_X, RECT_Y, RECT_W, RECT_H, 0xff, COLOR >> 16,
+		(COLOR >> 8) & 0xff, COLOR & 0xff);
+	sp_bo_flush_writes(sub);
+
+	fd = sp_bo_export_fd(sub);
+	if (fd < 0)
+		goto out;
+	bo = sp_bo_import_fd(dev, fd, WIDTH, HEIGHT, 24, 32,
+			DRM_FORMAT_XRGB8888, sub->pitch, sub->offset,
+			DRM_FORMAT_MOD_LINEAR);
+	if (!bo || !sp_bo_map(bo, 0) ||
+	    check_pixels("import", bo->map_addr, bo->pitch))
+		goto out;
+	ret = 0;
+
+out:
+	if (fd >= 0)
+		close(fd);
+	free_sp_bo(bo);
+	free_sp_bo(sub);
+	free_sp_bo(first);
+	destroy_sp_bo_atlas(atlas);
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	struct sp_dev *dev;
+	int ret;
+
+	setenv("SP_DEV", "fake", 0);
+	dev = create_sp_dev();
+	if (!dev) {
+		printf("Failed to create sp_dev\n");
+		return -1;
+	}
+
+	ret = test_wrap(dev);
+	if (!ret)
+		ret = test_import(dev);
+
+	destroy_sp_dev(dev);
+	printf("%s\n", ret ? "FAIL" : "PASS");
+	return ret;
+}
@@ -0,0 +1,1769 @@
+#define _GNU_SOURCE /* memfd_create(), fallocate() */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include <drm_fourcc.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+#include "dev.h"
+#include "fake.h"
+
+#define FAKE_DRIVER_LEN 64
+
+/* State of a fake device, dev->ops_priv of sp_fake_kms_ops devices */
+struct fake_bo {
+	uint64_t offset;	/* into dev->fd */
+	uint64_t size;
+	int live;
+};
+
+struct fake_fb {
+	uint32_t width;
+	uint32_t height;
+	uint32_t format;
+	int live;
+};
+
+struct fake_blob {
+	void *data;
+	uint32_t length;
+	int live;
+};
+
+struct fake_plane {
+	uint32_t crtc_id;
+	uint32_t fb_id;
+	int32_t crtc_x;
+	int32_t crtc_y;
+	uint32_t crtc_w;
+	uint32_t crtc_h;
+	uint32_t src_x;		/* 16.16 */
+	uint32_t src_y;
+	uint32_t src_w;
+	uint32_t src_h;
+};
+
+struct fake_crtc {
+	int active;
+	int has_mode;
+	uint32_t fb_id;		/* set by the legacy calls */
+
+	/* A flip waiting for the next vblank */
+	int pending;
+	uint64_t due_ns;
+	uint32_t sequence;
+	void *user_data;
+};
+
+struct fake {
+	/* Taken by every call that looks at or changes what follows */
+	pthread_mutex_t lock;
+
+	char driver[FAKE_DRIVER_LEN];
+
+	/* All zero for snapshots: no limits, events at once */
+	struct sp_fake_config config;
+	uint64_t start_ns;	/* of vblank 0 */
+
+	/* Dumb buffers, handle n is bos[n - 1] */
+	struct fake_bo *bos;
+	uint32_t num_bos;
+	uint64_t end;
+
+	/* Framebuffers, fb n is fbs[n - 1] */
+	struct fake_fb *fbs;
+	uint32_t num_fbs;
+
+	/* Property blobs, blob n is blobs[n - 1] */
+	struct fake_blob *blobs;
+	uint32_t num_blobs;
+
+	/*
+	 * Indexed like dev->planes, dev->crtcs and dev->connectors once the
+	 * topology is known, see fake_state(). Commits are checked on the
+	 * next_* copies and then swapped in.
+	 */
+	struct fake_plane *planes, *next_planes;
+	struct fake_crtc *crtcs, *next_crtcs;
+	uint32_t *connector_crtcs, *next_connector_crtcs;
+	int num_connectors;
+
+	/* Primary plane index per CRTC of made up universal planes, or -1 */
+	int *primary;
+
+	struct sp_fake_stats stats;
+};
+
+/* Property IDs of made up devices, shared by all objects like the kernel's */
+enum {
+	PROP_TYPE = 1,
+	PROP_FB_ID,
+	PROP_CRTC_ID,
+	PROP_CRTC_X,
+	PROP_CRTC_Y,
+	PROP_CRTC_W,
+	PROP_CRTC_H,
+	PROP_SRC_X,
+	PROP_SRC_Y,
+	PROP_SRC_W,
+	PROP_SRC_H,
+	PROP_ZPOS,
+	PROP_FB_DAMAGE_CLIPS,
+	PROP_IN_FORMATS,
+	PROP_ALPHA,
+	PROP_ACTIVE,
+	PROP_MODE_ID,
+	PROP_DPMS,
+};
+
+static const struct {
+	const char *name;
+	uint32_t flags;
+	uint64_t max;		/* of range properties */
+} fake_props[] = {
+	[PROP_TYPE] = { "type", DRM_MODE_PROP_ENUM | DRM_MODE_PROP_IMMUTABLE },
+	[PROP_FB_ID] = { "FB_ID", DRM_MODE_PROP_OBJECT },
+	[PROP_CRTC_ID] = { "CRTC_ID", DRM_MODE_PROP_OBJECT },
+	[PROP_CRTC_X] = { "CRTC_X", DRM_MODE_PROP_SIGNED_RANGE, INT32_MAX },
+	[PROP_CRTC_Y] = { "CRTC_Y", DRM_MODE_PROP_SIGNED_RANGE, INT32_MAX },
+	[PROP_CRTC_W] = { "CRTC_W", DRM_MODE_PROP_RANGE, INT32_MAX },
+	[PROP_CRTC_H] = { "CRTC_H", DRM_MODE_PROP_RANGE, INT32_MAX },
+	[PROP_SRC_X] = { "SRC_X", DRM_MODE_PROP_RANGE, UINT32_MAX },
+	[PROP_SRC_Y] = { "SRC_Y", DRM_MODE_PROP_RANGE, UINT32_MAX },
+	[PROP_SRC_W] = { "SRC_W", DRM_MODE_PROP_RANGE, UINT32_MAX },
+	[PROP_SRC_H] = { "SRC_H", DRM_MODE_PROP_RANGE, UINT32_MAX },
+	[PROP_ZPOS] = { "zpos", DRM_MODE_PROP_RANGE, 255 },
+	[PROP_FB_DAMAGE_CLIPS] = { "FB_DAMAGE_CLIPS", DRM_MODE_PROP_BLOB },
+	[PROP_IN_FORMATS] = { "IN_FORMATS",
+		DRM_MODE_PROP_BLOB | DRM_MODE_PROP_IMMUTABLE },
+	[PROP_ALPHA] = { "alpha", DRM_MODE_PROP_RANGE, 0xffff },
+	[PROP_ACTIVE] = { "ACTIVE", DRM_MODE_PROP_RANGE, 1 },
+	[PROP_MODE_ID] = { "MODE_ID", DRM_MODE_PROP_BLOB },
+	[PROP_DPMS] = { "DPMS", DRM_MODE_PROP_ENUM },
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void sp_fake_default_config(struct sp_fake_config *config)
+{
+	memset(config, 0, sizeof(*config));
+	config->num_crtcs = 2;
+	config->num_overlays = 3;
+	config->cursors = 1;
+	config->width = 1920;
+	config->height = 1080;
+	config->refresh = 60;
+	config->event_hz = 60;
+	config->universal_planes = 1;
+}
+
+int sp_fake_parse_config(const char *options, struct sp_fake_config *config)
+{
+	char *copy, *opt, *save = NULL, *val;
+	int ret = 0;
+
+	copy = strdup(options);
+	if (!copy)
+		return -ENOMEM;
+
+	for (opt = strtok_r(copy, ",", &save); opt && !ret;
+	     opt = strtok_r(NULL, ",", &save)) {
+		val = strchr(opt, '=');
+		if (!val) {
+			ret = -EINVAL;
+			break;
+		}
+		*val++ = '\0';
+
+		if (!strcmp(opt, "crtcs"))
+			config->num_crtcs = atoi(val);
+		else if (!strcmp(opt, "overlays"))
+			config->num_overlays = atoi(val);
+		else if (!strcmp(opt, "cursors"))
+			config->cursors = atoi(val);
+		else if (!strcmp(opt, "universal"))
+			config->universal_planes = atoi(val);
+		else if (!strcmp(opt, "mode"))
+			ret = sscanf(val, "%ux%u", &config->width,
+					&config->height) == 2 ? 0 : -EINVAL;
+		else if (!strcmp(opt, "refresh"))
+			config->refresh = atoi(val);
+		else if (!strcmp(opt, "hz"))
+			config->event_hz = atoi(val);
+		else if (!strcmp(opt, "max_planes"))
+			config->max_planes = atoi(val);
+		else if (!strcmp(opt, "scaling"))
+			config->no_scaling = !atoi(val);
+		else
+			ret = -EINVAL;
+	}
+	free(copy);
+
+	/* possible_crtcs is a 32 bit mask */
+	if (config->num_crtcs < 1 || config->num_crtcs > 32 ||
+	    config->num_overlays < 0 || !config->width || !config->height ||
+	    !config->refresh)
+		ret = -EINVAL;
+	return ret;
+}
+
+static int blob_live(struct fake *fk, uint32_t blob_id)
+{
+	return blob_id && blob_id <= fk->num_blobs &&
+		fk->blobs[blob_id - 1].live;
+}
+
+static int create_blob_locked(struct sp_dev *dev, const void *data,
+		size_t size, uint32_t *blob_id)
+{
+	struct fake *fk = dev->ops_priv;
+	struct fake_blob *blobs, *b;
+
+	if (!data || !size || size > UINT32_MAX)
+		return -EINVAL;
+	blobs = realloc(fk->blobs, (fk->num_blobs + 1) * sizeof(*blobs));
+	if (!blobs)
+		return -ENOMEM;
+	fk->blobs = blobs;
+	b = &blobs[fk->num_blobs];
+	b->data = malloc(size);
+	if (!b->data)
+		return -ENOMEM;
+	memcpy(b->data, data, size);
+	b->length = size;
+	b->live = 1;
+	*blob_id = ++fk->num_blobs;
+	return 0;
+}
+
+static int destroy_blob_locked(struct sp_dev *dev, uint32_t blob_id)
+{
+	struct fake *fk = dev->ops_priv;
+	struct fake_blob *b;
+
+	if (!blob_live(fk, blob_id))
+		return -ENOENT;
+	b = &fk->blobs[blob_id - 1];
+	free(b->data);
+	b->data = NULL;
+	b->live = 0;
+	return 0;
+}
+
+static drmModePropertyBlobPtr get_blob_locked(struct sp_dev *dev,
+		uint32_t blob_id)
+{
+	struct fake *fk = dev->ops_priv;
+	drmModePropertyBlobPtr blob;
+	struct fake_blob *b;
+
+	if (!blob_live(fk, blob_id))
+		return NULL;
+	b = &fk->blobs[blob_id - 1];
+	blob = calloc(1, sizeof(*blob));
+	if (!blob)
+		return NULL;
+	/* drmModeFreePropertyBlob() frees both */
+	blob->data = malloc(b->length);
+	if (!blob->data) {
+		free(blob);
+		return NULL;
+	}
+	memcpy(blob->data, b->data, b->length);
+	blob->id = blob_id;
+	blob->length = b->length;
+	return blob;
+}
+
+static struct sp_props *make_props(uint32_t object_id, uint32_t object_type,
+		const int *ids, const uint64_t *values, int count)
+{
+	static const struct drm_mode_property_enum plane_types[] = {
+		{ DRM_PLANE_TYPE_OVERLAY, "Overlay" },
+		{ DRM_PLANE_TYPE_PRIMARY, "Primary" },
+		{ DRM_PLANE_TYPE_CURSOR, "Cursor" },
+	};
+	static const struct drm_mode_property_enum dpms[] = {
+		{ 0, "On" }, { 1, "Standby" }, { 2, "Suspend" }, { 3, "Off" },
+	};
+	struct sp_props *props;
+	struct sp_prop prop;
+	uint64_t range[2];
+	int i;
+
+	props = sp_props_alloc(object_id, object_type, count);
+	for (i = 0; props && i < count; i++) {
+		memset(&prop, 0, sizeof(prop));
+		prop.id = ids[i];
+		prop.flags = fake_props[ids[i]].flags;
+		snprintf(prop.name, sizeof(prop.name), "%s",
+			fake_props[ids[i]].name);
+		prop.value = values[i];
+		if (fake_props[ids[i]].max) {
+			range[0] = 0;
+			range[1] = fake_props[ids[i]].max;
+			prop.count_values = 2;
+			prop.values = range;
+		}
+		if (ids[i] == PROP_TYPE) {
+			prop.count_enums = 3;
+			prop.enums = (struct drm_mode_property_enum *)plane_types;
+		} else if (ids[i] == PROP_DPMS) {
+			prop.count_enums = 4;
+			prop.enums = (struct drm_mode_property_enum *)dpms;
+		}
+		if (sp_props_add(props, &prop)) {
+			sp_props_free(props);
+			props = NULL;
+		}
+	}
+	return props;
+}
+
+static void make_mode(drmModeModeInfoPtr m, uint32_t width, uint32_t height,
+		uint32_t refresh, int preferred)
+{
+	memset(m, 0, sizeof(*m));
+	m->hdisplay = width;
+	m->hsync_start = width + 48;
+	m->hsync_end = width + 80;
+	m->htotal = width + 160;
+	m->vdisplay = height;
+	m->vsync_start = height + 3;
+	m->vsync_end = height + 8;
+	m->vtotal = height + 30;
+	m->vrefresh = refresh;
+	m->clock = (uint64_t)m->htotal * m->vtotal * refresh / 1000;
+	m->type = DRM_MODE_TYPE_DRIVER |
+		(preferred ? DRM_MODE_TYPE_PREFERRED : 0);
+	snprintf(m->name, sizeof(m->name), "%ux%u", width, height);
+}
+
+static drmModeConnectorPtr make_connector(uint32_t id, int index,
+		uint32_t encoder_id, const struct sp_fake_config *config)
+{
+	static const uint32_t others[][2] = { { 1280, 720 }, { 640, 480 } };
+	drmModeConnectorPtr c;
+	unsigned i;
+
+	c = calloc(1, sizeof(*c));
+	if (!c)
+		return NULL;
+	c->connector_id = id;
+	c->connector_type = DRM_MODE_CONNECTOR_VIRTUAL;
+	c->connector_type_id = index + 1;
+	c->connection = DRM_MODE_CONNECTED;
+	c->mmWidth = 520;
+	c->mmHeight = 290;
+	c->subpixel = DRM_MODE_SUBPIXEL_UNKNOWN;
+
+	c->modes = calloc(3, sizeof(*c->modes));
+	c->encoders = malloc(sizeof(*c->encoders));
+	c->props = malloc(2 * sizeof(*c->props));
+	c->prop_values = calloc(2, sizeof(*c->prop_values));
+	if (!c->modes || !c->encoders || !c->props || !c->prop_values) {
+		drmModeFreeConnector(c);
+		return NULL;
+	}
+	make_mode(&c->modes[c->count_modes++], config->width, config->height,
+		config->refresh, 1);
+	for (i = 0; i < 2; i++) {
+		if (others[i][0] < config->width)
+			make_mode(&c->modes[c->count_modes++], others[i][0],
+				others[i][1], 60, 0);
+	}
+	c->count_encoders = 1;
+	c->encoders[0] = encoder_id;
+	c->count_props = 2;
+	c->props[0] = PROP_CRTC_ID;
+	c->props[1] = PROP_DPMS;
+	return c;
+}
+
+static drmModePlanePtr make_plane(uint32_t id, uint32_t possible_crtcs,
+		int type)
+{
+	static const uint32_t primary_formats[] = {
+		DRM_FORMAT_XRGB8888, DRM_FORMAT_ARGB8888, DRM_FORMAT_RGB565,
+		DRM_FORMAT_XRGB2101010,
+	};
+	static const uint32_t overlay_formats[] = {
+		DRM_FORMAT_XRGB8888, DRM_FORMAT_ARGB8888, DRM_FORMAT_ABGR8888,
+		DRM_FORMAT_RGB565, DRM_FORMAT_XRGB2101010, DRM_FORMAT_NV12,
+		DRM_FORMAT_YUV420, DRM_FORMAT_P010,
+	};
+	static const uint32_t cursor_formats[] = { DRM_FORMAT_ARGB8888 };
+	const uint32_t *formats;
+	drmModePlanePtr p;
+	uint32_t count;
+
+	if (type == DRM_PLANE_TYPE_PRIMARY) {
+		formats = primary_formats;
+		count = sizeof(primary_formats) / sizeof(primary_formats[0]);
+	} else if (type == DRM_PLANE_TYPE_CURSOR) {
+		formats = cursor_formats;
+		count = 1;
+	} else {
+		formats = overlay_formats;
+		count = sizeof(overlay_formats) / sizeof(overlay_formats[0]);
+	}
+
+	p = calloc(1, sizeof(*p));
+	if (!p)
+		return NULL;
+	p->plane_id = id;
+	p->possible_crtcs = possible_crtcs;
+	p->count_formats = count;
+	p->formats = malloc(count * sizeof(*p->formats));
+	if (!p->formats) {
+		free(p);
+		return NULL;
+	}
+	memcpy(p->formats, formats, count * sizeof(*p->formats));
+	return p;
+}
+
+static int is_yuv(uint32_t format)
+{
+	return format == DRM_FORMAT_NV12 || format == DRM_FORMAT_YUV420 ||
+		format == DRM_FORMAT_P010;
+}
+
+/*
+ * An IN_FORMATS blob laid out like the kernel's. Every format is LINEAR,
+ * primaries and overlays take X tiled RGB, and overlays Y tiled anything,
+ * like i915 planes.
+ */
+static int make_in_formats(struct sp_dev *dev, const drmModePlane *p,
+		int type, uint32_t *blob_id)
+{
+	const uint64_t tilings[] = {
+		DRM_FORMAT_MOD_LINEAR, I915_FORMAT_MOD_X_TILED,
+		I915_FORMAT_MOD_Y_TILED,
+	};
+	struct drm_format_modifier_blob *h;
+	struct drm_format_modifier *mods;
+	uint32_t i, count = p->count_formats, n = 1;
+	size_t size;
+	int ret;
+
+	if (type != DRM_PLANE_TYPE_CURSOR)
+		n = type == DRM_PLANE_TYPE_OVERLAY ? 3 : 2;
+	size = sizeof(*h) + ((count * sizeof(uint32_t) + 7) & ~7) +
+		n * sizeof(*mods);
+	h = calloc(1, size);
+	if (!h)
+		return -ENOMEM;
+	h->version = 1;
+	h->count_formats = count;
+	h->formats_offset = sizeof(*h);
+	h->count_modifiers = n;
+	h->modifiers_offset = size - n * sizeof(*mods);
+	memcpy((char *)h + h->formats_offset, p->formats,
+		count * sizeof(uint32_t));
+	mods = (struct drm_format_modifier *)((char *)h + h->modifiers_offset);
+	for (i = 0; i < n; i++)
+		mods[i].modifier = tilings[i];
+	for (i = 0; i < count && i < 64; i++) {
+		mods[0].formats |= 1ull << i;
+		if (n > 1 && !is_yuv(p->formats[i]))
+			mods[1].formats |= 1ull << i;
+		if (n > 2)
+			mods[2].formats |= 1ull << i;
+	}
+	ret = create_blob_locked(dev, h, size, blob_id);
+	free(h);
+	return ret;
+}
+
+static int add_plane(struct sp_dev *dev, uint32_t *next_id,
+		uint32_t possible_crtcs, int type, int zpos)
+{
+	static const int ids[] = {
+		PROP_TYPE, PROP_FB_ID, PROP_CRTC_ID, PROP_CRTC_X, PROP_CRTC_Y,
+		PROP_CRTC_W, PROP_CRTC_H, PROP_SRC_X, PROP_SRC_Y, PROP_SRC_W,
+		PROP_SRC_H, PROP_ZPOS, PROP_FB_DAMAGE_CLIPS, PROP_IN_FORMATS,
+		PROP_ALPHA,
+	};
+	uint64_t values[sizeof(ids) / sizeof(ids[0])] = { type };
+	struct sp_plane *plane = &dev->planes[dev->num_planes];
+	uint32_t id = (*next_id)++, blob_id;
+	int ret;
+
+	values[11] = zpos;
+	values[14] = 0xffff;
+	plane->plane = make_plane(id, possible_crtcs, type);
+	dev->num_planes++;
+	if (!plane->plane)
+		return -ENOMEM;
+	ret = make_in_formats(dev, plane->plane, type, &blob_id);
+	if (ret)
+		return ret;
+	values[13] = blob_id;
+	plane->props = make_props(id, DRM_MODE_OBJECT_PLANE, ids, values,
+			sizeof(ids) / sizeof(ids[0]));
+	return plane->props ? 0 : -ENOMEM;
+}
+
+int sp_fake_load_topology(struct sp_dev *dev,
+		const struct sp_fake_config *config)
+{
+	static const int crtc_ids[] = { PROP_ACTIVE, PROP_MODE_ID };
+	static const int connector_ids[] = { PROP_CRTC_ID, PROP_DPMS };
+	static const uint64_t zeros[2];
+	struct fake *fk = dev->ops_priv;
+	int n = config->num_crtcs, max_planes, i, zpos = 0, ret;
+	uint32_t next_id = 31, all = 0;
+
+	if (dev->ops != &sp_fake_kms_ops || dev->num_crtcs)
+		return -EINVAL;
+	fk->config = *config;
+	snprintf(fk->driver, sizeof(fk->driver), "fake");
+
+	max_planes = config->num_overlays +
+		(config->universal_planes ? n * (1 + !!config->cursors) : 0);
+	dev->connectors = calloc(n, sizeof(*dev->connectors));
+	dev->connector_props = calloc(n, sizeof(*dev->connector_props));
+	dev->encoders = calloc(n, sizeof(*dev->encoders));
+	dev->crtcs = calloc(n, sizeof(*dev->crtcs));
+	dev->planes = calloc(max_planes + 1, sizeof(*dev->planes));
+	fk->primary = malloc(n * sizeof(*fk->primary));
+	if (!dev->connectors || !dev->connector_props || !dev->encoders ||
+	    !dev->crtcs || !dev->planes || !fk->primary)
+		return -ENOMEM;
+	dev->num_connectors = dev->num_encoders = dev->num_crtcs = n;
+
+	for (i = 0; i < n; i++) {
+		drmModeEncoderPtr e;
+		drmModeCrtcPtr c;
+		uint32_t crtc_id = next_id++, encoder_id = next_id++;
+		uint32_t connector_id = next_id++;
+
+		c = calloc(1, sizeof(*c));
+		e = calloc(1, sizeof(*e));
+		dev->crtcs[i].crtc = c;
+		dev->encoders[i] = e;
+		if (!c || !e)
+			return -ENOMEM;
+		c->crtc_id = crtc_id;
+		c->gamma_size = 256;
+		e->encoder_id = encoder_id;
+		e->encoder_type = DRM_MODE_ENCODER_VIRTUAL;
+		e->possible_crtcs = 1 << i;
+
+		dev->connectors[i] = make_connector(connector_id, i, encoder_id,
+				config);
+		dev->crtcs[i].props = make_props(crtc_id, DRM_MODE_OBJECT_CRTC,
+				crtc_ids, zeros, 2);
+		dev->connector_props[i] = make_props(connector_id,
+				DRM_MODE_OBJECT_CONNECTOR, connector_ids, zeros,
+				2);
+		if (!dev->connectors[i] || !dev->crtcs[i].props ||
+		    !dev->connector_props[i])
+			return -ENOMEM;
+		all |= 1 << i;
+	}
+
+	/* Planes in the order drivers usually create them */
+	for (i = 0; i < n; i++) {
+		fk->primary[i] = -1;
+		if (!config->universal_planes)
+			continue;
+		fk->primary[i] = dev->num_planes;
+		ret = add_plane(dev, &next_id, 1 << i, DRM_PLANE_TYPE_PRIMARY,
+				0);
+		if (ret)
+			return ret;
+	}
+	for (i = 0; i < config->num_overlays; i++) {
+		ret = add_plane(dev, &next_id, all, DRM_PLANE_TYPE_OVERLAY,
+				++zpos);
+		if (ret)
+			return ret;
+	}
+	for (i = 0; config->universal_planes && config->cursors && i < n;
+	     i++) {
+		ret = add_plane(dev, &next_id, 1 << i, DRM_PLANE_TYPE_CURSOR,
+				zpos + 1);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+const char *sp_fake_driver(struct sp_dev *dev)
+{
+	struct fake *fk = dev->ops_priv;
+
+	return dev->ops == &sp_fake_kms_ops ? fk->driver : NULL;
+}
+
+void sp_fake_set_driver(struct sp_dev *dev, const char *driver)
+{
+	struct fake *fk = dev->ops_priv;
+
+	if (dev->ops == &sp_fake_kms_ops)
+		snprintf(fk->driver, sizeof(fk->driver), "%s", driver);
+}
+
+int sp_fake_get_stats(struct sp_dev *dev, struct sp_fake_stats *stats)
+{
+	struct fake *fk = dev->ops_priv;
+
+	if (dev->ops != &sp_fake_kms_ops)
+		return -EINVAL;
+	pthread_mutex_lock(&fk->lock);
+	*stats = fk->stats;
+	pthread_mutex_unlock(&fk->lock);
+	return 0;
+}
+
+static int fake_init(struct sp_dev *dev)
+{
+	struct fake *fk;
+
+	fk = calloc(1, sizeof(*fk));
+	if (!fk)
+		return -ENOMEM;
+
+	dev->fd = memfd_create("sp_fake", MFD_CLOEXEC);
+	if (dev->fd < 0) {
+		free(fk);
+		return -errno;
+	}
+	pthread_mutex_init(&fk->lock, NULL);
+	fk->start_ns = now_ns();
+	dev->ops_priv = fk;
+	return 0;
+}
+
+static void fake_destroy(struct sp_dev *dev)
+{
+	struct fake *fk = dev->ops_priv;
+	uint32_t i;
+
+	if (!fk)
+		return;
+	for (i = 0; i < fk->num_blobs; i++)
+		free(fk->blobs[i].data);
+	free(fk->blobs);
+	free(fk->bos);
+	free(fk->fbs);
+	free(fk->planes);
+	free(fk->next_planes);
+	free(fk->crtcs);
+	free(fk->next_crtcs);
+	free(fk->connector_crtcs);
+	free(fk->next_connector_crtcs);
+	free(fk->primary);
+	pthread_mutex_destroy(&fk->lock);
+	free(fk);
+	dev->ops_priv = NULL;
+}
+
+static int find_crtc(struct sp_dev *dev, uint32_t crtc_id)
+{
+	int i;
+
+	for (i = 0; i < dev->num_crtcs; i++) {
+		if (dev->crtcs[i].crtc->crtc_id == crtc_id)
+			return i;
+	}
+	return -1;
+}
+
+static int find_plane(struct sp_dev *dev, uint32_t plane_id)
+{
+	int i;
+
+	for (i = 0; i < dev->num_planes; i++) {
+		if (dev->planes[i].plane->plane_id == plane_id)
+			return i;
+	}
+	return -1;
+}
+
+static int find_connector(struct sp_dev *dev, uint32_t connector_id)
+{
+	int i;
+
+	for (i = 0; i < dev->num_connectors; i++) {
+		if (dev->connectors[i]->connector_id == connector_id)
+			return i;
+	}
+	return -1;
+}
+
+/* The CRTC the topology had the connector on, if it was lit */
+static uint32_t connector_crtc_id(struct sp_dev *dev, int index)
+{
+	const struct sp_prop *prop = NULL;
+	int pipe;
+
+	if (dev->connector_props[index])
+		prop = sp_props_find(dev->connector_props[index], "CRTC_ID");
+	if (!prop)
+		return 0;
+	pipe = find_crtc(dev, prop->value);
+	if (pipe < 0 || !dev->crtcs[pipe].crtc->mode_valid)
+		return 0;
+	return prop->value;
+}
+
+/* Plane, CRTC and connector state, set up on first use from the topology */
+static struct fake *fake_state(struct sp_dev *dev)
+{
+	struct fake *fk = dev->ops_priv;
+	int i, n;
+
+	if (fk->planes)
+		return fk;
+
+	n = dev->num_planes + 1;
+	fk->planes = calloc(n, sizeof(*fk->planes));
+	fk->next_planes = calloc(n, sizeof(*fk->next_planes));
+	n = dev->num_crtcs + 1;
+	fk->crtcs = calloc(n, sizeof(*fk->crtcs));
+	fk->next_crtcs = calloc(n, sizeof(*fk->next_crtcs));
+	n = dev->num_connectors + 1;
+	fk->connector_crtcs = calloc(n, sizeof(*fk->connector_crtcs));
+	fk->next_connector_crtcs = calloc(n,
+			sizeof(*fk->next_connector_crtcs));
+	if (!fk->planes || !fk->next_planes || !fk->crtcs ||
+	    !fk->next_crtcs || !fk->connector_crtcs ||
+	    !fk->next_connector_crtcs) {
+		free(fk->planes);
+		fk->planes = NULL;
+		return NULL;
+	}
+	fk->num_connectors = dev->num_connectors;
+
+	for (i = 0; i < dev->num_planes; i++) {
+		fk->planes[i].crtc_id = dev->planes[i].plane->crtc_id;
+		fk->planes[i].fb_id = dev->planes[i].plane->fb_id;
+	}
+	for (i = 0; i < dev->num_crtcs; i++) {
+		fk->crtcs[i].active = dev->crtcs[i].crtc->mode_valid;
+		fk->crtcs[i].has_mode = dev->crtcs[i].crtc->mode_valid;
+		fk->crtcs[i].fb_id = dev->crtcs[i].crtc->buffer_id;
+	}
+	for (i = 0; i < fk->num_connectors; i++)
+		fk->connector_crtcs[i] = connector_crtc_id(dev, i);
+	return fk;
+}
+
+static struct fake_bo *find_bo(struct fake *fk, uint32_t handle)
+{
+	if (!handle || handle > fk->num_bos || !fk->bos[handle - 1].live)
+		return NULL;
+	return &fk->bos[handle - 1];
+}
+
+static struct fake_fb *find_fb(struct fake *fk, uint32_t fb_id)
+{
+	if (!fb_id || fb_id > fk->num_fbs || !fk->fbs[fb_id - 1].live)
+		return NULL;
+	return &fk->fbs[fb_id - 1];
+}
+
+static int create_dumb(struct sp_dev *dev, struct drm_mode_create_dumb *cd)
+{
+	struct fake *fk = dev->ops_priv;
+	struct fake_bo *bos;
+	uint64_t pitch, size;
+
+	if (!cd->width || !cd->height || !cd->bpp) {
+		errno = EINVAL;
+		return -1;
+	}
+	pitch = ((uint64_t)cd->width * ((cd->bpp + 7) / 8) + 63) & ~63ull;
+	size = (pitch * cd->height + 4095) & ~4095ull;
+	if (pitch > UINT32_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	bos = realloc(fk->bos, (fk->num_bos + 1) * sizeof(*bos));
+	if (!bos) {
+		errno = ENOMEM;
+		return -1;
+	}
+	fk->bos = bos;
+
+	/* Sparse, pages only get allocated when drawn to */
+	if (ftruncate(dev->fd, fk->end + size))
+		return -1;
+	bos[fk->num_bos].offset = fk->end;
+	bos[fk->num_bos].size = size;
+	bos[fk->num_bos].live = 1;
+	fk->end += size;
+
+	cd->handle = ++fk->num_bos;
+	cd->pitch = pitch;
+	cd->size = size;
+	return 0;
+}
+
+static int ioctl_locked(struct sp_dev *dev, unsigned long request, void *arg)
+{
+	struct fake *fk = dev->ops_priv;
+	struct drm_mode_map_dumb *md;
+	struct fake_bo *bo;
+	uint32_t handle;
+
+	switch (request) {
+	case DRM_IOCTL_MODE_CREATE_DUMB:
+		return create_dumb(dev, arg);
+	case DRM_IOCTL_MODE_MAP_DUMB:
+		md = arg;
+		bo = find_bo(fk, md->handle);
+		if (!bo)
+			break;
+		md->offset = bo->offset;
+		return 0;
+	case DRM_IOCTL_MODE_DESTROY_DUMB:
+	case DRM_IOCTL_GEM_CLOSE:
+		/* Both start with the handle */
+		handle = *(uint32_t *)arg;
+		bo = find_bo(fk, handle);
+		if (!bo)
+			break;
+		fallocate(dev->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			bo->offset, bo->size);
+		bo->live = 0;
+		return 0;
+	default:
+		errno = ENOTTY;
+		return -1;
+	}
+	errno = ENOENT;
+	return -1;
+}
+
+static int add_fb2_locked(struct sp_dev *dev, uint32_t width,
+		uint32_t height, uint32_t format, const uint32_t handles[4],
+		const uint32_t pitches[4], const uint32_t offsets[4],
+		const uint64_t modifiers[4], uint32_t *fb_id, uint32_t flags)
+{
+	struct fake *fk = dev->ops_priv;
+	struct fake_bo *bo;
+	struct fake_fb *fbs;
+	int i;
+
+	if (!width || !height || !handles[0])
+		return -EINVAL;
+	for (i = 0; i < 4 && handles[i]; i++) {
+		bo = find_bo(fk, handles[i]);
+		if (!bo)
+			return -ENOENT;
+		if (offsets[i] + (uint64_t)pitches[i] * (i ? 1 : height) >
+				bo->size)
+			return -EINVAL;
+	}
+
+	fbs = realloc(fk->fbs, (fk->num_fbs + 1) * sizeof(*fbs));
+	if (!fbs)
+		return -ENOMEM;
+	fk->fbs = fbs;
+	fbs[fk->num_fbs].width = width;
+	fbs[fk->num_fbs].height = height;
+	fbs[fk->num_fbs].format = format;
+	fbs[fk->num_fbs].live = 1;
+	*fb_id = ++fk->num_fbs;
+	return 0;
+}
+
+static int rm_fb_locked(struct sp_dev *dev, uint32_t fb_id)
+{
+	struct fake_fb *fb = find_fb(dev->ops_priv, fb_id);
+
+	if (!fb)
+		return -ENOENT;
+	fb->live = 0;
+	return 0;
+}
+
+static int dirty_fb_locked(struct sp_dev *dev, uint32_t fb_id,
+		drmModeClipPtr clips, uint32_t num_clips)
+{
+	if (!find_fb(dev->ops_priv, fb_id))
+		return -ENOENT;
+	/* Like drivers that scan out straight from memory */
+	return -ENOSYS;
+}
+
+/*
+ * Planes enabled on a CRTC, counting the framebuffer the legacy calls put
+ * on it when the primary plane isn't listed.
+ */
+static int count_planes(struct sp_dev *dev, const struct fake_plane *planes,
+		const struct fake_crtc *crtcs, int pipe)
+{
+	struct fake *fk = dev->ops_priv;
+	uint32_t crtc_id = dev->crtcs[pipe].crtc->crtc_id;
+	int i, n = 0;
+
+	for (i = 0; i < dev->num_planes; i++) {
+		if (planes[i].fb_id && planes[i].crtc_id == crtc_id)
+			n++;
+	}
+	if (!fk->config.universal_planes && crtcs[pipe].fb_id)
+		n++;
+	return n;
+}
+
+static int plane_limit_ok(struct sp_dev *dev, const struct fake_plane *planes,
+		const struct fake_crtc *crtcs, int pipe)
+{
+	struct fake *fk = dev->ops_priv;
+
+	return !fk->config.max_planes ||
+		count_planes(dev, planes, crtcs, pipe) <=
+		fk->config.max_planes;
+}
+
+static int count_connectors(struct sp_dev *dev,
+		const uint32_t *connector_crtcs, int pipe)
+{
+	struct fake *fk = dev->ops_priv;
+	int i, n = 0;
+
+	for (i = 0; i < fk->num_connectors; i++)
+		n += connector_crtcs[i] == dev->crtcs[pipe].crtc->crtc_id;
+	return n;
+}
+
+static int set_crtc_locked(struct sp_dev *dev, uint32_t crtc_id,
+		uint32_t fb_id, uint32_t x, uint32_t y, uint32_t *connectors,
+		int count, drmModeModeInfoPtr mode)
+{
+	struct fake *fk = fake_state(dev);
+	int i, pipe, index;
+
+	if (!fk)
+		return -ENOMEM;
+	pipe = find_crtc(dev, crtc_id);
+	if (pipe < 0)
+		return -ENOENT;
+	if (fb_id && !find_fb(fk, fb_id))
+		return -ENOENT;
+	if (fb_id && (!mode || !count))
+		return -EINVAL;
+	for (i = 0; i < count; i++) {
+		if (find_connector(dev, connectors[i]) < 0)
+			return -ENOENT;
+	}
+
+	/* The connectors given replace the CRTC's, off it has none */
+	for (i = 0; i < fk->num_connectors; i++) {
+		if (fk->connector_crtcs[i] == crtc_id)
+			fk->connector_crtcs[i] = 0;
+	}
+	for (i = 0; fb_id && i < count; i++) {
+		index = find_connector(dev, connectors[i]);
+		if (index < fk->num_connectors)
+			fk->connector_crtcs[index] = crtc_id;
+	}
+	fk->crtcs[pipe].active = fk->crtcs[pipe].has_mode = !!fb_id;
+	fk->crtcs[pipe].fb_id = fb_id;
+
+	/* As drm_atomic_helper_set_config(), CRTCs it took the last of go off */
+	for (i = 0; i < dev->num_crtcs; i++) {
+		if (i == pipe || !fk->crtcs[i].has_mode ||
+		    count_connectors(dev, fk->connector_crtcs, i))
+			continue;
+		fk->crtcs[i].active = fk->crtcs[i].has_mode = 0;
+		fk->crtcs[i].fb_id = 0;
+		for (index = 0; index < dev->num_planes; index++) {
+			if (fk->planes[index].crtc_id ==
+			    dev->crtcs[i].crtc->crtc_id)
+				memset(&fk->planes[index], 0,
+					sizeof(fk->planes[index]));
+		}
+	}
+	if (fk->primary && fk->primary[pipe] >= 0) {
+		struct fake_plane *p = &fk->planes[fk->primary[pipe]];
+
+		memset(p, 0, sizeof(*p));
+		if (fb_id) {
+			p->crtc_id = crtc_id;
+			p->fb_id = fb_id;
+			p->crtc_w = mode->hdisplay;
+			p->crtc_h = mode->vdisplay;
+			p->src_w = mode->hdisplay << 16;
+			p->src_h = mode->vdisplay << 16;
+		}
+	}
+	return 0;
+}
+
+static int plane_has_format(struct sp_dev *dev, int index, uint32_t format)
+{
+	drmModePlanePtr p = dev->planes[index].plane;
+	uint32_t i;
+
+	for (i = 0; i < p->count_formats; i++) {
+		if (p->formats[i] == format)
+			return 1;
+	}
+	return 0;
+}
+
+/* What the kernel checks of a plane's state before it gets to the driver */
+static int check_plane(struct sp_dev *dev, int index,
+		const struct fake_plane *p, const struct fake_crtc *crtcs)
+{
+	struct fake *fk = dev->ops_priv;
+	struct fake_fb *fb;
+	int pipe;
+
+	if (!p->fb_id != !p->crtc_id)
+		return -EINVAL;
+	if (!p->fb_id)
+		return 0;
+
+	fb = find_fb(fk, p->fb_id);
+	if (!fb)
+		return -ENOENT;
+	pipe = find_crtc(dev, p->crtc_id);
+	if (pipe < 0)
+		return -ENOENT;
+	if (!(dev->planes[index].plane->possible_crtcs & (1 << pipe)) ||
+	    !crtcs[pipe].active)
+		return -EINVAL;
+	if (!plane_has_format(dev, index, fb->format))
+		return -EINVAL;
+	if (!p->crtc_w || !p->crtc_h || !p->src_w || !p->src_h)
+		return -EINVAL;
+	if ((uint64_t)p->src_x + p->src_w > (uint64_t)fb->width << 16 ||
+	    (uint64_t)p->src_y + p->src_h > (uint64_t)fb->height << 16)
+		return -ENOSPC;
+	/* As drm_atomic_helper_check_plane_state() without scaling allowed */
+	if (fk->config.no_scaling && (p->src_w != p->crtc_w << 16 ||
+				      p->src_h != p->crtc_h << 16))
+		return -ERANGE;
+	return 0;
+}
+
+static int set_plane_locked(struct sp_dev *dev, uint32_t plane_id,
+		uint32_t crtc_id, uint32_t fb_id, uint32_t flags,
+		int32_t crtc_x, int32_t crtc_y, uint32_t crtc_w,
+		uint32_t crtc_h, uint32_t src_x, uint32_t src_y,
+		uint32_t src_w, uint32_t src_h)
+{
+	struct fake *fk = fake_state(dev);
+	struct fake_plane p = {
+		fb_id ? crtc_id : 0, fb_id, crtc_x, crtc_y, crtc_w, crtc_h,
+		src_x, src_y, src_w, src_h,
+	};
+	struct fake_plane old;
+	int index, pipe, ret;
+
+	if (!fk)
+		return -ENOMEM;
+	index = find_plane(dev, plane_id);
+	if (index < 0)
+		return -ENOENT;
+	/* Like the kernel's, the call needs the CRTC lit and never lights it */
+	ret = check_plane(dev, index, &p, fk->crtcs);
+	if (!ret && fb_id) {
+		pipe = find_crtc(dev, crtc_id);
+		old = fk->planes[index];
+		fk->planes[index] = p;
+		if (!plane_limit_ok(dev, fk->planes, fk->crtcs, pipe)) {
+			fk->planes[index] = old;
+			ret = -EINVAL;
+		}
+	}
+	if (ret) {
+		fk->stats.rejected++;
+		return ret;
+	}
+	fk->planes[index] = p;
+	return 0;
+}
+
+static drmModePlanePtr get_plane_locked(struct sp_dev *dev,
+		uint32_t plane_id)
+{
+	struct fake *fk = fake_state(dev);
+	drmModePlanePtr p;
+	int index;
+
+	if (!fk)
+		return NULL;
+	index = find_plane(dev, plane_id);
+	if (index < 0)
+		return NULL;
+
+	p = malloc(sizeof(*p));
+	if (!p)
+		return NULL;
+	*p = *dev->planes[index].plane;
+	p->crtc_id = fk->planes[index].crtc_id;
+	p->fb_id = fk->planes[index].fb_id;
+	p->formats = NULL;
+	if (p->count_formats) {
+		p->formats = malloc(p->count_formats * sizeof(*p->formats));
+		if (!p->formats) {
+			free(p);
+			return NULL;
+		}
+		memcpy(p->formats, dev->planes[index].plane->formats,
+			p->count_formats * sizeof(*p->formats));
+	}
+	return p;
+}
+
+static const struct sp_props *find_props(struct sp_dev *dev,
+		uint32_t object_id, uint32_t object_type)
+{
+	int i;
+
+	for (i = 0; i < dev->num_planes; i++) {
+		if (dev->planes[i].props &&
+		    dev->planes[i].props->object_id == object_id &&
+		    dev->planes[i].props->object_type == object_type)
+			return dev->planes[i].props;
+	}
+	for (i = 0; i < dev->num_crtcs; i++) {
+		if (dev->crtcs[i].props &&
+		    dev->crtcs[i].props->object_id == object_id &&
+		    dev->crtcs[i].props->object_type == object_type)
+			return dev->crtcs[i].props;
+	}
+	for (i = 0; i < dev->num_connectors; i++) {
+		if (dev->connector_props[i] &&
+		    dev->connector_props[i]->object_id == object_id &&
+		    dev->connector_props[i]->object_type == object_type)
+			return dev->connector_props[i];
+	}
+	return NULL;
+}
+
+static struct sp_props *fake_get_props(struct sp_dev *dev,
+		uint32_t object_id, uint32_t object_type)
+{
+	const struct sp_props *props;
+	struct sp_props *copy;
+	int i;
+
+	props = find_props(dev, object_id, object_type);
+	if (!props) {
+		printf("failed to get properties of object %u\n", object_id);
+		return NULL;
+	}
+
+	copy = sp_props_alloc(object_id, object_type, props->count);
+	for (i = 0; copy && i < props->count; i++) {
+		if (sp_props_add(copy, &props->props[i])) {
+			sp_props_free(copy);
+			copy = NULL;
+		}
+	}
+	return copy;
+}
+
+static uint32_t *dup_ids(const uint32_t *ids, int count)
+{
+	uint32_t *copy = malloc((count + 1) * sizeof(*copy));
+
+	if (copy && count)
+		memcpy(copy, ids, count * sizeof(*copy));
+	return copy;
+}
+
+static drmModeResPtr fake_get_resources(struct sp_dev *dev)
+{
+	drmModeResPtr r;
+	int i;
+
+	r = calloc(1, sizeof(*r));
+	if (!r)
+		return NULL;
+	r->count_connectors = dev->num_connectors;
+	r->count_encoders = dev->num_encoders;
+	r->count_crtcs = dev->num_crtcs;
+	r->connectors = malloc((dev->num_connectors + 1) *
+			sizeof(*r->connectors));
+	r->encoders = malloc((dev->num_encoders + 1) * sizeof(*r->encoders));
+	r->crtcs = malloc((dev->num_crtcs + 1) * sizeof(*r->crtcs));
+	if (!r->connectors || !r->encoders || !r->crtcs) {
+		drmModeFreeResources(r);
+		return NULL;
+	}
+	for (i = 0; i < dev->num_connectors; i++)
+		r->connectors[i] = dev->connectors[i]->connector_id;
+	for (i = 0; i < dev->num_encoders; i++)
+		r->encoders[i] = dev->encoders[i]->encoder_id;
+	for (i = 0; i < dev->num_crtcs; i++)
+		r->crtcs[i] = dev->crtcs[i].crtc->crtc_id;
+	return r;
+}
+
+/* A fake connector stays as it was made up or snapshotted */
+static drmModeConnectorPtr fake_get_connector(struct sp_dev *dev,
+		uint32_t connector_id, int probe)
+{
+	drmModeConnectorPtr c = NULL, src;
+	int i;
+
+	i = find_connector(dev, connector_id);
+	if (i < 0)
+		return NULL;
+	src = dev->connectors[i];
+
+	c = malloc(sizeof(*c));
+	if (!c)
+		return NULL;
+	*c = *src;
+	c->modes = malloc((src->count_modes + 1) * sizeof(*c->modes));
+	c->encoders = dup_ids(src->encoders, src->count_encoders);
+	c->props = dup_ids(src->props, src->count_props);
+	c->prop_values = malloc((src->count_props + 1) *
+			sizeof(*c->prop_values));
+	if (!c->modes || !c->encoders || !c->props || !c->prop_values) {
+		drmModeFreeConnector(c);
+		return NULL;
+	}
+	if (src->count_modes)
+		memcpy(c->modes, src->modes,
+			src->count_modes * sizeof(*c->modes));
+	if (src->count_props)
+		memcpy(c->prop_values, src->prop_values,
+			src->count_props * sizeof(*c->prop_values));
+	return c;
+}
+
+static const char *prop_name(const struct sp_props *props, uint32_t id)
+{
+	int i;
+
+	for (i = 0; props && i < props->count; i++) {
+		if (props->props[i].id == id)
+			return props->props[i].name;
+	}
+	return NULL;
+}
+
+static int apply_plane_prop(struct fake_plane *p, const char *name,
+		uint64_t value, struct fake *fk)
+{
+	if (!strcmp(name, "FB_ID"))
+		p->fb_id = value;
+	else if (!strcmp(name, "CRTC_ID"))
+		p->crtc_id = value;
+	else if (!strcmp(name, "CRTC_X"))
+		p->crtc_x = value;
+	else if (!strcmp(name, "CRTC_Y"))
+		p->crtc_y = value;
+	else if (!strcmp(name, "CRTC_W"))
+		p->crtc_w = value;
+	else if (!strcmp(name, "CRTC_H"))
+		p->crtc_h = value;
+	else if (!strcmp(name, "SRC_X"))
+		p->src_x = value;
+	else if (!strcmp(name, "SRC_Y"))
+		p->src_y = value;
+	else if (!strcmp(name, "SRC_W"))
+		p->src_w = value;
+	else if (!strcmp(name, "SRC_H"))
+		p->src_h = value;
+	else if (!strcmp(name, "FB_DAMAGE_CLIPS"))
+		return !value || blob_live(fk, value) ? 0 : -ENOENT;
+	else if (!strcmp(name, "type") || !strcmp(name, "IN_FORMATS"))
+		return -EINVAL;
+	return 0;
+}
+
+/* Returns 1 when the property needs a modeset */
+static int apply_crtc_prop(struct fake_crtc *c, const char *name,
+		uint64_t value, struct fake *fk)
+{
+	if (!strcmp(name, "ACTIVE")) {
+		if (c->active == !!value)
+			return 0;
+		c->active = !!value;
+		return 1;
+	}
+	if (!strcmp(name, "MODE_ID")) {
+		if (value && !blob_live(fk, value))
+			return -ENOENT;
+		c->has_mode = !!value;
+		return 1;
+	}
+	return 0;
+}
+
+/* When the next vblank is and its number, 0 when events aren't paced */
+static uint64_t next_vblank(struct fake *fk, uint64_t *sequence)
+{
+	uint64_t t = now_ns(), period;
+
+	if (!fk->config.event_hz) {
+		*sequence = 0;
+		return t;
+	}
+	period = 1000000000ull / fk->config.event_hz;
+	*sequence = (t - fk->start_ns) / period + 1;
+	return fk->start_ns + *sequence * period;
+}
+
+/* The CRTC's next vblank, or now when events aren't paced */
+static void queue_flip(struct fake *fk, struct fake_crtc *c, void *user_data)
+{
+	uint64_t n;
+
+	c->due_ns = next_vblank(fk, &n);
+	c->sequence = n ? n : c->sequence + 1;
+	c->pending = 1;
+	c->user_data = user_data;
+	fk->stats.flips++;
+}
+
+static int check_commit(struct sp_dev *dev, const struct sp_atomic *req,
+		uint32_t flags, uint32_t *crtc_mask, int *modeset)
+{
+	struct fake *fk = dev->ops_priv;
+	struct fake_plane *planes = fk->next_planes;
+	struct fake_crtc *crtcs = fk->next_crtcs;
+	uint32_t *connector_crtcs = fk->next_connector_crtcs;
+	const struct sp_atomic_prop *ap;
+	const char *name;
+	int i, index, pipe, ret;
+
+	*modeset = 0;
+	memcpy(planes, fk->planes, dev->num_planes * sizeof(*planes));
+	memcpy(crtcs, fk->crtcs, dev->num_crtcs * sizeof(*crtcs));
+	memcpy(connector_crtcs, fk->connector_crtcs,
+		fk->num_connectors * sizeof(*connector_crtcs));
+	*crtc_mask = 0;
+
+	for (i = 0; i < req->count; i++) {
+		ap = &req->props[i];
+
+		index = find_plane(dev, ap->object_id);
+		if (index >= 0) {
+			name = prop_name(dev->planes[index].props,
+					ap->property_id);
+			if (!name)
+				return -ENOENT;
+			pipe = find_crtc(dev, planes[index].crtc_id);
+			if (pipe >= 0)
+				*crtc_mask |= 1 << pipe;
+			ret = apply_plane_prop(&planes[index], name, ap->value,
+					fk);
+			if (ret)
+				return ret;
+			pipe = find_crtc(dev, planes[index].crtc_id);
+			if (pipe >= 0)
+				*crtc_mask |= 1 << pipe;
+			continue;
+		}
+
+		pipe = find_crtc(dev, ap->object_id);
+		if (pipe >= 0) {
+			name = prop_name(dev->crtcs[pipe].props,
+					ap->property_id);
+			if (!name)
+				return -ENOENT;
+			ret = apply_crtc_prop(&crtcs[pipe], name, ap->value,
+					fk);
+			if (ret < 0)
+				return ret;
+			*modeset |= ret;
+			*crtc_mask |= 1 << pipe;
+			continue;
+		}
+
+		index = find_connector(dev, ap->object_id);
+		if (index >= 0 && index < fk->num_connectors) {
+			name = prop_name(dev->connector_props[index],
+					ap->property_id);
+			if (!name)
+				return -ENOENT;
+			if (strcmp(name, "CRTC_ID"))
+				continue;
+			if (ap->value && find_crtc(dev, ap->value) < 0)
+				return -ENOENT;
+			if (connector_crtcs[index] != ap->value)
+				*modeset = 1;
+			connector_crtcs[index] = ap->value;
+			continue;
+		}
+		return -ENOENT;
+	}
+
+	if (*modeset && !(flags & DRM_MODE_ATOMIC_ALLOW_MODESET))
+		return -EINVAL;
+
+	for (pipe = 0; pipe < dev->num_crtcs; pipe++) {
+		if (crtcs[pipe].active && !crtcs[pipe].has_mode)
+			return -EINVAL;
+		/* "enable/connector mismatch" in drm_atomic_helper_check_modeset() */
+		if (!crtcs[pipe].has_mode !=
+		    !count_connectors(dev, connector_crtcs, pipe))
+			return -EINVAL;
+		if (!(*crtc_mask & (1 << pipe)))
+			continue;
+		if (!plane_limit_ok(dev, planes, crtcs, pipe))
+			return -EINVAL;
+		if (flags & DRM_MODE_PAGE_FLIP_EVENT) {
+			if (!crtcs[pipe].active)
+				return -EINVAL;
+			if (fk->crtcs[pipe].pending)
+				return -EBUSY;
+		}
+	}
+	for (i = 0; i < dev->num_planes; i++) {
+		ret = check_plane(dev, i, &planes[i], crtcs);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+/* *modeset says whether a CRTC or connector was switched */
+static int commit_locked(struct sp_dev *dev, const struct sp_atomic *req,
+		uint32_t flags, void *user_data, int *modeset)
+{
+	const uint32_t known = DRM_MODE_ATOMIC_TEST_ONLY |
+		DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_ATOMIC_ALLOW_MODESET |
+		DRM_MODE_PAGE_FLIP_EVENT;
+	struct fake *fk = fake_state(dev);
+	struct fake_plane *planes;
+	struct fake_crtc *crtcs;
+	uint32_t *connector_crtcs, crtc_mask;
+	int pipe, ret;
+
+	*modeset = 0;
+	if (!fk)
+		return -ENOMEM;
+	if ((flags & ~known) || ((flags & DRM_MODE_ATOMIC_TEST_ONLY) &&
+				 (flags & DRM_MODE_PAGE_FLIP_EVENT)))
+		ret = -EINVAL;
+	else
+		ret = check_commit(dev, req, flags, &crtc_mask, modeset);
+	if (ret) {
+		fk->stats.rejected++;
+		return ret;
+	}
+	if (flags & DRM_MODE_ATOMIC_TEST_ONLY) {
+		fk->stats.test_commits++;
+		*modeset = 0;
+		return 0;
+	}
+
+	/* The checked state becomes the current one */
+	planes = fk->planes;
+	fk->planes = fk->next_planes;
+	fk->next_planes = planes;
+	crtcs = fk->crtcs;
+	fk->crtcs = fk->next_crtcs;
+	fk->next_crtcs = crtcs;
+	connector_crtcs = fk->connector_crtcs;
+	fk->connector_crtcs = fk->next_connector_crtcs;
+	fk->next_connector_crtcs = connector_crtcs;
+	fk->stats.commits++;
+
+	for (pipe = 0; pipe < dev->num_crtcs; pipe++) {
+		if ((flags & DRM_MODE_PAGE_FLIP_EVENT) &&
+		    (crtc_mask & (1 << pipe)))
+			queue_flip(fk, &fk->crtcs[pipe], user_data);
+	}
+	return 0;
+}
+
+static int page_flip_locked(struct sp_dev *dev, uint32_t crtc_id,
+		uint32_t fb_id, uint32_t flags, void *user_data)
+{
+	struct fake *fk = fake_state(dev);
+	struct fake_crtc *c;
+	int pipe;
+
+	if (!fk)
+		return -ENOMEM;
+	pipe = find_crtc(dev, crtc_id);
+	if (pipe < 0 || !find_fb(fk, fb_id))
+		return -ENOENT;
+	c = &fk->crtcs[pipe];
+	if (!c->active)
+		return -EINVAL;
+	if (c->pending)
+		return -EBUSY;
+
+	c->fb_id = fb_id;
+	if (fk->primary && fk->primary[pipe] >= 0)
+		fk->planes[fk->primary[pipe]].fb_id = fb_id;
+	if (flags & DRM_MODE_PAGE_FLIP_EVENT)
+		queue_flip(fk, c, user_data);
+	return 0;
+}
+
+/*
+ * Blocking modesets return at the vblank after, which is as quick as the
+ * kernel's get. Called with the lock dropped.
+ */
+static void wait_modeset(struct fake *fk)
+{
+	struct timespec ts;
+	uint64_t due, n;
+
+	if (!fk->config.event_hz)
+		return;
+	due = next_vblank(fk, &n);
+	ts.tv_sec = due / 1000000000ull;
+	ts.tv_nsec = due % 1000000000ull;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+			EINTR)
+		;
+}
+
+/* The calls threads make concurrently, see the threading notes in dev.h */
+static int fake_ioctl(struct sp_dev *dev, unsigned long request, void *arg)
+{
+	struct fake *fk = dev->ops_priv;
+	int ret, err;
+
+	pthread_mutex_lock(&fk->lock);
+	ret = ioctl_locked(dev, request, arg);
+	err = errno;
+	pthread_mutex_unlock(&fk->lock);
+	errno = err;
+	return ret;
+}
+
+static int fake_add_fb2(struct sp_dev *dev, uint32_t width,
+		uint32_t height, uint32_t format, const uint32_t handles[4],
+		const uint32_t pitches[4], const uint32_t offsets[4],
+		const uint64_t modifiers[4], uint32_t *fb_id, uint32_t flags)
+{
+	struct fake *fk = dev->ops_priv;
+	int ret;
+
+	pthread_mutex_lock(&fk->lock);
+	ret = add_fb2_locked(dev, width, height, format, handles, pitches,
+			offsets, modifiers, fb_id, flags);
+	pthread_mutex_unlock(&fk->lock);
+	return ret;
+}
+
+static int fake_rm_fb(struct sp_dev *dev, uint32_t fb_id)
+{
+	struct fake *fk = dev->ops_priv;
+	int ret;
+
+	pthread_mutex_lock(&fk->lock);
+	ret = rm_fb_locked(dev, fb_id);
+	pthread_mutex_unlock(&fk->lock);
+	return ret;
+}
+
+static int fake_dirty_fb(struct sp_dev *dev, uint32_t fb_id,
+		drmModeClipPtr clips, uint32_t num_clips)
+{
+	struct fake *fk = dev->ops_priv;
+	int ret;
+
+	pthread_mutex_lock(&fk->lock);
+	ret = dirty_fb_locked(dev, fb_id, clips, num_clips);
+	pthread_mutex_unlock(&fk->lock);
+	return ret;
+}
+
+static int fake_set_crtc(struct sp_dev *dev, uint32_t crtc_id,
+		uint32_t fb_id, uint32_t x, uint32_t y, uint32_t *connectors,
+		int count, drmModeModeInfoPtr mode)
+{
+	struct fake *fk = dev->ops_priv;
+	int ret;
+
+	pthread_mutex_lock(&fk->lock);
+	ret = set_crtc_locked(dev, crtc_id, fb_id, x, y, connectors, count,
+			mode);
+	pthread_mutex_unlock(&fk->lock);
+	if (!ret && fb_id)
+		wait_modeset(fk);
+	return ret;
+}
+
+static int fake_set_plane(struct sp_dev *dev, uint32_t plane_id,
+		uint32_t crtc_id, uint32_t fb_id, uint32_t flags,
+		int32_t crtc_x, int32_t crtc_y, uint32_t crtc_w,
+		uint32_t crtc_h, uint32_t src_x, uint32_t src_y,
+		uint32_t src_w, uint32_t src_h)
+{
+	struct fake *fk = dev->ops_priv;
+	int ret;
+
+	pthread_mutex_lock(&fk->lock);
+	ret = set_plane_locked(dev, plane_id, crtc_id, fb_id, flags, crtc_x,
+			crtc_y, crtc_w, crtc_h, src_x, src_y, src_w, src_h);
+	pthread_mutex_unlock(&fk->lock);
+	return ret;
+}
+
+static drmModePlanePtr fake_get_plane(struct sp_dev *dev, uint32_t plane_id)
+{
+	struct fake *fk = dev->ops_priv;
+	drmModePlanePtr p;
+
+	pthread_mutex_lock(&fk->lock);
+	p = get_plane_locked(dev, plane_id);
+	pthread_mutex_unlock(&fk->lock);
+	return p;
+}
+
+static int fake_create_blob(struct sp_dev *dev, const void *data,
+		size_t size, uint32_t *blob_id)
+{
+	struct fake *fk = dev->ops_priv;
+	int ret;
+
+	pthread_mutex_lock(&fk->lock);
+	ret = create_blob_locked(dev, data, size, blob_id);
+	pthread_mutex_unlock(&fk->lock);
+	return ret;
+}
+
+static int fake_destroy_blob(struct sp_dev *dev, uint32_t blob_id)
+{
+	struct fake *fk = dev->ops_priv;
+	int ret;
+
+	pthread_mutex_lock(&fk->lock);
+	ret = destroy_blob_locked(dev, blob_id);
+	pthread_mutex_unlock(&fk->lock);
+	return ret;
+}
+
+static drmModePropertyBlobPtr fake_get_blob(struct sp_dev *dev,
+		uint32_t blob_id)
+{
+	struct fake *fk = dev->ops_priv;
+	drmModePropertyBlobPtr blob;
+
+	pthread_mutex_lock(&fk->lock);
+	blob = get_blob_locked(dev, blob_id);
+	pthread_mutex_unlock(&fk->lock);
+	return blob;
+}
+
+static int fake_commit(struct sp_dev *dev, const struct sp_atomic *req,
+		uint32_t flags, void *user_data)
+{
+	struct fake *fk = dev->ops_priv;
+	int ret, modeset;
+
+	pthread_mutex_lock(&fk->lock);
+	ret = commit_locked(dev, req, flags, user_data, &modeset);
+	pthread_mutex_unlock(&fk->lock);
+	if (!ret && modeset && !(flags & DRM_MODE_ATOMIC_NONBLOCK))
+		wait_modeset(fk);
+	return ret;
+}
+
+static int fake_page_flip(struct sp_dev *dev, uint32_t crtc_id,
+		uint32_t fb_id, uint32_t flags, void *user_data)
+{
+	struct fake *fk = dev->ops_priv;
+	int ret;
+
+	pthread_mutex_lock(&fk->lock);
+	ret = page_flip_locked(dev, crtc_id, fb_id, flags, user_data);
+	pthread_mutex_unlock(&fk->lock);
+	return ret;
+}
+
+/*
+ * dev->fd is a memfd, which select() and poll() always find readable, so
+ * this waits for the earliest pending flip itself. Every flip due by then
+ * is delivered, whichever thread queued it, with the lock dropped so the
+ * handler can flip again.
+ */
+static int fake_handle_event(struct sp_dev *dev, drmEventContextPtr ctx)
+{
+	struct fake *fk = dev->ops_priv;
+	struct fake_crtc *c;
+	struct timespec ts;
+	uint64_t due = UINT64_MAX, t;
+	uint32_t sequence;
+	void *user_data;
+	int pipe;
+
+	pthread_mutex_lock(&fk->lock);
+	if (!fake_state(dev)) {
+		pthread_mutex_unlock(&fk->lock);
+		return -ENOMEM;
+	}
+	for (pipe = 0; pipe < dev->num_crtcs; pipe++) {
+		if (fk->crtcs[pipe].pending && fk->crtcs[pipe].due_ns < due)
+			due = fk->crtcs[pipe].due_ns;
+	}
+	pthread_mutex_unlock(&fk->lock);
+	if (due == UINT64_MAX)
+		return 0;
+
+	ts.tv_sec = due / 1000000000ull;
+	ts.tv_nsec = due % 1000000000ull;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+			EINTR)
+		;
+
+	t = now_ns();
+	for (pipe = 0; pipe < dev->num_crtcs; pipe++) {
+		pthread_mutex_lock(&fk->lock);
+		c = &fk->crtcs[pipe];
+		if (!c->pending || c->due_ns > t) {
+			pthread_mutex_unlock(&fk->lock);
+			continue;
+		}
+		c->pending = 0;
+		fk->stats.events++;
+		due = c->due_ns;
+		sequence = c->sequence;
+		user_data = c->user_data;
+		pthread_mutex_unlock(&fk->lock);
+
+		if (ctx->page_flip_handler)
+			ctx->page_flip_handler(dev->fd, sequence,
+				due / 1000000000ull,
+				due % 1000000000ull / 1000, user_data);
+	}
+	return 0;
+}
+
+const struct sp_kms_ops sp_fake_kms_ops = {
+	.init = fake_init,
+	.destroy = fake_destroy,
+	.ioctl = fake_ioctl,
+	.add_fb2 = fake_add_fb2,
+	.rm_fb = fake_rm_fb,
+	.dirty_fb = fake_dirty_fb,
+	.set_crtc = fake_set_crtc,
+	.set_plane = fake_set_plane,
+	.get_plane = fake_get_plane,
+	.create_blob = fake_create_blob,
+	.destroy_blob = fake_destroy_blob,
+	.get_blob = fake_get_blob,
+	.get_props = fake_get_props,
+	.get_resources = fake_get_resources,
+	.get_connector = fake_get_connector,
+	.commit = fake_commit,
+	.page_flip = fake_page_flip,
+	.handle_event = fake_handle_event,
+};
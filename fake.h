@@ -0,0 +1,72 @@
+#ifndef __FAKE_H_INCLUDED__
+#define __FAKE_H_INCLUDED__
+
+#include <stdint.h>
+
+struct sp_dev;
+struct sp_kms_ops;
+
+/*
+ * The topology of a made up device: every CRTC has a connector and encoder
+ * of its own, a primary plane and optionally a cursor when universal, and
+ * the overlays can go on any CRTC. IN_FORMATS has every format LINEAR,
+ * and i915's X tiling on primaries and overlays and Y tiling on overlays.
+ * Planes have zpos and alpha, which are taken but not checked.
+ */
+struct sp_fake_config {
+	int num_crtcs;
+	int num_overlays;
+	int cursors;		/* a cursor plane per CRTC */
+	/* Primary and cursor planes, as DRM_CLIENT_CAP_UNIVERSAL_PLANES gets */
+	int universal_planes;
+	uint32_t width;		/* of the preferred mode */
+	uint32_t height;
+	uint32_t refresh;
+	uint32_t event_hz;	/* vblanks per second, 0 for events at once */
+	int max_planes;		/* enabled per CRTC, 0 for no limit */
+	int no_scaling;		/* planes show fbs at their size, like vkms */
+};
+
+/*
+ * SP_DEV=fake[:options] creates one, options being a comma separated list
+ * of crtcs=<n>, overlays=<n>, cursors=<0|1>, universal=<0|1>,
+ * mode=<w>x<h>, refresh=<hz>, hz=<vblanks per second>, max_planes=<n> and
+ * scaling=<0|1>. Without options it has two 1920x1080@60 CRTCs, three
+ * overlays and cursors, universal planes, scaling planes, and sends
+ * events at 60 Hz.
+ */
+void sp_fake_default_config(struct sp_fake_config *config);
+int sp_fake_parse_config(const char *options, struct sp_fake_config *config);
+
+/* Fills in the topology of an sp_fake_kms_ops device that has none yet */
+int sp_fake_load_topology(struct sp_dev *dev,
+		const struct sp_fake_config *config);
+
+struct sp_fake_stats {
+	uint64_t commits;
+	uint64_t test_commits;	/* DRM_MODE_ATOMIC_TEST_ONLY */
+	uint64_t rejected;	/* commits and plane updates that failed */
+	uint64_t flips;
+	uint64_t events;	/* delivered by handle_event() */
+};
+
+/* -EINVAL if dev isn't answered by sp_fake_kms_ops */
+int sp_fake_get_stats(struct sp_dev *dev, struct sp_fake_stats *stats);
+
+/* What drmGetVersion() would name the driver, kept by snapshots */
+const char *sp_fake_driver(struct sp_dev *dev);
+void sp_fake_set_driver(struct sp_dev *dev, const char *driver);
+
+/*
+ * Answers an sp_dev's kernel calls from memory, for replayed snapshots
+ * (see snapshot.h) and made up devices. Dumb buffers live in a memfd
+ * (dev->fd) so they can be mapped and drawn to. Framebuffers, mode sets,
+ * plane updates and atomic commits are checked against the topology and
+ * then only recorded. Page flips and commits with
+ * DRM_MODE_PAGE_FLIP_EVENT complete at the CRTC's next vblank, which
+ * handle_event() waits for. Mode sets return at the next vblank, atomic
+ * ones unless DRM_MODE_ATOMIC_NONBLOCK. PRIME and gbm are not available.
+ */
+extern const struct sp_kms_ops sp_fake_kms_ops;
+
+#endif /* __FAKE_H_INCLUDED__ */
@@ -0,0 +1,264 @@
+/*
+ * Measures the userspace side of a frame on a fake device, with no kernel
+ * in the way: taking and returning planes, building atomic commits and
+ * having them checked, and whole frames of drawing, committing and waiting
+ * for the flip event.
+ *
+ *   fake_bench [planes] [frames]
+ *
+ * SP_DEV defaults to fake:hz=0, whose events arrive at once, so frames
+ * are only as slow as the code making them. SP_DEV=fake:hz=60 paces them
+ * like a display, SP_DEV=fake:max_planes=<n> has commits with more planes
+ * rejected, and a real node runs the same loop against the kernel.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+#include "bo.h"
+#include "dev.h"
+#include "fake.h"
+#include "modeset.h"
+
+#define PLANE_SIZE 64
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void flip_handler(int fd, unsigned int sequence, unsigned int tv_sec,
+		unsigned int tv_usec, void *user_data)
+{
+	*(int *)user_data = 0;
+}
+
+static void bench_planes(struct sp_dev *dev, struct sp_crtc *crtc,
+		int frames)
+{
+	struct sp_plane *plane;
+	double start;
+	int i, n = 0;
+
+	start = now();
+	for (i = 0; i < frames; i++) {
+		plane = get_sp_plane(dev, crtc);
+		if (!plane)
+			break;
+		put_sp_plane(plane);
+		n++;
+	}
+	if (n)
+		printf("get/put plane      %8.3f us\n",
+			(now() - start) * 1e6 / n);
+}
+
+static int build(struct sp_dev *dev, struct sp_atomic *req,
+		struct sp_crtc *crtc, struct sp_plane **planes, int num_planes,
+		int frame)
+{
+	int i, ret;
+
+	sp_atomic_reset(req);
+	for (i = 0; i < num_planes; i++) {
+		ret = set_sp_plane_pset(dev, planes[i], req, crtc,
+				(frame * 4 + i * PLANE_SIZE) %
+				(crtc->crtc->mode.hdisplay - PLANE_SIZE),
+				i * PLANE_SIZE % (crtc->crtc->mode.vdisplay -
+					PLANE_SIZE));
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+/* Drops planes until a commit with the rest would be taken */
+static int fit_planes(struct sp_dev *dev, struct sp_atomic *req,
+		struct sp_crtc *crtc, struct sp_plane **planes, int num_planes)
+{
+	while (num_planes > 0) {
+		if (!build(dev, req, crtc, planes, num_planes, 0) &&
+		    !sp_atomic_commit(dev, req, DRM_MODE_ATOMIC_TEST_ONLY,
+				      NULL))
+			return num_planes;
+		num_planes--;
+	}
+	return 0;
+}
+
+static int bench_commits(struct sp_dev *dev, struct sp_atomic *req,
+		struct sp_crtc *crtc, struct sp_plane **planes, int num_planes,
+		int frames)
+{
+	double t_build = 0, t_test = 0, start;
+	int i, ret;
+
+	for (i = 0; i < frames; i++) {
+		start = now();
+		ret = build(dev, req, crtc, planes, num_planes, i);
+		t_build += now() - start;
+		if (ret)
+			return ret;
+
+		start = now();
+		ret = sp_atomic_commit(dev, req, DRM_MODE_ATOMIC_TEST_ONLY,
+				NULL);
+		t_test += now() - start;
+		if (ret) {
+			printf("test commit failed ret=%d\n", ret);
+			return ret;
+		}
+	}
+	printf("build commit       %8.3f us (%d props)\n",
+		t_build * 1e6 / frames, req->count);
+	printf("test commit        %8.3f us\n", t_test * 1e6 / frames);
+	return 0;
+}
+
+static int bench_frames(struct sp_dev *dev, struct sp_atomic *req,
+		struct sp_crtc *crtc, struct sp_plane **planes, int num_planes,
+		int frames)
+{
+	drmEventContext ctx = {};
+	double t_draw = 0, start, total;
+	int i, j, ret, pending;
+
+	ctx.version = DRM_EVENT_CONTEXT_VERSION;
+	ctx.page_flip_handler = flip_handler;
+
+	total = now();
+	for (i = 0; i < frames; i++) {
+		start = now();
+		for (j = 0; j < num_planes; j++)
+			draw_rect(planes[j]->bo, i % (PLANE_SIZE - 8), 0, 8,
+				PLANE_SIZE, 0xff, i, j * 0x40, 0xff - i);
+		t_draw += now() - start;
+
+		ret = build(dev, req, crtc, planes, num_planes, i);
+		if (ret)
+			return ret;
+
+		pending = 1;
+		ret = sp_atomic_commit(dev, req, DRM_MODE_PAGE_FLIP_EVENT,
+				&pending);
+		if (ret) {
+			printf("commit failed ret=%d\n", ret);
+			return ret;
+		}
+		while (pending) {
+			ret = dev->ops->handle_event(dev, &ctx);
+			if (ret) {
+				printf("failed to handle event ret=%d\n", ret);
+				return ret;
+			}
+		}
+	}
+	total = now() - total;
+
+	printf("draw               %8.3f us\n", t_draw * 1e6 / frames);
+	printf("frame              %8.3f us, %.0f frames/s\n",
+		total * 1e6 / frames, frames / total);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int num_planes = argc > 1 ? atoi(argv[1]) : 0;
+	int frames = argc > 2 ? atoi(argv[2]) : 10000;
+	struct sp_plane **planes = NULL;
+	struct sp_fake_stats stats;
+	struct sp_atomic *req = NULL;
+	struct sp_crtc *crtc = NULL;
+	struct sp_dev *dev;
+	int i, n = 0, ret;
+
+	setenv("SP_DEV", "fake:hz=0", 0);
+	if (frames < 1)
+		frames = 1;
+
+	dev = create_sp_dev();
+	if (!dev) {
+		printf("Failed to create sp_dev\n");
+		return -1;
+	}
+
+	ret = initialize_screens(dev);
+	if (ret) {
+		printf("Failed to initialize screens\n");
+		goto out;
+	}
+	for (i = 0; i < dev->num_crtcs; i++) {
+		if (dev->crtcs[i].scanout) {
+			crtc = &dev->crtcs[i];
+			break;
+		}
+	}
+	if (!crtc) {
+		printf("No active crtc\n");
+		ret = -1;
+		goto out;
+	}
+
+	bench_planes(dev, crtc, frames);
+
+	if (num_planes < 1)
+		num_planes = dev->num_planes;
+	planes = calloc(num_planes, sizeof(*planes));
+	req = sp_atomic_alloc();
+	if (!planes || !req) {
+		ret = -1;
+		goto out;
+	}
+	for (n = 0; n < num_planes; n++) {
+		planes[n] = get_sp_plane(dev, crtc);
+		if (!planes[n])
+			break;
+		planes[n]->bo = create_sp_bo(dev, PLANE_SIZE, PLANE_SIZE, 24,
+				sp_format_bpp(planes[n]->format),
+				planes[n]->format, 0);
+		if (!planes[n]->bo) {
+			put_sp_plane(planes[n]);
+			break;
+		}
+		fill_bo(planes[n]->bo, 0xff, 0x00, 0x00, 0xff);
+	}
+
+	num_planes = fit_planes(dev, req, crtc, planes, n);
+	printf("%s: %d of %d planes on crtc %d, %d frames\n",
+		sp_fake_driver(dev) ? "fake" : "kernel", num_planes, n,
+		crtc->pipe, frames);
+	if (!num_planes) {
+		ret = -1;
+		goto out;
+	}
+
+	ret = bench_commits(dev, req, crtc, planes, num_planes, frames);
+	if (!ret)
+		ret = bench_frames(dev, req, crtc, planes, num_planes, frames);
+
+	if (!sp_fake_get_stats(dev, &stats))
+		printf("fake: %llu commits, %llu test commits, %llu rejected, "
+			"%llu flips, %llu events\n",
+			(unsigned long long)stats.commits,
+			(unsigned long long)stats.test_commits,
+			(unsigned long long)stats.rejected,
+			(unsigned long long)stats.flips,
+			(unsigned long long)stats.events);
+	print_sp_dev_stats(dev);
+
+out:
+	for (i = 0; i < n; i++)
+		put_sp_plane(planes[i]);
+	sp_atomic_free(req);
+	free(planes);
+	destroy_sp_dev(dev);
+	printf("%s\n", ret ? "FAIL" : "PASS");
+	return ret;
+}
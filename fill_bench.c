@@ -0,0 +1,150 @@
+/*
+ * Measures fill_bo() throughput on dumb buffers for each format draw_rect()
+ * supports and a few common scanout sizes. The 8888 formats are also timed
+ * with the per-pixel loop draw_rect() used to run, so span writers can be
+ * compared on a given driver (e.g. vkms).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+#include <drm_fourcc.h>
+
+#include "bo.h"
+#include "dev.h"
+
+static const uint32_t formats[] = {
+	DRM_FORMAT_XRGB8888,
+	DRM_FORMAT_ARGB8888,
+	DRM_FORMAT_RGBA8888,
+	DRM_FORMAT_ABGR8888,
+	DRM_FORMAT_XRGB2101010,
+	DRM_FORMAT_XBGR2101010,
+	DRM_FORMAT_ABGR16161616F,
+	DRM_FORMAT_BGR888,
+	DRM_FORMAT_RGB565,
+};
+
+static const struct {
+	uint32_t width;
+	uint32_t height;
+} sizes[] = {
+	{ 640, 480 },
+	{ 1920, 1080 },
+	{ 3840, 2160 },
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* The per-pixel loop draw_rect() used before span writers, for reference */
+static void legacy_fill(struct sp_bo *bo, uint8_t a, uint8_t r, uint8_t g,
+		uint8_t b)
+{
+	uint8_t *map = sp_bo_map(bo, 0);
+	uint32_t i, j;
+
+	for (i = 0; map && i < bo->height; i++) {
+		uint8_t *row = map + i * bo->pitch;
+
+		for (j = 0; j < bo->width; j++) {
+			uint8_t *pixel = row + j * 4;
+
+			if (bo->format == DRM_FORMAT_ARGB8888 ||
+			    bo->format == DRM_FORMAT_XRGB8888)
+			{
+				pixel[0] = b;
+				pixel[1] = g;
+				pixel[2] = r;
+				pixel[3] = a;
+			} else if (bo->format == DRM_FORMAT_RGBA8888) {
+				pixel[0] = r;
+				pixel[1] = g;
+				pixel[2] = b;
+				pixel[3] = a;
+			}
+		}
+	}
+}
+
+static double run(struct sp_bo *bo, int legacy, int iterations)
+{
+	double start, secs;
+	int i;
+
+	start = now();
+	for (i = 0; i < iterations; i++) {
+		if (legacy)
+			legacy_fill(bo, 0xFF, i, i >> 1, i >> 2);
+		else
+			fill_bo(bo, 0xFF, i, i >> 1, i >> 2);
+	}
+	secs = now() - start;
+
+	return (double)bo->width * bo->height * iterations / secs;
+}
+
+int main(int argc, char *argv[])
+{
+	struct sp_dev *dev;
+	int iterations = 50;
+	unsigned i, j;
+
+	if (argc > 1)
+		iterations = atoi(argv[1]);
+	if (iterations <= 0)
+		iterations = 1;
+
+	dev = create_sp_dev();
+	if (!dev) {
+		printf("Failed to create sp_dev\n");
+		return -1;
+	}
+
+	printf("span writer: %s, %d iterations\n", sp_bo_fill_impl(),
+		iterations);
+
+	for (i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+		for (j = 0; j < sizeof(sizes) / sizeof(sizes[0]); j++) {
+			struct sp_bo *bo;
+			uint32_t bpp = sp_format_bpp(formats[i]);
+			double legacy = 0, span;
+
+			bo = create_sp_bo(dev, sizes[j].width, sizes[j].height,
+					bpp == 32 ? 24 : bpp, bpp, formats[i], 0);
+			if (!bo) {
+				printf("%.4s %ux%u: unsupported, skipping\n",
+					(char *)&formats[i], sizes[j].width,
+					sizes[j].height);
+				continue;
+			}
+
+			/* legacy_fill() only knows the original 8888 formats */
+			if (i < 3)
+				legacy = run(bo, 1, iterations);
+			span = run(bo, 0, iterations);
+			printf("%.4s %4ux%-4u span %7.1f Mpix/s %6.2f GB/s",
+				(char *)&formats[i], sizes[j].width,
+				sizes[j].height, span / 1e6,
+				span * bpp / 8 / 1e9);
+			if (legacy)
+				printf("  legacy %6.2f GB/s  (%.1fx)",
+					legacy * 4 / 1e9, span / legacy);
+			printf("\n");
+
+			free_sp_bo(bo);
+		}
+	}
+
+	destroy_sp_dev(dev);
+	return 0;
+}
@@ -0,0 +1,412 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <linux/netlink.h>
+
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+#include "dev.h"
+#include "hotplug.h"
+
+struct sp_hotplug {
+	struct sp_dev *dev;
+	int fd;
+	dev_t rdev;
+
+	int num_changes;
+	int max_changes;
+	struct sp_connector_change *changes;
+};
+
+struct sp_hotplug *sp_hotplug_create(struct sp_dev *dev)
+{
+	struct sockaddr_nl addr;
+	struct sp_hotplug *hp;
+	struct stat st;
+
+	hp = calloc(1, sizeof(*hp));
+	if (!hp) {
+		printf("Failed to allocate hotplug\n");
+		return NULL;
+	}
+	hp->dev = dev;
+
+	/* A replayed device has no node, and only ever sees refreshes */
+	if (!fstat(dev->fd, &st) && S_ISCHR(st.st_mode))
+		hp->rdev = st.st_rdev;
+
+	hp->fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			NETLINK_KOBJECT_UEVENT);
+	if (hp->fd < 0) {
+		printf("Failed to open uevent socket %d\n", errno);
+		goto err;
+	}
+
+	/* Group 1 carries the kernel's own uevents, not udev's */
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = 1;
+	if (bind(hp->fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		printf("Failed to bind uevent socket %d\n", errno);
+		goto err;
+	}
+	return hp;
+
+err:
+	if (hp->fd >= 0)
+		close(hp->fd);
+	free(hp);
+	return NULL;
+}
+
+void sp_hotplug_destroy(struct sp_hotplug *hp)
+{
+	close(hp->fd);
+	free(hp->changes);
+	free(hp);
+}
+
+int sp_hotplug_fd(struct sp_hotplug *hp)
+{
+	return hp->fd;
+}
+
+static struct sp_connector_change *add_change(struct sp_hotplug *hp,
+		uint32_t connector_id)
+{
+	struct sp_connector_change *change;
+	int i;
+
+	for (i = 0; i < hp->num_changes; i++) {
+		if (hp->changes[i].connector_id == connector_id)
+			return &hp->changes[i];
+	}
+
+	if (hp->num_changes == hp->max_changes) {
+		int max = hp->max_changes ? hp->max_changes * 2 : 8;
+
+		change = realloc(hp->changes, max * sizeof(*change));
+		if (!change)
+			return NULL;
+		hp->changes = change;
+		hp->max_changes = max;
+	}
+	change = &hp->changes[hp->num_changes++];
+	change->connector_id = connector_id;
+	change->index = -1;
+	change->flags = 0;
+	return change;
+}
+
+static int find_connector(struct sp_dev *dev, uint32_t connector_id)
+{
+	int i;
+
+	for (i = 0; i < dev->num_connectors; i++) {
+		if (dev->connectors[i]->connector_id == connector_id)
+			return i;
+	}
+	return -1;
+}
+
+static uint32_t diff_connector(drmModeConnectorPtr old,
+		drmModeConnectorPtr c)
+{
+	uint32_t flags = 0;
+
+	if (old->connection != c->connection) {
+		if (c->connection == DRM_MODE_CONNECTED)
+			flags |= SP_CONNECTOR_CONNECTED;
+		else if (old->connection == DRM_MODE_CONNECTED)
+			flags |= SP_CONNECTOR_DISCONNECTED;
+	}
+	if (old->count_modes != c->count_modes ||
+	    old->mmWidth != c->mmWidth || old->mmHeight != c->mmHeight ||
+	    (c->count_modes && memcmp(old->modes, c->modes,
+			c->count_modes * sizeof(*c->modes))))
+		flags |= SP_CONNECTOR_MODES;
+	/* The EDID blob gets a new ID when the EDID changes */
+	if (old->count_props != c->count_props ||
+	    (c->count_props && (memcmp(old->props, c->props,
+			c->count_props * sizeof(*c->props)) ||
+	     memcmp(old->prop_values, c->prop_values,
+			c->count_props * sizeof(*c->prop_values)))))
+		flags |= SP_CONNECTOR_PROPERTIES;
+	return flags;
+}
+
+static drmModeConnectorPtr get_connector(struct sp_dev *dev,
+		uint32_t connector_id, drmModeConnectorPtr old)
+{
+	drmModeConnectorPtr c;
+
+	c = dev->ops->get_connector(dev, connector_id, 0);
+	dev->stats.ioctls++;
+	if (!c || c->connection != DRM_MODE_CONNECTED)
+		return c;
+
+	/*
+	 * The cached state is enough unless the connector has just been
+	 * connected and nothing has probed its modes yet.
+	 */
+	if (c->count_modes &&
+	    (!old || old->connection == DRM_MODE_CONNECTED))
+		return c;
+
+	drmModeFreeConnector(c);
+	c = dev->ops->get_connector(dev, connector_id, 1);
+	dev->stats.ioctls++;
+	return c;
+}
+
+static int refresh_connector(struct sp_hotplug *hp, int index)
+{
+	struct sp_dev *dev = hp->dev;
+	drmModeConnectorPtr old = dev->connectors[index], c;
+	struct sp_connector_change *change;
+	uint32_t flags;
+
+	c = get_connector(dev, old->connector_id, old);
+	if (!c) {
+		/* Unplugged MST connectors disappear, refresh() lists them */
+		return errno == ENOENT ? -ENOENT : 0;
+	}
+
+	flags = diff_connector(old, c);
+	if (!flags) {
+		drmModeFreeConnector(c);
+		return 0;
+	}
+
+	change = add_change(hp, c->connector_id);
+	if (!change) {
+		drmModeFreeConnector(c);
+		return -ENOMEM;
+	}
+	change->index = index;
+	change->flags |= flags;
+
+	drmModeFreeConnector(old);
+	dev->connectors[index] = c;
+	sp_props_free(dev->connector_props[index]);
+	dev->connector_props[index] = NULL;
+	return 0;
+}
+
+static int remove_connector(struct sp_hotplug *hp, int index)
+{
+	struct sp_dev *dev = hp->dev;
+	struct sp_connector_change *change;
+	int i, n;
+
+	change = add_change(hp, dev->connectors[index]->connector_id);
+	if (!change)
+		return -ENOMEM;
+	change->index = -1;
+	change->flags = SP_CONNECTOR_REMOVED;
+
+	drmModeFreeConnector(dev->connectors[index]);
+	sp_props_free(dev->connector_props[index]);
+
+	n = dev->num_connectors - index - 1;
+	memmove(&dev->connectors[index], &dev->connectors[index + 1],
+		n * sizeof(*dev->connectors));
+	memmove(&dev->connector_props[index], &dev->connector_props[index + 1],
+		n * sizeof(*dev->connector_props));
+	dev->num_connectors--;
+
+	/* Changes already made point past the hole */
+	for (i = 0; i < hp->num_changes; i++) {
+		if (hp->changes[i].index > index)
+			hp->changes[i].index--;
+	}
+	return 0;
+}
+
+static int add_connector(struct sp_hotplug *hp, uint32_t connector_id)
+{
+	struct sp_dev *dev = hp->dev;
+	struct sp_connector_change *change;
+	drmModeConnectorPtr *connectors, c;
+	struct sp_props **props;
+	int n = dev->num_connectors + 1;
+
+	c = get_connector(dev, connector_id, NULL);
+	if (!c)
+		return 0;
+
+	connectors = realloc(dev->connectors, n * sizeof(*connectors));
+	if (!connectors)
+		goto err;
+	dev->connectors = connectors;
+	props = realloc(dev->connector_props, n * sizeof(*props));
+	if (!props)
+		goto err;
+	dev->connector_props = props;
+
+	change = add_change(hp, connector_id);
+	if (!change)
+		goto err;
+	change->index = dev->num_connectors;
+	change->flags = SP_CONNECTOR_ADDED;
+	if (c->connection == DRM_MODE_CONNECTED)
+		change->flags |= SP_CONNECTOR_CONNECTED;
+
+	dev->connectors[dev->num_connectors] = c;
+	dev->connector_props[dev->num_connectors] = NULL;
+	dev->num_connectors++;
+	return 0;
+
+err:
+	drmModeFreeConnector(c);
+	return -ENOMEM;
+}
+
+/*
+ * Connectors can come and go (DP MST), so the connector list is read again
+ * before refreshing the ones that stayed.
+ */
+static int refresh_all(struct sp_hotplug *hp)
+{
+	struct sp_dev *dev = hp->dev;
+	drmModeResPtr r;
+	int i, j, ret = 0;
+
+	r = dev->ops->get_resources(dev);
+	dev->stats.ioctls++;
+	if (!r)
+		return errno ? -errno : -ENODEV;
+
+	for (i = 0; i < dev->num_connectors && !ret; ) {
+		for (j = 0; j < r->count_connectors; j++) {
+			if (r->connectors[j] ==
+			    dev->connectors[i]->connector_id)
+				break;
+		}
+		if (j == r->count_connectors) {
+			ret = remove_connector(hp, i);
+			continue;
+		}
+		ret = refresh_connector(hp, i++);
+		if (ret == -ENOENT)
+			ret = 0;
+	}
+	for (j = 0; j < r->count_connectors && !ret; j++) {
+		if (find_connector(dev, r->connectors[j]) < 0)
+			ret = add_connector(hp, r->connectors[j]);
+	}
+
+	drmModeFreeResources(r);
+	return ret;
+}
+
+static int refresh(struct sp_hotplug *hp, uint32_t connector_id)
+{
+	int index, ret;
+
+	index = connector_id ? find_connector(hp->dev, connector_id) : -1;
+	if (index < 0)
+		return refresh_all(hp);
+	ret = refresh_connector(hp, index);
+	return ret == -ENOENT ? refresh_all(hp) : ret;
+}
+
+int sp_hotplug_refresh(struct sp_hotplug *hp, uint32_t connector_id,
+		const struct sp_connector_change **changes)
+{
+	int ret;
+
+	hp->num_changes = 0;
+	ret = refresh(hp, connector_id);
+	*changes = hp->changes;
+	return ret ? ret : hp->num_changes;
+}
+
+/*
+ * A kernel uevent is "ACTION@DEVPATH" followed by KEY=VALUE strings, each
+ * NUL terminated. DRM sends HOTPLUG=1, with CONNECTOR=<id> (and
+ * PROPERTY=<id>) when the driver knows which connector changed.
+ */
+static int parse_uevent(struct sp_hotplug *hp, const char *buf, int len,
+		uint32_t *connector_id)
+{
+	int drm = 0, hotplug = 0, major = -1, minor = -1;
+	const char *s, *end = buf + len;
+
+	*connector_id = 0;
+	for (s = buf; s < end; s += strlen(s) + 1) {
+		if (!strcmp(s, "SUBSYSTEM=drm"))
+			drm = 1;
+		else if (!strcmp(s, "HOTPLUG=1"))
+			hotplug = 1;
+		else if (!strncmp(s, "MAJOR=", 6))
+			major = atoi(s + 6);
+		else if (!strncmp(s, "MINOR=", 6))
+			minor = atoi(s + 6);
+		else if (!strncmp(s, "CONNECTOR=", 10))
+			*connector_id = strtoul(s + 10, NULL, 10);
+	}
+	if (!drm || !hotplug)
+		return 0;
+
+	/* Another GPU's hotplug */
+	if (!hp->rdev || major != (int)major(hp->rdev) ||
+	    minor != (int)minor(hp->rdev))
+		return 0;
+	return 1;
+}
+
+int sp_hotplug_dispatch(struct sp_hotplug *hp,
+		const struct sp_connector_change **changes)
+{
+	char buf[4096];
+	struct sockaddr_nl addr;
+	struct iovec iov = { .iov_base = buf, .iov_len = sizeof(buf) - 1 };
+	struct msghdr msg = {
+		.msg_name = &addr,
+		.msg_namelen = sizeof(addr),
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+	};
+	uint32_t connector_id;
+	ssize_t len;
+	int ret = 0;
+
+	hp->num_changes = 0;
+	*changes = hp->changes;
+
+	for (;;) {
+		len = recvmsg(hp->fd, &msg, MSG_DONTWAIT);
+		if (len < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			if (errno == EINTR)
+				continue;
+			/* ENOBUFS: events were dropped, refresh everything */
+			if (errno != ENOBUFS)
+				return -errno;
+			ret = refresh(hp, 0);
+			if (ret)
+				return ret;
+			continue;
+		}
+		/* Only the kernel, not a process pretending to be it */
+		if (addr.nl_pid)
+			continue;
+		buf[len] = '\0';
+		if (!parse_uevent(hp, buf, len, &connector_id))
+			continue;
+
+		ret = refresh(hp, connector_id);
+		if (ret)
+			return ret;
+	}
+	*changes = hp->changes;
+	return hp->num_changes;
+}
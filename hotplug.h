@@ -0,0 +1,52 @@
+#ifndef __HOTPLUG_H_INCLUDED__
+#define __HOTPLUG_H_INCLUDED__
+
+#include <stdint.h>
+
+struct sp_dev;
+struct sp_hotplug;
+
+/* sp_connector_change flags */
+#define SP_CONNECTOR_ADDED		(1 << 0) /* e.g. a DP MST port */
+#define SP_CONNECTOR_REMOVED		(1 << 1)
+#define SP_CONNECTOR_CONNECTED		(1 << 2)
+#define SP_CONNECTOR_DISCONNECTED	(1 << 3)
+#define SP_CONNECTOR_MODES		(1 << 4) /* mode list or size changed */
+#define SP_CONNECTOR_PROPERTIES		(1 << 5) /* e.g. EDID, link-status */
+
+struct sp_connector_change {
+	uint32_t connector_id;
+	int index;		/* into dev->connectors, -1 once removed */
+	uint32_t flags;
+};
+
+/*
+ * Keeps dev->connectors up to date as displays come and go. Kernel uevents
+ * arrive on a netlink socket the caller polls alongside the rest of its
+ * event loop. Only the connectors an event names are queried again, with
+ * drmModeGetConnectorCurrent() unless a connector newly connected needs
+ * probing for its modes. CRTCs, planes and their buffers are left alone:
+ * a scanout whose connector went away keeps its CRTC until the caller
+ * decides otherwise.
+ */
+struct sp_hotplug *sp_hotplug_create(struct sp_dev *dev);
+void sp_hotplug_destroy(struct sp_hotplug *hp);
+
+/* Becomes readable when uevents are pending, for poll() or select() */
+int sp_hotplug_fd(struct sp_hotplug *hp);
+
+/*
+ * Reads the pending uevents and refreshes the connectors of this device
+ * they name, or all of them for an event that names none. Returns the
+ * number of connectors that changed, which *changes then lists until the
+ * next call, or -errno. Connectors added are appended to dev->connectors,
+ * removing one moves the connectors after it down.
+ */
+int sp_hotplug_dispatch(struct sp_hotplug *hp,
+		const struct sp_connector_change **changes);
+
+/* What dispatch does for a uevent, connector_id 0 meaning all of them */
+int sp_hotplug_refresh(struct sp_hotplug *hp, uint32_t connector_id,
+		const struct sp_connector_change **changes);
+
+#endif /* __HOTPLUG_H_INCLUDED__ */
@@ -0,0 +1,188 @@
+/*
+ * Lights up the screens, then unplugs and replugs a connector by forcing
+ * its status through sysfs, which vkms honours like any driver:
+ *
+ *   hotplug_test [connector]	e.g. Virtual-1 (the default) or HDMI-A-1
+ *
+ * Each step waits for the kernel's uevent and prints what changed, how
+ * long that took and how many ioctls it cost, against destroying and
+ * creating the sp_dev again. The scanouts must survive both steps.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+#include "bo.h"
+#include "dev.h"
+#include "hotplug.h"
+#include "modeset.h"
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int write_status(const char *path, const char *status)
+{
+	int fd, ret = 0;
+
+	fd = open(path, O_WRONLY);
+	if (fd < 0) {
+		printf("Failed to open %s %d\n", path, errno);
+		return -errno;
+	}
+	if (write(fd, status, strlen(status)) < 0) {
+		printf("Failed to write %s to %s %d\n", status, path, errno);
+		ret = -errno;
+	}
+	close(fd);
+	return ret;
+}
+
+static void print_changes(const struct sp_connector_change *changes, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		printf("  connector %u (index %d):%s%s%s%s%s%s\n",
+			changes[i].connector_id, changes[i].index,
+			changes[i].flags & SP_CONNECTOR_ADDED ? " added" : "",
+			changes[i].flags & SP_CONNECTOR_REMOVED ? " removed" : "",
+			changes[i].flags & SP_CONNECTOR_CONNECTED ?
+				" connected" : "",
+			changes[i].flags & SP_CONNECTOR_DISCONNECTED ?
+				" disconnected" : "",
+			changes[i].flags & SP_CONNECTOR_MODES ? " modes" : "",
+			changes[i].flags & SP_CONNECTOR_PROPERTIES ?
+				" properties" : "");
+	}
+}
+
+/* Forces the connector's status and handles what follows */
+static int step(struct sp_dev *dev, struct sp_hotplug *hp, const char *path,
+		const char *status, uint32_t expect)
+{
+	const struct sp_connector_change *changes;
+	struct pollfd pfd = { .fd = sp_hotplug_fd(hp), .events = POLLIN };
+	uint64_t ioctls;
+	double start;
+	int i, n, ret;
+
+	ret = write_status(path, status);
+	if (ret)
+		return ret;
+
+	start = now();
+	ioctls = dev->stats.ioctls;
+	ret = poll(&pfd, 1, 2000);
+	if (ret > 0) {
+		n = sp_hotplug_dispatch(hp, &changes);
+	} else {
+		printf("no uevent within 2 s, refreshing all connectors\n");
+		n = sp_hotplug_refresh(hp, 0, &changes);
+	}
+	if (n < 0) {
+		printf("Failed to handle hotplug %d\n", n);
+		return n;
+	}
+	printf("%s: %d changes in %.3f ms, %llu ioctls\n", status, n,
+		(now() - start) * 1e3,
+		(unsigned long long)(dev->stats.ioctls - ioctls));
+	print_changes(changes, n);
+
+	for (i = 0; i < n; i++) {
+		if (changes[i].flags & expect)
+			return 0;
+	}
+	printf("expected a connector to be %s\n",
+		expect == SP_CONNECTOR_CONNECTED ? "connected" :
+		"disconnected");
+	return -1;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *name = argc > 1 ? argv[1] : "Virtual-1";
+	uint32_t fb_ids[16] = { 0 };
+	struct sp_hotplug *hp = NULL;
+	struct sp_dev *dev, *full;
+	char path[PATH_MAX];
+	struct stat st;
+	double start;
+	int i, ret;
+
+	dev = create_sp_dev();
+	if (!dev) {
+		printf("Failed to create sp_dev\n");
+		return -1;
+	}
+
+	ret = initialize_screens(dev);
+	if (ret) {
+		printf("Failed to initialize screens ret=%d\n", ret);
+		goto out;
+	}
+	for (i = 0; i < dev->num_crtcs && i < 16; i++) {
+		if (dev->crtcs[i].scanout)
+			fb_ids[i] = dev->crtcs[i].scanout->fb_id;
+	}
+
+	if (fstat(dev->fd, &st)) {
+		ret = -errno;
+		goto out;
+	}
+	snprintf(path, sizeof(path), "/sys/class/drm/card%u-%s/status",
+		minor(st.st_rdev), name);
+
+	hp = sp_hotplug_create(dev);
+	if (!hp) {
+		ret = -1;
+		goto out;
+	}
+
+	ret = step(dev, hp, path, "off", SP_CONNECTOR_DISCONNECTED);
+	if (!ret)
+		ret = step(dev, hp, path, "detect", SP_CONNECTOR_CONNECTED);
+	if (ret)
+		goto out;
+
+	for (i = 0; i < dev->num_crtcs && i < 16; i++) {
+		struct sp_bo *scanout = dev->crtcs[i].scanout;
+
+		if ((scanout ? scanout->fb_id : 0) != fb_ids[i]) {
+			printf("crtc %d lost its scanout\n", i);
+			ret = -1;
+			goto out;
+		}
+	}
+
+	start = now();
+	full = create_sp_dev();
+	if (full) {
+		printf("full re-enumeration: %.3f ms, %llu ioctls\n",
+			(now() - start) * 1e3,
+			(unsigned long long)full->stats.ioctls);
+		destroy_sp_dev(full);
+	}
+
+out:
+	printf("%s\n", ret ? "FAIL" : "PASS");
+	if (hp)
+		sp_hotplug_destroy(hp);
+	destroy_sp_dev(dev);
+	return ret;
+}
@@ -0,0 +1,651 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+#include <drm_fourcc.h>
+
+#include "bo.h"
+#include "compositor.h"
+#include "dev.h"
+#include "layout.h"
+#include "modeset.h"
+
+/* The frame being decided, by position from the bottom layer up */
+struct frame {
+	struct sp_layout_layer *layers;
+	int n;
+	int order[SP_LAYOUT_MAX_LAYERS];	/* index into layers */
+	int hw[SP_LAYOUT_MAX_LAYERS];
+	int plane[SP_LAYOUT_MAX_LAYERS];	/* index into layout->planes */
+	uint64_t zpos[SP_LAYOUT_MAX_LAYERS];
+};
+
+/* Where a plane shows a layer, clipped to the CRTC */
+struct plane_rect {
+	int32_t x, y;
+	uint32_t w, h;
+	uint32_t src_x, src_y, src_w, src_h;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint32_t layer_w(const struct sp_layout_layer *l)
+{
+	return l->w ? l->w : l->bo->width;
+}
+
+static uint32_t layer_h(const struct sp_layout_layer *l)
+{
+	return l->h ? l->h : l->bo->height;
+}
+
+static int scaled(const struct sp_layout_layer *l)
+{
+	return layer_w(l) != l->bo->width || layer_h(l) != l->bo->height;
+}
+
+static int composable(const struct sp_layout_layer *l)
+{
+	return l->bo->format == DRM_FORMAT_XRGB8888 ||
+		l->bo->format == DRM_FORMAT_ARGB8888;
+}
+
+/*
+ * -ENOENT if none of the layer is on screen, -ERANGE if it is scaled and
+ * partly off it, which would need the source clipped in fractions.
+ */
+static int plane_rect(struct sp_layout *layout,
+		const struct sp_layout_layer *l, struct plane_rect *r)
+{
+	const drmModeModeInfo *m = &layout->crtc->crtc->mode;
+	int x2 = l->x + (int)layer_w(l), y2 = l->y + (int)layer_h(l);
+	int x1 = l->x < 0 ? 0 : l->x, y1 = l->y < 0 ? 0 : l->y;
+
+	if (x2 > m->hdisplay)
+		x2 = m->hdisplay;
+	if (y2 > m->vdisplay)
+		y2 = m->vdisplay;
+	if (x1 >= x2 || y1 >= y2)
+		return -ENOENT;
+
+	r->x = x1;
+	r->y = y1;
+	r->w = x2 - x1;
+	r->h = y2 - y1;
+	if (scaled(l)) {
+		if (r->w != layer_w(l) || r->h != layer_h(l))
+			return -ERANGE;
+		r->src_x = r->src_y = 0;
+		r->src_w = l->bo->width << 16;
+		r->src_h = l->bo->height << 16;
+	} else {
+		r->src_x = (x1 - l->x) << 16;
+		r->src_y = (y1 - l->y) << 16;
+		r->src_w = r->w << 16;
+		r->src_h = r->h << 16;
+	}
+	return 0;
+}
+
+static int overlaps(const struct sp_layout_layer *a,
+		const struct sp_layout_layer *b)
+{
+	return a->x < b->x + (int)layer_w(b) && b->x < a->x + (int)layer_w(a) &&
+		a->y < b->y + (int)layer_h(b) && b->y < a->y + (int)layer_h(a);
+}
+
+static struct sp_layout_layer *layer_at(struct frame *f, int k)
+{
+	return &f->layers[f->order[k]];
+}
+
+/* No layer on a plane may have a composited one over it */
+static int stacks(struct sp_layout *layout, struct frame *f)
+{
+	struct plane_rect r;
+	int k, j;
+
+	for (k = 0; k < f->n; k++) {
+		if (!f->hw[k])
+			continue;
+		for (j = k + 1; j < f->n; j++) {
+			if (!f->hw[j] && overlaps(layer_at(f, k), layer_at(f, j)) &&
+			    plane_rect(layout, layer_at(f, j), &r) != -ENOENT)
+				return 0;
+		}
+	}
+	return 1;
+}
+
+/* What can be told without asking the display: format and alpha */
+static int plane_takes(struct sp_layout *layout, int p,
+		const struct sp_layout_layer *l)
+{
+	struct sp_plane *plane = layout->planes[p];
+
+	return sp_plane_supports(plane, l->bo->format, l->bo->modifier) &&
+		(l->alpha == 255 || plane->alpha_pid);
+}
+
+/* Kuhn's augmenting path, owner has a position per plane or -1 */
+static int match(struct sp_layout *layout, struct frame *f, int k,
+		int *owner, int *seen)
+{
+	int p;
+
+	for (p = 0; p < layout->num_planes; p++) {
+		if (seen[p] || !plane_takes(layout, p, layer_at(f, k)))
+			continue;
+		seen[p] = 1;
+		if (owner[p] < 0 || match(layout, f, owner[p], owner, seen)) {
+			owner[p] = k;
+			f->plane[k] = p;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Gives the layers marked hw a plane each. With zpos settable any plane
+ * will do and the layers get zpos above the primary in their order,
+ * otherwise the planes' own order has to match the layers'.
+ */
+static int assign(struct sp_layout *layout, struct frame *f)
+{
+	int *owner = layout->match, *seen = layout->match + layout->num_planes;
+	const struct sp_prop *prop;
+	int k, p = 0, above = 0;
+
+	if (!layout->zpos_mutable) {
+		for (k = 0; k < f->n; k++) {
+			if (!f->hw[k])
+				continue;
+			while (p < layout->num_planes &&
+			       !plane_takes(layout, p, layer_at(f, k)))
+				p++;
+			if (p == layout->num_planes)
+				return -ENOSPC;
+			f->plane[k] = p++;
+		}
+		return 0;
+	}
+
+	memset(owner, 0xff, layout->num_planes * sizeof(*owner));
+	for (k = 0; k < f->n; k++) {
+		if (!f->hw[k])
+			continue;
+		memset(seen, 0, layout->num_planes * sizeof(*seen));
+		if (!match(layout, f, k, owner, seen))
+			return -ENOSPC;
+	}
+	for (k = 0; k < f->n; k++) {
+		if (!f->hw[k])
+			continue;
+		f->zpos[k] = layout->primary_zpos + ++above;
+		prop = sp_props_find(sp_plane_props(layout->planes[f->plane[k]]),
+				"zpos");
+		if (prop && prop->count_values > 1 &&
+		    f->zpos[k] > prop->values[1])
+			return -ERANGE;
+	}
+	return 0;
+}
+
+/* fb_id 0 switches the plane off, leaving r unused */
+static int add_plane_state(struct sp_layout *layout, struct sp_atomic *req,
+		struct sp_plane *plane, uint32_t fb_id,
+		const struct plane_rect *r, uint8_t alpha, uint64_t zpos)
+{
+	const struct plane_rect off = {};
+	const struct sp_atomic_prop props[] = {
+		{ 0, plane->crtc_pid,
+			fb_id ? layout->crtc->crtc->crtc_id : 0 },
+		{ 0, plane->fb_pid, fb_id },
+		{ 0, plane->crtc_x_pid, (r ? r : &off)->x },
+		{ 0, plane->crtc_y_pid, (r ? r : &off)->y },
+		{ 0, plane->crtc_w_pid, (r ? r : &off)->w },
+		{ 0, plane->crtc_h_pid, (r ? r : &off)->h },
+		{ 0, plane->src_x_pid, (r ? r : &off)->src_x },
+		{ 0, plane->src_y_pid, (r ? r : &off)->src_y },
+		{ 0, plane->src_w_pid, (r ? r : &off)->src_w },
+		{ 0, plane->src_h_pid, (r ? r : &off)->src_h },
+		{ 0, plane->alpha_pid, alpha * 257 },
+		{ 0, layout->zpos_mutable ? plane->zpos_pid : 0, zpos },
+	};
+	int i, ret = 0;
+
+	/* Switching it off only takes the first two */
+	for (i = 0; i < (fb_id ? 12 : 2) && !ret; i++) {
+		if (props[i].property_id)
+			ret = sp_atomic_add(req, plane->plane->plane_id,
+					props[i].property_id, props[i].value);
+	}
+	return ret;
+}
+
+/*
+ * The primary with the composited layers, the layers on planes and every
+ * other plane off. The frame's request sends the scanout's damage too.
+ */
+static int build(struct sp_layout *layout, struct frame *f,
+		struct sp_atomic *req, int final)
+{
+	struct sp_crtc *crtc = layout->crtc;
+	struct sp_layout_layer *l;
+	struct plane_rect r = {
+		0, 0, crtc->scanout->width, crtc->scanout->height, 0, 0,
+		crtc->scanout->width << 16, crtc->scanout->height << 16,
+	};
+	int k, p, ret;
+
+	if (final)
+		ret = set_sp_plane_pset(layout->dev, layout->primary, req,
+				crtc, 0, 0);
+	else
+		ret = add_plane_state(layout, req, layout->primary,
+				crtc->scanout->fb_id, &r, 255,
+				layout->primary_zpos);
+
+	for (p = 0; p < layout->num_planes && !ret; p++) {
+		for (k = 0; k < f->n; k++) {
+			if (f->hw[k] && f->plane[k] == p)
+				break;
+		}
+		if (k == f->n) {
+			ret = add_plane_state(layout, req, layout->planes[p], 0,
+					NULL, 0, 0);
+			continue;
+		}
+		l = layer_at(f, k);
+		ret = plane_rect(layout, l, &r);
+		if (!ret)
+			ret = add_plane_state(layout, req, layout->planes[p],
+					l->bo->fb_id, &r, l->alpha, f->zpos[k]);
+	}
+	return ret;
+}
+
+static int probe(struct sp_layout *layout, struct frame *f)
+{
+	int ret;
+
+	sp_atomic_reset(layout->probe);
+	ret = build(layout, f, layout->probe, 0);
+	if (ret)
+		return ret;
+	layout->stats.probes++;
+	return sp_atomic_commit(layout->dev, layout->probe,
+			DRM_MODE_ATOMIC_TEST_ONLY, NULL);
+}
+
+/* Which is tried first: layers only a plane can show, then bigger ones */
+static int before(struct frame *f, int a, int b)
+{
+	struct sp_layout_layer *la = layer_at(f, a), *lb = layer_at(f, b);
+	uint64_t area_a = (uint64_t)layer_w(la) * layer_h(la);
+	uint64_t area_b = (uint64_t)layer_w(lb) * layer_h(lb);
+
+	if (composable(la) != composable(lb))
+		return !composable(la);
+	if (area_a != area_b)
+		return area_a > area_b;
+	return a > b;
+}
+
+/*
+ * Adds layers to the planes one at a time, keeping each the display takes.
+ * A layer left out only because a composited one lies over it is tried
+ * again once others went on planes. Returns whether any still was while
+ * the display took every layer it was offered, so might take that one.
+ */
+static int search(struct sp_layout *layout, struct frame *f)
+{
+	int cand[SP_LAYOUT_MAX_LAYERS], tried[SP_LAYOUT_MAX_LAYERS] = {};
+	int i, j, k, n = 0, changed, blocked, refused = 0;
+	struct plane_rect r;
+
+	for (k = 0; k < f->n; k++) {
+		f->hw[k] = 0;
+		if (plane_rect(layout, layer_at(f, k), &r))
+			continue;
+		for (i = n++; i > 0 && before(f, k, cand[i - 1]); i--)
+			cand[i] = cand[i - 1];
+		cand[i] = k;
+	}
+
+	do {
+		changed = blocked = 0;
+		for (j = 0; j < n; j++) {
+			k = cand[j];
+			if (tried[k])
+				continue;
+			f->hw[k] = 1;
+			if (!stacks(layout, f)) {
+				f->hw[k] = 0;
+				blocked = 1;
+				continue;
+			}
+			tried[k] = 1;
+			if (assign(layout, f) || probe(layout, f)) {
+				f->hw[k] = 0;
+				refused = 1;
+				continue;
+			}
+			changed = 1;
+		}
+	} while (changed && blocked);
+
+	/* The last probe may have been one that failed */
+	assign(layout, f);
+	return blocked && !refused;
+}
+
+/* The last frame's planes, if its layers only moved and still fit */
+static int reuse(struct sp_layout *layout, struct frame *f)
+{
+	struct sp_layout_layer *l, *last;
+	struct plane_rect r;
+	int k;
+
+	if (layout->last_count != f->n || layout->last_blocked)
+		return 0;
+	for (k = 0; k < f->n; k++) {
+		l = layer_at(f, k);
+		last = &layout->last[f->order[k]];
+		if (l->bo != last->bo || layer_w(l) != layer_w(last) ||
+		    layer_h(l) != layer_h(last) || l->alpha != last->alpha ||
+		    l->zpos != last->zpos)
+			return 0;
+		f->hw[k] = layout->last_planes[f->order[k]] >= 0;
+		if (f->hw[k] && plane_rect(layout, l, &r))
+			return 0;
+	}
+	return stacks(layout, f) && !assign(layout, f) && !probe(layout, f);
+}
+
+/* Nearest neighbour, into a bo kept while the layer stays composited */
+static struct sp_bo *scaled_copy(struct sp_layout *layout,
+		const struct sp_layout_layer *l)
+{
+	struct sp_layout_scaled *s = NULL, *free_slot = NULL;
+	uint32_t w = layer_w(l), h = layer_h(l), x, y, sx, step;
+	const uint8_t *src;
+	uint32_t *dst;
+	int i;
+
+	for (i = 0; i < SP_LAYOUT_MAX_LAYERS; i++) {
+		s = &layout->scaled[i];
+		if (s->bo && s->src == l->bo && s->bo->width == w &&
+		    s->bo->height == h && !s->used)
+			break;
+		if (!s->bo && !free_slot)
+			free_slot = s;
+	}
+	if (i == SP_LAYOUT_MAX_LAYERS) {
+		s = free_slot;
+		if (!s)
+			return NULL;
+		s->bo = create_sp_bo(layout->dev, w, h,
+				l->bo->format == DRM_FORMAT_ARGB8888 ? 32 : 24,
+				32, l->bo->format, 0);
+		if (!s->bo)
+			return NULL;
+		s->src = l->bo;
+	} else if (!l->bo->num_damage) {
+		s->used = 1;
+		return s->bo;
+	}
+
+	src = sp_bo_map(l->bo, 0);
+	dst = sp_bo_map(s->bo, 0);
+	if (!src || !dst)
+		return NULL;
+	step = ((uint64_t)l->bo->width << 16) / w;
+	for (y = 0; y < h; y++) {
+		const uint32_t *row = (const uint32_t *)(src +
+			(uint64_t)y * l->bo->height / h * l->bo->pitch);
+
+		for (x = 0, sx = step / 2; x < w; x++, sx += step)
+			dst[x] = row[sx >> 16];
+		dst = (uint32_t *)((uint8_t *)dst + s->bo->pitch);
+	}
+	sp_bo_clear_damage(l->bo);
+	sp_bo_add_damage(s->bo, 0, 0, w, h);
+	s->used = 1;
+	return s->bo;
+}
+
+/* Hands the composited layers to the compositor, keeping what it had */
+static int composite(struct sp_layout *layout, struct frame *f)
+{
+	struct sp_compositor *comp = layout->comp;
+	struct sp_bo *bos[SP_LAYOUT_MAX_LAYERS];
+	struct sp_layout_layer *l;
+	struct plane_rect r;
+	int i, k, n = 0, same;
+
+	for (i = 0; i < SP_LAYOUT_MAX_LAYERS; i++)
+		layout->scaled[i].used = 0;
+
+	for (k = 0; k < f->n; k++) {
+		l = layer_at(f, k);
+		if (f->hw[k] || plane_rect(layout, l, &r) == -ENOENT)
+			continue;
+		if (!composable(l))
+			return -ENOSPC;
+		bos[n] = scaled(l) ? scaled_copy(layout, l) : l->bo;
+		if (!bos[n])
+			return -ENOMEM;
+		/* Composited layers keep their compositor slot in plane */
+		f->plane[k] = n++;
+	}
+
+	same = n == layout->num_composed;
+	for (i = 0; same && i < n; i++)
+		same = layout->composed[i]->bo == bos[i];
+	if (!same) {
+		for (i = 0; i < layout->num_composed; i++)
+			sp_compositor_remove_layer(comp, layout->composed[i]);
+		layout->num_composed = 0;
+	}
+
+	for (k = 0; k < f->n; k++) {
+		l = layer_at(f, k);
+		if (f->hw[k] || plane_rect(layout, l, &r) == -ENOENT)
+			continue;
+		i = f->plane[k];
+		if (!same) {
+			layout->composed[i] = sp_compositor_add_layer(comp,
+					bos[i], l->x, l->y, l->alpha);
+			if (!layout->composed[i])
+				return -ENOMEM;
+			layout->num_composed++;
+			continue;
+		}
+		layout->composed[i]->x = l->x;
+		layout->composed[i]->y = l->y;
+		layout->composed[i]->alpha = l->alpha;
+	}
+
+	for (i = 0; i < SP_LAYOUT_MAX_LAYERS; i++) {
+		if (layout->scaled[i].bo && !layout->scaled[i].used) {
+			free_sp_bo(layout->scaled[i].bo);
+			layout->scaled[i].bo = NULL;
+			layout->scaled[i].src = NULL;
+		}
+	}
+
+	i = sp_compositor_compose(comp);
+	layout->stats.composed_pixels += comp->composed_pixels;
+	return i;
+}
+
+int sp_layout_frame(struct sp_layout *layout, struct sp_layout_layer *layers,
+		int num_layers, struct sp_atomic *req)
+{
+	struct sp_layout_layer *l;
+	struct frame f;
+	uint64_t start;
+	int i, k, blocked = 0, ret;
+
+	if (num_layers < 0 || num_layers > SP_LAYOUT_MAX_LAYERS)
+		return -EINVAL;
+
+	start = now_ns();
+	f.layers = layers;
+	f.n = num_layers;
+	for (i = 0; i < num_layers; i++) {
+		for (k = i; k > 0 && layers[f.order[k - 1]].zpos >
+				      layers[i].zpos; k--)
+			f.order[k] = f.order[k - 1];
+		f.order[k] = i;
+	}
+	if (reuse(layout, &f))
+		layout->stats.reused++;
+	else
+		blocked = search(layout, &f);
+	layout->stats.search_ns += now_ns() - start;
+
+	for (k = 0; k < f.n; k++) {
+		l = layer_at(&f, k);
+		l->plane = f.hw[k] ? layout->planes[f.plane[k]] : NULL;
+		layout->last[f.order[k]] = *l;
+		layout->last_planes[f.order[k]] = f.hw[k] ? f.plane[k] : -1;
+		layout->stats.offloaded += f.hw[k];
+	}
+	layout->last_count = f.n;
+	layout->last_blocked = blocked;
+	layout->stats.frames++;
+	layout->stats.layers += f.n;
+
+	start = now_ns();
+	ret = composite(layout, &f);
+	layout->stats.compose_ns += now_ns() - start;
+	if (ret)
+		return ret;
+
+	for (k = 0; k < f.n; k++) {
+		l = layer_at(&f, k);
+		if (!f.hw[k])
+			continue;
+		sp_bo_flush_writes(l->bo);
+		sp_bo_clear_damage(l->bo);
+	}
+	return build(layout, &f, req, 1);
+}
+
+/* Planes by zpos, those without in the order they came, cursors on top */
+static uint64_t plane_order(struct sp_plane *plane, int index)
+{
+	const struct sp_prop *prop;
+
+	prop = sp_props_find(sp_plane_props(plane), "zpos");
+	if (prop)
+		return prop->value << 32 | index;
+	return (uint64_t)(plane->type == DRM_PLANE_TYPE_CURSOR) << 48 | index;
+}
+
+struct sp_layout *create_sp_layout(struct sp_dev *dev, struct sp_crtc *crtc,
+		uint32_t background_color)
+{
+	const struct sp_prop *prop;
+	struct sp_layout *layout;
+	struct sp_plane *p;
+	int i, k;
+
+	if (!dev->atomic) {
+		printf("layouts need atomic commits\n");
+		return NULL;
+	}
+	if (!crtc->primary || !crtc->scanout) {
+		printf("layouts need a lit crtc with universal planes\n");
+		return NULL;
+	}
+	if (sp_plane_try_claim(crtc->primary)) {
+		printf("primary plane of crtc %d is taken\n", crtc->pipe);
+		return NULL;
+	}
+
+	layout = calloc(1, sizeof(*layout));
+	if (!layout) {
+		sp_plane_release(crtc->primary);
+		return NULL;
+	}
+	layout->dev = dev;
+	layout->crtc = crtc;
+	layout->primary = crtc->primary;
+	layout->primary->bo = crtc->scanout;
+
+	layout->planes = calloc(dev->num_planes + 1, sizeof(*layout->planes));
+	layout->match = malloc(2 * (dev->num_planes + 1) *
+			sizeof(*layout->match));
+	layout->comp = create_sp_compositor(crtc->scanout, NULL,
+			background_color);
+	layout->probe = sp_atomic_alloc();
+	if (!layout->planes || !layout->match || !layout->comp ||
+	    !layout->probe || sp_plane_pids(layout->primary))
+		goto err;
+
+	for (i = 0; i < dev->num_planes; i++) {
+		p = &dev->planes[i];
+		if (!(crtc->possible_planes[i / 64] & (1ull << (i % 64))) ||
+		    p->type == DRM_PLANE_TYPE_PRIMARY || sp_plane_try_claim(p))
+			continue;
+		if (sp_plane_pids(p)) {
+			sp_plane_release(p);
+			continue;
+		}
+		for (k = layout->num_planes++; k > 0 &&
+		     plane_order(layout->planes[k - 1],
+				 layout->planes[k - 1] - dev->planes) >
+		     plane_order(p, i); k--)
+			layout->planes[k] = layout->planes[k - 1];
+		layout->planes[k] = p;
+	}
+
+	layout->zpos_mutable = layout->num_planes > 0;
+	for (i = 0; i < layout->num_planes; i++) {
+		prop = sp_props_find(sp_plane_props(layout->planes[i]), "zpos");
+		if (!prop || (prop->flags & DRM_MODE_PROP_IMMUTABLE))
+			layout->zpos_mutable = 0;
+	}
+	prop = sp_props_find(sp_plane_props(layout->primary), "zpos");
+	if (prop)
+		layout->primary_zpos = prop->value;
+	return layout;
+
+err:
+	destroy_sp_layout(layout);
+	return NULL;
+}
+
+void destroy_sp_layout(struct sp_layout *layout)
+{
+	int i;
+
+	for (i = 0; i < SP_LAYOUT_MAX_LAYERS; i++) {
+		if (layout->scaled[i].bo)
+			free_sp_bo(layout->scaled[i].bo);
+	}
+	for (i = 0; i < layout->num_planes; i++)
+		sp_plane_release(layout->planes[i]);
+	layout->primary->bo = NULL;
+	sp_plane_release(layout->primary);
+	if (layout->comp)
+		destroy_sp_compositor(layout->comp);
+	sp_atomic_free(layout->probe);
+	free(layout->planes);
+	free(layout->match);
+	free(layout);
+}
@@ -0,0 +1,116 @@
+#ifndef __LAYOUT_H_INCLUDED__
+#define __LAYOUT_H_INCLUDED__
+
+#include <stdint.h>
+
+#include "compositor.h"
+
+struct sp_atomic;
+struct sp_crtc;
+struct sp_dev;
+struct sp_plane;
+
+#define SP_LAYOUT_MAX_LAYERS SP_COMPOSITOR_MAX_LAYERS
+
+/*
+ * A layer of a frame: bo shown at x, y scaled to w x h (0 for the bo's
+ * size), blended with plane alpha (255 is opaque) over the layers of lower
+ * zpos. Layers that end up composited must be XRGB8888 or premultiplied
+ * ARGB8888, as compositor.h takes them; others need a plane.
+ */
+struct sp_layout_layer {
+	struct sp_bo *bo;
+	int x, y;
+	uint32_t w, h;
+	int zpos;
+	uint8_t alpha;
+
+	/* Set by sp_layout_frame(), NULL when composited */
+	struct sp_plane *plane;
+};
+
+struct sp_layout_stats {
+	uint64_t frames;
+	uint64_t layers;
+	uint64_t offloaded;	/* layers shown by planes */
+	uint64_t probes;	/* TEST_ONLY commits */
+	uint64_t reused;	/* frames that kept the last frame's planes */
+	uint64_t composed_pixels;
+	uint64_t search_ns;	/* deciding, probes included */
+	uint64_t compose_ns;
+};
+
+/* A layer composited from a scaled copy, kept while it is in use */
+struct sp_layout_scaled {
+	struct sp_bo *src;
+	struct sp_bo *bo;
+	int used;
+};
+
+/*
+ * Shows a CRTC's layers the way a hardware composer does: as many as the
+ * display takes on planes, found with DRM_MODE_ATOMIC_TEST_ONLY commits,
+ * and the rest blended on the CPU into the scanout, which the primary
+ * plane shows below them. Bigger layers are tried first, as each one the
+ * display takes saves composing and reading back its pixels. A composited
+ * layer can't go above a plane's, so layers under one that overlaps them
+ * and stays composited stay composited too.
+ *
+ * A frame whose layers only moved first tries the planes of the one
+ * before, which takes a single probe. Needs universal planes and atomic
+ * commits. The layout holds the CRTC's primary plane and every free plane
+ * that can go on it until destroyed.
+ */
+struct sp_layout {
+	struct sp_dev *dev;
+	struct sp_crtc *crtc;
+	struct sp_plane *primary;
+
+	/* Bottom to top, by zpos when the planes have it */
+	int num_planes;
+	struct sp_plane **planes;
+	/* Whether every plane's zpos can be set, else they keep their order */
+	int zpos_mutable;
+	uint64_t primary_zpos;
+	/* Room for matching layers to planes, two ints per plane */
+	int *match;
+
+	struct sp_compositor *comp;
+	int num_composed;
+	struct sp_layer *composed[SP_LAYOUT_MAX_LAYERS];
+	struct sp_layout_scaled scaled[SP_LAYOUT_MAX_LAYERS];
+
+	/* The last frame's layers and where they went, plane indices or -1 */
+	int last_count;
+	struct sp_layout_layer last[SP_LAYOUT_MAX_LAYERS];
+	int last_planes[SP_LAYOUT_MAX_LAYERS];
+	/* Some layer stayed composited only for one above it, with room left */
+	int last_blocked;
+
+	struct sp_atomic *probe;
+	struct sp_layout_stats stats;
+};
+
+/*
+ * Composites onto crtc's scanout, whatever no layer covers being
+ * background_color. NULL without a primary plane or when the primary is
+ * taken.
+ */
+struct sp_layout *create_sp_layout(struct sp_dev *dev, struct sp_crtc *crtc,
+		uint32_t background_color);
+/*
+ * Releases the planes without switching them off, a frame without layers
+ * committed first does that.
+ */
+void destroy_sp_layout(struct sp_layout *layout);
+
+/*
+ * Decides which layers go on planes, composites the others and adds the
+ * frame's plane state to req for the caller to commit. Layers keep their
+ * order by zpos, ties by index. -ENOSPC if a layer the compositor can't
+ * take got no plane.
+ */
+int sp_layout_frame(struct sp_layout *layout, struct sp_layout_layer *layers,
+		int num_layers, struct sp_atomic *req);
+
+#endif /* __LAYOUT_H_INCLUDED__ */
@@ -0,0 +1,313 @@
+/*
+ * Moves a stack of layers around a CRTC and has sp_layout_frame() decide
+ * which go on planes, committing every frame. Checks that no layer on a
+ * plane ends up under a composited one and that composited layers show in
+ * the scanout, and reports how many layers the display took and what
+ * deciding and compositing cost per frame.
+ *
+ *   layout_test [layers] [frames]
+ *
+ * SP_DEV defaults to
+ * fake:hz=0,crtcs=1,universal=1,overlays=3,max_planes=3,scaling=0, planes
+ * as few and unscaling as vkms's, and the numbers it reports are the fake
+ * device's. A kernel device has to take the atomic client cap, or the
+ * test stops before the first frame. Some layers are scaled, some
+ * translucent, and they overlap as they move.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+#include <drm_fourcc.h>
+
+#include "bo.h"
+#include "dev.h"
+#include "layout.h"
+#include "modeset.h"
+
+static const struct {
+	uint32_t w, h;
+	uint32_t scale;		/* percent */
+	uint8_t alpha;
+	uint32_t format;
+} kinds[] = {
+	{ 640, 360, 100, 255, DRM_FORMAT_XRGB8888 },
+	{ 256, 256, 100, 255, DRM_FORMAT_ARGB8888 },
+	{ 320, 180, 200, 255, DRM_FORMAT_XRGB8888 },
+	{ 128, 128, 100, 160, DRM_FORMAT_ARGB8888 },
+	{ 480, 270, 100, 255, DRM_FORMAT_XRGB8888 },
+	{ 64, 64, 100, 255, DRM_FORMAT_ARGB8888 },
+	{ 200, 120, 150, 200, DRM_FORMAT_XRGB8888 },
+	{ 96, 300, 100, 255, DRM_FORMAT_XRGB8888 },
+};
+
+#define NUM_KINDS (sizeof(kinds) / sizeof(kinds[0]))
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void flip_handler(int fd, unsigned int sequence, unsigned int tv_sec,
+		unsigned int tv_usec, void *user_data)
+{
+	*(int *)user_data = 0;
+}
+
+static uint32_t layer_color(int i)
+{
+	return ((i * 0x3d) & 0xff) << 16 | ((0xff - i * 0x21) & 0xff) << 8 |
+		((i * 0x57 + 0x40) & 0xff);
+}
+
+static uint32_t shown_w(const struct sp_layout_layer *l)
+{
+	return l->w ? l->w : l->bo->width;
+}
+
+static uint32_t shown_h(const struct sp_layout_layer *l)
+{
+	return l->h ? l->h : l->bo->height;
+}
+
+static int covers(const struct sp_layout_layer *l, int x, int y)
+{
+	return x >= l->x && y >= l->y && x < l->x + (int)shown_w(l) &&
+		y < l->y + (int)shown_h(l);
+}
+
+static int overlap(const struct sp_layout_layer *a,
+		const struct sp_layout_layer *b)
+{
+	return a->x < b->x + (int)shown_w(b) && b->x < a->x + (int)shown_w(a) &&
+		a->y < b->y + (int)shown_h(b) && b->y < a->y + (int)shown_h(a);
+}
+
+/* The same rules sp_layout_frame() has to follow, worked out again */
+static int check_frame(struct sp_crtc *crtc, struct sp_layout_layer *layers,
+		int n)
+{
+	struct sp_bo *scanout = crtc->scanout;
+	int i, j, x, y, ret = 0;
+	uint32_t pixel;
+
+	for (i = 0; i < n; i++) {
+		if (!layers[i].plane)
+			continue;
+		if (!(layers[i].plane->plane->possible_crtcs &
+		      (1 << crtc->pipe))) {
+			printf("layer %d on a plane of another crtc\n", i);
+			ret = -1;
+		}
+		for (j = 0; j < n; j++) {
+			if (j != i && layers[j].plane == layers[i].plane) {
+				printf("layers %d and %d share a plane\n", i, j);
+				ret = -1;
+			}
+			if (layers[j].zpos > layers[i].zpos &&
+			    !layers[j].plane && overlap(&layers[i], &layers[j])) {
+				printf("composited layer %d over layer %d on a "
+					"plane\n", j, i);
+				ret = -1;
+			}
+		}
+	}
+
+	/* An opaque composited layer shows where nothing is above it */
+	if (!sp_bo_map(scanout, 0))
+		return -1;
+	for (i = 0; i < n; i++) {
+		if (layers[i].plane || layers[i].alpha != 255 ||
+		    layers[i].bo->format != DRM_FORMAT_XRGB8888 ||
+		    layers[i].w)
+			continue;
+		x = layers[i].x + shown_w(&layers[i]) / 2;
+		y = layers[i].y + shown_h(&layers[i]) / 2;
+		if (x < 0 || y < 0 || x >= (int)scanout->width ||
+		    y >= (int)scanout->height)
+			continue;
+		for (j = 0; j < n; j++) {
+			if (layers[j].zpos > layers[i].zpos &&
+			    covers(&layers[j], x, y))
+				break;
+		}
+		if (j < n)
+			continue;
+		pixel = *(uint32_t *)((uint8_t *)scanout->map_addr +
+				y * scanout->pitch + x * 4);
+		if ((pixel & 0xffffff) != layer_color(i)) {
+			printf("layer %d: scanout has %06x at %d,%d, not %06x\n",
+				i, pixel & 0xffffff, x, y, layer_color(i));
+			ret = -1;
+		}
+	}
+	return ret;
+}
+
+static void move(struct sp_layout_layer *l, int *dx, int *dy,
+		const drmModeModeInfo *m)
+{
+	l->x += *dx;
+	l->y += *dy;
+	if (l->x < 0 || l->x + (int)shown_w(l) > m->hdisplay)
+		*dx = -*dx;
+	if (l->y < 0 || l->y + (int)shown_h(l) > m->vdisplay)
+		*dy = -*dy;
+}
+
+int main(int argc, char *argv[])
+{
+	int num_layers = argc > 1 ? atoi(argv[1]) : NUM_KINDS;
+	int frames = argc > 2 ? atoi(argv[2]) : 600;
+	struct sp_layout_layer layers[SP_LAYOUT_MAX_LAYERS] = {};
+	int dx[SP_LAYOUT_MAX_LAYERS], dy[SP_LAYOUT_MAX_LAYERS];
+	drmEventContext ctx = {};
+	struct sp_layout *layout = NULL;
+	struct sp_atomic *req = NULL;
+	struct sp_layout_stats *st;
+	struct sp_crtc *crtc = NULL;
+	uint64_t layer_pixels = 0;
+	int i, f, pending, ret;
+	struct sp_dev *dev;
+	uint32_t c;
+	double start;
+
+	setenv("SP_DEV", "fake:hz=0,crtcs=1,universal=1,overlays=3,"
+		"max_planes=3,scaling=0", 0);
+	if (num_layers < 1)
+		num_layers = 1;
+	if (num_layers > SP_LAYOUT_MAX_LAYERS)
+		num_layers = SP_LAYOUT_MAX_LAYERS;
+	if (frames < 1)
+		frames = 1;
+	ctx.version = DRM_EVENT_CONTEXT_VERSION;
+	ctx.page_flip_handler = flip_handler;
+
+	dev = create_sp_dev();
+	if (!dev) {
+		printf("Failed to create sp_dev\n");
+		return -1;
+	}
+
+	ret = initialize_screens(dev);
+	if (ret) {
+		printf("Failed to initialize screens\n");
+		goto out;
+	}
+	for (i = 0; i < dev->num_crtcs && !crtc; i++) {
+		if (dev->crtcs[i].scanout)
+			crtc = &dev->crtcs[i];
+	}
+	if (!crtc) {
+		printf("No active crtc\n");
+		ret = -1;
+		goto out;
+	}
+
+	layout = create_sp_layout(dev, crtc, 0xff202020);
+	req = sp_atomic_alloc();
+	if (!layout || !req) {
+		ret = -1;
+		goto out;
+	}
+
+	for (i = 0; i < num_layers; i++) {
+		int k = i % NUM_KINDS;
+
+		layers[i].bo = create_sp_bo(dev, kinds[k].w, kinds[k].h,
+				kinds[k].format == DRM_FORMAT_ARGB8888 ? 32 : 24,
+				32, kinds[k].format, 0);
+		if (!layers[i].bo) {
+			ret = -1;
+			goto out;
+		}
+		c = layer_color(i);
+		fill_bo(layers[i].bo, 0xff, c >> 16, c >> 8, c);
+		if (kinds[k].scale != 100) {
+			layers[i].w = kinds[k].w * kinds[k].scale / 100;
+			layers[i].h = kinds[k].h * kinds[k].scale / 100;
+		}
+		layers[i].x = (i * 173) % (crtc->crtc->mode.hdisplay -
+				shown_w(&layers[i]));
+		layers[i].y = (i * 97) % (crtc->crtc->mode.vdisplay -
+				shown_h(&layers[i]));
+		layers[i].zpos = i;
+		layers[i].alpha = kinds[k].alpha;
+		dx[i] = 3 + i % 5;
+		dy[i] = 2 + i % 3;
+		layer_pixels += shown_w(&layers[i]) * shown_h(&layers[i]);
+	}
+
+	printf("%d layers on crtc %d, %d planes, zpos %s\n", num_layers,
+		crtc->pipe, layout->num_planes,
+		layout->zpos_mutable ? "settable" : "fixed");
+
+	start = now();
+	for (f = 0; f < frames; f++) {
+		for (i = 0; i < num_layers; i++)
+			move(&layers[i], &dx[i], &dy[i], &crtc->crtc->mode);
+
+		sp_atomic_reset(req);
+		ret = sp_layout_frame(layout, layers, num_layers, req);
+		if (ret) {
+			printf("frame %d: layout failed ret=%d\n", f, ret);
+			break;
+		}
+		pending = 1;
+		ret = sp_atomic_commit(dev, req, DRM_MODE_PAGE_FLIP_EVENT,
+				&pending);
+		if (ret) {
+			printf("frame %d: commit failed ret=%d\n", f, ret);
+			break;
+		}
+		while (pending && !ret)
+			ret = dev->ops->handle_event(dev, &ctx);
+		if (!ret)
+			ret = check_frame(crtc, layers, num_layers);
+		if (ret)
+			break;
+	}
+	start = now() - start;
+
+	/* Leave the planes off for whoever comes next */
+	sp_atomic_reset(req);
+	if (!sp_layout_frame(layout, layers, 0, req))
+		sp_atomic_commit(dev, req, 0, NULL);
+
+	st = &layout->stats;
+	if (st->frames > 1) {
+		st->frames--;
+		printf("offloaded %.1f%% of layers, %.2f of %d per frame\n",
+			st->offloaded * 100.0 / st->layers,
+			(double)st->offloaded / st->frames, num_layers);
+		printf("search   %8.3f us per frame, %.2f probes, %.1f%% of "
+			"frames kept the last planes\n",
+			st->search_ns / 1e3 / st->frames,
+			(double)st->probes / st->frames,
+			st->reused * 100.0 / st->frames);
+		printf("compose  %8.3f us per frame, %.0f of %llu layer "
+			"pixels\n", st->compose_ns / 1e3 / st->frames,
+			(double)st->composed_pixels / st->frames,
+			(unsigned long long)layer_pixels);
+		printf("frame    %8.3f us, %.0f frames/s\n",
+			start * 1e6 / frames, frames / start);
+	}
+
+out:
+	if (layout)
+		destroy_sp_layout(layout);
+	for (i = 0; i < num_layers; i++) {
+		if (layers[i].bo)
+			free_sp_bo(layers[i].bo);
+	}
+	sp_atomic_free(req);
+	destroy_sp_dev(dev);
+	printf("%s\n", ret ? "FAIL" : "PASS");
+	return ret;
+}
@@ -0,0 +1,279 @@
+/*
+ * Measures sequential write (plain and non-temporal), sequential read and
+ * read-modify-write throughput through CPU mappings of a dumb buffer on the
+ * KMS device, a vgem dumb buffer and a gbm bo, to decide per driver whether
+ * to render straight into the mapping or into system memory and copy.
+ */
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <gbm.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+#include <drm_fourcc.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "bo.h"
+#include "dev.h"
+
+#define WIDTH 1920
+#define HEIGHT 1080
+#define ITERATIONS 20
+
+static const char * const caching_names[] = {
+	[SP_BO_CACHING_UNKNOWN] = "unknown",
+	[SP_BO_CACHING_CACHED] = "cached",
+	[SP_BO_CACHING_WC] = "wc",
+	[SP_BO_CACHING_UNCACHED] = "uncached",
+};
+
+const char g_sys_card_path_format[] =
+	"/sys/bus/platform/devices/vgem/drm/card%d";
+const char g_dev_card_path_format[] =
+	"/dev/dri/card%d";
+
+static int drm_open_vgem(void)
+{
+	char *name;
+	int i, fd;
+
+	for (i = 0; i < 16; i++) {
+		struct stat _stat;
+		int ret;
+		ret = asprintf(&name, g_sys_card_path_format, i);
+		assert(ret != -1);
+
+		if (stat(name, &_stat) == -1) {
+			free(name);
+			continue;
+		}
+
+		free(name);
+		ret = asprintf(&name, g_dev_card_path_format, i);
+		assert(ret != -1);
+
+		fd = open(name, O_RDWR);
+		free(name);
+		if (fd == -1)
+			continue;
+		return fd;
+	}
+	return -1;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void write_seq(uint64_t *p, size_t n, uint64_t v)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		p[i] = v;
+}
+
+static void write_stream(uint64_t *p, size_t n, uint64_t v)
+{
+#if defined(__SSE2__)
+	__m128i x = _mm_set1_epi64x(v);
+	size_t i;
+
+	for (i = 0; i + 2 <= n; i += 2)
+		_mm_stream_si128((__m128i *)(p + i), x);
+	for (; i < n; i++)
+		p[i] = v;
+	_mm_sfence();
+#else
+	write_seq(p, n, v);
+#endif
+}
+
+static uint64_t read_seq(const uint64_t *p, size_t n)
+{
+	uint64_t sum = 0;
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		sum += p[i];
+	return sum;
+}
+
+static void rmw(uint64_t *p, size_t n, uint64_t v)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		p[i] ^= v;
+}
+
+static void bench(const char *name, void *map, size_t size)
+{
+	size_t n = size / sizeof(uint64_t);
+	volatile uint64_t sink = 0;
+	double t[4], start;
+	int i, j;
+
+	for (j = 0; j < 4; j++) {
+		start = now();
+		for (i = 0; i < ITERATIONS; i++) {
+			switch (j) {
+			case 0:
+				write_seq(map, n, i);
+				break;
+			case 1:
+				write_stream(map, n, i);
+				break;
+			case 2:
+				sink += read_seq(map, n);
+				break;
+			case 3:
+				rmw(map, n, i);
+				break;
+			}
+		}
+		t[j] = (double)size * ITERATIONS / (now() - start) / 1e6;
+	}
+	(void)sink;
+
+	printf("%-22s write %7.0f  stream %7.0f  read %7.0f  rmw %7.0f MB/s\n",
+		name, t[0], t[1], t[2], t[3]);
+}
+
+static void bench_dumb(struct sp_dev *dev)
+{
+	struct sp_bo *bo;
+	char name[64];
+
+	bo = create_sp_bo(dev, WIDTH, HEIGHT, 24, 32, DRM_FORMAT_XRGB8888, 0);
+	if (!bo) {
+		printf("dumb: failed to create bo\n");
+		return;
+	}
+
+	if (!sp_bo_map(bo, 0)) {
+		printf("dumb: failed to map bo\n");
+		free_sp_bo(bo);
+		return;
+	}
+
+	snprintf(name, sizeof(name), "dumb (%s)", caching_names[bo->caching]);
+	bench(name, bo->map_addr, bo->size);
+	free_sp_bo(bo);
+}
+
+static void bench_vgem(void)
+{
+	struct drm_mode_create_dumb cd = {};
+	struct drm_mode_map_dumb md = {};
+	struct drm_mode_destroy_dumb dd = {};
+	void *map;
+	int fd;
+
+	fd = drm_open_vgem();
+	if (fd < 0) {
+		printf("vgem: no device, skipping\n");
+		return;
+	}
+
+	cd.width = WIDTH;
+	cd.height = HEIGHT;
+	cd.bpp = 32;
+	if (drmIoctl(fd, DRM_IOCTL_MODE_CREATE_DUMB, &cd)) {
+		printf("vgem: failed to create bo\n");
+		goto out;
+	}
+
+	md.handle = cd.handle;
+	if (drmIoctl(fd, DRM_IOCTL_MODE_MAP_DUMB, &md)) {
+		printf("vgem: failed to map bo\n");
+		goto destroy;
+	}
+
+	map = mmap(NULL, cd.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+			md.offset);
+	if (map == MAP_FAILED) {
+		printf("vgem: failed to mmap bo\n");
+		goto destroy;
+	}
+
+	bench("vgem", map, cd.size);
+	munmap(map, cd.size);
+
+destroy:
+	dd.handle = cd.handle;
+	drmIoctl(fd, DRM_IOCTL_MODE_DESTROY_DUMB, &dd);
+out:
+	close(fd);
+}
+
+static void bench_gbm(struct sp_dev *dev)
+{
+	struct gbm_device *gbm;
+	struct gbm_bo *bo;
+	uint32_t stride;
+	void *map, *map_data = NULL;
+
+	gbm = gbm_create_device(dev->fd);
+	if (!gbm) {
+		printf("gbm: failed to create device\n");
+		return;
+	}
+
+	bo = gbm_bo_create(gbm, WIDTH, HEIGHT, GBM_BO_FORMAT_XRGB8888,
+			GBM_BO_USE_SCANOUT | GBM_BO_USE_RENDERING);
+	if (!bo) {
+		printf("gbm: failed to create bo\n");
+		goto out;
+	}
+
+	map = gbm_bo_map(bo, 0, 0, WIDTH, HEIGHT, GBM_BO_TRANSFER_READ_WRITE,
+			&stride, &map_data);
+	if (!map) {
+		printf("gbm: failed to map bo\n");
+		goto destroy;
+	}
+
+	bench("gbm", map, (size_t)stride * HEIGHT);
+	gbm_bo_unmap(bo, map_data);
+
+destroy:
+	gbm_bo_destroy(bo);
+out:
+	gbm_device_destroy(gbm);
+}
+
+int main(int argc, char *argv[])
+{
+	struct sp_dev *dev;
+
+	dev = create_sp_dev();
+	if (!dev) {
+		printf("Failed to create sp_dev\n");
+		return -1;
+	}
+
+	printf("%dx%d XRGB8888, %d iterations\n", WIDTH, HEIGHT, ITERATIONS);
+	bench_dumb(dev);
+	bench_vgem();
+	bench_gbm(dev);
+
+	destroy_sp_dev(dev);
+	return 0;
+}
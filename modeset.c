@@ -1,3 +1,5 @@
+#include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,133 +12,740 @@
 #include "bo.h"
 #include "dev.h"
 
-int initialize_screens(struct sp_dev *dev)
+/* The preferred mode, or the first if none is */
+static drmModeModeInfoPtr preferred_mode(drmModeConnectorPtr c)
 {
-	int ret, i, j, k;
+	int i;
 
-	for (i = 0; i < dev->num_connectors; i++) {
-		drmModeConnectorPtr c = dev->connectors[i];
-		drmModeModeInfoPtr m = NULL;
-		drmModeEncoderPtr e = NULL;
-		struct sp_crtc *cr = NULL;
+	for (i = 0; i < c->count_modes; i++) {
+		if (c->modes[i].type & DRM_MODE_TYPE_PREFERRED)
+			return &c->modes[i];
+	}
+	return &c->modes[0];
+}
 
-		if (c->connection != DRM_MODE_CONNECTED)
-			continue;
+static int encoder_index(struct sp_dev *dev, uint32_t encoder_id)
+{
+	int i;
 
-		if (!c->count_modes) {
-			printf("connector has no modes, skipping\n");
-			continue;
-		}
+	for (i = 0; i < dev->num_encoders; i++) {
+		if (dev->encoders[i] &&
+		    dev->encoders[i]->encoder_id == encoder_id)
+			return i;
+	}
+	return -1;
+}
 
-		/* Take the first unless there's a preferred mode */
-		m = &c->modes[0];
-		for (j = 0; j < c->count_modes; j++) {
-			drmModeModeInfoPtr tmp_m = &c->modes[j];
+/*
+ * A min cost flow network: source -> connector -> encoder in -> encoder
+ * out -> CRTC -> sink, every edge taking one unit. Edge e ^ 1 is e's
+ * reverse.
+ */
+struct flow {
+	int num_nodes;
+	int num_edges;
+	int *head;		/* first edge out of a node, or -1 */
+	int *next;
+	int *to;
+	int *cap;
+	int *cost;
+};
+
+static void add_edge(struct flow *f, int from, int to, int cost)
+{
+	int e = f->num_edges;
+
+	f->to[e] = to;
+	f->cap[e] = 1;
+	f->cost[e] = cost;
+	f->next[e] = f->head[from];
+	f->head[from] = e;
+	f->to[e + 1] = from;
+	f->cap[e + 1] = 0;
+	f->cost[e + 1] = -cost;
+	f->next[e + 1] = f->head[to];
+	f->head[to] = e + 1;
+	f->num_edges += 2;
+}
 
-			if (!(tmp_m->type & DRM_MODE_TYPE_PREFERRED))
+/*
+ * Pushes one unit along the cheapest path from source to sink, found with
+ * Bellman-Ford as costs are negative. Returns 0 once there is none.
+ */
+static int augment(struct flow *f, int source, int sink, int *dist,
+		int *prev)
+{
+	int i, e, changed = 1;
+
+	for (i = 0; i < f->num_nodes; i++)
+		dist[i] = INT_MAX;
+	dist[source] = 0;
+	for (i = 0; changed && i < f->num_nodes; i++) {
+		changed = 0;
+		for (e = 0; e < f->num_edges; e++) {
+			int from = f->to[e ^ 1];
+
+			if (!f->cap[e] || dist[from] == INT_MAX ||
+			    dist[from] + f->cost[e] >= dist[f->to[e]])
 				continue;
-
-			m = tmp_m;
-			break;
+			dist[f->to[e]] = dist[from] + f->cost[e];
+			prev[f->to[e]] = e;
+			changed = 1;
 		}
+	}
+	if (dist[sink] == INT_MAX)
+		return 0;
+	for (i = sink; i != source; i = f->to[prev[i] ^ 1]) {
+		f->cap[prev[i]]--;
+		f->cap[prev[i] ^ 1]++;
+	}
+	return 1;
+}
+
+/* Where the unit leaving node went, -1 if none did */
+static int flow_out(struct flow *f, int node)
+{
+	int e;
+
+	for (e = f->head[node]; e >= 0; e = f->next[e]) {
+		if (!(e & 1) && !f->cap[e])
+			return f->to[e];
+	}
+	return -1;
+}
+
+/* Whether the connector has mode, to clone a CRTC already showing it */
+static int has_mode(drmModeConnectorPtr c, drmModeModeInfoPtr m)
+{
+	int i;
+
+	for (i = 0; i < c->count_modes; i++) {
+		if (c->modes[i].hdisplay == m->hdisplay &&
+		    c->modes[i].vdisplay == m->vdisplay &&
+		    c->modes[i].clock == m->clock &&
+		    c->modes[i].htotal == m->htotal &&
+		    c->modes[i].vtotal == m->vtotal &&
+		    c->modes[i].flags == m->flags)
+			return 1;
+	}
+	return 0;
+}
+
+/* The CRTC a connector's current encoder drives, 0 if none */
+static uint32_t connector_crtc_id(struct sp_dev *dev, int index)
+{
+	uint32_t encoder_id = dev->connectors[index]->encoder_id;
+	int i;
 
-		for (j = 0; j < dev->num_encoders; j++) {
-			e = dev->encoders[j];
-			if (!e)
+	for (i = 0; encoder_id && i < dev->num_encoders; i++) {
+		if (dev->encoders[i]->encoder_id == encoder_id)
+			return dev->encoders[i]->crtc_id;
+	}
+	return 0;
+}
+
+/* The CRTC with that ID if an earlier initialize_screens() lit it */
+static struct sp_crtc *lit_crtc(struct sp_dev *dev, uint32_t crtc_id)
+{
+	int i;
+
+	for (i = 0; crtc_id && i < dev->num_crtcs; i++) {
+		if (dev->crtcs[i].crtc->crtc_id == crtc_id)
+			return dev->crtcs[i].scanout ? &dev->crtcs[i] : NULL;
+	}
+	return NULL;
+}
+
+/* Whether enc may join every encoder already driving crtc */
+static int can_clone(struct sp_dev *dev, int enc, struct sp_crtc *crtc,
+		struct sp_output *outputs, int n)
+{
+	drmModeEncoderPtr e = dev->encoders[enc];
+	int j;
+
+	if (!(e->possible_crtcs & (1 << crtc->pipe)))
+		return 0;
+	for (j = 0; j < n; j++) {
+		if (outputs[j].crtc != crtc)
+			continue;
+		if (!(dev->encoders[outputs[j].encoder]->possible_clones &
+		      (1 << enc)) ||
+		    !(e->possible_clones & (1 << outputs[j].encoder)))
+			return 0;
+	}
+	return 1;
+}
+
+/* Puts a connector no CRTC was left for on one it can clone */
+static int find_clone(struct sp_dev *dev, int index,
+		struct sp_output *outputs, int n, struct sp_output *out)
+{
+	drmModeConnectorPtr c = dev->connectors[index];
+	int i, j, enc;
+
+	for (i = 0; i < c->count_encoders; i++) {
+		enc = encoder_index(dev, c->encoders[i]);
+		for (j = 0; j < n && enc >= 0; j++) {
+			if (outputs[j].encoder == enc)
+				enc = -1;
+		}
+		if (enc < 0 || lit_crtc(dev, dev->encoders[enc]->crtc_id))
+			continue;
+		for (j = 0; j < n; j++) {
+			if (outputs[j].clone ||
+			    !can_clone(dev, enc, outputs[j].crtc, outputs, n) ||
+			    !has_mode(c, outputs[j].mode))
 				continue;
-			for (k = 0; k < c->count_encoders; k++) {
-				if (e->encoder_id == c->encoders[k])
-					break;
-			}
-			if (k < c->count_encoders)
-				break;
+			out->connector = index;
+			out->encoder = enc;
+			out->crtc = outputs[j].crtc;
+			out->mode = outputs[j].mode;
+			out->clone = 1;
+			return 0;
 		}
+	}
+	return -ENOENT;
+}
+
+static int count_bits(const uint64_t *bits, int words)
+{
+	int i, n = 0;
 
-		if (j == dev->num_encoders) {
-			printf("could not find supported encoder for the connector\n");
+	for (i = 0; i < words; i++)
+		n += __builtin_popcountll(bits[i]);
+	return n;
+}
+
+int sp_assign_outputs(struct sp_dev *dev, struct sp_output *outputs)
+{
+	int nc = dev->num_connectors, ne = dev->num_encoders;
+	int nr = dev->num_crtcs, source, sink, max_edges;
+	int i, j, k, enc, pipe, n = 0, ret = -ENOMEM;
+	int *dist = NULL, *prev = NULL;
+	struct flow f = {};
+
+	/* source, connectors, encoders in and out, CRTCs, sink */
+	f.num_nodes = nc + 2 * ne + nr + 2;
+	source = f.num_nodes - 2;
+	sink = f.num_nodes - 1;
+	max_edges = nc + ne + ne * nr + nr;
+	for (i = 0; i < nc; i++)
+		max_edges += dev->connectors[i]->count_encoders;
+	max_edges *= 2;
+	f.head = malloc(f.num_nodes * sizeof(*f.head));
+	f.next = malloc(max_edges * sizeof(*f.next));
+	f.to = malloc(max_edges * sizeof(*f.to));
+	f.cap = malloc(max_edges * sizeof(*f.cap));
+	f.cost = malloc(max_edges * sizeof(*f.cost));
+	dist = malloc(f.num_nodes * sizeof(*dist));
+	prev = malloc(f.num_nodes * sizeof(*prev));
+	if (!f.head || !f.next || !f.to || !f.cap || !f.cost || !dist ||
+	    !prev)
+		goto out;
+	memset(f.head, 0xff, f.num_nodes * sizeof(*f.head));
+
+	/* What an earlier call lit stays as it is */
+	for (i = 0; i < nc; i++) {
+		drmModeConnectorPtr c = dev->connectors[i];
+
+		if (c->connection != DRM_MODE_CONNECTED || !c->count_modes ||
+		    lit_crtc(dev, connector_crtc_id(dev, i)))
 			continue;
+		add_edge(&f, source, i, 0);
+		for (j = 0; j < c->count_encoders; j++) {
+			enc = encoder_index(dev, c->encoders[j]);
+			if (enc >= 0)
+				add_edge(&f, i, nc + enc, 0);
 		}
-
-		for (j = 0; j < dev->num_crtcs; j++) {
-			cr = &dev->crtcs[j];
-			if (e->possible_crtcs & (1 << j)) {
-				e->crtc_id = cr->crtc->crtc_id;
-				break;
-			}
+	}
+	for (i = 0; i < ne; i++) {
+		if (!dev->encoders[i] ||
+		    lit_crtc(dev, dev->encoders[i]->crtc_id))
+			continue;
+		add_edge(&f, nc + i, nc + ne + i, 0);
+		/*
+		 * More overlays first, then the lower pipe as the first fit
+		 * did. An overlay outweighs any number of pipe orders.
+		 */
+		for (pipe = 0; pipe < nr; pipe++) {
+			if (!(dev->encoders[i]->possible_crtcs & (1 << pipe)))
+				continue;
+			add_edge(&f, nc + ne + i, nc + 2 * ne + pipe,
+				pipe - 1024 * count_bits(
+				dev->crtcs[pipe].type_planes[DRM_PLANE_TYPE_OVERLAY],
+				dev->num_plane_words));
 		}
+	}
+	for (pipe = 0; pipe < nr; pipe++) {
+		if (!dev->crtcs[pipe].scanout)
+			add_edge(&f, nc + 2 * ne + pipe, sink, 0);
+	}
+
+	while (augment(&f, source, sink, dist, prev))
+		;
 
-		if (j == dev->num_crtcs) {
-			printf("could not find crtc for the encoder\n");
+	for (i = 0; i < nc; i++) {
+		k = flow_out(&f, i);
+		if (k < 0)
 			continue;
-		}
+		enc = k - nc;
+		pipe = flow_out(&f, nc + ne + enc) - nc - 2 * ne;
+		outputs[n].connector = i;
+		outputs[n].encoder = enc;
+		outputs[n].crtc = &dev->crtcs[pipe];
+		outputs[n].mode = preferred_mode(dev->connectors[i]);
+		outputs[n].clone = 0;
+		n++;
+	}
 
-		if (cr->scanout) {
-			printf("crtc already in use\n");
+	/* Whoever is left can only share a CRTC */
+	for (i = 0; i < nc; i++) {
+		if (dev->connectors[i]->connection != DRM_MODE_CONNECTED ||
+		    !dev->connectors[i]->count_modes ||
+		    lit_crtc(dev, connector_crtc_id(dev, i)))
 			continue;
-		}
+		for (j = 0; j < n && outputs[j].connector != i; j++)
+			;
+		if (j < n)
+			continue;
+		if (!find_clone(dev, i, outputs, n, &outputs[n]))
+			n++;
+	}
+	ret = n;
+
+out:
+	free(f.head);
+	free(f.next);
+	free(f.to);
+	free(f.cap);
+	free(f.cost);
+	free(dist);
+	free(prev);
+	return ret;
+}
+
+/*
+ * Picks a mode and CRTC for every connected connector it can and creates
+ * the scanouts. CRTCs an earlier call lit keep theirs. Returns the number
+ * of outputs.
+ */
+static int pick_outputs(struct sp_dev *dev, struct sp_output *outputs)
+{
+	struct sp_crtc *cr;
+	drmModeModeInfoPtr m;
+	int i, j, n, lit = 0;
+
+	n = sp_assign_outputs(dev, outputs);
+	if (n < 0)
+		return 0;
+	for (i = 0; i < dev->num_connectors; i++) {
+		drmModeConnectorPtr c = dev->connectors[i];
 
-		/* XXX: Hardcoding the format here... :| */
-		cr->scanout = create_sp_bo(dev, m->hdisplay, m->vdisplay,
-				24, 32, DRM_FORMAT_XRGB8888, 0);
-		if (!cr->scanout) {
-			printf("failed to create new scanout bo\n");
+		if (c->connection != DRM_MODE_CONNECTED ||
+		    lit_crtc(dev, connector_crtc_id(dev, i)))
 			continue;
+		for (j = 0; j < n && outputs[j].connector != i; j++)
+			;
+		if (!c->count_modes)
+			printf("connector has no modes, skipping\n");
+		else if (j == n)
+			printf("could not find crtc for connector %u\n",
+				c->connector_id);
+	}
+	for (i = 0; i < n; i++) {
+		cr = outputs[i].crtc;
+		m = outputs[i].mode;
+		if (!outputs[i].clone) {
+			cr->scanout = create_sp_bo(dev, m->hdisplay,
+					m->vdisplay,
+					dev->scanout_format ==
+					DRM_FORMAT_RGB565 ? 16 : 24,
+					sp_format_bpp(dev->scanout_format),
+					dev->scanout_format, 0);
+			if (!cr->scanout)
+				printf("failed to create new scanout bo\n");
+			else
+				fill_bo(cr->scanout, 0xFF, 0xFF, 0xFF, 0x00);
 		}
+		/* Clones come last, after the scanout they share */
+		if (!cr->scanout)
+			continue;
+		dev->encoders[outputs[i].encoder]->crtc_id = cr->crtc->crtc_id;
+		outputs[lit++] = outputs[i];
+	}
+	for (i = 0; i < lit; i++) {
+		for (j = 0; j < i && outputs[j].crtc != outputs[i].crtc; j++)
+			;
+		outputs[i].clone = j < i;
+	}
+	return lit;
+}
 
-		fill_bo(cr->scanout, 0xFF, 0xFF, 0xFF, 0x00);
+/* The first primary plane that can show the scanout, if planes are universal */
+static struct sp_plane *find_primary(struct sp_dev *dev, struct sp_crtc *cr)
+{
+	const uint64_t *planes;
+	uint64_t bits;
+	int i;
 
-		ret = drmModeSetCrtc(dev->fd, cr->crtc->crtc_id,
-				cr->scanout->fb_id, 0, 0, &c->connector_id,
-				1, m);
+	planes = sp_dev_format_planes(dev, dev->scanout_format,
+			DRM_FORMAT_MOD_LINEAR);
+	for (i = 0; planes && i < dev->num_plane_words; i++) {
+		bits = planes[i] & cr->type_planes[DRM_PLANE_TYPE_PRIMARY][i];
+		if (bits)
+			return &dev->planes[i * 64 + __builtin_ctzll(bits)];
+	}
+	return NULL;
+}
+
+static void set_crtc_mode(struct sp_crtc *cr, drmModeModeInfoPtr m)
+{
+	cr->crtc->mode = *m;
+	cr->crtc->mode_valid = 1;
+}
+
+/* One drmModeSetCrtc() per CRTC with its clones, each a modeset of its own */
+static void light_legacy(struct sp_dev *dev, struct sp_output *outputs,
+		int n)
+{
+	uint32_t *connectors;
+	struct sp_crtc *cr;
+	int i, j, count, ret;
+
+	connectors = calloc(n, sizeof(*connectors));
+	if (!connectors)
+		return;
+	for (i = 0; i < n; i++) {
+		if (outputs[i].clone)
+			continue;
+		cr = outputs[i].crtc;
+		for (j = i, count = 0; j < n; j++) {
+			if (outputs[j].crtc == cr)
+				connectors[count++] =
+				dev->connectors[outputs[j].connector]->connector_id;
+		}
+		ret = dev->ops->set_crtc(dev, cr->crtc->crtc_id,
+				cr->scanout->fb_id, 0, 0, connectors, count,
+				outputs[i].mode);
 		if (ret) {
 			printf("failed to set crtc mode ret=%d\n", ret);
 			continue;
 		}
+		for (j = i; j < n; j++) {
+			if (outputs[j].crtc != cr)
+				continue;
+			dev->connectors[outputs[j].connector]->encoder_id =
+				dev->encoders[outputs[j].encoder]->encoder_id;
+		}
+		set_crtc_mode(cr, outputs[i].mode);
+		cr->primary = find_primary(dev, cr);
+	}
+	free(connectors);
+}
+
+static int add_primary_props(struct sp_atomic *req, struct sp_plane *plane,
+		uint32_t crtc_id, uint32_t fb_id, uint32_t w, uint32_t h)
+{
+	const struct sp_atomic_prop props[] = {
+		{ 0, plane->crtc_pid, crtc_id },
+		{ 0, plane->fb_pid, fb_id },
+		{ 0, plane->crtc_x_pid, 0 },
+		{ 0, plane->crtc_y_pid, 0 },
+		{ 0, plane->crtc_w_pid, w },
+		{ 0, plane->crtc_h_pid, h },
+		{ 0, plane->src_x_pid, 0 },
+		{ 0, plane->src_y_pid, 0 },
+		{ 0, plane->src_w_pid, (uint64_t)w << 16 },
+		{ 0, plane->src_h_pid, (uint64_t)h << 16 },
+	};
+	int i, ret = 0;
+
+	/* Switching it off only takes the first two */
+	for (i = 0; i < (fb_id ? 10 : 2) && !ret; i++)
+		ret = sp_atomic_add(req, plane->plane->plane_id,
+				props[i].property_id, props[i].value);
+	return ret;
+}
+
+/* Shows bo full screen on the primary plane, or switches it off if NULL */
+static int add_primary(struct sp_atomic *req, struct sp_plane *plane,
+		struct sp_crtc *cr, struct sp_bo *bo, drmModeModeInfoPtr m)
+{
+	int ret;
+
+	ret = sp_plane_pids(plane);
+	if (ret)
+		return ret;
+	if (!bo)
+		return add_primary_props(req, plane, 0, 0, 0, 0);
+	return add_primary_props(req, plane, cr->crtc->crtc_id, bo->fb_id,
+			m->hdisplay, m->vdisplay);
+}
+
+static int add_crtc(struct sp_dev *dev, struct sp_atomic *req,
+		struct sp_crtc *cr, uint32_t mode_blob)
+{
+	struct sp_props *props = sp_crtc_props(dev, cr);
+	uint32_t active_pid, mode_pid;
+	int ret;
 
-		cr->crtc->mode.hdisplay = m->hdisplay;
-		cr->crtc->mode.vdisplay = m->vdisplay;
+	if (!props)
+		return -ENODEV;
+	active_pid = sp_props_id(props, "ACTIVE");
+	mode_pid = sp_props_id(props, "MODE_ID");
+	if (!active_pid || !mode_pid)
+		return -ENOENT;
+	ret = sp_atomic_add(req, cr->crtc->crtc_id, active_pid, !!mode_blob);
+	if (!ret)
+		ret = sp_atomic_add(req, cr->crtc->crtc_id, mode_pid,
+				mode_blob);
+	return ret;
+}
+
+/* Points the connector at cr, or detaches it if NULL */
+static int add_connector(struct sp_dev *dev, struct sp_atomic *req,
+		int index, struct sp_crtc *cr)
+{
+	struct sp_props *props = sp_connector_props(dev, index);
+	uint32_t crtc_pid = props ? sp_props_id(props, "CRTC_ID") : 0;
+
+	if (!crtc_pid)
+		return -ENOENT;
+	return sp_atomic_add(req, dev->connectors[index]->connector_id,
+			crtc_pid, cr ? cr->crtc->crtc_id : 0);
+}
+
+/* Whether a connector stays on a CRTC an earlier call lit */
+static int connector_kept(struct sp_dev *dev, int index,
+		struct sp_output *outputs, int n)
+{
+	struct sp_crtc *cr = lit_crtc(dev, connector_crtc_id(dev, index));
+	int j;
+
+	for (j = 0; cr && j < n; j++) {
+		if (outputs[j].crtc == cr)
+			return 0;
 	}
-	return 0;
+	return cr != NULL;
 }
 
-struct sp_plane *get_sp_plane(struct sp_dev *dev, struct sp_crtc *crtc)
+/*
+ * Every output in one commit: a MODE_ID blob, ACTIVE and the primary plane
+ * per CRTC and CRTC_ID per connector, checked with TEST_ONLY before it is
+ * made. CRTCs left lit by whoever had the device before are switched off in
+ * the same commit, their connectors may be among ours. Connectors we don't
+ * light are detached unless an earlier call lit their CRTC, as every other
+ * CRTC is either ours or going off, and the kernel refuses a CRTC whose
+ * connectors don't match whether it is enabled. Needs universal planes,
+ * and the atomic client cap on a kernel device.
+ */
+static int light_atomic(struct sp_dev *dev, struct sp_output *outputs,
+		int n)
 {
-	int i;
+	struct sp_plane **primaries = NULL;
+	struct sp_atomic *req = NULL;
+	uint32_t *blobs = NULL;
+	struct sp_crtc *cr;
+	struct sp_plane *p;
+	int i, j, ret = -ENOMEM;
+
+	req = sp_atomic_alloc();
+	blobs = calloc(n + 1, sizeof(*blobs));
+	primaries = calloc(n + 1, sizeof(*primaries));
+	if (!req || !blobs || !primaries)
+		goto out;
+
+	for (i = 0; i < n; i++) {
+		cr = outputs[i].crtc;
+		/* A clone only points its connector at the CRTC */
+		if (outputs[i].clone) {
+			ret = add_connector(dev, req, outputs[i].connector,
+					cr);
+			if (ret)
+				goto out;
+			continue;
+		}
+		primaries[i] = find_primary(dev, cr);
+		if (!primaries[i]) {
+			ret = -ENOTSUP;
+			goto out;
+		}
+		ret = dev->ops->create_blob(dev, outputs[i].mode,
+				sizeof(*outputs[i].mode), &blobs[i]);
+		if (ret)
+			goto out;
+		ret = add_crtc(dev, req, cr, blobs[i]);
+		if (!ret)
+			ret = add_connector(dev, req, outputs[i].connector,
+					cr);
+		if (!ret)
+			ret = add_primary(req, primaries[i], cr, cr->scanout,
+					outputs[i].mode);
+		if (ret)
+			goto out;
+	}
 
-	for(i = 0; i < dev->num_planes; i++) {
-		struct sp_plane *p = &dev->planes[i];
+	for (i = 0; i < dev->num_crtcs; i++) {
+		cr = &dev->crtcs[i];
+		if (cr->scanout || !cr->crtc->mode_valid)
+			continue;
+		ret = add_crtc(dev, req, cr, 0);
+		p = find_primary(dev, cr);
+		if (!ret && p)
+			ret = add_primary(req, p, cr, NULL, NULL);
+		if (ret)
+			goto out;
+	}
 
-		if (p->in_use)
+	for (i = 0; i < dev->num_connectors; i++) {
+		for (j = 0; j < n && outputs[j].connector != i; j++)
+			;
+		if (j < n || !connector_crtc_id(dev, i) ||
+		    connector_kept(dev, i, outputs, n))
+			continue;
+		ret = add_connector(dev, req, i, NULL);
+		if (ret)
+			goto out;
+	}
+
+	ret = sp_atomic_commit(dev, req, DRM_MODE_ATOMIC_TEST_ONLY |
+			DRM_MODE_ATOMIC_ALLOW_MODESET, NULL);
+	if (!ret)
+		ret = sp_atomic_commit(dev, req, DRM_MODE_ATOMIC_ALLOW_MODESET,
+				NULL);
+	if (ret)
+		goto out;
+
+	for (i = 0; i < dev->num_crtcs; i++) {
+		cr = &dev->crtcs[i];
+		if (!cr->scanout && cr->crtc->mode_valid)
+			cr->crtc->mode_valid = 0;
+	}
+	for (i = 0; i < dev->num_connectors; i++) {
+		if (!connector_kept(dev, i, outputs, n))
+			dev->connectors[i]->encoder_id = 0;
+	}
+	for (i = 0; i < n; i++) {
+		dev->connectors[outputs[i].connector]->encoder_id =
+			dev->encoders[outputs[i].encoder]->encoder_id;
+		if (outputs[i].clone)
 			continue;
+		set_crtc_mode(outputs[i].crtc, outputs[i].mode);
+		outputs[i].crtc->primary = primaries[i];
+	}
+
+out:
+	/* The commit holds on to the modes it took */
+	for (i = 0; blobs && i < n; i++) {
+		if (blobs[i])
+			dev->ops->destroy_blob(dev, blobs[i]);
+	}
+	free(blobs);
+	free(primaries);
+	sp_atomic_free(req);
+	return ret;
+}
+
+int initialize_screens(struct sp_dev *dev)
+{
+	const char *env = getenv("SP_MODESET");
+	struct sp_output *outputs;
+	int n, ret = 0;
+
+	outputs = calloc(dev->num_connectors + 1, sizeof(*outputs));
+	if (!outputs)
+		return -ENOMEM;
+
+	n = pick_outputs(dev, outputs);
+	if (!n)
+		goto out;
+
+	if (!env || strcmp(env, "legacy")) {
+		ret = light_atomic(dev, outputs, n);
+		if (!ret || (env && !strcmp(env, "atomic"))) {
+			if (ret)
+				printf("atomic modeset failed ret=%d\n", ret);
+			goto out;
+		}
+		ret = 0;
+	}
+	light_legacy(dev, outputs, n);
 
-		if (!(p->plane->possible_crtcs & (1 << crtc->pipe)))
+out:
+	free(outputs);
+	return ret;
+}
+
+void print_scanout_bandwidth(struct sp_dev *dev)
+{
+	double total = 0, saved = 0, bytes, pixels;
+	int i, j;
+
+	for (i = 0; i < dev->num_crtcs; i++) {
+		struct sp_crtc *cr = &dev->crtcs[i];
+		drmModeModeInfo *m = &cr->crtc->mode;
+
+		if (!cr->scanout)
 			continue;
 
-		p->in_use = 1;
-		return p;
+		/* The primary plane plus whatever overlays sit on top */
+		pixels = (double)cr->scanout->width * cr->scanout->height;
+		bytes = pixels * cr->scanout->bpp / 8;
+		for (j = 0; j < dev->num_planes; j++) {
+			struct sp_plane *p = &dev->planes[j];
+
+			if (!sp_plane_in_use(p) || !p->bo || p->crtc != cr)
+				continue;
+			pixels += (double)p->bo->width * p->bo->height;
+			bytes += (double)p->bo->width * p->bo->height *
+				p->bo->bpp / 8;
+		}
+
+		printf("crtc %d: %ux%u@%u scanout %.4s, %7.1f MB/s, "
+			"%7.1f MB/s less than XRGB8888\n", i, m->hdisplay,
+			m->vdisplay, m->vrefresh,
+			(char *)&cr->scanout->format, bytes * m->vrefresh / 1e6,
+			(pixels * 4 - bytes) * m->vrefresh / 1e6);
+		total += bytes * m->vrefresh;
+		saved += (pixels * 4 - bytes) * m->vrefresh;
 	}
-	return NULL;
+	printf("scanout total %.1f MB/s, saved %.1f MB/s\n", total / 1e6,
+		saved / 1e6);
+}
+
+struct sp_plane *get_sp_plane(struct sp_dev *dev, struct sp_crtc *crtc)
+{
+	return sp_plane_claim(dev, crtc, NULL);
 }
 
 void put_sp_plane(struct sp_plane *plane)
 {
+	struct sp_dev *dev = plane->dev;
 	drmModePlanePtr p;
 
 	/* Get the latest plane information (most notably the crtc_id) */
-	p = drmModeGetPlane(plane->dev->fd, plane->plane->plane_id);
-	if (p)
+	p = dev->ops->get_plane(dev, plane->plane->plane_id);
+	if (p) {
+		drmModeFreePlane(plane->plane);
 		plane->plane = p;
+	}
 
 	if (plane->plane->crtc_id)
-		drmModeSetPlane(plane->dev->fd, plane->plane->plane_id,
+		dev->ops->set_plane(dev, plane->plane->plane_id,
 				plane->plane->crtc_id, 0, 0,
 				0, 0, 0, 0, 0, 0, 0, 0);
 
+	if (plane->damage_blob_id) {
+		dev->ops->destroy_blob(dev, plane->damage_blob_id);
+		plane->damage_blob_id = 0;
+	}
+
 	if (plane->bo) {
 		free_sp_bo(plane->bo);
 		plane->bo = NULL;
 	}
-	plane->in_use = 0;
+	plane->crtc = NULL;
+	sp_plane_release(plane);
 }
 
 int set_sp_plane(struct sp_dev *dev, struct sp_plane *plane,
@@ -145,6 +754,8 @@ int set_sp_plane(struct sp_dev *dev, struct sp_plane *plane,
 	int ret;
 	uint32_t w, h;
 
+	sp_bo_flush_writes(plane->bo);
+
 	w = plane->bo->width;
 	h = plane->bo->height;
 
@@ -153,23 +764,61 @@ int set_sp_plane(struct sp_dev *dev, struct sp_plane *plane,
 	if ((h + y) > crtc->crtc->mode.vdisplay)
 		h = crtc->crtc->mode.vdisplay - y;
 
-	ret = drmModeSetPlane(dev->fd, plane->plane->plane_id,
+	ret = dev->ops->set_plane(dev, plane->plane->plane_id,
 			crtc->crtc->crtc_id, plane->bo->fb_id, 0, x, y, w, h,
 			0, 0, w << 16, h << 16);
 	if (ret) {
 		printf("failed to set plane to crtc ret=%d\n", ret);
 		return ret;
 	}
+	plane->crtc = crtc;
 
 	return ret;
 }
-#ifdef USE_ATOMIC_API
+
+/*
+ * Turns the bo's damage into an FB_DAMAGE_CLIPS blob. The blob from the
+ * previous call has been consumed by that commit and is destroyed here.
+ */
+static int add_damage_clips(struct sp_dev *dev, struct sp_plane *plane,
+		struct sp_atomic *req)
+{
+	struct sp_bo *bo = plane->bo;
+	int ret;
+
+	if (plane->damage_blob_id) {
+		dev->ops->destroy_blob(dev, plane->damage_blob_id);
+		plane->damage_blob_id = 0;
+	}
+
+	if (!plane->damage_clips_pid || !bo->num_damage)
+		return 0;
+
+	ret = dev->ops->create_blob(dev, bo->damage,
+			bo->num_damage * sizeof(bo->damage[0]),
+			&plane->damage_blob_id);
+	if (ret) {
+		printf("failed to create damage blob ret=%d\n", ret);
+		return ret;
+	}
+	sp_bo_clear_damage(bo);
+
+	return sp_atomic_add(req, plane->plane->plane_id,
+			plane->damage_clips_pid, plane->damage_blob_id);
+}
+
 int set_sp_plane_pset(struct sp_dev *dev, struct sp_plane *plane,
-		drmModePropertySetPtr pset, struct sp_crtc *crtc, int x, int y)
+		struct sp_atomic *req, struct sp_crtc *crtc, int x, int y)
 {
 	int ret;
 	uint32_t w, h;
 
+	ret = sp_plane_pids(plane);
+	if (ret)
+		return ret;
+
+	sp_bo_flush_writes(plane->bo);
+
 	w = plane->bo->width;
 	h = plane->bo->height;
 
@@ -178,31 +827,32 @@ int set_sp_plane_pset(struct sp_dev *dev, struct sp_plane *plane,
 	if ((h + y) > crtc->crtc->mode.vdisplay)
 		h = crtc->crtc->mode.vdisplay - y;
 
-	ret = drmModePropertySetAdd(pset, plane->plane->plane_id,
+	ret = sp_atomic_add(req, plane->plane->plane_id,
 			plane->crtc_pid, crtc->crtc->crtc_id)
-		|| drmModePropertySetAdd(pset, plane->plane->plane_id,
+		|| sp_atomic_add(req, plane->plane->plane_id,
 			plane->fb_pid, plane->bo->fb_id)
-		|| drmModePropertySetAdd(pset, plane->plane->plane_id,
+		|| sp_atomic_add(req, plane->plane->plane_id,
 			plane->crtc_x_pid, x)
-		|| drmModePropertySetAdd(pset, plane->plane->plane_id,
+		|| sp_atomic_add(req, plane->plane->plane_id,
 			plane->crtc_y_pid, y)
-		|| drmModePropertySetAdd(pset, plane->plane->plane_id,
+		|| sp_atomic_add(req, plane->plane->plane_id,
 			plane->crtc_w_pid, w)
-		|| drmModePropertySetAdd(pset, plane->plane->plane_id,
+		|| sp_atomic_add(req, plane->plane->plane_id,
 			plane->crtc_h_pid, h)
-		|| drmModePropertySetAdd(pset, plane->plane->plane_id,
+		|| sp_atomic_add(req, plane->plane->plane_id,
 			plane->src_x_pid, 0)
-		|| drmModePropertySetAdd(pset, plane->plane->plane_id,
+		|| sp_atomic_add(req, plane->plane->plane_id,
 			plane->src_y_pid, 0)
-		|| drmModePropertySetAdd(pset, plane->plane->plane_id,
+		|| sp_atomic_add(req, plane->plane->plane_id,
 			plane->src_w_pid, w << 16)
-		|| drmModePropertySetAdd(pset, plane->plane->plane_id,
-			plane->src_h_pid, h << 16);
+		|| sp_atomic_add(req, plane->plane->plane_id,
+			plane->src_h_pid, h << 16)
+		|| add_damage_clips(dev, plane, req);
 	if (ret) {
 		printf("failed to add properties to the set\n");
 		return -1;
 	}
+	plane->crtc = crtc;
 
 	return ret;
 }
-#endif
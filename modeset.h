@@ -3,19 +3,59 @@
 
 struct sp_dev;
 struct sp_crtc;
+struct sp_atomic;
+struct _drmModeModeInfo;
 
+/* A connector to light, and what with */
+struct sp_output {
+	int connector;		/* index into dev->connectors */
+	int encoder;		/* index into dev->encoders */
+	struct sp_crtc *crtc;
+	struct _drmModeModeInfo *mode;
+	int clone;		/* shares crtc with an output before it */
+};
+
+/*
+ * Matches connected connectors to encoders and CRTCs so that as many as
+ * possible light, each with its preferred mode. Of the assignments that
+ * do, it takes one leaving the CRTCs used the most overlay planes. A
+ * connector no CRTC is left for may clone one whose encoder it can share
+ * it with, showing the same mode. CRTCs that already have a scanout, and
+ * the encoders and connectors on them, are left out. outputs takes
+ * num_connectors entries, clones last; returns how many it filled or
+ * -ENOMEM. Nothing is set.
+ */
+int sp_assign_outputs(struct sp_dev *dev, struct sp_output *outputs);
+
+/*
+ * Lights every connected connector sp_assign_outputs() finds a CRTC for,
+ * with its preferred mode and a yellow scanout. All of them go in one
+ * atomic commit, tested first, when the device takes one; otherwise, or
+ * with SP_MODESET=legacy, each CRTC gets a drmModeSetCrtc() of its own.
+ * SP_MODESET=atomic fails rather than falls back. Called again, after a
+ * hotplug say, it lights only what is not lit yet.
+ */
 int initialize_screens(struct sp_dev *dev);
 
+/*
+ * Prints the memory bandwidth each lit CRTC's scanout takes at its mode
+ * and refresh rate, counting planes last set on it, and how much less that
+ * is than with XRGB8888 buffers.
+ */
+void print_scanout_bandwidth(struct sp_dev *dev);
 
+/*
+ * A free plane for crtc, and back. Threads may take and put planes for
+ * their own CRTCs at the same time, see sp_plane_claim().
+ */
 struct sp_plane *get_sp_plane(struct sp_dev *dev, struct sp_crtc *crtc);
 void put_sp_plane(struct sp_plane *plane);
 
 int set_sp_plane(struct sp_dev *dev, struct sp_plane *plane,
 		struct sp_crtc *crtc, int x, int y);
 
-#ifdef USE_ATOMIC_API
+/* Adds the plane's properties to req, sp_atomic_commit() then sets it */
 int set_sp_plane_pset(struct sp_dev *dev, struct sp_plane *plane,
-		drmModePropertySetPtr pset, struct sp_crtc *crtc, int x, int y);
-#endif
+		struct sp_atomic *req, struct sp_crtc *crtc, int x, int y);
 
 #endif /* __MODESET_H_INCLUDED__ */
@@ -0,0 +1,173 @@
+/*
+ * Times initialize_screens() from its call until every screen is lit, once
+ * with a drmModeSetCrtc() per output and once with a single atomic commit,
+ * on a freshly created device each round.
+ *
+ *   modeset_bench [rounds]
+ *
+ * SP_DEV defaults to fake:crtcs=4,universal=1, whose mode sets return at
+ * the next 60 Hz vblank like a kernel's would at best. Both include
+ * creating and filling the scanouts.
+ *
+ * A last round starts from every CRTC lit, as fbcon leaves them, with the
+ * last connector unplugged since; its CRTC has to go off with it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+#include <drm_fourcc.h>
+
+#include "bo.h"
+#include "dev.h"
+#include "fake.h"
+#include "modeset.h"
+
+static const char * const paths[] = { "legacy", "atomic" };
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Lights every CRTC with its connector and one fb, and has the topology
+ * say so as the kernel would, then unplugs the last connector.
+ */
+static struct sp_bo *light_like_fbcon(struct sp_dev *dev)
+{
+	drmModeConnectorPtr c;
+	drmModeCrtcPtr crtc;
+	struct sp_bo *bo;
+	int i, n = dev->num_crtcs;
+
+	if (n > dev->num_connectors)
+		n = dev->num_connectors;
+	if (!n || !dev->connectors[0]->count_modes)
+		return NULL;
+	c = dev->connectors[0];
+	bo = create_sp_bo(dev, c->modes[0].hdisplay, c->modes[0].vdisplay, 24,
+			32, DRM_FORMAT_XRGB8888, 0);
+	if (!bo)
+		return NULL;
+
+	for (i = 0; i < n; i++) {
+		c = dev->connectors[i];
+		crtc = dev->crtcs[i].crtc;
+		if (!c->count_modes || dev->ops->set_crtc(dev, crtc->crtc_id,
+				bo->fb_id, 0, 0, &c->connector_id, 1,
+				&c->modes[0])) {
+			free_sp_bo(bo);
+			return NULL;
+		}
+		crtc->mode = c->modes[0];
+		crtc->mode_valid = 1;
+		crtc->buffer_id = bo->fb_id;
+		c->encoder_id = dev->encoders[i]->encoder_id;
+		dev->encoders[i]->crtc_id = crtc->crtc_id;
+	}
+	dev->connectors[n - 1]->connection = DRM_MODE_DISCONNECTED;
+	return bo;
+}
+
+/* Lit CRTCs after one initialize_screens(), -1 if it failed */
+static int bench(const char *path, int unplugged, double *ms)
+{
+	struct sp_fake_stats stats;
+	struct sp_bo *fbcon = NULL;
+	struct sp_dev *dev;
+	int i, ret, lit = 0;
+	double start;
+
+	*ms = 0;
+	setenv("SP_MODESET", path, 1);
+	dev = create_sp_dev();
+	if (!dev) {
+		printf("Failed to create sp_dev\n");
+		return -1;
+	}
+	if (unplugged) {
+		fbcon = light_like_fbcon(dev);
+		if (!fbcon) {
+			printf("failed to light crtcs like fbcon\n");
+			destroy_sp_dev(dev);
+			return -1;
+		}
+	}
+
+	start = now();
+	ret = initialize_screens(dev);
+	*ms = (now() - start) * 1e3;
+	for (i = 0; i < dev->num_crtcs; i++) {
+		if (dev->crtcs[i].scanout && dev->crtcs[i].crtc->mode_valid)
+			lit++;
+	}
+	if (!ret && !sp_fake_get_stats(dev, &stats) && stats.rejected)
+		printf("%s: %llu rejected\n", path,
+			(unsigned long long)stats.rejected);
+
+	free_sp_bo(fbcon);
+	destroy_sp_dev(dev);
+	return ret ? -1 : lit;
+}
+
+int main(int argc, char *argv[])
+{
+	int rounds = argc > 1 ? atoi(argv[1]) : 5;
+	double ms, total[2] = {}, best[2] = { 1e9, 1e9 };
+	int i, r, lit[2] = { -1, -1 }, ret = 0;
+
+	setenv("SP_DEV", "fake:crtcs=4,universal=1", 0);
+	if (rounds < 1)
+		rounds = 1;
+
+	for (r = 0; r < rounds; r++) {
+		for (i = 0; i < 2; i++) {
+			lit[i] = bench(paths[i], 0, &ms);
+			total[i] += ms;
+			if (ms < best[i])
+				best[i] = ms;
+		}
+		/* Without atomic commits there is nothing to compare */
+		if (lit[0] < 0 || lit[1] < 0)
+			break;
+	}
+
+	if (lit[0] < 0) {
+		printf("legacy modeset failed\n");
+		ret = -1;
+		goto out;
+	}
+	if (lit[1] < 0) {
+		printf("%d screens lit with legacy, atomic unavailable "
+			"(no universal planes or atomic commits?)\n", lit[0]);
+		goto out;
+	}
+	for (i = 0; i < 2; i++)
+		printf("%-8s %d screens lit in %8.3f ms (best %8.3f ms)\n",
+			paths[i], lit[i], total[i] / rounds, best[i]);
+	printf("atomic took %.2fx the time of legacy\n", total[1] / total[0]);
+	if (lit[0] != lit[1]) {
+		printf("legacy lit %d screens, atomic %d\n", lit[0], lit[1]);
+		ret = -1;
+	}
+
+	/* One connector less than the first rounds had */
+	r = bench(paths[1], 1, &ms);
+	printf("%-8s %d screens lit in %8.3f ms after an unplug\n", paths[1],
+		r, ms);
+	if (r != lit[1] - 1) {
+		printf("atomic should have lit %d screens\n", lit[1] - 1);
+		ret = -1;
+	}
+
+out:
+	printf("%s\n", ret ? "FAIL" : "PASS");
+	return ret;
+}
@@ -0,0 +1,265 @@
+/*
+ * Compares sp_assign_outputs() with the first fit initialize_screens() used
+ * to do, on made up topologies where connectors have a choice of encoders,
+ * encoders only reach some CRTCs, some encoders can be cloned and CRTCs
+ * have different overlays. Counts the outputs each lights and the overlays
+ * left on their CRTCs, checks every assignment is one the device allows,
+ * and times both.
+ *
+ *   output_match_bench [topologies]
+ *
+ * SP_DEV defaults to fake:crtcs=12,overlays=24, whose topology is redrawn
+ * at random, the same for each run, for every round.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+#include "dev.h"
+#include "modeset.h"
+
+#define MAX_ENCODERS 3
+
+struct totals {
+	int lit;
+	int overlays;
+	int clones;
+	double secs;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Pipes 0 and 1 are the ones most encoders reach, as on hardware where
+ * only some CRTCs drive every output type.
+ */
+static int make_topology(struct sp_dev *dev, const uint64_t *overlays,
+		unsigned *seed)
+{
+	int i, j, n = dev->num_crtcs;
+	drmModeConnectorPtr c;
+	drmModeEncoderPtr e;
+	uint32_t *encoders;
+
+	for (i = 0; i < dev->num_encoders; i++) {
+		e = dev->encoders[i];
+		e->possible_crtcs = 1 << (rand_r(seed) % 2);
+		for (j = rand_r(seed) % 3; j > 0; j--)
+			e->possible_crtcs |= 1 << (rand_r(seed) % n);
+		e->possible_clones = 1 << i;
+	}
+	for (i = 0; i + 1 < dev->num_encoders; i += 2) {
+		if (rand_r(seed) % 4)
+			continue;
+		dev->encoders[i]->possible_clones |= 1 << (i + 1);
+		dev->encoders[i + 1]->possible_clones |= 1 << i;
+	}
+
+	for (i = 0; i < dev->num_connectors; i++) {
+		c = dev->connectors[i];
+		encoders = realloc(c->encoders, MAX_ENCODERS *
+				sizeof(*encoders));
+		if (!encoders)
+			return -1;
+		c->encoders = encoders;
+		c->count_encoders = 1 + rand_r(seed) % MAX_ENCODERS;
+		for (j = 0; j < c->count_encoders; j++)
+			c->encoders[j] = dev->encoders[rand_r(seed) %
+					dev->num_encoders]->encoder_id;
+		c->connection = rand_r(seed) % 8 ? DRM_MODE_CONNECTED :
+			DRM_MODE_DISCONNECTED;
+	}
+
+	for (i = 0; i < n; i++) {
+		for (j = 0; j < dev->num_plane_words; j++)
+			dev->crtcs[i].type_planes[DRM_PLANE_TYPE_OVERLAY][j] =
+				overlays[j] & (((uint64_t)rand_r(seed) << 32) |
+					rand_r(seed));
+	}
+	return 0;
+}
+
+/* What initialize_screens() did: the first encoder, its first CRTC */
+static int first_fit(struct sp_dev *dev, struct sp_output *outputs)
+{
+	int i, j, k, pipe, n = 0;
+	uint64_t taken = 0;
+
+	for (i = 0; i < dev->num_connectors; i++) {
+		drmModeConnectorPtr c = dev->connectors[i];
+
+		if (c->connection != DRM_MODE_CONNECTED || !c->count_modes)
+			continue;
+		for (j = 0; j < dev->num_encoders; j++) {
+			for (k = 0; k < c->count_encoders; k++) {
+				if (dev->encoders[j]->encoder_id ==
+				    c->encoders[k])
+					break;
+			}
+			if (k < c->count_encoders)
+				break;
+		}
+		if (j == dev->num_encoders)
+			continue;
+		pipe = __builtin_ffs(dev->encoders[j]->possible_crtcs) - 1;
+		if (pipe < 0 || pipe >= dev->num_crtcs ||
+		    (taken & (1ull << pipe)))
+			continue;
+		taken |= 1ull << pipe;
+		outputs[n].connector = i;
+		outputs[n].encoder = j;
+		outputs[n].crtc = &dev->crtcs[pipe];
+		outputs[n].mode = &c->modes[0];
+		outputs[n].clone = 0;
+		n++;
+	}
+	return n;
+}
+
+/* Whether the device can do it, counting the overlays on its CRTCs */
+static int check(struct sp_dev *dev, struct sp_output *outputs, int n,
+		struct totals *t)
+{
+	drmModeEncoderPtr e, base;
+	int i, j, k, found;
+
+	for (i = 0; i < n; i++) {
+		drmModeConnectorPtr c = dev->connectors[outputs[i].connector];
+
+		e = dev->encoders[outputs[i].encoder];
+		for (k = found = 0; k < c->count_encoders; k++)
+			found |= c->encoders[k] == e->encoder_id;
+		if (!found || c->connection != DRM_MODE_CONNECTED ||
+		    !(e->possible_crtcs & (1 << outputs[i].crtc->pipe)))
+			return -1;
+		for (j = 0; j < i; j++) {
+			if (outputs[j].connector == outputs[i].connector ||
+			    outputs[j].encoder == outputs[i].encoder)
+				return -1;
+			if (outputs[j].crtc != outputs[i].crtc)
+				continue;
+			base = dev->encoders[outputs[j].encoder];
+			if (!outputs[i].clone ||
+			    !(base->possible_clones & (1 << outputs[i].encoder)))
+				return -1;
+		}
+		if (outputs[i].clone) {
+			t->clones++;
+			continue;
+		}
+		for (k = 0; k < dev->num_plane_words; k++)
+			t->overlays += __builtin_popcountll(
+				outputs[i].crtc->type_planes[DRM_PLANE_TYPE_OVERLAY][k]);
+	}
+	t->lit += n;
+	return 0;
+}
+
+static void print_totals(const char *name, struct totals *t, int rounds)
+{
+	printf("%-12s %6.2f lit, %5.1f overlays on their crtcs, "
+		"%5.2f clones, %8.3f us\n", name, (double)t->lit / rounds,
+		(double)t->overlays / rounds, (double)t->clones / rounds,
+		t->secs * 1e6 / rounds);
+}
+
+int main(int argc, char *argv[])
+{
+	int rounds = argc > 1 ? atoi(argv[1]) : 10000;
+	struct totals fit = {}, match = {};
+	struct sp_output *outputs = NULL;
+	uint64_t *overlays = NULL;
+	int i, r, n, worse = 0, ret = 0;
+	struct sp_dev *dev;
+	unsigned seed = 1;
+	double start;
+
+	setenv("SP_DEV", "fake:crtcs=12,overlays=24", 0);
+	if (rounds < 1)
+		rounds = 1;
+
+	dev = create_sp_dev();
+	if (!dev) {
+		printf("Failed to create sp_dev\n");
+		return -1;
+	}
+	if (dev->num_crtcs > 32 || dev->num_encoders > 32) {
+		printf("at most 32 crtcs and encoders\n");
+		ret = -1;
+		goto out;
+	}
+
+	outputs = calloc(dev->num_connectors + 1, sizeof(*outputs));
+	overlays = calloc(dev->num_plane_words + 1, sizeof(*overlays));
+	if (!outputs || !overlays) {
+		ret = -1;
+		goto out;
+	}
+	for (i = 0; i < dev->num_plane_words; i++)
+		overlays[i] = dev->crtcs[0].type_planes[DRM_PLANE_TYPE_OVERLAY][i];
+	printf("%d connectors, %d encoders, %d crtcs, %d topologies\n",
+		dev->num_connectors, dev->num_encoders, dev->num_crtcs,
+		rounds);
+
+	for (r = 0; r < rounds; r++) {
+		struct totals a = {}, b = {};
+
+		if (make_topology(dev, overlays, &seed)) {
+			ret = -1;
+			goto out;
+		}
+
+		start = now();
+		n = first_fit(dev, outputs);
+		fit.secs += now() - start;
+		if (check(dev, outputs, n, &a)) {
+			printf("round %d: first fit made an invalid choice\n", r);
+			ret = -1;
+		}
+
+		start = now();
+		n = sp_assign_outputs(dev, outputs);
+		match.secs += now() - start;
+		if (n < 0 || check(dev, outputs, n, &b)) {
+			printf("round %d: invalid assignment\n", r);
+			ret = -1;
+			continue;
+		}
+
+		/* No maximum matching may lose to first fit on either count */
+		if (b.lit - b.clones < a.lit ||
+		    (b.lit - b.clones == a.lit && b.overlays < a.overlays))
+			worse++;
+		fit.lit += a.lit;
+		fit.overlays += a.overlays;
+		match.lit += b.lit;
+		match.overlays += b.overlays;
+		match.clones += b.clones;
+	}
+
+	print_totals("first fit", &fit, rounds);
+	print_totals("matching", &match, rounds);
+	printf("matching lit %.1f%% more outputs\n",
+		fit.lit ? (match.lit - fit.lit) * 100.0 / fit.lit : 0.0);
+	if (worse) {
+		printf("%d topologies where first fit did better\n", worse);
+		ret = -1;
+	}
+
+out:
+	free(outputs);
+	free(overlays);
+	destroy_sp_dev(dev);
+	printf("%s\n", ret ? "FAIL" : "PASS");
+	return ret;
+}
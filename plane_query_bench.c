@@ -0,0 +1,276 @@
+/*
+ * Compares finding a plane by CRTC, type, format and modifier through the
+ * tables built at enumeration with scanning every plane's format list and
+ * IN_FORMATS blob, and checks that both find the same planes. Prints which
+ * formats the device takes with which modifiers.
+ *
+ *   plane_query_bench [rounds]
+ *
+ * SP_DEV defaults to fake:crtcs=4,overlays=32.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <drm_fourcc.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+#include "dev.h"
+
+static const struct {
+	int type;
+	uint32_t format;
+	uint64_t modifier;
+} queries[] = {
+	{ DRM_PLANE_TYPE_PRIMARY, DRM_FORMAT_XRGB8888, DRM_FORMAT_MOD_LINEAR },
+	{ DRM_PLANE_TYPE_PRIMARY, DRM_FORMAT_XRGB8888,
+		I915_FORMAT_MOD_X_TILED },
+	{ DRM_PLANE_TYPE_OVERLAY, DRM_FORMAT_NV12, DRM_FORMAT_MOD_LINEAR },
+	{ DRM_PLANE_TYPE_OVERLAY, DRM_FORMAT_NV12, I915_FORMAT_MOD_Y_TILED },
+	{ DRM_PLANE_TYPE_OVERLAY, DRM_FORMAT_NV12, I915_FORMAT_MOD_X_TILED },
+	{ DRM_PLANE_TYPE_OVERLAY, DRM_FORMAT_P010, DRM_FORMAT_MOD_INVALID },
+	{ DRM_PLANE_TYPE_CURSOR, DRM_FORMAT_ARGB8888, DRM_FORMAT_MOD_LINEAR },
+	{ -1, DRM_FORMAT_XRGB2101010, DRM_FORMAT_MOD_LINEAR },
+	{ -1, DRM_FORMAT_ABGR16161616F, DRM_FORMAT_MOD_INVALID },
+};
+
+#define NUM_QUERIES (sizeof(queries) / sizeof(queries[0]))
+
+/* Keeps the timed lookups from being optimized out */
+static struct sp_plane *volatile found;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static const char *modifier_name(uint64_t modifier)
+{
+	static char buf[32];
+
+	if (modifier == DRM_FORMAT_MOD_LINEAR)
+		return "linear";
+	if (modifier == I915_FORMAT_MOD_X_TILED)
+		return "x-tiled";
+	if (modifier == I915_FORMAT_MOD_Y_TILED)
+		return "y-tiled";
+	snprintf(buf, sizeof(buf), "0x%llx", (unsigned long long)modifier);
+	return buf;
+}
+
+/* Whether the blob pairs format with modifier, walking all of it */
+static int blob_has(drmModePropertyBlobPtr blob, uint32_t format,
+		uint64_t modifier)
+{
+	const struct drm_format_modifier_blob *h = blob->data;
+	const struct drm_format_modifier *mods;
+	const uint32_t *formats;
+	uint32_t i, j;
+
+	formats = (const uint32_t *)((const char *)h + h->formats_offset);
+	mods = (const struct drm_format_modifier *)((const char *)h +
+			h->modifiers_offset);
+	for (i = 0; i < h->count_modifiers; i++) {
+		if (modifier != DRM_FORMAT_MOD_INVALID &&
+		    mods[i].modifier != modifier)
+			continue;
+		for (j = 0; j < 64 && mods[i].offset + j < h->count_formats;
+		     j++) {
+			if ((mods[i].formats & (1ull << j)) &&
+			    formats[mods[i].offset + j] == format)
+				return 1;
+		}
+	}
+	return 0;
+}
+
+/* The way lookups went before the tables: every plane, every format */
+static struct sp_plane *scan(struct sp_dev *dev, drmModePropertyBlobPtr *blobs,
+		struct sp_crtc *crtc, int type, uint32_t format,
+		uint64_t modifier)
+{
+	const struct sp_prop *prop;
+	struct sp_plane *p;
+	uint32_t j;
+	int i;
+
+	for (i = 0; i < dev->num_planes; i++) {
+		p = &dev->planes[i];
+		if (!(p->plane->possible_crtcs & (1 << crtc->pipe)))
+			continue;
+		if (type >= 0) {
+			prop = sp_props_find(sp_plane_props(p), "type");
+			if ((prop ? (int)prop->value : DRM_PLANE_TYPE_OVERLAY) !=
+			    type)
+				continue;
+		}
+		if (blobs[i]) {
+			if (blob_has(blobs[i], format, modifier))
+				return p;
+			continue;
+		}
+		if (modifier != DRM_FORMAT_MOD_LINEAR &&
+		    modifier != DRM_FORMAT_MOD_INVALID)
+			continue;
+		for (j = 0; j < p->plane->count_formats; j++) {
+			if (p->plane->formats[j] == format)
+				return p;
+		}
+	}
+	return NULL;
+}
+
+/* The first plane the tables give, without claiming it */
+static struct sp_plane *lookup(struct sp_dev *dev, struct sp_crtc *crtc,
+		int type, uint32_t format, uint64_t modifier)
+{
+	const uint64_t *planes, *mask;
+	uint64_t bits;
+	int i;
+
+	planes = sp_dev_format_planes(dev, format, modifier);
+	if (!planes)
+		return NULL;
+	mask = type < 0 ? crtc->possible_planes : crtc->type_planes[type];
+	for (i = 0; i < dev->num_plane_words; i++) {
+		bits = planes[i] & mask[i];
+		if (bits)
+			return &dev->planes[i * 64 + __builtin_ctzll(bits)];
+	}
+	return NULL;
+}
+
+static void print_matrix(struct sp_dev *dev)
+{
+	const uint64_t *planes;
+	int f, m, i, n;
+
+	printf("%d formats, %d modifiers, planes taking each:\n",
+		dev->num_formats, dev->num_modifiers);
+	printf("      ");
+	for (m = 0; m < dev->num_modifiers; m++)
+		printf(" %10s", modifier_name(dev->modifiers[m]));
+	printf("\n");
+	for (f = 0; f < dev->num_formats; f++) {
+		printf("%.4s  ", (char *)&dev->formats[f]);
+		for (m = 0; m < dev->num_modifiers; m++) {
+			planes = sp_dev_format_planes(dev, dev->formats[f],
+					dev->modifiers[m]);
+			for (i = n = 0; i < dev->num_plane_words; i++)
+				n += __builtin_popcountll(planes[i]);
+			printf(" %10d", n);
+		}
+		printf("\n");
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	int rounds = argc > 1 ? atoi(argv[1]) : 100000;
+	drmModePropertyBlobPtr *blobs = NULL;
+	struct sp_plane *a, *b;
+	const struct sp_prop *prop;
+	double t_scan, t_lookup, t_claim;
+	int i, c, r, n = 0, ret = 0;
+	struct sp_crtc *crtc;
+	unsigned q;
+	struct sp_dev *dev;
+
+	setenv("SP_DEV", "fake:crtcs=4,overlays=32", 0);
+	if (rounds < 1)
+		rounds = 1;
+
+	dev = create_sp_dev();
+	if (!dev) {
+		printf("Failed to create sp_dev\n");
+		return -1;
+	}
+	print_matrix(dev);
+
+	blobs = calloc(dev->num_planes + 1, sizeof(*blobs));
+	if (!blobs) {
+		ret = -1;
+		goto out;
+	}
+	for (i = 0; i < dev->num_planes; i++) {
+		prop = sp_props_find(sp_plane_props(&dev->planes[i]),
+				"IN_FORMATS");
+		if (prop && prop->value && dev->ops->get_blob)
+			blobs[i] = dev->ops->get_blob(dev, prop->value);
+	}
+
+	/* Both ways have to agree before either is timed */
+	for (c = 0; c < dev->num_crtcs; c++) {
+		crtc = &dev->crtcs[c];
+		for (q = 0; q < NUM_QUERIES; q++) {
+			a = scan(dev, blobs, crtc, queries[q].type,
+				queries[q].format, queries[q].modifier);
+			b = lookup(dev, crtc, queries[q].type,
+				queries[q].format, queries[q].modifier);
+			if (a != b) {
+				printf("crtc %d: %.4s %s found plane %d "
+					"scanning, %d from the tables\n", c,
+					(char *)&queries[q].format,
+					modifier_name(queries[q].modifier),
+					a ? (int)(a - dev->planes) : -1,
+					b ? (int)(b - dev->planes) : -1);
+				ret = -1;
+			}
+			n += !!b;
+		}
+	}
+	printf("%d planes on %d crtcs, %d of %d queries found one\n",
+		dev->num_planes, dev->num_crtcs, n,
+		(int)(dev->num_crtcs * NUM_QUERIES));
+	if (ret)
+		goto out;
+
+	t_scan = now();
+	for (r = 0; r < rounds; r++) {
+		crtc = &dev->crtcs[r % dev->num_crtcs];
+		q = r % NUM_QUERIES;
+		found = scan(dev, blobs, crtc, queries[q].type,
+			queries[q].format, queries[q].modifier);
+	}
+	t_scan = now() - t_scan;
+
+	t_lookup = now();
+	for (r = 0; r < rounds; r++) {
+		crtc = &dev->crtcs[r % dev->num_crtcs];
+		q = r % NUM_QUERIES;
+		found = lookup(dev, crtc, queries[q].type, queries[q].format,
+			queries[q].modifier);
+	}
+	t_lookup = now() - t_lookup;
+
+	t_claim = now();
+	for (r = 0; r < rounds; r++) {
+		crtc = &dev->crtcs[r % dev->num_crtcs];
+		q = r % NUM_QUERIES;
+		a = sp_plane_claim_for(dev, crtc, queries[q].type,
+			queries[q].format, queries[q].modifier, NULL);
+		if (a)
+			sp_plane_release(a);
+	}
+	t_claim = now() - t_claim;
+
+	printf("scan               %8.3f us\n", t_scan * 1e6 / rounds);
+	printf("tables             %8.3f us, %.1fx\n", t_lookup * 1e6 / rounds,
+		t_scan / t_lookup);
+	printf("claim and release  %8.3f us\n", t_claim * 1e6 / rounds);
+
+out:
+	for (i = 0; blobs && i < dev->num_planes; i++) {
+		if (blobs[i])
+			drmModeFreePropertyBlob(blobs[i]);
+	}
+	free(blobs);
+	destroy_sp_dev(dev);
+	printf("%s\n", ret ? "FAIL" : "PASS");
+	return ret;
+}
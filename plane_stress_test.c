@@ -0,0 +1,295 @@
+/*
+ * Hammers the plane allocator from several threads, then drives every CRTC
+ * from a thread of its own. Claims are checked for planes handed to two
+ * threads at once and for planes that can't go on the CRTC asked for.
+ *
+ *   plane_stress_test [threads] [claims per thread]
+ *
+ * Threads default to one per CRTC and take turns on the CRTCs. SP_DEV
+ * defaults to fake:hz=0,crtcs=4,overlays=12, where the overlays are
+ * shared by every CRTC and so contended for.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+#include "bo.h"
+#include "dev.h"
+#include "modeset.h"
+
+#define FRAMES 1000
+#define PLANE_SIZE 64
+
+struct worker {
+	pthread_t thread;
+	int id;
+	struct sp_dev *dev;
+	struct sp_crtc *crtc;
+	int claims;
+
+	uint64_t claimed;
+	uint64_t retries;
+	uint64_t empty;		/* no plane was free */
+	uint64_t errors;
+	int frames;
+	int ret;
+};
+
+static pthread_barrier_t start;
+static int *owners;		/* worker id per dev->planes index, or -1 */
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Nobody else may have had the plane, and it must fit the CRTC */
+static void own(struct worker *w, struct sp_plane *plane, int owner)
+{
+	int index = plane - w->dev->planes;
+	int prev;
+
+	if (!(plane->plane->possible_crtcs & (1 << w->crtc->pipe)))
+		w->errors++;
+	prev = __atomic_exchange_n(&owners[index], owner, __ATOMIC_RELAXED);
+	if (prev != (owner < 0 ? w->id : -1))
+		w->errors++;
+}
+
+/* Takes two planes at a time so others find fewer free ones */
+static void *claim_thread(void *arg)
+{
+	struct worker *w = arg;
+	struct sp_plane *a, *b;
+	int i;
+
+	pthread_barrier_wait(&start);
+	for (i = 0; i < w->claims; i++) {
+		a = sp_plane_claim(w->dev, w->crtc, &w->retries);
+		if (!a) {
+			w->empty++;
+			continue;
+		}
+		own(w, a, w->id);
+		b = sp_plane_claim(w->dev, w->crtc, &w->retries);
+		if (b)
+			own(w, b, w->id);
+		w->claimed += 1 + !!b;
+
+		if (b) {
+			own(w, b, -1);
+			sp_plane_release(b);
+		}
+		own(w, a, -1);
+		sp_plane_release(a);
+	}
+	return NULL;
+}
+
+static void flip_handler(int fd, unsigned int sequence, unsigned int tv_sec,
+		unsigned int tv_usec, void *user_data)
+{
+	/* Possibly another CRTC's thread delivering it */
+	__atomic_store_n((int *)user_data, 0, __ATOMIC_RELEASE);
+}
+
+/* A CRTC's render loop: its own plane, bo, commits and flips */
+static void *frame_thread(void *arg)
+{
+	struct worker *w = arg;
+	struct sp_dev *dev = w->dev;
+	drmEventContext ctx = {};
+	struct sp_atomic *req;
+	struct sp_plane *plane;
+	int i, pending;
+
+	ctx.version = DRM_EVENT_CONTEXT_VERSION;
+	ctx.page_flip_handler = flip_handler;
+
+	pthread_barrier_wait(&start);
+	req = sp_atomic_alloc();
+	plane = get_sp_plane(dev, w->crtc);
+	if (!req || !plane) {
+		printf("thread %d: no plane for crtc %d\n", w->id,
+			w->crtc->pipe);
+		w->ret = -1;
+		goto out;
+	}
+	plane->bo = create_sp_bo(dev, PLANE_SIZE, PLANE_SIZE, 24,
+			sp_format_bpp(plane->format), plane->format, 0);
+	if (!plane->bo) {
+		w->ret = -1;
+		goto out;
+	}
+	fill_bo(plane->bo, 0xff, 0x00, 0x00, 0xff);
+
+	for (i = 0; i < FRAMES; i++) {
+		draw_rect(plane->bo, i % (PLANE_SIZE - 8), 0, 8, PLANE_SIZE,
+			0xff, i, w->id * 0x40, 0xff);
+
+		sp_atomic_reset(req);
+		w->ret = set_sp_plane_pset(dev, plane, req, w->crtc,
+				i % (w->crtc->crtc->mode.hdisplay - PLANE_SIZE),
+				0);
+		if (w->ret)
+			break;
+
+		pending = 1;
+		w->ret = sp_atomic_commit(dev, req, DRM_MODE_PAGE_FLIP_EVENT,
+				&pending);
+		if (w->ret) {
+			printf("thread %d: commit failed ret=%d\n", w->id,
+				w->ret);
+			break;
+		}
+		while (__atomic_load_n(&pending, __ATOMIC_ACQUIRE)) {
+			w->ret = dev->ops->handle_event(dev, &ctx);
+			if (w->ret)
+				goto out;
+		}
+		w->frames++;
+	}
+
+out:
+	if (plane)
+		put_sp_plane(plane);
+	sp_atomic_free(req);
+	return NULL;
+}
+
+static int run(struct worker *workers, int num_workers,
+		void *(*fn)(void *), double *secs)
+{
+	int i, ret = 0;
+
+	pthread_barrier_init(&start, NULL, num_workers + 1);
+	for (i = 0; i < num_workers; i++) {
+		if (pthread_create(&workers[i].thread, NULL, fn,
+				&workers[i])) {
+			printf("failed to create thread %d\n", i);
+			/* The barrier would never open */
+			exit(-1);
+		}
+	}
+	pthread_barrier_wait(&start);
+	*secs = now();
+	for (i = 0; i < num_workers; i++) {
+		pthread_join(workers[i].thread, NULL);
+		if (workers[i].errors || workers[i].ret)
+			ret = -1;
+	}
+	*secs = now() - *secs;
+	pthread_barrier_destroy(&start);
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	uint64_t claimed = 0, retries = 0, empty = 0, errors = 0;
+	struct worker *workers = NULL;
+	struct sp_crtc **crtcs = NULL;
+	int i, n, num_crtcs = 0, num_workers, claims, frames = 0, ret;
+	struct sp_dev *dev;
+	double secs;
+
+	setenv("SP_DEV", "fake:hz=0,crtcs=4,overlays=12", 0);
+
+	dev = create_sp_dev();
+	if (!dev) {
+		printf("Failed to create sp_dev\n");
+		return -1;
+	}
+
+	ret = initialize_screens(dev);
+	if (ret) {
+		printf("Failed to initialize screens\n");
+		goto out;
+	}
+
+	crtcs = calloc(dev->num_crtcs, sizeof(*crtcs));
+	owners = malloc((dev->num_planes + 1) * sizeof(*owners));
+	if (!crtcs || !owners) {
+		ret = -1;
+		goto out;
+	}
+	for (i = 0; i < dev->num_crtcs; i++) {
+		if (dev->crtcs[i].scanout)
+			crtcs[num_crtcs++] = &dev->crtcs[i];
+	}
+	for (i = 0; i < dev->num_planes; i++)
+		owners[i] = -1;
+	if (!num_crtcs) {
+		printf("No active crtc\n");
+		ret = -1;
+		goto out;
+	}
+
+	num_workers = argc > 1 ? atoi(argv[1]) : num_crtcs;
+	claims = argc > 2 ? atoi(argv[2]) : 200000;
+	if (num_workers < 1)
+		num_workers = 1;
+	/* The frame threads reuse them, one per CRTC */
+	n = num_workers > num_crtcs ? num_workers : num_crtcs;
+	workers = calloc(n, sizeof(*workers));
+	if (!workers) {
+		ret = -1;
+		goto out;
+	}
+	for (i = 0; i < n; i++) {
+		workers[i].id = i;
+		workers[i].dev = dev;
+		workers[i].crtc = crtcs[i % num_crtcs];
+		workers[i].claims = claims;
+	}
+
+	ret = run(workers, num_workers, claim_thread, &secs);
+	for (i = 0; i < num_workers; i++) {
+		claimed += workers[i].claimed;
+		retries += workers[i].retries;
+		empty += workers[i].empty;
+		errors += workers[i].errors;
+	}
+	printf("claim: %d threads on %d crtcs, %d planes, %.0f claims/s, "
+		"%.2f%% lost a compare and swap, %llu found none free\n",
+		num_workers, num_crtcs, dev->num_planes, claimed / secs,
+		claimed ? retries * 100.0 / claimed : 0.0,
+		(unsigned long long)empty);
+	if (errors)
+		printf("%llu planes claimed twice or for the wrong crtc\n",
+			(unsigned long long)errors);
+	for (i = 0; i < dev->num_planes; i++) {
+		if (sp_plane_in_use(&dev->planes[i])) {
+			printf("plane %d still taken\n", i);
+			ret = -1;
+		}
+	}
+	if (ret)
+		goto out;
+
+	/* One thread per CRTC, as the threading notes in dev.h allow */
+	for (i = 0; i < num_crtcs; i++) {
+		workers[i].crtc = crtcs[i];
+		workers[i].ret = 0;
+	}
+	ret = run(workers, num_crtcs, frame_thread, &secs);
+	for (i = 0; i < num_crtcs; i++)
+		frames += workers[i].frames;
+	printf("frames: %d threads, %.0f frames/s\n", num_crtcs,
+		frames / secs);
+
+out:
+	destroy_sp_dev(dev);
+	free(workers);
+	free(crtcs);
+	free(owners);
+	printf("%s\n", ret ? "FAIL" : "PASS");
+	return ret;
+}
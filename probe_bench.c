@@ -0,0 +1,68 @@
+/*
+ * Lists what sp_probe_devices() finds on each DRM node and how long the
+ * node took to probe, against the full enumeration create_sp_dev() used
+ * to do on every node it tried. Then times create_sp_dev() to a usable
+ * device, honouring SP_DEV like the tests do.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "dev.h"
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+	struct sp_dev_probe *probes;
+	struct sp_dev *dev;
+	double start, wall, serial = 0, full;
+	int i, n;
+
+	start = now();
+	n = sp_probe_devices(&probes);
+	wall = (now() - start) * 1e3;
+	if (n < 0) {
+		printf("Failed to probe devices: %d\n", n);
+		return -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		struct sp_dev_probe *p = &probes[i];
+
+		serial += p->ready_ms;
+		printf("%-18s %-12s kms %d dumb %d master %d  probe %7.3f ms",
+			p->path, p->error ? "(error)" : p->driver, p->kms,
+			p->dumb, p->master, p->ready_ms);
+
+		start = now();
+		dev = create_sp_dev_from_path(p->path);
+		full = (now() - start) * 1e3;
+		if (dev) {
+			printf("  enumerate %7.3f ms %4llu ioctls", full,
+				(unsigned long long)dev->stats.ioctls);
+			destroy_sp_dev(dev);
+		}
+		printf("%s\n", sp_dev_probe_usable(p) ? "" : "  (unusable)");
+	}
+	printf("%d nodes probed in %.3f ms, %.3f ms one after another\n", n,
+		wall, serial);
+	free(probes);
+
+	start = now();
+	dev = create_sp_dev();
+	if (!dev) {
+		printf("Failed to create sp_dev\n");
+		return -1;
+	}
+	printf("create_sp_dev: ready in %.3f ms\n", (now() - start) * 1e3);
+	destroy_sp_dev(dev);
+	return 0;
+}
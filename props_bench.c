@@ -0,0 +1,175 @@
+/*
+ * Compares looking up property IDs by name the old way, a
+ * drmModeGetProperty() per property until the name matches, against one
+ * sp_props_get() per object followed by hashed lookups. Covers every plane,
+ * CRTC and connector of the device, and times create_sp_dev() itself.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+#include "dev.h"
+
+#define ITERATIONS 10
+
+static const char * const plane_names[] = {
+	"CRTC_ID", "FB_ID", "CRTC_X", "CRTC_Y", "CRTC_W", "CRTC_H",
+	"SRC_X", "SRC_Y", "SRC_W", "SRC_H", "FB_DAMAGE_CLIPS", "type",
+	"IN_FORMATS", "zpos",
+};
+
+static const char * const crtc_names[] = {
+	"ACTIVE", "MODE_ID", "OUT_FENCE_PTR", "VRR_ENABLED", "GAMMA_LUT",
+};
+
+static const char * const connector_names[] = {
+	"CRTC_ID", "DPMS", "EDID", "link-status", "content type",
+};
+
+struct lookup_stats {
+	double secs;
+	uint64_t ioctls;
+	int found;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* The scan dev.c used to do for each name */
+static uint32_t legacy_find(int fd, drmModeObjectPropertiesPtr props,
+		const char *name, uint64_t *ioctls)
+{
+	drmModePropertyPtr p;
+	uint32_t i, prop_id = 0;
+
+	for (i = 0; !prop_id && i < props->count_props; i++) {
+		p = drmModeGetProperty(fd, props->props[i]);
+		(*ioctls)++;
+		if (!p)
+			continue;
+		if (!strcmp(p->name, name))
+			prop_id = p->prop_id;
+		drmModeFreeProperty(p);
+	}
+	return prop_id;
+}
+
+static void legacy_lookup(struct sp_dev *dev, uint32_t id, uint32_t type,
+		const char * const *names, int num_names,
+		struct lookup_stats *stats)
+{
+	drmModeObjectPropertiesPtr props;
+	double start = now();
+	int i;
+
+	props = drmModeObjectGetProperties(dev->fd, id, type);
+	stats->ioctls++;
+	if (!props)
+		return;
+	for (i = 0; i < num_names; i++)
+		stats->found += !!legacy_find(dev->fd, props, names[i],
+				&stats->ioctls);
+	drmModeFreeObjectProperties(props);
+	stats->secs += now() - start;
+}
+
+static void indexed_lookup(struct sp_dev *dev, uint32_t id, uint32_t type,
+		const char * const *names, int num_names,
+		struct lookup_stats *stats)
+{
+	uint64_t ioctls = dev->stats.ioctls;
+	struct sp_props *props;
+	double start = now();
+	int i;
+
+	props = sp_props_get(dev, id, type);
+	if (props) {
+		for (i = 0; i < num_names; i++)
+			stats->found += !!sp_props_id(props, names[i]);
+		sp_props_free(props);
+	}
+	stats->secs += now() - start;
+	stats->ioctls += dev->stats.ioctls - ioctls;
+}
+
+static void bench(struct sp_dev *dev, const char *what, int count,
+		uint32_t (*get_id)(struct sp_dev *dev, int i), uint32_t type,
+		const char * const *names, int num_names)
+{
+	struct lookup_stats legacy = { 0 }, indexed = { 0 };
+	int i;
+
+	for (i = 0; i < count; i++) {
+		legacy_lookup(dev, get_id(dev, i), type, names, num_names,
+			&legacy);
+		indexed_lookup(dev, get_id(dev, i), type, names, num_names,
+			&indexed);
+	}
+	if (legacy.found != indexed.found)
+		printf("  %s: legacy found %d properties, index %d\n", what,
+			legacy.found, indexed.found);
+
+	printf("%-10s %3d x %2d names  legacy %8.3f ms %6llu ioctls  "
+		"index %8.3f ms %6llu ioctls\n", what, count, num_names,
+		legacy.secs * 1e3, (unsigned long long)legacy.ioctls,
+		indexed.secs * 1e3, (unsigned long long)indexed.ioctls);
+}
+
+static uint32_t plane_id(struct sp_dev *dev, int i)
+{
+	return dev->planes[i].plane->plane_id;
+}
+
+static uint32_t crtc_id(struct sp_dev *dev, int i)
+{
+	return dev->crtcs[i].crtc->crtc_id;
+}
+
+static uint32_t connector_id(struct sp_dev *dev, int i)
+{
+	return dev->connectors[i]->connector_id;
+}
+
+int main(int argc, char *argv[])
+{
+	struct sp_dev *dev = NULL;
+	double start, secs = 0;
+	int i;
+
+	for (i = 0; i < ITERATIONS; i++) {
+		if (dev)
+			destroy_sp_dev(dev);
+		start = now();
+		dev = create_sp_dev();
+		secs += now() - start;
+		if (!dev) {
+			printf("Failed to create sp_dev\n");
+			return -1;
+		}
+	}
+	printf("create_sp_dev: %.3f ms, %llu ioctls, %d planes %d crtcs "
+		"%d connectors\n", secs * 1e3 / ITERATIONS,
+		(unsigned long long)dev->stats.ioctls, dev->num_planes,
+		dev->num_crtcs, dev->num_connectors);
+
+	bench(dev, "planes", dev->num_planes, plane_id, DRM_MODE_OBJECT_PLANE,
+		plane_names, sizeof(plane_names) / sizeof(plane_names[0]));
+	bench(dev, "crtcs", dev->num_crtcs, crtc_id, DRM_MODE_OBJECT_CRTC,
+		crtc_names, sizeof(crtc_names) / sizeof(crtc_names[0]));
+	bench(dev, "connectors", dev->num_connectors, connector_id,
+		DRM_MODE_OBJECT_CONNECTOR, connector_names,
+		sizeof(connector_names) / sizeof(connector_names[0]));
+
+	destroy_sp_dev(dev);
+	return 0;
+}
@@ -0,0 +1,161 @@
+/*
+ * Reports ms/frame of CPU drawing into dumb buffers versus worker thread
+ * count at 1080p, 4K and 8K, for a solid fill and for a per-pixel pattern
+ * (the moving circle of vgem_fb_test's draw step).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+#include <drm_fourcc.h>
+
+#include "bo.h"
+#include "dev.h"
+#include "workers.h"
+
+#define FRAMES 30
+
+static const struct {
+	const char *name;
+	uint32_t width;
+	uint32_t height;
+} sizes[] = {
+	{ "1080p", 1920, 1080 },
+	{ "4K", 3840, 2160 },
+	{ "8K", 7680, 4320 },
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void draw_circle(struct sp_bo *bo, uint32_t y0, uint32_t y1,
+		void *data)
+{
+	int radius = *(int *)data;
+	uint32_t x, y;
+
+	for (y = y0; y < y1; y++) {
+		uint32_t *row = (uint32_t *)((uint8_t *)bo->map_addr +
+				y * bo->pitch);
+		int dy = (int)y - 100;
+
+		for (x = 0; x < bo->width; x++) {
+			int dx = (int)x - 100;
+
+			if (dx * dx + dy * dy < radius * radius)
+				row[x] = 0xff000000 | (radius & 0xff) << 8;
+			else
+				row[x] = 0xff0000ff;
+		}
+	}
+}
+
+static void bench(struct sp_bo *bo, int num_threads)
+{
+	struct sp_workers *workers;
+	double start, fill, pattern;
+	int i, radius[FRAMES];
+
+	workers = create_sp_workers(num_threads);
+	if (!workers) {
+		printf("failed to create %d workers\n", num_threads);
+		return;
+	}
+
+	start = now();
+	for (i = 0; i < FRAMES; i++) {
+		sp_workers_fill_bo(workers, bo, 0xFF, i, i, i);
+		sp_workers_finish(workers);
+	}
+	fill = (now() - start) / FRAMES;
+
+	start = now();
+	for (i = 0; i < FRAMES; i++) {
+		radius[i] = i * 16;
+		sp_workers_run(workers, bo, draw_circle, &radius[i]);
+		sp_workers_finish(workers);
+	}
+	pattern = (now() - start) / FRAMES;
+
+	printf("  %2d threads: fill %7.2f ms/frame  pattern %7.2f ms/frame\n",
+		num_threads, fill * 1e3, pattern * 1e3);
+
+	sp_bo_clear_damage(bo);
+	destroy_sp_workers(workers);
+}
+
+int main(int argc, char *argv[])
+{
+	struct sp_dev *dev;
+	long max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned i;
+	int n;
+
+	if (argc > 1)
+		max_threads = atoi(argv[1]);
+	if (max_threads <= 0)
+		max_threads = 1;
+
+	dev = create_sp_dev();
+	if (!dev) {
+		printf("Failed to create sp_dev\n");
+		return -1;
+	}
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		struct sp_bo *bo;
+		double start;
+		int j, radius;
+
+		bo = create_sp_bo(dev, sizes[i].width, sizes[i].height, 24, 32,
+				DRM_FORMAT_XRGB8888, 0);
+		if (!bo) {
+			printf("%s: failed to create bo, skipping\n",
+				sizes[i].name);
+			continue;
+		}
+
+		if (!sp_bo_map(bo, SP_BO_MAP_POPULATE)) {
+			printf("%s: failed to map bo, skipping\n",
+				sizes[i].name);
+			free_sp_bo(bo);
+			continue;
+		}
+
+		printf("%s (%ux%u)\n", sizes[i].name, bo->width, bo->height);
+
+		start = now();
+		for (j = 0; j < FRAMES; j++)
+			fill_bo(bo, 0xFF, j, j, j);
+		printf("  no workers: fill %7.2f ms/frame",
+			(now() - start) / FRAMES * 1e3);
+
+		start = now();
+		for (j = 0; j < FRAMES; j++) {
+			radius = j * 16;
+			draw_circle(bo, 0, bo->height, &radius);
+		}
+		printf("  pattern %7.2f ms/frame\n",
+			(now() - start) / FRAMES * 1e3);
+
+		for (n = 1; n <= max_threads; n *= 2)
+			bench(bo, n);
+		if (n / 2 != max_threads)
+			bench(bo, max_threads);
+
+		free_sp_bo(bo);
+	}
+
+	destroy_sp_dev(dev);
+	return 0;
+}
@@ -0,0 +1,813 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+#include "dev.h"
+#include "fake.h"
+#include "snapshot.h"
+
+#define SNAPSHOT_MAGIC 0x534b5053 /* "SPKS" */
+#define SNAPSHOT_VERSION 2
+#define DRIVER_NAME_LEN 64
+
+/* No properties were read for the object */
+#define NO_PROPS UINT32_MAX
+
+struct writer {
+	uint8_t *buf;
+	size_t len;
+	size_t size;
+	int error;
+};
+
+struct reader {
+	const uint8_t *buf;
+	size_t len;
+	size_t pos;
+	int error;
+};
+
+/* A blob's contents as the file has them */
+struct blob {
+	uint32_t length;
+	void *data;
+};
+
+static void put(struct writer *w, const void *data, size_t len)
+{
+	uint8_t *buf;
+	size_t size;
+
+	if (w->error || !len)
+		return;
+	if (w->len + len > w->size) {
+		for (size = w->size ? w->size : 4096; size < w->len + len;
+		     size *= 2)
+			;
+		buf = realloc(w->buf, size);
+		if (!buf) {
+			w->error = -ENOMEM;
+			return;
+		}
+		w->buf = buf;
+		w->size = size;
+	}
+	memcpy(w->buf + w->len, data, len);
+	w->len += len;
+}
+
+static void put_u32(struct writer *w, uint32_t v)
+{
+	put(w, &v, sizeof(v));
+}
+
+static void put_u64(struct writer *w, uint64_t v)
+{
+	put(w, &v, sizeof(v));
+}
+
+static void get(struct reader *r, void *data, size_t len)
+{
+	if (r->error || len > r->len - r->pos) {
+		r->error = -EINVAL;
+		memset(data, 0, len);
+		return;
+	}
+	memcpy(data, r->buf + r->pos, len);
+	r->pos += len;
+}
+
+static uint32_t get_u32(struct reader *r)
+{
+	uint32_t v;
+
+	get(r, &v, sizeof(v));
+	return v;
+}
+
+static uint64_t get_u64(struct reader *r)
+{
+	uint64_t v;
+
+	get(r, &v, sizeof(v));
+	return v;
+}
+
+/* A count of things at least size bytes each, so a bad file can't OOM us */
+static uint32_t check_count(struct reader *r, uint32_t count, size_t size)
+{
+	if (r->error || count > (r->len - r->pos) / size) {
+		r->error = -EINVAL;
+		return 0;
+	}
+	return count;
+}
+
+static uint32_t get_count(struct reader *r, size_t size)
+{
+	return check_count(r, get_u32(r), size);
+}
+
+/* NULL for empty arrays, as libdrm hands them out */
+static void *get_array(struct reader *r, uint32_t count, size_t size)
+{
+	void *data;
+
+	if (!count || r->error)
+		return NULL;
+	data = malloc(count * size);
+	if (!data) {
+		r->error = -ENOMEM;
+		return NULL;
+	}
+	get(r, data, count * size);
+	return data;
+}
+
+static void put_props(struct writer *w, const struct sp_props *props)
+{
+	const struct sp_prop *p;
+	int i, j;
+
+	if (!props) {
+		put_u32(w, NO_PROPS);
+		return;
+	}
+
+	put_u32(w, props->count);
+	for (i = 0; i < props->count; i++) {
+		p = &props->props[i];
+		put_u32(w, p->id);
+		put_u32(w, p->flags);
+		put(w, p->name, sizeof(p->name));
+		put_u64(w, p->value);
+		put_u32(w, p->count_values);
+		put(w, p->values, p->count_values * sizeof(*p->values));
+		put_u32(w, p->count_enums);
+		for (j = 0; j < p->count_enums; j++) {
+			put_u64(w, p->enums[j].value);
+			put(w, p->enums[j].name, sizeof(p->enums[j].name));
+		}
+	}
+}
+
+static struct sp_props *get_props(struct reader *r, uint32_t object_id,
+		uint32_t object_type)
+{
+	struct sp_props *props;
+	struct sp_prop prop;
+	uint32_t i, j, count;
+	int ret;
+
+	count = get_u32(r);
+	if (r->error || count == NO_PROPS)
+		return NULL;
+	count = check_count(r, count, 2 * sizeof(uint32_t) +
+			DRM_PROP_NAME_LEN + sizeof(uint64_t));
+
+	props = sp_props_alloc(object_id, object_type, count);
+	if (!props) {
+		r->error = -ENOMEM;
+		return NULL;
+	}
+
+	for (i = 0; i < count && !r->error; i++) {
+		memset(&prop, 0, sizeof(prop));
+		prop.id = get_u32(r);
+		prop.flags = get_u32(r);
+		get(r, prop.name, sizeof(prop.name));
+		prop.value = get_u64(r);
+		prop.count_values = get_count(r, sizeof(*prop.values));
+		prop.values = get_array(r, prop.count_values,
+				sizeof(*prop.values));
+		prop.count_enums = get_count(r, sizeof(uint64_t) +
+				DRM_PROP_NAME_LEN);
+		if (prop.count_enums && !r->error) {
+			prop.enums = calloc(prop.count_enums,
+					sizeof(*prop.enums));
+			if (!prop.enums)
+				r->error = -ENOMEM;
+		}
+		for (j = 0; prop.enums && j < (uint32_t)prop.count_enums;
+		     j++) {
+			prop.enums[j].value = get_u64(r);
+			get(r, prop.enums[j].name, sizeof(prop.enums[j].name));
+		}
+
+		if (!r->error) {
+			ret = sp_props_add(props, &prop);
+			if (ret)
+				r->error = ret;
+		}
+		free(prop.values);
+		free(prop.enums);
+	}
+
+	if (r->error) {
+		sp_props_free(props);
+		return NULL;
+	}
+	return props;
+}
+
+static void put_connector(struct writer *w, drmModeConnectorPtr c)
+{
+	put_u32(w, c->connector_id);
+	put_u32(w, c->encoder_id);
+	put_u32(w, c->connector_type);
+	put_u32(w, c->connector_type_id);
+	put_u32(w, c->connection);
+	put_u32(w, c->mmWidth);
+	put_u32(w, c->mmHeight);
+	put_u32(w, c->subpixel);
+	put_u32(w, c->count_modes);
+	put(w, c->modes, c->count_modes * sizeof(*c->modes));
+	put_u32(w, c->count_encoders);
+	put(w, c->encoders, c->count_encoders * sizeof(*c->encoders));
+	put_u32(w, c->count_props);
+	put(w, c->props, c->count_props * sizeof(*c->props));
+	put(w, c->prop_values, c->count_props * sizeof(*c->prop_values));
+}
+
+static drmModeConnectorPtr get_connector(struct reader *r)
+{
+	drmModeConnectorPtr c;
+
+	c = calloc(1, sizeof(*c));
+	if (!c) {
+		r->error = -ENOMEM;
+		return NULL;
+	}
+	c->connector_id = get_u32(r);
+	c->encoder_id = get_u32(r);
+	c->connector_type = get_u32(r);
+	c->connector_type_id = get_u32(r);
+	c->connection = get_u32(r);
+	c->mmWidth = get_u32(r);
+	c->mmHeight = get_u32(r);
+	c->subpixel = get_u32(r);
+	c->count_modes = get_count(r, sizeof(*c->modes));
+	c->modes = get_array(r, c->count_modes, sizeof(*c->modes));
+	c->count_encoders = get_count(r, sizeof(*c->encoders));
+	c->encoders = get_array(r, c->count_encoders, sizeof(*c->encoders));
+	c->count_props = get_count(r, sizeof(*c->props) +
+			sizeof(*c->prop_values));
+	c->props = get_array(r, c->count_props, sizeof(*c->props));
+	c->prop_values = get_array(r, c->count_props,
+			sizeof(*c->prop_values));
+
+	if (r->error) {
+		drmModeFreeConnector(c);
+		return NULL;
+	}
+	return c;
+}
+
+static void put_encoder(struct writer *w, drmModeEncoderPtr e)
+{
+	put_u32(w, e->encoder_id);
+	put_u32(w, e->encoder_type);
+	put_u32(w, e->crtc_id);
+	put_u32(w, e->possible_crtcs);
+	put_u32(w, e->possible_clones);
+}
+
+static drmModeEncoderPtr get_encoder(struct reader *r)
+{
+	drmModeEncoderPtr e;
+
+	e = calloc(1, sizeof(*e));
+	if (!e) {
+		r->error = -ENOMEM;
+		return NULL;
+	}
+	e->encoder_id = get_u32(r);
+	e->encoder_type = get_u32(r);
+	e->crtc_id = get_u32(r);
+	e->possible_crtcs = get_u32(r);
+	e->possible_clones = get_u32(r);
+
+	if (r->error) {
+		drmModeFreeEncoder(e);
+		return NULL;
+	}
+	return e;
+}
+
+static void put_crtc(struct writer *w, drmModeCrtcPtr c)
+{
+	put_u32(w, c->crtc_id);
+	put_u32(w, c->buffer_id);
+	put_u32(w, c->x);
+	put_u32(w, c->y);
+	put_u32(w, c->width);
+	put_u32(w, c->height);
+	put_u32(w, c->mode_valid);
+	put(w, &c->mode, sizeof(c->mode));
+	put_u32(w, c->gamma_size);
+}
+
+static drmModeCrtcPtr get_crtc(struct reader *r)
+{
+	drmModeCrtcPtr c;
+
+	c = calloc(1, sizeof(*c));
+	if (!c) {
+		r->error = -ENOMEM;
+		return NULL;
+	}
+	c->crtc_id = get_u32(r);
+	c->buffer_id = get_u32(r);
+	c->x = get_u32(r);
+	c->y = get_u32(r);
+	c->width = get_u32(r);
+	c->height = get_u32(r);
+	c->mode_valid = get_u32(r);
+	get(r, &c->mode, sizeof(c->mode));
+	c->gamma_size = get_u32(r);
+
+	if (r->error) {
+		drmModeFreeCrtc(c);
+		return NULL;
+	}
+	return c;
+}
+
+static void put_plane(struct writer *w, drmModePlanePtr p)
+{
+	put_u32(w, p->plane_id);
+	put_u32(w, p->crtc_id);
+	put_u32(w, p->fb_id);
+	put_u32(w, p->crtc_x);
+	put_u32(w, p->crtc_y);
+	put_u32(w, p->x);
+	put_u32(w, p->y);
+	put_u32(w, p->possible_crtcs);
+	put_u32(w, p->gamma_size);
+	put_u32(w, p->count_formats);
+	put(w, p->formats, p->count_formats * sizeof(*p->formats));
+}
+
+static drmModePlanePtr get_plane(struct reader *r)
+{
+	drmModePlanePtr p;
+
+	p = calloc(1, sizeof(*p));
+	if (!p) {
+		r->error = -ENOMEM;
+		return NULL;
+	}
+	p->plane_id = get_u32(r);
+	p->crtc_id = get_u32(r);
+	p->fb_id = get_u32(r);
+	p->crtc_x = get_u32(r);
+	p->crtc_y = get_u32(r);
+	p->x = get_u32(r);
+	p->y = get_u32(r);
+	p->possible_crtcs = get_u32(r);
+	p->gamma_size = get_u32(r);
+	p->count_formats = get_count(r, sizeof(*p->formats));
+	p->formats = get_array(r, p->count_formats, sizeof(*p->formats));
+
+	if (r->error) {
+		drmModeFreePlane(p);
+		return NULL;
+	}
+	return p;
+}
+
+/* The contents of the blob the property holds, none if it holds none */
+static void put_blob(struct writer *w, struct sp_dev *dev,
+		struct sp_props *props, const char *name)
+{
+	const struct sp_prop *prop = props ? sp_props_find(props, name) : NULL;
+	drmModePropertyBlobPtr blob = NULL;
+
+	if (prop && prop->value && dev->ops->get_blob)
+		blob = dev->ops->get_blob(dev, prop->value);
+	put_u32(w, blob ? blob->length : 0);
+	if (blob) {
+		put(w, blob->data, blob->length);
+		drmModeFreePropertyBlob(blob);
+	}
+}
+
+static void get_blob(struct reader *r, struct blob *blob)
+{
+	blob->length = get_count(r, 1);
+	blob->data = get_array(r, blob->length, 1);
+}
+
+/*
+ * A replay has no blobs of the node's, so the property is pointed at one
+ * of its own with the contents the file kept.
+ */
+static int replay_blob(struct sp_dev *dev, struct sp_props *props,
+		const char *name, const struct blob *blob)
+{
+	uint32_t blob_id;
+	int i, ret;
+
+	if (!props || !blob->length)
+		return 0;
+	for (i = 0; i < props->count; i++) {
+		if (strcmp(props->props[i].name, name))
+			continue;
+		ret = dev->ops->create_blob(dev, blob->data, blob->length,
+				&blob_id);
+		if (ret)
+			return ret;
+		props->props[i].value = blob_id;
+	}
+	return 0;
+}
+
+static int get_driver_name(struct sp_dev *dev, char *driver)
+{
+	drmVersionPtr version;
+
+	if (sp_fake_driver(dev)) {
+		snprintf(driver, DRIVER_NAME_LEN, "%s", sp_fake_driver(dev));
+		return 0;
+	}
+
+	version = drmGetVersion(dev->fd);
+	dev->stats.ioctls++;
+	if (!version)
+		return -errno;
+	snprintf(driver, DRIVER_NAME_LEN, "%s", version->name);
+	drmFreeVersion(version);
+	return 0;
+}
+
+int sp_dev_save_snapshot(struct sp_dev *dev, const char *path)
+{
+	char driver[DRIVER_NAME_LEN] = "", tmp[PATH_MAX];
+	struct writer w = { 0 };
+	int i, ret;
+	FILE *f;
+
+	ret = get_driver_name(dev, driver);
+	if (ret)
+		return ret;
+
+	put_u32(&w, SNAPSHOT_MAGIC);
+	put_u32(&w, SNAPSHOT_VERSION);
+	put(&w, driver, sizeof(driver));
+	put_u32(&w, dev->num_connectors);
+	put_u32(&w, dev->num_encoders);
+	put_u32(&w, dev->num_crtcs);
+	put_u32(&w, dev->num_planes);
+
+	/* The property indexes are read here if nothing needed them yet */
+	for (i = 0; i < dev->num_connectors; i++) {
+		put_connector(&w, dev->connectors[i]);
+		put_props(&w, sp_connector_props(dev, i));
+	}
+	for (i = 0; i < dev->num_encoders; i++)
+		put_encoder(&w, dev->encoders[i]);
+	for (i = 0; i < dev->num_crtcs; i++) {
+		put_crtc(&w, dev->crtcs[i].crtc);
+		put_props(&w, sp_crtc_props(dev, &dev->crtcs[i]));
+	}
+	for (i = 0; i < dev->num_planes; i++) {
+		put_plane(&w, dev->planes[i].plane);
+		put_props(&w, sp_plane_props(&dev->planes[i]));
+		put_blob(&w, dev, sp_plane_props(&dev->planes[i]),
+				"IN_FORMATS");
+	}
+	if (w.error) {
+		ret = w.error;
+		goto out;
+	}
+
+	/* Readers never see half a file */
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	f = fopen(tmp, "wb");
+	if (!f) {
+		ret = -errno;
+		goto out;
+	}
+	if (fwrite(w.buf, 1, w.len, f) != w.len)
+		ret = -EIO;
+	if (fclose(f) && !ret)
+		ret = -EIO;
+	if (!ret && rename(tmp, path))
+		ret = -errno;
+	if (ret)
+		unlink(tmp);
+out:
+	free(w.buf);
+	return ret;
+}
+
+static int read_file(const char *path, struct reader *r)
+{
+	struct stat st;
+	uint8_t *buf;
+	int fd, ret = 0;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+	if (fstat(fd, &st)) {
+		ret = -errno;
+		goto out;
+	}
+
+	buf = malloc(st.st_size ? st.st_size : 1);
+	if (!buf) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	if (read(fd, buf, st.st_size) != st.st_size) {
+		free(buf);
+		ret = -EIO;
+		goto out;
+	}
+	r->buf = buf;
+	r->len = st.st_size;
+out:
+	close(fd);
+	return ret;
+}
+
+static void free_topology(struct sp_dev *t)
+{
+	int i;
+
+	for (i = 0; t->connectors && i < t->num_connectors; i++) {
+		if (t->connectors[i])
+			drmModeFreeConnector(t->connectors[i]);
+		sp_props_free(t->connector_props[i]);
+	}
+	free(t->connectors);
+	free(t->connector_props);
+	for (i = 0; t->encoders && i < t->num_encoders; i++) {
+		if (t->encoders[i])
+			drmModeFreeEncoder(t->encoders[i]);
+	}
+	free(t->encoders);
+	for (i = 0; t->crtcs && i < t->num_crtcs; i++) {
+		if (t->crtcs[i].crtc)
+			drmModeFreeCrtc(t->crtcs[i].crtc);
+		sp_props_free(t->crtcs[i].props);
+	}
+	free(t->crtcs);
+	for (i = 0; t->planes && i < t->num_planes; i++) {
+		if (t->planes[i].plane)
+			drmModeFreePlane(t->planes[i].plane);
+		sp_props_free(t->planes[i].props);
+	}
+	free(t->planes);
+}
+
+/* Three ioctls instead of one per object and property */
+static int check_node(struct sp_dev *dev, const char *driver,
+		const struct sp_dev *t)
+{
+	char name[DRIVER_NAME_LEN];
+	drmModeRes *r = NULL;
+	drmModePlaneRes *pr = NULL;
+	int i, ret = -ESTALE;
+
+	if (get_driver_name(dev, name) || strcmp(name, driver))
+		return -ESTALE;
+
+	r = drmModeGetResources(dev->fd);
+	dev->stats.ioctls++;
+	pr = drmModeGetPlaneResources(dev->fd);
+	dev->stats.ioctls++;
+	if (!r || !pr)
+		goto out;
+
+	if (r->count_connectors != t->num_connectors ||
+	    r->count_encoders != t->num_encoders ||
+	    r->count_crtcs != t->num_crtcs ||
+	    (int)pr->count_planes != t->num_planes)
+		goto out;
+	for (i = 0; i < t->num_connectors; i++) {
+		if (r->connectors[i] != t->connectors[i]->connector_id)
+			goto out;
+	}
+	for (i = 0; i < t->num_encoders; i++) {
+		if (r->encoders[i] != t->encoders[i]->encoder_id)
+			goto out;
+	}
+	for (i = 0; i < t->num_crtcs; i++) {
+		if (r->crtcs[i] != t->crtcs[i].crtc->crtc_id)
+			goto out;
+	}
+	for (i = 0; i < t->num_planes; i++) {
+		if (pr->planes[i] != t->planes[i].plane->plane_id)
+			goto out;
+	}
+	ret = 0;
+out:
+	if (pr)
+		drmModeFreePlaneResources(pr);
+	if (r)
+		drmModeFreeResources(r);
+	return ret;
+}
+
+/* The current values of an object's properties, the table kept */
+static int refresh_props(struct sp_dev *dev, struct sp_props *props)
+{
+	drmModeObjectPropertiesPtr op;
+	uint32_t i;
+	int j;
+
+	if (!props)
+		return 0;
+	op = drmModeObjectGetProperties(dev->fd, props->object_id,
+			props->object_type);
+	dev->stats.ioctls++;
+	if (!op)
+		return -ESTALE;
+	for (i = 0; i < op->count_props; i++) {
+		for (j = 0; j < props->count; j++) {
+			if (props->props[j].id == op->props[i])
+				props->props[j].value = op->prop_values[i];
+		}
+	}
+	drmModeFreeObjectProperties(op);
+	return 0;
+}
+
+/*
+ * What is plugged in and lit changes without the IDs changing, so a cache
+ * hit reads that again: connectors as they are now (status, modes, EDID)
+ * without probing, encoders' and CRTCs' routing and modes, planes' CRTC
+ * and fb, and every property value. The property tables, formats and
+ * possible_crtcs/clones stay as the file has them.
+ */
+static int refresh_state(struct sp_dev *dev, struct sp_dev *t)
+{
+	drmModeConnectorPtr c;
+	drmModeEncoderPtr e;
+	drmModeCrtcPtr crtc;
+	drmModePlanePtr p, fresh;
+	int i, ret = 0;
+
+	for (i = 0; !ret && i < t->num_connectors; i++) {
+		c = drmModeGetConnectorCurrent(dev->fd,
+				t->connectors[i]->connector_id);
+		dev->stats.ioctls++;
+		if (!c)
+			return -ESTALE;
+		drmModeFreeConnector(t->connectors[i]);
+		t->connectors[i] = c;
+		ret = refresh_props(dev, t->connector_props[i]);
+	}
+	for (i = 0; !ret && i < t->num_encoders; i++) {
+		e = drmModeGetEncoder(dev->fd, t->encoders[i]->encoder_id);
+		dev->stats.ioctls++;
+		if (!e)
+			return -ESTALE;
+		drmModeFreeEncoder(t->encoders[i]);
+		t->encoders[i] = e;
+	}
+	for (i = 0; !ret && i < t->num_crtcs; i++) {
+		crtc = drmModeGetCrtc(dev->fd, t->crtcs[i].crtc->crtc_id);
+		dev->stats.ioctls++;
+		if (!crtc)
+			return -ESTALE;
+		drmModeFreeCrtc(t->crtcs[i].crtc);
+		t->crtcs[i].crtc = crtc;
+		ret = refresh_props(dev, t->crtcs[i].props);
+	}
+	for (i = 0; !ret && i < t->num_planes; i++) {
+		p = t->planes[i].plane;
+		fresh = drmModeGetPlane(dev->fd, p->plane_id);
+		dev->stats.ioctls++;
+		if (!fresh)
+			return -ESTALE;
+		p->crtc_id = fresh->crtc_id;
+		p->fb_id = fresh->fb_id;
+		p->crtc_x = fresh->crtc_x;
+		p->crtc_y = fresh->crtc_y;
+		p->x = fresh->x;
+		p->y = fresh->y;
+		drmModeFreePlane(fresh);
+		ret = refresh_props(dev, t->planes[i].props);
+	}
+	return ret;
+}
+
+int sp_dev_load_snapshot(struct sp_dev *dev, const char *path, int check)
+{
+	char driver[DRIVER_NAME_LEN];
+	struct reader r = { 0 };
+	struct blob *in_formats = NULL;
+	struct sp_dev t;
+	uint32_t magic, version;
+	int i, ret;
+
+	ret = read_file(path, &r);
+	if (ret)
+		return ret;
+
+	memset(&t, 0, sizeof(t));
+	magic = get_u32(&r);
+	version = get_u32(&r);
+	get(&r, driver, sizeof(driver));
+	driver[sizeof(driver) - 1] = '\0';
+	if (r.error || magic != SNAPSHOT_MAGIC || version != SNAPSHOT_VERSION) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	/* Every object takes at least a word */
+	t.num_connectors = get_count(&r, sizeof(uint32_t));
+	t.num_encoders = get_count(&r, sizeof(uint32_t));
+	t.num_crtcs = get_count(&r, sizeof(uint32_t));
+	t.num_planes = get_count(&r, sizeof(uint32_t));
+	if (r.error) {
+		ret = r.error;
+		goto out;
+	}
+
+	t.connectors = calloc(t.num_connectors + 1, sizeof(*t.connectors));
+	t.connector_props = calloc(t.num_connectors + 1,
+			sizeof(*t.connector_props));
+	t.encoders = calloc(t.num_encoders + 1, sizeof(*t.encoders));
+	t.crtcs = calloc(t.num_crtcs + 1, sizeof(*t.crtcs));
+	t.planes = calloc(t.num_planes + 1, sizeof(*t.planes));
+	in_formats = calloc(t.num_planes + 1, sizeof(*in_formats));
+	if (!t.connectors || !t.connector_props || !t.encoders || !t.crtcs ||
+	    !t.planes || !in_formats) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; !r.error && i < t.num_connectors; i++) {
+		t.connectors[i] = get_connector(&r);
+		if (t.connectors[i])
+			t.connector_props[i] = get_props(&r,
+					t.connectors[i]->connector_id,
+					DRM_MODE_OBJECT_CONNECTOR);
+	}
+	for (i = 0; !r.error && i < t.num_encoders; i++)
+		t.encoders[i] = get_encoder(&r);
+	for (i = 0; !r.error && i < t.num_crtcs; i++) {
+		t.crtcs[i].crtc = get_crtc(&r);
+		if (t.crtcs[i].crtc)
+			t.crtcs[i].props = get_props(&r,
+					t.crtcs[i].crtc->crtc_id,
+					DRM_MODE_OBJECT_CRTC);
+	}
+	for (i = 0; !r.error && i < t.num_planes; i++) {
+		t.planes[i].plane = get_plane(&r);
+		if (t.planes[i].plane)
+			t.planes[i].props = get_props(&r,
+					t.planes[i].plane->plane_id,
+					DRM_MODE_OBJECT_PLANE);
+		get_blob(&r, &in_formats[i]);
+	}
+	if (r.error) {
+		ret = r.error;
+		goto out;
+	}
+
+	/* A node has the blobs already, a replay needs its own */
+	if (check) {
+		ret = check_node(dev, driver, &t);
+		if (!ret)
+			ret = refresh_state(dev, &t);
+	} else {
+		for (i = 0; !ret && i < t.num_planes; i++)
+			ret = replay_blob(dev, t.planes[i].props, "IN_FORMATS",
+					&in_formats[i]);
+	}
+	if (ret)
+		goto out;
+
+	dev->num_connectors = t.num_connectors;
+	dev->connectors = t.connectors;
+	dev->connector_props = t.connector_props;
+	dev->num_encoders = t.num_encoders;
+	dev->encoders = t.encoders;
+	dev->num_crtcs = t.num_crtcs;
+	dev->crtcs = t.crtcs;
+	dev->num_planes = t.num_planes;
+	dev->planes = t.planes;
+	sp_fake_set_driver(dev, driver);
+
+out:
+	if (ret)
+		free_topology(&t);
+	for (i = 0; in_formats && i < t.num_planes; i++)
+		free(in_formats[i].data);
+	free(in_formats);
+	free((void *)r.buf);
+	return ret;
+}
@@ -0,0 +1,31 @@
+#ifndef __SNAPSHOT_H_INCLUDED__
+#define __SNAPSHOT_H_INCLUDED__
+
+#include <stdint.h>
+
+struct sp_dev;
+
+/*
+ * A snapshot is what create_sp_dev() enumerates: connectors with their
+ * modes, encoders, CRTCs, planes with their formats and possible_crtcs,
+ * and the property tables of planes, CRTCs and connectors. It is a compact
+ * binary file in host byte order, for the machine or CI job that made it.
+ * Blob contents (EDID, MODE_ID) are not kept, only their IDs, but for each
+ * plane's IN_FORMATS, so the formats and modifiers planes take are the
+ * same offline. A snapshot file given to create_sp_dev_from_path() is
+ * replayed with sp_fake_kms_ops, see fake.h, which gets those blobs as its
+ * own.
+ */
+int sp_dev_save_snapshot(struct sp_dev *dev, const char *path);
+
+/*
+ * Fills in the topology of an sp_dev that has none yet. With check set,
+ * dev is an open node and the snapshot is only taken if it has the
+ * same driver and object IDs, otherwise this fails with -ESTALE. What
+ * hotplugs and modesets change is read from the node again: connectors
+ * without probing them, encoder and CRTC state, the planes' CRTCs and fbs
+ * and every property value. On failure dev is left as it was.
+ */
+int sp_dev_load_snapshot(struct sp_dev *dev, const char *path, int check);
+
+#endif /* __SNAPSHOT_H_INCLUDED__ */
@@ -0,0 +1,235 @@
+/*
+ * Saves the topology of the device create_sp_dev() picks to a snapshot,
+ * replays it and checks the replay matches: connectors and their modes,
+ * encoders, CRTCs, planes, property tables and the formats and modifiers
+ * planes take. Then lights up the replayed screens and puts an overlay on
+ * each, without touching the kernel.
+ *
+ *   snapshot_test <file>		snapshot the device, then replay it
+ *   snapshot_test -r <file>	only replay, e.g. on a machine without a GPU
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+#include "bo.h"
+#include "dev.h"
+#include "modeset.h"
+#include "snapshot.h"
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_props(const char *what, int index, struct sp_props *a,
+		struct sp_props *b)
+{
+	const struct sp_prop *p, *q;
+	int i;
+
+	if (!a || !b)
+		return a == b ? 0 : -1;
+	if (a->count != b->count) {
+		printf("%s %d: %d properties, replay has %d\n", what, index,
+			a->count, b->count);
+		return -1;
+	}
+	for (i = 0; i < a->count; i++) {
+		p = &a->props[i];
+		q = sp_props_find(b, p->name);
+		/* The replay's IN_FORMATS is a blob of its own, see compare() */
+		if (!q || q->id != p->id ||
+		    (q->value != p->value && strcmp(p->name, "IN_FORMATS")) ||
+		    q->flags != p->flags || q->count_enums != p->count_enums ||
+		    q->count_values != p->count_values) {
+			printf("%s %d: property %s differs\n", what, index,
+				p->name);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int compare(struct sp_dev *a, struct sp_dev *b)
+{
+	int i, f, ret = 0;
+
+	if (a->num_connectors != b->num_connectors ||
+	    a->num_encoders != b->num_encoders ||
+	    a->num_crtcs != b->num_crtcs || a->num_planes != b->num_planes) {
+		printf("object counts differ\n");
+		return -1;
+	}
+
+	for (i = 0; i < a->num_connectors; i++) {
+		drmModeConnectorPtr c = a->connectors[i], d = b->connectors[i];
+
+		if (c->connector_id != d->connector_id ||
+		    c->connection != d->connection ||
+		    c->count_modes != d->count_modes ||
+		    c->count_encoders != d->count_encoders ||
+		    (c->count_modes && memcmp(c->modes, d->modes,
+				c->count_modes * sizeof(*c->modes)))) {
+			printf("connector %d differs\n", i);
+			ret = -1;
+		}
+		ret |= compare_props("connector", i,
+				sp_connector_props(a, i),
+				sp_connector_props(b, i));
+	}
+	for (i = 0; i < a->num_encoders; i++) {
+		if (memcmp(a->encoders[i], b->encoders[i],
+				sizeof(*a->encoders[i]))) {
+			printf("encoder %d differs\n", i);
+			ret = -1;
+		}
+	}
+	for (i = 0; i < a->num_crtcs; i++) {
+		if (a->crtcs[i].crtc->crtc_id != b->crtcs[i].crtc->crtc_id ||
+		    memcmp(&a->crtcs[i].crtc->mode, &b->crtcs[i].crtc->mode,
+				sizeof(a->crtcs[i].crtc->mode)) ||
+		    a->crtcs[i].num_planes != b->crtcs[i].num_planes) {
+			printf("crtc %d differs\n", i);
+			ret = -1;
+		}
+		ret |= compare_props("crtc", i, sp_crtc_props(a, &a->crtcs[i]),
+				sp_crtc_props(b, &b->crtcs[i]));
+	}
+	for (i = 0; i < a->num_planes; i++) {
+		drmModePlanePtr p = a->planes[i].plane, q = b->planes[i].plane;
+
+		if (p->plane_id != q->plane_id ||
+		    p->possible_crtcs != q->possible_crtcs ||
+		    p->count_formats != q->count_formats ||
+		    (p->count_formats && memcmp(p->formats, q->formats,
+				p->count_formats * sizeof(*p->formats))) ||
+		    a->planes[i].format != b->planes[i].format) {
+			printf("plane %d differs\n", i);
+			ret = -1;
+		}
+		ret |= compare_props("plane", i, sp_plane_props(&a->planes[i]),
+				sp_plane_props(&b->planes[i]));
+	}
+
+	/* What IN_FORMATS says the planes take, modifiers included */
+	if (a->num_formats != b->num_formats ||
+	    a->num_modifiers != b->num_modifiers ||
+	    memcmp(a->formats, b->formats,
+			a->num_formats * sizeof(*a->formats)) ||
+	    memcmp(a->modifiers, b->modifiers,
+			a->num_modifiers * sizeof(*a->modifiers))) {
+		printf("formats or modifiers differ\n");
+		return -1;
+	}
+	for (i = 0; i < a->num_planes; i++) {
+		for (f = 0; f < a->num_formats; f++) {
+			if (a->planes[i].format_modifiers[f] !=
+			    b->planes[i].format_modifiers[f]) {
+				printf("plane %d modifiers of %.4s differ\n",
+					i, (char *)&a->formats[f]);
+				ret = -1;
+				break;
+			}
+		}
+	}
+	return ret;
+}
+
+/* What a test would do with the replayed device */
+static int exercise(struct sp_dev *dev)
+{
+	struct sp_plane *plane;
+	int i, lit = 0, planes = 0, ret;
+
+	ret = initialize_screens(dev);
+	if (ret) {
+		printf("failed to initialize screens ret=%d\n", ret);
+		return ret;
+	}
+
+	for (i = 0; i < dev->num_crtcs; i++) {
+		struct sp_crtc *cr = &dev->crtcs[i];
+
+		if (!cr->scanout)
+			continue;
+		lit++;
+
+		plane = get_sp_plane(dev, cr);
+		if (!plane)
+			continue;
+		plane->bo = create_sp_bo(dev, cr->crtc->mode.hdisplay / 2,
+				cr->crtc->mode.vdisplay / 2, 24,
+				sp_format_bpp(plane->format), plane->format, 0);
+		if (!plane->bo) {
+			put_sp_plane(plane);
+			return -1;
+		}
+		fill_bo(plane->bo, 0xff, 0x00, 0x00, 0xff);
+		ret = set_sp_plane(dev, plane, cr, 0, 0);
+		put_sp_plane(plane);
+		if (ret)
+			return ret;
+		planes++;
+	}
+	printf("replay: %d crtcs lit, %d planes set\n", lit, planes);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct sp_dev *dev = NULL, *replay;
+	const char *path;
+	double start, secs = 0;
+	int ret;
+
+	if (argc == 3 && !strcmp(argv[1], "-r")) {
+		path = argv[2];
+	} else if (argc == 2) {
+		path = argv[1];
+		start = now();
+		dev = create_sp_dev();
+		secs = now() - start;
+		if (!dev) {
+			printf("Failed to create sp_dev\n");
+			return -1;
+		}
+		ret = sp_dev_save_snapshot(dev, path);
+		if (ret) {
+			printf("Failed to save %s ret=%d\n", path, ret);
+			goto out;
+		}
+	} else {
+		printf("usage: %s [-r] <snapshot>\n", argv[0]);
+		return -1;
+	}
+
+	start = now();
+	replay = create_sp_dev_from_path(path);
+	if (!replay) {
+		printf("Failed to replay %s\n", path);
+		ret = -1;
+		goto out;
+	}
+	if (dev)
+		printf("enumerate %.3f ms, replay %.3f ms\n", secs * 1e3,
+			(now() - start) * 1e3);
+
+	ret = dev ? compare(dev, replay) : 0;
+	if (!ret)
+		ret = exercise(replay);
+	printf("%s\n", ret ? "FAIL" : "PASS");
+	destroy_sp_dev(replay);
+out:
+	if (dev)
+		destroy_sp_dev(dev);
+	return ret;
+}
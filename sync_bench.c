@@ -0,0 +1,189 @@
+/*
+ * Measures the per-frame cost of bracketing CPU drawing with dma-buf sync
+ * when a vgem buffer is scanned out by the KMS device (vkms on most test
+ * setups). Each frame draws a band into the buffer between
+ * sp_bo_begin_cpu_access() and sp_bo_end_cpu_access() and flips to it.
+ * The same is done through a second sp_bo imported from the first one's
+ * dma-buf, which maps the dma-buf itself instead of vgem.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/select.h>
+#include <time.h>
+
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+#include <drm_fourcc.h>
+
+#include "bo.h"
+#include "dev.h"
+#include "modeset.h"
+
+#define FRAMES 120
+#define BAND 64
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void flip_handler(int fd, unsigned int sequence, unsigned int tv_sec,
+		unsigned int tv_usec, void *user_data)
+{
+	*(int *)user_data = 0;
+}
+
+static int flip(struct sp_dev *dev, struct sp_crtc *crtc, uint32_t fb_id)
+{
+	drmEventContext ctx = {};
+	struct timeval tv;
+	fd_set fds;
+	int ret, pending = 1;
+
+	ret = dev->ops->page_flip(dev, crtc->crtc->crtc_id, fb_id,
+			DRM_MODE_PAGE_FLIP_EVENT, &pending);
+	if (ret) {
+		printf("failed to flip ret=%d\n", ret);
+		return ret;
+	}
+
+	ctx.version = DRM_EVENT_CONTEXT_VERSION;
+	ctx.page_flip_handler = flip_handler;
+	while (pending) {
+		FD_ZERO(&fds);
+		FD_SET(dev->fd, &fds);
+		tv.tv_sec = 1;
+		tv.tv_usec = 0;
+		if (select(dev->fd + 1, &fds, NULL, NULL, &tv) <= 0) {
+			printf("timed out waiting for flip\n");
+			return -1;
+		}
+		dev->ops->handle_event(dev, &ctx);
+	}
+	return 0;
+}
+
+/* Alternates between two bos so the one being drawn is never on screen */
+static void bench(const char *name, struct sp_dev *dev, struct sp_crtc *crtc,
+		struct sp_bo **bo, int sync)
+{
+	double start, t_sync = 0, t_draw = 0, t_frame;
+	uint64_t syncs = dev->stats.syncs;
+	int i, y;
+
+	start = now();
+	for (i = 0; i < FRAMES; i++) {
+		struct sp_bo *b = bo[i & 1];
+		double t;
+
+		y = (i * BAND / 2) % (b->height - BAND);
+
+		t = now();
+		if (sync && sp_bo_begin_cpu_access(b, SP_BO_ACCESS_WRITE))
+			return;
+		t_sync += now() - t;
+
+		t = now();
+		draw_rect(b, 0, y, b->width, BAND, 0xff, i, 0x40, 0xff - i);
+		t_draw += now() - t;
+
+		t = now();
+		if (sync && sp_bo_end_cpu_access(b, SP_BO_ACCESS_WRITE))
+			return;
+		t_sync += now() - t;
+
+		if (flip(dev, crtc, b->fb_id))
+			return;
+	}
+	t_frame = now() - start;
+
+	printf("%-16s %-7s sync %7.1f us  draw %7.1f us  frame %6.2f ms  "
+		"(%llu syncs)\n", name, sync ? "sync" : "no-sync",
+		t_sync * 1e6 / FRAMES, t_draw * 1e6 / FRAMES,
+		t_frame * 1e3 / FRAMES,
+		(unsigned long long)(dev->stats.syncs - syncs));
+}
+
+int main(int argc, char *argv[])
+{
+	struct sp_dev *dev;
+	struct sp_crtc *crtc = NULL;
+	struct sp_bo *bo[2] = {}, *imported[2] = {};
+	uint32_t width, height;
+	int i, fd, ret = -1;
+
+	dev = create_sp_dev();
+	if (!dev) {
+		printf("Failed to create sp_dev\n");
+		return -1;
+	}
+
+	ret = initialize_screens(dev);
+	if (ret) {
+		printf("Failed to initialize screens\n");
+		goto out;
+	}
+
+	for (i = 0; i < dev->num_crtcs; i++) {
+		if (dev->crtcs[i].scanout) {
+			crtc = &dev->crtcs[i];
+			break;
+		}
+	}
+	if (!crtc) {
+		printf("No active crtc\n");
+		ret = -1;
+		goto out;
+	}
+	width = crtc->crtc->mode.hdisplay;
+	height = crtc->crtc->mode.vdisplay;
+
+	for (i = 0; i < 2; i++) {
+		bo[i] = create_sp_bo_with_backend(dev, SP_BO_BACKEND_VGEM,
+				width, height, 24, 32, DRM_FORMAT_XRGB8888, 0,
+				NULL, 0);
+		if (!bo[i]) {
+			printf("Failed to create vgem bo\n");
+			ret = -1;
+			goto out;
+		}
+
+		fd = sp_bo_export_fd(bo[i]);
+		if (fd < 0) {
+			ret = fd;
+			goto out;
+		}
+		imported[i] = sp_bo_import_fd(dev, fd, width, height, 24, 32,
+				DRM_FORMAT_XRGB8888, bo[i]->pitch, 0,
+				DRM_FORMAT_MOD_LINEAR);
+		close(fd);
+		if (!imported[i]) {
+			ret = -1;
+			goto out;
+		}
+	}
+
+	printf("%ux%u XRGB8888, %d frames, %d line band per frame\n", width,
+		height, FRAMES, BAND);
+	bench("vgem", dev, crtc, bo, 0);
+	bench("vgem", dev, crtc, bo, 1);
+	bench("imported dma-buf", dev, crtc, imported, 0);
+	bench("imported dma-buf", dev, crtc, imported, 1);
+
+	flip(dev, crtc, crtc->scanout->fb_id);
+	ret = 0;
+
+out:
+	for (i = 0; i < 2; i++) {
+		free_sp_bo(imported[i]);
+		free_sp_bo(bo[i]);
+	}
+	destroy_sp_dev(dev);
+	return ret;
+}
@@ -0,0 +1,299 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "bo.h"
+#include "workers.h"
+
+#define MAX_JOBS 64
+#define CACHE_LINE 64
+
+enum job_type {
+	JOB_RECT,
+	JOB_ROWS,
+};
+
+struct job {
+	enum job_type type;
+	struct sp_bo *bo;
+
+	/* JOB_RECT */
+	uint32_t x, y, width, height;
+	uint8_t a, r, g, b;
+
+	/* JOB_ROWS */
+	sp_rows_fn fn;
+	void *data;
+};
+
+struct worker {
+	struct sp_workers *workers;
+	pthread_t thread;
+	int index;
+	uint64_t done; /* jobs completed, guarded by the pool lock */
+};
+
+struct sp_workers {
+	pthread_mutex_t lock;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+	int quit;
+
+	struct job jobs[MAX_JOBS];
+	uint64_t submitted;
+
+	int num_threads;
+	struct worker *threads;
+};
+
+static uint32_t gcd(uint32_t a, uint32_t b)
+{
+	while (b) {
+		uint32_t t = a % b;
+
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+/*
+ * Rows [*y0, *y1) of bo owned by worker index. Bands are rounded up to a
+ * number of rows that is whole chroma rows, whose total size in every plane
+ * is a multiple of the cache line, so no line is written by two threads
+ * (mappings are page aligned).
+ */
+static void worker_band(struct sp_workers *workers, struct sp_bo *bo,
+		int index, uint32_t *y0, uint32_t *y1)
+{
+	uint32_t quantum = CACHE_LINE / gcd(bo->pitch, CACHE_LINE);
+	uint32_t vsub = sp_format_vsub(bo->format), q, i;
+	uint32_t band = (bo->height + workers->num_threads - 1) /
+			workers->num_threads;
+
+	/* Chroma planes take one row for every vsub */
+	for (i = 1; vsub > 1 && i < bo->num_planes; i++) {
+		q = vsub * (CACHE_LINE / gcd(bo->pitches[i], CACHE_LINE));
+		quantum = quantum / gcd(quantum, q) * q;
+	}
+	quantum = quantum / gcd(quantum, vsub) * vsub;
+
+	band = (band + quantum - 1) / quantum * quantum;
+	*y0 = index * band;
+	*y1 = *y0 + band;
+	if (*y0 > bo->height)
+		*y0 = bo->height;
+	if (*y1 > bo->height)
+		*y1 = bo->height;
+}
+
+static void run_job(struct sp_workers *workers, struct job *job, int index)
+{
+	uint32_t y0, y1;
+
+	worker_band(workers, job->bo, index, &y0, &y1);
+
+	if (job->type == JOB_ROWS) {
+		if (y0 < y1)
+			job->fn(job->bo, y0, y1, job->data);
+		return;
+	}
+
+	if (job->y > y0)
+		y0 = job->y;
+	if (job->y <= y1 && job->height < y1 - job->y)
+		y1 = job->y + job->height;
+	if (y0 < y1)
+		draw_rect_nodamage(job->bo, job->x, y0, job->width, y1 - y0,
+				job->a, job->r, job->g, job->b);
+}
+
+static void *worker_main(void *arg)
+{
+	struct worker *w = arg;
+	struct sp_workers *workers = w->workers;
+	struct job job;
+
+	pthread_mutex_lock(&workers->lock);
+	for (;;) {
+		while (!workers->quit && w->done == workers->submitted)
+			pthread_cond_wait(&workers->work_cond, &workers->lock);
+		if (w->done == workers->submitted)
+			break;
+
+		job = workers->jobs[w->done % MAX_JOBS];
+		pthread_mutex_unlock(&workers->lock);
+
+		run_job(workers, &job, w->index);
+		sp_bo_flush_writes(job.bo);
+
+		pthread_mutex_lock(&workers->lock);
+		w->done++;
+		pthread_cond_broadcast(&workers->done_cond);
+	}
+	pthread_mutex_unlock(&workers->lock);
+	return NULL;
+}
+
+/* Lowest completion count over all threads, called with the lock held */
+static uint64_t min_done(struct sp_workers *workers)
+{
+	uint64_t done = workers->submitted;
+	int i;
+
+	for (i = 0; i < workers->num_threads; i++) {
+		if (workers->threads[i].done < done)
+			done = workers->threads[i].done;
+	}
+	return done;
+}
+
+static int submit(struct sp_workers *workers, const struct job *job)
+{
+	pthread_mutex_lock(&workers->lock);
+	while (workers->submitted - min_done(workers) >= MAX_JOBS)
+		pthread_cond_wait(&workers->done_cond, &workers->lock);
+
+	workers->jobs[workers->submitted % MAX_JOBS] = *job;
+	workers->submitted++;
+	pthread_cond_broadcast(&workers->work_cond);
+	pthread_mutex_unlock(&workers->lock);
+	return 0;
+}
+
+struct sp_workers *create_sp_workers(int num_threads)
+{
+	struct sp_workers *workers;
+	int i, ret;
+
+	if (num_threads <= 0)
+		num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (num_threads <= 0)
+		num_threads = 1;
+
+	workers = calloc(1, sizeof(*workers));
+	if (!workers)
+		return NULL;
+
+	workers->threads = calloc(num_threads, sizeof(*workers->threads));
+	if (!workers->threads) {
+		free(workers);
+		return NULL;
+	}
+
+	pthread_mutex_init(&workers->lock, NULL);
+	pthread_cond_init(&workers->work_cond, NULL);
+	pthread_cond_init(&workers->done_cond, NULL);
+
+	for (i = 0; i < num_threads; i++) {
+		struct worker *w = &workers->threads[i];
+
+		w->workers = workers;
+		w->index = i;
+		ret = pthread_create(&w->thread, NULL, worker_main, w);
+		if (ret) {
+			printf("failed to create worker thread ret=%d\n", ret);
+			break;
+		}
+		workers->num_threads++;
+	}
+
+	if (!workers->num_threads) {
+		destroy_sp_workers(workers);
+		return NULL;
+	}
+	return workers;
+}
+
+void destroy_sp_workers(struct sp_workers *workers)
+{
+	int i;
+
+	if (!workers)
+		return;
+
+	pthread_mutex_lock(&workers->lock);
+	workers->quit = 1;
+	pthread_cond_broadcast(&workers->work_cond);
+	pthread_mutex_unlock(&workers->lock);
+
+	for (i = 0; i < workers->num_threads; i++)
+		pthread_join(workers->threads[i].thread, NULL);
+
+	pthread_cond_destroy(&workers->done_cond);
+	pthread_cond_destroy(&workers->work_cond);
+	pthread_mutex_destroy(&workers->lock);
+	free(workers->threads);
+	free(workers);
+}
+
+int sp_workers_num_threads(struct sp_workers *workers)
+{
+	return workers->num_threads;
+}
+
+int sp_workers_draw_rect(struct sp_workers *workers, struct sp_bo *bo,
+		uint32_t x, uint32_t y, uint32_t width, uint32_t height,
+		uint8_t a, uint8_t r, uint8_t g, uint8_t b)
+{
+	struct job job = {
+		.type = JOB_RECT,
+		.bo = bo,
+		.x = x,
+		.y = y,
+		.width = width,
+		.height = height,
+		.a = a,
+		.r = r,
+		.g = g,
+		.b = b,
+	};
+
+	if (x >= bo->width || y >= bo->height)
+		return 0;
+
+	/* Map here, the workers would race to do it */
+	if (!sp_bo_map(bo, x == 0 && y == 0 && width >= bo->width &&
+			height >= bo->height ? SP_BO_MAP_POPULATE : 0))
+		return -ENOMEM;
+
+	/* The workers write whole chroma rows, as draw_rect() does */
+	sp_bo_align_rect(bo, &x, &y, &width, &height);
+	sp_bo_add_damage(bo, x, y, width, height);
+	return submit(workers, &job);
+}
+
+int sp_workers_fill_bo(struct sp_workers *workers, struct sp_bo *bo,
+		uint8_t a, uint8_t r, uint8_t g, uint8_t b)
+{
+	return sp_workers_draw_rect(workers, bo, 0, 0, bo->width, bo->height,
+			a, r, g, b);
+}
+
+int sp_workers_run(struct sp_workers *workers, struct sp_bo *bo,
+		sp_rows_fn fn, void *data)
+{
+	struct job job = {
+		.type = JOB_ROWS,
+		.bo = bo,
+		.fn = fn,
+		.data = data,
+	};
+
+	if (!sp_bo_map(bo, SP_BO_MAP_POPULATE))
+		return -ENOMEM;
+
+	sp_bo_add_damage(bo, 0, 0, bo->width, bo->height);
+	return submit(workers, &job);
+}
+
+void sp_workers_finish(struct sp_workers *workers)
+{
+	pthread_mutex_lock(&workers->lock);
+	while (min_done(workers) != workers->submitted)
+		pthread_cond_wait(&workers->done_cond, &workers->lock);
+	pthread_mutex_unlock(&workers->lock);
+}
@@ -0,0 +1,42 @@
+#ifndef __WORKERS_H_INCLUDED__
+#define __WORKERS_H_INCLUDED__
+
+#include <stdint.h>
+
+struct sp_bo;
+struct sp_workers;
+
+/*
+ * Draws rows [y0, y1) of bo. Called from worker threads, each with its own
+ * rows, so it may only touch those rows and must not record damage.
+ */
+typedef void (*sp_rows_fn)(struct sp_bo *bo, uint32_t y0, uint32_t y1,
+		void *data);
+
+/*
+ * A persistent pool of threads for CPU drawing into sp_bo mappings. Each
+ * thread owns a fixed band of every bo's rows, with band edges on cache
+ * line boundaries and whole chroma rows of every plane, and runs the
+ * queued jobs in order on its band. Jobs touching the same rows therefore
+ * never race, and queued jobs only need a barrier (sp_workers_finish())
+ * before the bo is flipped or read.
+ *
+ * Submitting and finishing must happen from one thread. Damage is recorded
+ * on the submitting thread.
+ */
+struct sp_workers *create_sp_workers(int num_threads);
+void destroy_sp_workers(struct sp_workers *workers);
+int sp_workers_num_threads(struct sp_workers *workers);
+
+int sp_workers_fill_bo(struct sp_workers *workers, struct sp_bo *bo,
+		uint8_t a, uint8_t r, uint8_t g, uint8_t b);
+int sp_workers_draw_rect(struct sp_workers *workers, struct sp_bo *bo,
+		uint32_t x, uint32_t y, uint32_t width, uint32_t height,
+		uint8_t a, uint8_t r, uint8_t g, uint8_t b);
+/* data must stay valid until sp_workers_finish() */
+int sp_workers_run(struct sp_workers *workers, struct sp_bo *bo,
+		sp_rows_fn fn, void *data);
+
+void sp_workers_finish(struct sp_workers *workers);
+
+#endif /* __WORKERS_H_INCLUDED__ */
@@ -0,0 +1,142 @@
+/*
+ * Shows colour bars on an overlay plane of the first lit CRTC in a YUV
+ * format (NV12 by default, or the fourcc given, e.g. P010 or YU12). The
+ * bars are drawn in XRGB8888 and converted with sp_bo_blit(). vkms exposes
+ * YUV overlay formats, so this runs without display hardware.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+#include <drm_fourcc.h>
+
+#include "blit.h"
+#include "bo.h"
+#include "dev.h"
+#include "modeset.h"
+
+static const uint8_t bars[][3] = {
+	{ 0xC0, 0xC0, 0xC0 },
+	{ 0xC0, 0xC0, 0x00 },
+	{ 0x00, 0xC0, 0xC0 },
+	{ 0x00, 0xC0, 0x00 },
+	{ 0xC0, 0x00, 0xC0 },
+	{ 0xC0, 0x00, 0x00 },
+	{ 0x00, 0x00, 0xC0 },
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Bars on top, a grey ramp below */
+static void draw_bars(struct sp_bo *bo)
+{
+	uint32_t i, n = sizeof(bars) / sizeof(bars[0]);
+	uint32_t w = bo->width / n, h = bo->height * 2 / 3;
+
+	for (i = 0; i < n; i++)
+		draw_rect(bo, i * w, 0, i == n - 1 ? bo->width - i * w : w, h,
+			0xFF, bars[i][0], bars[i][1], bars[i][2]);
+	for (i = 0; i < bo->width; i++) {
+		uint8_t c = i * 255 / (bo->width - 1);
+
+		draw_rect(bo, i, h, 1, bo->height - h, 0xFF, c, c, c);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	uint32_t format = DRM_FORMAT_NV12, w, h;
+	struct sp_crtc *crtc = NULL;
+	struct sp_plane *plane;
+	struct sp_bo *rgb = NULL;
+	struct sp_dev *dev;
+	double start;
+	int i, ret;
+
+	if (argc > 1 && strlen(argv[1]) == 4)
+		format = fourcc_code(argv[1][0], argv[1][1], argv[1][2],
+				argv[1][3]);
+	if (sp_format_num_planes(format) == 1) {
+		printf("%.4s is not a supported YUV format\n", (char *)&format);
+		return -1;
+	}
+
+	dev = create_sp_dev();
+	if (!dev) {
+		printf("Failed to create sp_dev\n");
+		return -1;
+	}
+
+	ret = initialize_screens(dev);
+	if (ret) {
+		printf("Failed to initialize screens\n");
+		goto out;
+	}
+
+	for (i = 0; !crtc && i < dev->num_crtcs; i++)
+		if (dev->crtcs[i].scanout)
+			crtc = &dev->crtcs[i];
+	if (!crtc) {
+		printf("No lit crtc\n");
+		ret = -1;
+		goto out;
+	}
+
+	plane = sp_plane_claim_for(dev, crtc, -1, format,
+			DRM_FORMAT_MOD_LINEAR, NULL);
+	if (!plane) {
+		printf("No plane supports %.4s\n", (char *)&format);
+		ret = -1;
+		goto out;
+	}
+
+	/* Half the mode, kept even for the chroma planes */
+	w = crtc->crtc->mode.hdisplay / 2 & ~1;
+	h = crtc->crtc->mode.vdisplay / 2 & ~1;
+
+	plane->bo = create_sp_bo(dev, w, h, 0, 0, format, 0);
+	rgb = create_sp_bo(dev, w, h, 24, 32, DRM_FORMAT_XRGB8888, 0);
+	if (!plane->bo || !rgb) {
+		printf("Failed to create bos\n");
+		ret = -1;
+		goto put;
+	}
+	draw_bars(rgb);
+
+	start = now();
+	ret = sp_bo_blit(plane->bo, 0, 0, rgb, 0, 0, w, h);
+	if (ret) {
+		printf("Failed to convert to %.4s ret=%d\n", (char *)&format,
+			ret);
+		goto put;
+	}
+	printf("%ux%u %.4s, %u planes, converted in %.2f ms (%s)\n", w, h,
+		(char *)&format, plane->bo->num_planes, (now() - start) * 1e3,
+		sp_bo_blit_impl());
+	for (i = 0; i < (int)plane->bo->num_planes; i++)
+		printf("  plane %d: offset %u pitch %u\n", i,
+			plane->bo->offsets[i], plane->bo->pitches[i]);
+
+	ret = set_sp_plane(dev, plane, crtc, crtc->crtc->mode.hdisplay / 4,
+			crtc->crtc->mode.vdisplay / 4);
+	if (!ret)
+		sleep(5);
+
+put:
+	free_sp_bo(rgb);
+	put_sp_plane(plane);
+out:
+	destroy_sp_dev(dev);
+	return ret;
+}